@@ -51,13 +51,17 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "ae_epoll.c"
+    #ifdef HAVE_IOURING
+    #include "ae_iouring.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "ae_kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "ae_epoll.c"
         #else
-        #include "ae_select.c"
+            #ifdef HAVE_KQUEUE
+            #include "ae_kqueue.c"
+            #else
+            #include "ae_select.c"
+            #endif
         #endif
     #endif
 #endif
@@ -503,3 +507,235 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
+
+#ifdef REDIS_TEST
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+/* The same checks whatever the backend, that is: make test, then with
+ * USE_IOURING=yes, then ./redis-server test ae. Every backend must behave
+ * like the level-triggered epoll one. */
+
+typedef struct aeTestPair {
+    int fds[2];
+    int reads;
+    int writes;
+    int maxreads;       /* Readable deleted after this many reads. */
+} aeTestPair;
+
+static long long aeTestTimerFired;
+
+static void aeTestRead(aeEventLoop *el, int fd, void *clientData, int mask) {
+    aeTestPair *p = clientData;
+    char c;
+    (void) mask;
+
+    if (read(fd, &c, 1) == 1) p->reads++;
+    if (p->reads == p->maxreads) aeDeleteFileEvent(el, fd, AE_READABLE);
+}
+
+static void aeTestWrite(aeEventLoop *el, int fd, void *clientData, int mask) {
+    aeTestPair *p = clientData;
+    (void) mask;
+
+    p->writes++;
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+}
+
+static int aeTestTimer(aeEventLoop *el, long long id, void *clientData) {
+    (void) el;
+    (void) id;
+    (void) clientData;
+    aeTestTimerFired = getMonotonicUs();
+    return AE_NOMORE;
+}
+
+/* Drives the loop without blocking until no event is left to process.
+ * Returns the number of events processed. */
+static long aeTestDrain(aeEventLoop *el) {
+    long total = 0;
+    int processed, idle = 0;
+
+    /* Twice in a row, since a backend may complete the polls it submitted
+     * in the next call only. */
+    while (idle < 2) {
+        processed = aeProcessEvents(el, AE_FILE_EVENTS|AE_DONT_WAIT);
+        total += processed;
+        idle = processed ? 0 : idle+1;
+    }
+    return total;
+}
+
+/* Microseconds per event of 'rounds' rounds where every reader gets a byte,
+ * 'churn' deletes and adds again the readable event of every fd after each
+ * of its reads as the handlers of a busy server do. */
+static double aeTestBench(aeEventLoop *el, aeTestPair *pairs, int numpairs, int rounds, int churn) {
+    long long start, events = 0;
+
+    for (int j = 0; j < numpairs; j++) {
+        pairs[j].reads = 0;
+        pairs[j].maxreads = -1;
+        aeCreateFileEvent(el, pairs[j].fds[0], AE_READABLE, aeTestRead, pairs+j);
+    }
+    start = getMonotonicUs();
+    for (int r = 0; r < rounds; r++) {
+        for (int j = 0; j < numpairs; j++) {
+            if (write(pairs[j].fds[1], "x", 1) != 1) return -1;
+        }
+        events += aeTestDrain(el);
+        if (churn) {
+            for (int j = 0; j < numpairs; j++) {
+                aeDeleteFileEvent(el, pairs[j].fds[0], AE_READABLE);
+                aeCreateFileEvent(el, pairs[j].fds[0], AE_READABLE, aeTestRead, pairs+j);
+            }
+        }
+    }
+    for (int j = 0; j < numpairs; j++) aeDeleteFileEvent(el, pairs[j].fds[0], AE_READABLE);
+    return events ? (double) (getMonotonicUs() - start) / events : -1;
+}
+
+int aeTest(int argc, char **argv, int accurate) {
+    int numpairs = 500, rounds = accurate ? 1000 : 100;
+    aeTestPair *pairs;
+    aeEventLoop *el;
+    struct rlimit limit;
+    int failed = 0;
+    (void) argc;
+    (void) argv;
+
+    monotonicInit();
+    /* Two fds per pair, and some room for the backend and stdio. */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) numpairs*2+64)
+        numpairs = (limit.rlim_cur-64)/2;
+    el = aeCreateEventLoop(numpairs*2+64);
+    if (el == NULL) {
+        printf("[failed] can't create the %s event loop\n", aeGetApiName());
+        return 1;
+    }
+    printf("ae backend: %s, %d socket pairs\n", aeGetApiName(), numpairs);
+
+    pairs = zcalloc(sizeof(aeTestPair)*numpairs);
+    for (int j = 0; j < numpairs; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[j].fds) == -1) {
+            printf("[failed] socketpair: %s\n", strerror(errno));
+            return 1;
+        }
+        anetNonBlock(NULL, pairs[j].fds[0]);
+        anetNonBlock(NULL, pairs[j].fds[1]);
+    }
+
+    /* Level-triggered: a reader that consumes one byte per event keeps being
+     * called while bytes are left, until its event is deleted. Every writer
+     * is called once since it deletes its event. */
+    for (int j = 0; j < numpairs; j++) {
+        pairs[j].maxreads = j % 2 ? 3 : 2;
+        if (aeCreateFileEvent(el, pairs[j].fds[0], AE_READABLE, aeTestRead, pairs+j) == AE_ERR ||
+            aeCreateFileEvent(el, pairs[j].fds[1], AE_WRITABLE, aeTestWrite, pairs+j) == AE_ERR)
+        {
+            printf("[failed] can't add the events of fd %d\n", pairs[j].fds[0]);
+            failed = 1;
+        }
+        if (write(pairs[j].fds[1], "abc", 3) != 3) failed = 1;
+    }
+    aeTestDrain(el);
+    for (int j = 0; j < numpairs; j++) {
+        if (pairs[j].reads != pairs[j].maxreads || pairs[j].writes != 1) {
+            printf("[failed] pair %d: %d reads, %d writes, expected %d and 1\n",
+                j, pairs[j].reads, pairs[j].writes, pairs[j].maxreads);
+            failed = 1;
+            break;
+        }
+    }
+    if (aeProcessEvents(el, AE_FILE_EVENTS|AE_DONT_WAIT) != 0) {
+        printf("[failed] events delivered with no fd ready\n");
+        failed = 1;
+    }
+
+    /* The byte left behind by a deleted readable is delivered once the
+     * event is added again, and a mask change keeps the other event. */
+    for (int j = 0; j < numpairs; j += 2) {
+        pairs[j].maxreads = 3;
+        aeCreateFileEvent(el, pairs[j].fds[0], AE_READABLE, aeTestRead, pairs+j);
+        aeCreateFileEvent(el, pairs[j].fds[0], AE_WRITABLE, aeTestWrite, pairs+j);
+        aeDeleteFileEvent(el, pairs[j].fds[0], AE_WRITABLE);
+    }
+    aeTestDrain(el);
+    for (int j = 0; j < numpairs; j += 2) {
+        if (pairs[j].reads != 3 || pairs[j].writes != 1) {
+            printf("[failed] pair %d after re-adding: %d reads, %d writes\n",
+                j, pairs[j].reads, pairs[j].writes);
+            failed = 1;
+            break;
+        }
+    }
+    if (aeGetFileEvents(el, pairs[0].fds[0]) != AE_NONE) {
+        printf("[failed] fd %d still has events\n", pairs[0].fds[0]);
+        failed = 1;
+    }
+
+    /* A client closed after its events were deleted, and whose fd number is
+     * reused by the next one in the same iteration: the old socket must be
+     * closed for its peer, and the new one watched. */
+    {
+        aeTestPair old = {{-1,-1},0,0,-1}, reused = {{-1,-1},0,0,-1};
+        char c;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, old.fds) == -1) {
+            printf("[failed] socketpair: %s\n", strerror(errno));
+            return 1;
+        }
+        anetNonBlock(NULL, old.fds[1]);
+        aeCreateFileEvent(el, old.fds[0], AE_READABLE, aeTestRead, &old);
+        aeTestDrain(el);
+        aeDeleteFileEvent(el, old.fds[0], AE_READABLE);
+        close(old.fds[0]);
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, reused.fds) == -1) {
+            printf("[failed] socketpair: %s\n", strerror(errno));
+            return 1;
+        }
+        aeCreateFileEvent(el, reused.fds[0], AE_READABLE, aeTestRead, &reused);
+        if (write(reused.fds[1], "x", 1) != 1) failed = 1;
+        aeTestDrain(el);
+        if (reused.fds[0] == old.fds[0] && reused.reads != 1) {
+            printf("[failed] reused fd %d: %d reads, expected 1\n", reused.fds[0], reused.reads);
+            failed = 1;
+        }
+        if (read(old.fds[1], &c, 1) != 0) {
+            printf("[failed] the peer of the closed fd got no EOF\n");
+            failed = 1;
+        }
+        aeDeleteFileEvent(el, reused.fds[0], AE_READABLE);
+        close(reused.fds[0]);
+        close(reused.fds[1]);
+        close(old.fds[1]);
+    }
+
+    /* With nothing ready the wait ends with the next timer. */
+    {
+        long long start = getMonotonicUs(), elapsed;
+
+        aeTestTimerFired = 0;
+        aeCreateTimeEvent(el, 50, aeTestTimer, NULL, NULL);
+        while (aeTestTimerFired == 0 && getMonotonicUs() - start < 1000000)
+            aeProcessEvents(el, AE_ALL_EVENTS);
+        elapsed = aeTestTimerFired - start;
+        if (aeTestTimerFired == 0 || elapsed < 45000) {
+            printf("[failed] 50 ms timer fired after %lld us\n", aeTestTimerFired ? elapsed : -1);
+            failed = 1;
+        }
+    }
+
+    /* The cost per event with a stable interest set, the usual case, and
+     * when the handlers keep deleting and adding their events. */
+    printf("stable interest: %.2f us per event\n", aeTestBench(el, pairs, numpairs, rounds, 0));
+    printf("churn: %.2f us per event\n", aeTestBench(el, pairs, numpairs, rounds, 1));
+
+    for (int j = 0; j < numpairs; j++) {
+        close(pairs[j].fds[0]);
+        close(pairs[j].fds[1]);
+    }
+    zfree(pairs);
+    aeDeleteEventLoop(el);
+    return failed;
+}
+#endif
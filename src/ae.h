@@ -132,4 +132,8 @@ int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
 
+#ifdef REDIS_TEST
+int aeTest(int argc, char *argv[], int accurate);
+#endif
+
 #endif
@@ -0,0 +1,339 @@
+/* Linux io_uring based ae.c module
+ *
+ * The readiness of the file descriptors is watched with one-shot
+ * IORING_OP_POLL_ADD requests. The changes requested by aeApiAddEvent() and
+ * aeApiDelEvent() are only recorded, and are queued in the submission ring
+ * when the event loop polls: all of them, together with the re-arming of
+ * the descriptors that fired in the previous iteration, reach the kernel in
+ * the same io_uring_enter() that waits for the next events. An iteration of
+ * the event loop is a single system call however many clients changed
+ * their interest, where epoll needs an epoll_ctl() for each of them.
+ *
+ * Multishot polls are not used: they only post a completion when the file
+ * wakes up, while ae is level triggered and its handlers may leave data in
+ * the socket (readQueryFromClient() reads PROTO_IOBUF_LEN at most, and
+ * writeToClient() stops after NET_MAX_WRITES_PER_EVENT). A one-shot poll
+ * checks the readiness when it is armed, so re-arming after every event
+ * keeps the level triggered semantic.
+ *
+ * Built with USE_IOURING=sqpoll the submission ring is drained by a kernel
+ * thread (IORING_SETUP_SQPOLL). It needs Linux 5.11 or newer, and with an
+ * older kernel or io_uring disabled the event loop can't be created. */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <endian.h>
+
+#define AE_IOURING_SQ_ENTRIES 1024
+#define AE_IOURING_MAX_CQ_ENTRIES 65536
+#define AE_IOURING_IGNORE UINT64_MAX    /* user_data of the POLL_REMOVEs. */
+
+typedef struct aeIoUringFd {
+    int mask;           /* The events ae wants for the fd. */
+    int armed;          /* The events of the poll in the kernel, if any. */
+    int changed;        /* Already in the changes list. */
+    int removed;        /* All the events were deleted since the poll was
+                         * armed: the fd may have been closed and reused. */
+    uint32_t gen;       /* Generation of the poll, to skip stale completions. */
+} aeIoUringFd;
+
+typedef struct aeApiState {
+    int ringfd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned sq_local_tail;     /* Tail of the SQEs filled so far. */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    aeIoUringFd *fds;
+    int *changes;
+    int numchanges;
+} aeApiState;
+
+static void aeIoUringUnmap(aeApiState *state) {
+    if (state->sqes)
+        munmap(state->sqes,sizeof(struct io_uring_sqe)*state->sq_entries);
+    if (state->cq_ring && state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring,state->cq_ring_size);
+    if (state->sq_ring) munmap(state->sq_ring,state->sq_ring_size);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+    struct io_uring_params p;
+    unsigned cq_entries = AE_IOURING_SQ_ENTRIES*2;
+
+    if (!state) return -1;
+    while (cq_entries < (unsigned)eventLoop->setsize &&
+           cq_entries < AE_IOURING_MAX_CQ_ENTRIES) cq_entries *= 2;
+
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+#ifdef USE_IOURING_SQPOLL
+    p.flags |= IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = 1000;
+#endif
+    state->ringfd = syscall(__NR_io_uring_setup,AE_IOURING_SQ_ENTRIES,&p);
+    if (state->ringfd == -1) {
+        zfree(state);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) goto err;
+
+    /* Map the rings, in a single mapping when the kernel allows it. */
+    state->sq_entries = p.sq_entries;
+    state->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_ring_size > state->sq_ring_size)
+            state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+    state->sq_ring = mmap(NULL,state->sq_ring_size,PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sq_ring == MAP_FAILED) {
+        state->sq_ring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ring = state->sq_ring;
+    } else {
+        state->cq_ring = mmap(NULL,state->cq_ring_size,PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cq_ring == MAP_FAILED) {
+            state->cq_ring = NULL;
+            goto err;
+        }
+    }
+    state->sqes = mmap(NULL,sizeof(struct io_uring_sqe)*p.sq_entries,
+                       PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                       state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sq_head = (unsigned *)((char *)state->sq_ring + p.sq_off.head);
+    state->sq_tail = (unsigned *)((char *)state->sq_ring + p.sq_off.tail);
+    state->sq_mask = (unsigned *)((char *)state->sq_ring + p.sq_off.ring_mask);
+    state->sq_flags = (unsigned *)((char *)state->sq_ring + p.sq_off.flags);
+    state->sq_array = (unsigned *)((char *)state->sq_ring + p.sq_off.array);
+    state->sq_local_tail = *state->sq_tail;
+    state->cq_head = (unsigned *)((char *)state->cq_ring + p.cq_off.head);
+    state->cq_tail = (unsigned *)((char *)state->cq_ring + p.cq_off.tail);
+    state->cq_mask = (unsigned *)((char *)state->cq_ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cq_ring + p.cq_off.cqes);
+
+    state->fds = zcalloc(sizeof(aeIoUringFd)*eventLoop->setsize);
+    state->changes = zmalloc(sizeof(int)*eventLoop->setsize);
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    aeIoUringUnmap(state);
+    close(state->ringfd);
+    zfree(state);
+    return -1;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+
+    state->fds = zrealloc(state->fds, sizeof(aeIoUringFd)*setsize);
+    if (setsize > eventLoop->setsize)
+        memset(state->fds+eventLoop->setsize,0,
+               sizeof(aeIoUringFd)*(setsize-eventLoop->setsize));
+    state->changes = zrealloc(state->changes, sizeof(int)*setsize);
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    aeIoUringUnmap(state);
+    close(state->ringfd);
+    zfree(state->fds);
+    zfree(state->changes);
+    zfree(state);
+}
+
+/* Submit the queued SQEs and, if 'wait' is set, wait for a completion or
+ * for the timeout 'tvp' (forever if NULL). */
+static int aeIoUringEnter(aeApiState *state, int wait, struct timeval *tvp) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG, to_submit;
+
+    __atomic_store_n(state->sq_tail,state->sq_local_tail,__ATOMIC_RELEASE);
+    to_submit = state->sq_local_tail - __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+#ifdef USE_IOURING_SQPOLL
+    /* The kernel thread submits: wake it up if it went idle. */
+    if (__atomic_load_n(state->sq_flags,__ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+        flags |= IORING_ENTER_SQ_WAKEUP;
+    else if (!wait)
+        return 0;
+#endif
+    if (!to_submit && !wait) return 0;
+
+    memset(&arg,0,sizeof(arg));
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    if (syscall(__NR_io_uring_enter,state->ringfd,to_submit,wait ? 1 : 0,
+                flags,&arg,sizeof(arg)) == -1 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+static struct io_uring_sqe *aeIoUringGetSqe(aeApiState *state) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (state->sq_local_tail -
+           __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE) >= state->sq_entries)
+    {
+#ifdef USE_IOURING_SQPOLL
+        __atomic_store_n(state->sq_tail,state->sq_local_tail,__ATOMIC_RELEASE);
+        if (syscall(__NR_io_uring_enter,state->ringfd,0,0,
+                    IORING_ENTER_SQ_WAKEUP|IORING_ENTER_SQ_WAIT,NULL,0) == -1 &&
+            errno != EINTR) return NULL;
+#else
+        if (aeIoUringEnter(state,0,NULL) == -1) return NULL;
+#endif
+    }
+    idx = state->sq_local_tail & *state->sq_mask;
+    sqe = &state->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    state->sq_local_tail++;
+    return sqe;
+}
+
+static void aeIoUringChanged(aeApiState *state, int fd) {
+    if (state->fds[fd].changed) return;
+    state->fds[fd].changed = 1;
+    state->changes[state->numchanges++] = fd;
+}
+
+/* Queue the polls of the descriptors whose events changed or fired. If the
+ * ring can't take them, the rest is kept for the next iteration. */
+static void aeIoUringQueueChanges(aeApiState *state) {
+    int j;
+
+    for (j = 0; j < state->numchanges; j++) {
+        int fd = state->changes[j];
+        aeIoUringFd *f = state->fds+fd;
+        struct io_uring_sqe *sqe;
+
+        /* A poll holds a reference to the file it was armed on: once the
+         * events of the fd were all deleted the poll is removed even if the
+         * same events are wanted again, for the fd that reused the number. */
+        if (f->armed == f->mask && !f->removed) {
+            f->changed = 0;
+            continue;
+        }
+        if (f->armed) {
+            if ((sqe = aeIoUringGetSqe(state)) == NULL) break;
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = ((uint64_t)f->gen << 32) | (uint32_t)fd;
+            sqe->user_data = AE_IOURING_IGNORE;
+            f->armed = 0;
+            f->gen++;
+        }
+        if (f->mask) {
+            uint32_t events = 0;
+
+            if ((sqe = aeIoUringGetSqe(state)) == NULL) break;
+            if (f->mask & AE_READABLE) events |= POLLIN;
+            if (f->mask & AE_WRITABLE) events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+            events = (events << 16) | (events >> 16);
+#endif
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = events;
+            sqe->user_data = ((uint64_t)f->gen << 32) | (uint32_t)fd;
+            f->armed = f->mask;
+        }
+        f->changed = 0;
+        f->removed = 0;
+    }
+    memmove(state->changes,state->changes+j,sizeof(int)*(state->numchanges-j));
+    state->numchanges -= j;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    state->fds[fd].mask = eventLoop->events[fd].mask | mask;
+    aeIoUringChanged(state,fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    state->fds[fd].mask = eventLoop->events[fd].mask & (~delmask);
+    if (state->fds[fd].mask == AE_NONE) state->fds[fd].removed = 1;
+    aeIoUringChanged(state,fd);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    int wait = !tvp || tvp->tv_sec || tvp->tv_usec;
+    int numevents = 0;
+    unsigned head, tail;
+
+    aeIoUringQueueChanges(state);
+    if (aeIoUringEnter(state,wait,tvp) == -1) return 0;
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    for (; head != tail && numevents < eventLoop->setsize; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        int fd = (int)(cqe->user_data & 0xffffffff);
+        uint32_t gen = cqe->user_data >> 32;
+        int mask = 0;
+
+        if (cqe->user_data == AE_IOURING_IGNORE ||
+            fd >= eventLoop->setsize) continue;
+        aeIoUringFd *f = state->fds+fd;
+        if (!f->armed || f->gen != gen) continue; /* Removed meanwhile. */
+
+        /* The poll is over: arm it again before the next wait. */
+        f->armed = 0;
+        f->gen++;
+        aeIoUringChanged(state,fd);
+        if (cqe->res == -ECANCELED) continue;
+        if (cqe->res < 0) {
+            mask = AE_READABLE|AE_WRITABLE;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE|AE_READABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE|AE_READABLE;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return "io_uring";
+}
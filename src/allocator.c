@@ -54,6 +54,8 @@ fp+DSIZE--> +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+-
 ***************************************** END OF ENTRY INFO **************************************************/
 
 #include "allocator.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 typedef unsigned int u_int;
 typedef unsigned long long u_llong;
@@ -114,11 +116,39 @@ typedef unsigned long long u_llong;
 #define PREV_FREEP(bp) ( *(void **)(bp + DSIZE) )
 
 #define SLOTS 16384
+
+/* Size of the buffer malloc'd for a block whose payload is 'size' bytes:
+ * the payload plus the prologue and epilogue dummy headers */
+#define BLOCK_BUF_SIZE(size)    (WSIZE + (size) + WSIZE)
+
+/* The size field of a segment header is 32 bits wide and its lowest 3 bits are flags */
+#define MAX_SEGMENT_SIZE        0xFFFFFFF8UL
+
+/* ## SEGREGATED FREE LIST MACROS ## */
+
+/* Free segments are kept in size classes (bins) per slot. Each power of two
+ * range [2^fl, 2^(fl+1)) is split in FREELIST_SL_COUNT linear sub-classes.
+ * The smallest segment is MIN_SEGMENT_SIZE (24 bytes, fl = 4) and the size
+ * field of the header is 32 bits wide, so fl is in [4, 31]. */
+#define FREELIST_SL_LOG2    2
+#define FREELIST_SL_COUNT   (1 << FREELIST_SL_LOG2)
+#define FREELIST_FL_MIN     4
+#define FREELIST_FL_COUNT   (32 - FREELIST_FL_MIN)
+#define FREELIST_BINS       (FREELIST_FL_COUNT * FREELIST_SL_COUNT)
+#define FREELIST_MAP_WORDS  ((FREELIST_BINS + 63) / 64)
 #define ENTRY_HEADER_SIZE WSIZE //this is 4 bytes used to store the size of the sub-fields in the segment
 #define KEY_META_SIZE sizeof(robj)
 #define VAL_META_SIZE sizeof(robj)
 
+/* Free lists of a slot, allocated with its first free segment: most slots never
+ * have one, and the bins of every slot would take ~15MB */
+typedef struct freelist_bins {
+    void        *bins[FREELIST_BINS];       // segregated free lists, one per size class
+    uint64_t    map[FREELIST_MAP_WORDS];    // bit i is set if bins[i] is not empty
+} freelist_bins_t;
+
 struct allocated_block {
+    size_t  size;       // bytes of the buffer available for segments (without the dummy headers)
     size_t  bytes_total_in_use;
     size_t  bytes_free;
     char    *block_start;
@@ -126,17 +156,27 @@ struct allocated_block {
     struct  allocated_block *prev;
     size_t  segments_used;     //TODO: DEBUG remove in production
     size_t  segments_free;     //TODO: DEBUG remove in production
+    uint64_t gen;       // generation of the last write in the block while the slot is tracked
 };
 
 struct r_allocator {
     alloc_bloc_t    *slot_blocks[SLOTS];    // array with lists of blocks. A list per slot
     alloc_bloc_t    *slot_blocks_tail[SLOTS];   // points at the last block of the list for each slot
     unsigned int    slot_blocks_num[SLOTS]; // number of blocks per slot
-    void            *free_list[SLOTS];      // array with containing the free lists per slot
+    freelist_bins_t *free_lists[SLOTS];     // free lists per slot, NULL until the slot has a free segment
     // void            *alternative_free_list[SLOTS];  //DEBUG TODO: remove when in production
     unsigned char   slot_locked[SLOTS];     // flag indicating if the slot index is locked for migration
+    unsigned char   slot_tracked[SLOTS];    // writes of the slot are tracked for pre-copy (see r_allocator_track_slot())
+    uint64_t        slot_gen[SLOTS];        // generation of the last tracked write of each slot
+    unsigned int    slot_pins[SLOTS];       // replies referencing K-Vs of the slot in place (see r_allocator_pin_slot())
     unsigned int    total_blocks_num;  // all blocks of all slots
     unsigned long   bytes_size; // total allocated bytes for all slots. Includes headers sizes
+    size_t          block_size_min;     // size of the first block of a slot
+    size_t          block_size_max;     // blocks grow up to this size. Larger K-Vs get an overflow block of their own
+    size_t          slot_bytes_blocks[SLOTS];   // sum of the sizes of the blocks of each slot
+    size_t          bytes_blocks;               // sum of slot_bytes_blocks, read without the slot mutexes
+    size_t          slot_bytes_used[SLOTS];     // bytes of the used segments of each slot
+    unsigned long   overflow_blocks;    // blocks larger than block_size_max (one K-V each)
     pthread_mutex_t mutexes[SLOTS]; // there is a mutex for each slot to synch slot_lock and writes
 };
 
@@ -147,38 +187,97 @@ r_allocator_t r_allocator;
 /* * * * * * * * FREE LIST HANDLERS * * * * * * * * */
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifdef REDIS_TEST
+/* When set, every free segment goes in bin 0, which is then the single unsorted
+ * LIFO list walked first-fit of the original allocator. Only flipped while the
+ * slot has no free segment, to benchmark against it. */
+static int freelist_legacy_first_fit = 0;
+#endif
+
+/*
+* internal use
+* returns the index of the size class (bin) that holds free segments of 'size' bytes
+* fl: the position of the most significant bit of the size
+* sl: the next FREELIST_SL_LOG2 bits, splitting [2^fl, 2^(fl+1)) in linear sub-classes
+*/
+static inline int freelist_bin_index(size_t size)
+{
+    int fl = 31 - __builtin_clz((u_int) size);
+    int sl = (size >> (fl - FREELIST_SL_LOG2)) & (FREELIST_SL_COUNT - 1);
+    return (fl - FREELIST_FL_MIN) * FREELIST_SL_COUNT + sl;
+}
+
+/* internal use: the bin a free segment of 'size' bytes is kept in */
+static inline int freelist_segment_bin(size_t size)
+{
+#ifdef REDIS_TEST
+    if (freelist_legacy_first_fit) return 0;
+#endif
+    return freelist_bin_index(size);
+}
+
 /*
 * internal use
-* insert at the front of the list
+* returns the first non-empty bin with index >= 'from' or -1 if there is none
+*/
+static inline int freelist_next_bin(int slot, int from)
+{
+    freelist_bins_t *fl = r_allocator.free_lists[slot];
+    int word = from / 64;
+    if (fl == NULL || word >= FREELIST_MAP_WORDS) return -1;
+
+    uint64_t map = fl->map[word] & (~0ULL << (from % 64));
+    while (1) {
+        if (map) return word * 64 + __builtin_ctzll(map);
+        if (++word == FREELIST_MAP_WORDS) return -1;
+        map = fl->map[word];
+    }
+}
+
+/* internal use: forget all free segments of the slot and release its bins */
+static void freelist_reset(int slot)
+{
+    free(r_allocator.free_lists[slot]);
+    r_allocator.free_lists[slot] = NULL;
+}
+
+/*
+* internal use
+* insert at the front of the list of the size class of the segment
 * parameter-1: the slot that the segment belongs to
 * parameter-2: pointer at the free segment *after* the segment header
-* TODO: keep list sorted for best-fit insertions
 */
 void freelist_insert_segment(int slot, void *segment)
 {
     assert(segment != NULL);
     // printf("%s:%d %s() +++++++++++insert %u\n", __FILE__, __LINE__, __func__, GET_SIZE(HDRP(segment)));
-    
-    // void **free_list = &(r_allocator.free_list[slot]);
-    // void *free_list = r_allocator.free_list[slot];
 
-    if ( r_allocator.free_list[slot] ) {
-        // printf("%s:%d %s() freelist not empty\n", __FILE__, __LINE__, __func__);
+    freelist_bins_t *fl = r_allocator.free_lists[slot];
+    if (fl == NULL) {
+        fl = r_allocator.free_lists[slot] = calloc(1, sizeof(freelist_bins_t));
+        if (fl == NULL) {
+            fprintf(stderr, "%s:%d %s() allocation ERROR!\n", __FILE__, __LINE__, __func__);
+            exit(1);
+        }
+    }
+
+    int bin = freelist_segment_bin(GET_SIZE(HDRP(segment)));
+    void *head = fl->bins[bin];
+
+    if (head) {
         /* previous free list start now needs prev ptr */
-        PREV_FREEP(r_allocator.free_list[slot]) = segment; 
-        /* set next free ptr to old start of list */
-        NEXT_FREEP(segment) = r_allocator.free_list[slot]; 
+        PREV_FREEP(head) = segment;
     } else {
-        // printf("%s:%d %s() freelist IS empty\n", __FILE__, __LINE__, __func__);
-        NEXT_FREEP(segment) = NULL;
+        /* first segment of this size class: mark the bin as non-empty */
+        fl->map[bin / 64] |= (1ULL << (bin % 64));
     }
+    /* set next free ptr to old start of list */
+    NEXT_FREEP(segment) = head;
 
     /* new first free block in list */
-    PREV_FREEP(segment) = NULL; 
+    PREV_FREEP(segment) = NULL;
     /* reset start of free list */
-    // *(void **)(free_list) = segment;
-    r_allocator.free_list[slot] = segment;
-    // printf(">>>>>>%p\n", r_allocator.free_list[slot]);
+    fl->bins[bin] = segment;
 }
 
 //DEBUG
@@ -211,58 +310,88 @@ void freelist_insert_segment(int slot, void *segment)
 //internal use
 // param-1: the slot the pointer belongs
 // param-2: ptr on the segment after semgnet hdr i.e. the "next" field
+// the segment header must still hold the size the segment was inserted with
 void freelist_remove_segment(int slot, void *fp)
 {
     // printf("%s:%d %s() --------remove %u\n", __FILE__, __LINE__, __func__, GET_SIZE(HDRP(fp)));
-    // void *free_list = r_allocator.free_list[slot];
-
-    void *prev = PREV_FREEP(fp); 
+    void *prev = PREV_FREEP(fp);
     void *next = NEXT_FREEP(fp);
 
     /* If there's a previous free block... */
     if (prev)  {
-        NEXT_FREEP(PREV_FREEP(fp)) = NEXT_FREEP(fp); 
-    } else { /* If not, next free block is the new start */
-        // free_list = NEXT_FREEP(fp); 
-        r_allocator.free_list[slot] = NEXT_FREEP(fp);
+        NEXT_FREEP(prev) = next;
+    } else { /* If not, next free block is the new start of the bin */
+        freelist_bins_t *fl = r_allocator.free_lists[slot];
+        int bin = freelist_segment_bin(GET_SIZE(HDRP(fp)));
+        fl->bins[bin] = next;
+        if (next == NULL) {
+            fl->map[bin / 64] &= ~(1ULL << (bin % 64));
+        }
     }
     /* If there's a next free block... */
-    if (next)  { 
-        PREV_FREEP(NEXT_FREEP(fp)) = PREV_FREEP(fp);
+    if (next)  {
+        PREV_FREEP(next) = prev;
     }
 }
 
-/* 
+/*
  * Internal use
- * find_fit - Find a fit for a block with asize bytes 
+ * find_fit - Find a fit for a block with asize bytes
+ * The request is rounded up to the next size class, so any segment found
+ * through the bitmap is big enough. Only if no such class has free segments,
+ * the class of asize itself is scanned, as it may still contain a segment
+ * that fits.
  */
 void *freelist_find_fit(int slot, size_t asize)
 {
     // printf("%s:%d %s() start\n", __FILE__, __LINE__, __func__);
-    void *free_list = r_allocator.free_list[slot];
-    void *fp = free_list;
-    /* Search free list for big enough block */
-    while (fp) { 
-        if (asize <= GET_SIZE(HDRP(fp))) {
-            return fp;
+    freelist_bins_t *lists = r_allocator.free_lists[slot];
+    void *fp;
+    int bin;
+
+    if (lists == NULL) return NULL;
+#ifdef REDIS_TEST
+    if (freelist_legacy_first_fit) {
+        for (fp = lists->bins[0]; fp; fp = NEXT_FREEP(fp)) {
+            if (asize <= GET_SIZE(HDRP(fp))) return fp;
         }
-        fp = NEXT_FREEP(fp);
+        return NULL;
     }
+#endif
+
+    int fl = 31 - __builtin_clz((u_int) asize);
+    size_t rounded = asize + (1UL << (fl - FREELIST_SL_LOG2)) - 1;
+    int exact_bin = freelist_bin_index(asize);
+    int fit_bin = freelist_bin_index(rounded);
+
+    if (fit_bin > exact_bin) {
+        bin = freelist_next_bin(slot, fit_bin);
+        if (bin != -1) return lists->bins[bin];
 
+        /* Search the list of the requested class for big enough block */
+        for (fp = lists->bins[exact_bin]; fp; fp = NEXT_FREEP(fp)) {
+            if (asize <= GET_SIZE(HDRP(fp))) return fp;
+        }
+        return NULL;
+    }
+
+    /* asize is the lower bound of its class: every segment of the class fits */
+    bin = freelist_next_bin(slot, exact_bin);
     // printf("%s:%d %s() end\n", __FILE__, __LINE__, __func__);
-    return NULL; /* no fit */
+    return (bin == -1) ? NULL : lists->bins[bin]; /* NULL: no fit */
 }
 
 // DEBUG
 void freelist_print(int slot)
 {
     // printf("%s:%d %s() start\n", __FILE__, __LINE__, __func__);
-    void *fp = r_allocator.free_list[slot];
-    /* Search free list for big enough block */
     printf("***********freelist (size,alloc): ");
-    while (fp) { 
-        printf("(%u,%u),", GET_SIZE(HDRP(fp)), GET_ALLOC(HDRP(fp)) );
-        fp = NEXT_FREEP(fp);
+    for (int bin = freelist_next_bin(slot, 0); bin != -1; bin = freelist_next_bin(slot, bin + 1)) {
+        void *fp = r_allocator.free_lists[slot]->bins[bin];
+        while (fp) {
+            printf("(%u,%u),", GET_SIZE(HDRP(fp)), GET_ALLOC(HDRP(fp)) );
+            fp = NEXT_FREEP(fp);
+        }
     }
     printf("\n");
     // printf("%s:%d %s() end\n", __FILE__, __LINE__, __func__);
@@ -282,31 +411,387 @@ void freelist_print(int slot)
 //     // printf("%s:%d %s() end\n", __FILE__, __LINE__, __func__);
 // }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+/* * * * * * * * * * BLOCK ARENA * * * * * * * * * */
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* Block buffers are carved out of one region reserved at startup, backed by
+ * huge pages when available, instead of being malloc'd one at a time.
+ * Block i lives at base + i*stride and its header is arena.headers[i], so
+ * the headers of all blocks are packed in a dense array and the block of a
+ * pointer is found with a division.
+ * Only blocks of the maximum block size come from the arena. Smaller blocks of
+ * sparse slots, overflow blocks and blocks requested when the arena is
+ * disabled (size 0) or full are malloc'd. */
+#define ARENA_BLOCK_ALIGN       64
+#define ARENA_PAGE_2MB          (2UL * 1024 * 1024)
+#define ARENA_PAGE_1GB          (1024UL * 1024 * 1024)
+#define ARENA_PREFAULT_STEP     4096
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+struct block_arena {
+    char            *base;          // start of the reserved region, NULL if the arena is not used
+    size_t          region_size;    // bytes reserved
+    size_t          stride;         // distance between the buffers of two consecutive blocks
+    size_t          block_size;     // payload size of the arena blocks
+    unsigned int    capacity;       // number of blocks that fit in the region
+    alloc_bloc_t    *headers;       // dense array of block headers, headers[i] describes block i
+    unsigned int    *free_stack;    // indexes of the unused blocks, top is free_stack[free_num-1]
+    unsigned int    free_num;
+    unsigned int    prefaulted;     // blocks faulted in at init
+    int             hugepages;      // ALLOCATOR_HUGEPAGES_* actually in use (may differ from the requested)
+    int             numa_node;      // node the region is bound to, -1 if none
+    unsigned long long fallback_blocks;    // blocks malloc'd because the arena was full
+    pthread_mutex_t lock;
+};
+
+static struct block_arena arena = { .base = NULL, .numa_node = -1 };
+
+static inline int arena_owns(void *ptr)
+{
+    return arena.base != NULL && (char *)ptr >= arena.base &&
+           (char *)ptr < arena.base + (size_t)arena.capacity * arena.stride;
+}
+
+/* internal use: index of the arena block that contains ptr (ptr must be owned by the arena) */
+static inline unsigned int arena_block_index(void *ptr)
+{
+    return ((char *)ptr - arena.base) / arena.stride;
+}
+
+/* internal use: bind [addr, addr+len) to the given NUMA node. Returns 0 on success */
+static int arena_bind_numa_node(void *addr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long nodemask[1024 / (8 * sizeof(unsigned long))] = {0};
+    if (node < 0 || node >= 1024) return -1;
+    nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, nodemask, 1024 + 1, 0) == 0 ? 0 : -1;
+#else
+    UNUSED(addr); UNUSED(len); UNUSED(node);
+    return -1;
+#endif
+}
+
+/* internal use: map 'size' bytes with the requested page size.
+ * MAP_HUGETLB needs pages reserved in /proc/sys/vm/nr_hugepages, if they are
+ * not there we fall back to transparent huge pages. Updates *hugepages with
+ * the mode that was actually used */
+static void * arena_map_region(size_t size, int *hugepages)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *addr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    // no MAP_NORESERVE here: the huge pages must be reserved now, otherwise
+    // the first write into a page that is not in the pool raises SIGBUS
+    if (*hugepages == ALLOCATOR_HUGEPAGES_2MB || *hugepages == ALLOCATOR_HUGEPAGES_1GB) {
+        int shift = (*hugepages == ALLOCATOR_HUGEPAGES_1GB) ? 30 : 21;
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+        if (addr != MAP_FAILED) return addr;
+        *hugepages = ALLOCATOR_HUGEPAGES_THP;
+    }
+#else
+    if (*hugepages != ALLOCATOR_HUGEPAGES_NO) *hugepages = ALLOCATOR_HUGEPAGES_THP;
+#endif
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+
+#ifdef MADV_HUGEPAGE
+    if (*hugepages == ALLOCATOR_HUGEPAGES_THP && madvise(addr, size, MADV_HUGEPAGE) != 0) {
+        *hugepages = ALLOCATOR_HUGEPAGES_NO;
+    }
+#else
+    *hugepages = ALLOCATOR_HUGEPAGES_NO;
+#endif
+    return addr;
+}
+
+/* internal use: pops a block from the arena. Returns NULL if the arena is unused, full or
+ * its blocks are not of the requested size */
+static alloc_bloc_t * arena_get_bloc(size_t size)
+{
+    if (arena.base == NULL || size != arena.block_size) return NULL;
+
+    pthread_mutex_lock(&arena.lock);
+    if (arena.free_num == 0) {
+        arena.fallback_blocks++;
+        pthread_mutex_unlock(&arena.lock);
+        return NULL;
+    }
+    unsigned int idx = arena.free_stack[--arena.free_num];
+    pthread_mutex_unlock(&arena.lock);
+
+    alloc_bloc_t *blk = &arena.headers[idx];
+    blk->block_start = arena.base + (size_t)idx * arena.stride;
+    return blk;
+}
+
+// public API
+/*
+* Reserves the block arena. Must be called after r_allocator_init() and r_allocator_set_block_size()
+* and before any block is allocated.
+* size: bytes to reserve (rounded up to the page size), 0 keeps allocating blocks with malloc
+* hugepages: ALLOCATOR_HUGEPAGES_*
+* numa_node: node to bind the region to, -1 for no binding
+* prefault_blocks: number of blocks to fault in now so the first writes into them do not page fault
+* returns 0 on success, -1 if the region could not be reserved (blocks keep coming from malloc)
+*/
+int r_allocator_arena_init(size_t size, int hugepages, int numa_node, unsigned int prefault_blocks)
+{
+    if (size == 0 || arena.base != NULL) return (size == 0) ? 0 : -1;
+
+    size_t page = (hugepages == ALLOCATOR_HUGEPAGES_1GB) ? ARENA_PAGE_1GB : ARENA_PAGE_2MB;
+    size = (size + page - 1) & ~(page - 1);
+
+    arena.block_size = r_allocator.block_size_max;
+    arena.stride = (BLOCK_BUF_SIZE(arena.block_size) + ARENA_BLOCK_ALIGN - 1) & ~((size_t)ARENA_BLOCK_ALIGN - 1);
+    if (size < arena.stride) return -1;
+
+    arena.hugepages = hugepages;
+    char *base = arena_map_region(size, &arena.hugepages);
+    if (base == NULL) return -1;
+
+    // the policy must be set before the pages are touched
+    arena.numa_node = -1;
+    if (numa_node >= 0 && arena_bind_numa_node(base, size, numa_node) == 0) {
+        arena.numa_node = numa_node;
+    }
+
+    arena.region_size = size;
+    arena.capacity = size / arena.stride;
+    arena.headers = calloc(arena.capacity, sizeof(alloc_bloc_t));
+    arena.free_stack = malloc(arena.capacity * sizeof(unsigned int));
+    if (arena.headers == NULL || arena.free_stack == NULL) {
+        fprintf(stderr, "%s:%d %s() allocation ERROR!\n", __FILE__, __LINE__, __func__);
+        exit(1);
+    }
+    // lowest index on top of the stack: blocks are handed out in address order
+    for (unsigned int i = 0; i < arena.capacity; i++) {
+        arena.free_stack[i] = arena.capacity - 1 - i;
+    }
+    arena.free_num = arena.capacity;
+    arena.fallback_blocks = 0;
+    pthread_mutex_init(&arena.lock, NULL);
+
+    arena.prefaulted = (prefault_blocks < arena.capacity) ? prefault_blocks : arena.capacity;
+    size_t prefault_bytes = (size_t)arena.prefaulted * arena.stride;
+    for (size_t off = 0; off < prefault_bytes; off += ARENA_PREFAULT_STEP) {
+        base[off] = 0;
+    }
+
+    arena.base = base;
+    return 0;
+}
+
+// public API
+/* unmaps the arena. No block of the arena may be in use */
+void r_allocator_arena_release()
+{
+    if (arena.base == NULL) return;
+    assert(arena.free_num == arena.capacity);
+
+    munmap(arena.base, arena.region_size);
+    free(arena.headers);
+    free(arena.free_stack);
+    pthread_mutex_destroy(&arena.lock);
+    memset(&arena, 0, sizeof(arena));
+    arena.numa_node = -1;
+}
+
+// public API
+arena_stats_t r_allocator_arena_stats()
+{
+    arena_stats_t stats;
+    stats.region_size = arena.region_size;
+    stats.blocks_total = arena.capacity;
+    stats.blocks_free = arena.free_num;
+    stats.blocks_prefaulted = arena.prefaulted;
+    stats.hugepages = arena.hugepages;
+    stats.numa_node = arena.numa_node;
+    stats.fallback_blocks = arena.fallback_blocks;
+    return stats;
+}
+
+/* public API: start and size of the arena region, NULL if the arena is not used */
+void * r_allocator_arena_region(size_t *size)
+{
+    *size = arena.region_size;
+    return arena.base;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+/* * * * * * * * * * BLOCK POOL * * * * * * * * * */
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* Released blocks of the maximum size that are not part of the arena are kept
+ * in a pool of up to block_pool.max blocks instead of being freed, and new
+ * blocks are taken from the pool first. The buffers keep their address, so
+ * anything attached to it (an RDMA registration) stays valid. Buffers that
+ * are really freed are reported to the release hook first. */
+static struct {
+    alloc_bloc_t        **blocks;
+    unsigned int        num;
+    unsigned int        max;
+    pthread_mutex_t     lock;
+} block_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static r_allocator_release_hook_fn release_hook = NULL;
+
+// internal use
+static void free_bloc_memory(alloc_bloc_t *blk)
+{
+    if (release_hook) release_hook(blk->block_start, BLOCK_BUF_SIZE(blk->size));
+    free(blk->block_start);
+    free(blk);
+}
+
+// internal use: pops a block of the pool, NULL if it is empty or size is not the pool one
+static alloc_bloc_t * pool_get_bloc(size_t size)
+{
+    alloc_bloc_t *blk = NULL;
+
+    if (size != r_allocator.block_size_max) return NULL;
+    pthread_mutex_lock(&block_pool.lock);
+    if (block_pool.num) blk = block_pool.blocks[--block_pool.num];
+    pthread_mutex_unlock(&block_pool.lock);
+    return blk;
+}
+
+// internal use: returns 1 if the pool kept the block
+static int pool_put_bloc(alloc_bloc_t *blk)
+{
+    int kept = 0;
+
+    if (blk->size != r_allocator.block_size_max) return 0;
+    pthread_mutex_lock(&block_pool.lock);
+    if (block_pool.num < block_pool.max) {
+        block_pool.blocks[block_pool.num++] = blk;
+        kept = 1;
+    }
+    pthread_mutex_unlock(&block_pool.lock);
+    return kept;
+}
+
+/* public API: keep up to max_blocks released blocks in the pool. Blocks above
+ * the new maximum are freed. */
+void r_allocator_set_block_pool(unsigned int max_blocks)
+{
+    pthread_mutex_lock(&block_pool.lock);
+    while (block_pool.num > max_blocks) {
+        free_bloc_memory(block_pool.blocks[--block_pool.num]);
+    }
+    block_pool.blocks = realloc(block_pool.blocks, (max_blocks ? max_blocks : 1) * sizeof(alloc_bloc_t *));
+    block_pool.max = max_blocks;
+    pthread_mutex_unlock(&block_pool.lock);
+}
+
+/* public API: allocate blocks until the pool holds 'blocks' blocks (at most its
+ * maximum). Returns the blocks in the pool. */
+unsigned int r_allocator_block_pool_fill(unsigned int blocks)
+{
+    unsigned int num;
+
+    pthread_mutex_lock(&block_pool.lock);
+    if (blocks > block_pool.max) blocks = block_pool.max;
+    while (block_pool.num < blocks) {
+        alloc_bloc_t *blk = malloc(sizeof(alloc_bloc_t));
+        if (blk == NULL) break;
+        blk->size = r_allocator.block_size_max;
+        blk->block_start = malloc(BLOCK_BUF_SIZE(blk->size));
+        if (blk->block_start == NULL) {
+            free(blk);
+            break;
+        }
+        block_pool.blocks[block_pool.num++] = blk;
+    }
+    num = block_pool.num;
+    pthread_mutex_unlock(&block_pool.lock);
+    return num;
+}
+
+/* public API: calls fn for the buffer of every block in the pool */
+void r_allocator_block_pool_foreach(void (*fn)(void *buffer, size_t len, void *privdata), void *privdata)
+{
+    pthread_mutex_lock(&block_pool.lock);
+    for (unsigned int i = 0; i < block_pool.num; i++) {
+        fn(block_pool.blocks[i]->block_start, BLOCK_BUF_SIZE(block_pool.blocks[i]->size), privdata);
+    }
+    pthread_mutex_unlock(&block_pool.lock);
+}
+
+unsigned int r_allocator_block_pool_size()
+{
+    unsigned int num;
+
+    pthread_mutex_lock(&block_pool.lock);
+    num = block_pool.num;
+    pthread_mutex_unlock(&block_pool.lock);
+    return num;
+}
+
+/* public API: fn is called with the buffer of every block whose memory is given
+ * back to the system. Arena and pool blocks are never given back. */
+void r_allocator_set_release_hook(r_allocator_release_hook_fn fn)
+{
+    release_hook = fn;
+}
+
+// internal use
+// gives back the memory of a block that is no longer in any slot list
+static void release_bloc(alloc_bloc_t *blk)
+{
+    if (blk->size > r_allocator.block_size_max) {
+        __atomic_sub_fetch(&r_allocator.overflow_blocks, 1, __ATOMIC_RELAXED);
+    }
+    if (arena_owns(blk->block_start)) {
+        pthread_mutex_lock(&arena.lock);
+        arena.free_stack[arena.free_num++] = arena_block_index(blk->block_start);
+        pthread_mutex_unlock(&arena.lock);
+        return;
+    }
+    if (pool_put_bloc(blk)) return;
+    free_bloc_memory(blk);
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
 /* * * * * * * * INTERNAL FUNCTIONS * * * * * *  * */
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
 
 // internal use
 // returns a pointer at the beggining of the new block
+// size: bytes available for segments. Must be 8-aligned
 // The caller is responsible to add the new empty block in the free list
-alloc_bloc_t * allocate_new_bloc()
+alloc_bloc_t * allocate_new_bloc(size_t size)
 {
     // printf("%s:%d %s() start\n", __FILE__, __LINE__, __func__);
-    alloc_bloc_t *new_block = (alloc_bloc_t *) malloc(sizeof(alloc_bloc_t));
+    assert(size >= MIN_SEGMENT_SIZE && size <= MAX_SEGMENT_SIZE && (size & 0x7) == 0);
+    alloc_bloc_t *new_block = arena_get_bloc(size);
+    if (new_block == NULL) new_block = pool_get_bloc(size);
     if (new_block == NULL) {
-        fprintf(stderr, "%s:%d %s() allocation ERROR!\n", __FILE__, __LINE__, __func__);
-        exit(1);
-    }
+        new_block = (alloc_bloc_t *) malloc(sizeof(alloc_bloc_t));
+        if (new_block == NULL) {
+            fprintf(stderr, "%s:%d %s() allocation ERROR!\n", __FILE__, __LINE__, __func__);
+            exit(1);
+        }
 
-    // each block has 2 extra hidden dummy header:
-    // one at the end of the block used to indicate the end of the block and
-    // one at the front of the block used when coalescing (the prev segment of the 1st segment is the prologue)
-    // So allocate additional space for the dummy headers
-    // The useful block size for the user payload is BLOCK_SIZE_BYTES
-    new_block->block_start = (char *) malloc(WSIZE + BLOCK_SIZE_BYTES + WSIZE);
-    if (new_block->block_start == NULL) {
-        fprintf(stderr, "%s:%d %s() allocation ERROR!\n", __FILE__, __LINE__, __func__);
-        exit(1);
+        // each block has 2 extra hidden dummy header:
+        // one at the end of the block used to indicate the end of the block and
+        // one at the front of the block used when coalescing (the prev segment of the 1st segment is the prologue)
+        // So allocate additional space for the dummy headers
+        // The useful block size for the user payload is size
+        new_block->block_start = (char *) malloc(BLOCK_BUF_SIZE(size));
+        if (new_block->block_start == NULL) {
+            fprintf(stderr, "%s:%d %s() allocation ERROR!\n", __FILE__, __LINE__, __func__);
+            exit(1);
+        }
     }
     // printf("%s:%d %s() new block @: %p buf: %p\n", __FILE__, __LINE__, __func__, new_block, new_block->block_start);    
 
@@ -316,11 +801,11 @@ alloc_bloc_t * allocate_new_bloc()
     //put header and boundary footer to the new empty block
     /* Initialize free block header/footer and the epilogue hceader */
     void *fist_segment_ptr = new_block->block_start + WSIZE;
-    PUT(fist_segment_ptr, PACK(BLOCK_SIZE_BYTES, 0));
-    char *footer_start_ptr = fist_segment_ptr + BLOCK_SIZE_BYTES - WSIZE;
-    PUT(footer_start_ptr, PACK(BLOCK_SIZE_BYTES, 0));
+    PUT(fist_segment_ptr, PACK(size, 0));
+    char *footer_start_ptr = fist_segment_ptr + size - WSIZE;
+    PUT(footer_start_ptr, PACK(size, 0));
     // printf("%s:%d %s() header size %u footer size %u\n", __FILE__, __LINE__, __func__, GET_SIZE(new_block->block_start), GET_SIZE(footer_start_ptr));
-    void *dummy_hdr_ptr = fist_segment_ptr + BLOCK_SIZE_BYTES;    //dummy header is at the end of the "useful" block size
+    void *dummy_hdr_ptr = fist_segment_ptr + size;    //dummy header is at the end of the "useful" block size
     // set the flags in the last dummy header as "used" with size 0
     // this indicates that we reached the end of the block
     PUT(dummy_hdr_ptr, PACK(0, 1));   /* New epilogue/dummy header */
@@ -329,7 +814,8 @@ alloc_bloc_t * allocate_new_bloc()
     // Header/footer will be overwritten when allocator puts data into segments. 
     // Only when segments are written we assume that header/footer is occupied and
     // maintain the corresponding counters
-    new_block->bytes_free = BLOCK_SIZE_BYTES;
+    new_block->size = size;
+    new_block->bytes_free = size;
     new_block->bytes_total_in_use = 0;
 
     new_block->next = NULL;
@@ -339,6 +825,8 @@ alloc_bloc_t * allocate_new_bloc()
     new_block->segments_free = 0;
     new_block->segments_used = 0;
 
+    new_block->gen = 0;
+
     return new_block;
 }
 
@@ -384,6 +872,37 @@ void * add_data_no_header(char **segment, char *data, size_t size)
     return return_ptr;
 }
 
+// Internal use
+// removes an empty block from the block list of the slot and releases it
+static void delete_slot_block(int slot, alloc_bloc_t *blk)
+{
+    alloc_bloc_t *prev_blk = blk->prev;
+    alloc_bloc_t *next_blk = blk->next;
+
+    if (prev_blk != NULL) {
+        prev_blk->next = next_blk;
+    } else { // if prev is null, this is the fist block of the list. Update head
+        //if blk was the only block of the list, then next=NULL --> slot block list will be null
+        r_allocator.slot_blocks[slot] = next_blk;
+    }
+
+    if (next_blk != NULL) {
+        next_blk->prev = prev_blk;
+    } else { //if this is the last block in list, update tail pointer
+        //if this is the only block in the list, then the prev_blk pointer
+        // will be NULL. So the tail ptr will also be NULL
+        r_allocator.slot_blocks_tail[slot] = prev_blk;
+    }
+
+    // delete block
+    r_allocator.slot_bytes_blocks[slot] -= blk->size;
+    __atomic_sub_fetch(&r_allocator.bytes_blocks, blk->size, __ATOMIC_RELAXED);
+    release_bloc(blk);
+
+    //update block counter for the block
+    r_allocator.slot_blocks_num[slot] -= 1;
+}
+
 // Internal use
 // parameter: pointer *after the header* of the segment that will be deleted.
 void coalesce(int slot, void *segment)
@@ -440,34 +959,12 @@ void coalesce(int slot, void *segment)
 
     // if the free segments is between dummy prologue/epilogue headers, 
     // this means the whole block is empty. We can delete the block
-    if (is_next_epilogue && is_prev_prologue) {
+    // unless the slot is tracked: the blocks already sent keep their position in the list
+    if (is_next_epilogue && is_prev_prologue && !r_allocator.slot_tracked[slot]) {
         // printf("%s:%d %s() ########> Delete whole block\n", __FILE__, __LINE__, __func__);
         alloc_bloc_t *blk = get_block_from_ptr(slot, final_free_sgmt);
         assert(blk != NULL);
-        alloc_bloc_t *prev_blk = blk->prev;
-        alloc_bloc_t *next_blk = blk->next;
-
-        if (prev_blk != NULL) {
-            prev_blk->next = next_blk;
-        } else { // if prev is null, this is the fist block of the list. Update head
-            //if blk was the only block of the list, then next=NULL --> slot block list will be null
-            r_allocator.slot_blocks[slot] = next_blk;
-        }
-
-        if (next_blk != NULL) {
-            next_blk->prev = prev_blk;
-        } else { //if this is the last block in list, update tail pointer
-            //if this is the only block in the list, then the prev_blk pointer
-            // will be NULL. So the tail ptr will also be NULL
-            r_allocator.slot_blocks_tail[slot] = prev_blk;
-        }
-
-        // delete block
-        free(blk->block_start);
-        free(blk);
-
-        //update block counter for the block
-        r_allocator.slot_blocks_num[slot] -= 1;
+        delete_slot_block(slot, blk);
     } else {
         // if we don't delete the whole block, then we have to add the free segment in the free list
         freelist_insert_segment(slot, final_free_sgmt);
@@ -487,17 +984,62 @@ void r_allocator_init()
         r_allocator.slot_blocks[i] = NULL; 
         r_allocator.slot_blocks_tail[i] = NULL;
         r_allocator.slot_blocks_num[i] = 0;
-        r_allocator.free_list[i] = NULL;
+        freelist_reset(i);
         // r_allocator.alternative_free_list[i] = NULL;
         r_allocator.slot_locked[i] = 0;
+        r_allocator.slot_tracked[i] = 0;
+        r_allocator.slot_gen[i] = 0;
+        r_allocator.slot_pins[i] = 0;
+        r_allocator.slot_bytes_blocks[i] = 0;
+        r_allocator.slot_bytes_used[i] = 0;
         pthread_mutex_init(&r_allocator.mutexes[i], NULL);
     }
     // printf("%s:%d %s() spot 2\n", __FILE__, __LINE__, __func__);
     // r_allocator.total_blocks_num     = 0;
     r_allocator.bytes_size    = 0;
+    r_allocator.bytes_blocks  = 0;
+    r_allocator.block_size_min = BLOCK_SIZE_BYTES;
+    r_allocator.block_size_max = BLOCK_SIZE_BYTES;
+    r_allocator.overflow_blocks = 0;
     // printf("%s:%d %s() END\n", __FILE__, __LINE__, __func__);
 }
 
+// public API
+/*
+* Sets the size of the blocks. The first block of a slot is min_size bytes and every new block
+* of the slot is as large as all the blocks the slot already has, up to max_size bytes.
+* Sizes are rounded down to 8 bytes. Call before any block is allocated
+*/
+void r_allocator_set_block_size(size_t min_size, size_t max_size)
+{
+    max_size &= ~(size_t)0x7;
+    min_size &= ~(size_t)0x7;
+    assert(max_size >= MIN_SEGMENT_SIZE && max_size <= MAX_SEGMENT_SIZE);
+    if (min_size < MIN_SEGMENT_SIZE || min_size > max_size) {
+        min_size = max_size;
+    }
+    r_allocator.block_size_min = min_size;
+    r_allocator.block_size_max = max_size;
+}
+
+// internal use
+// returns the size of the next block of the slot that must fit a segment of 'segment_size' bytes.
+// Blocks of a slot start at block_size_min and double the capacity of the slot up to block_size_max.
+// A segment larger than block_size_max gets an overflow block of exactly its size
+static size_t next_block_size(int slot, size_t segment_size)
+{
+    size_t size = r_allocator.slot_bytes_blocks[slot];
+    if (size < r_allocator.block_size_min) size = r_allocator.block_size_min;
+    if (size > r_allocator.block_size_max) size = r_allocator.block_size_max;
+
+    while (size < segment_size && size < r_allocator.block_size_max) {
+        size <<= 1;
+    }
+    if (size > r_allocator.block_size_max) size = r_allocator.block_size_max;
+    if (size < segment_size) size = segment_size;
+    return ALIGN(size);
+}
+
 /* 
 * Allocates a new empty block for the given slot. 
 * If slot already has block, it will add the new block at the front of the block list
@@ -506,11 +1048,25 @@ void r_allocator_init()
 * returns a pointer at the data buffer of the block (EXCLUDING block metadata)
 */
 void * r_allocator_alloc_new_empty_block(int slot)
+{
+    return r_allocator_alloc_new_empty_block_of_size(slot, next_block_size(slot, 0));
+}
+
+/*
+* Same as r_allocator_alloc_new_empty_block() but the block has exactly 'size' bytes for segments.
+* Used to create the blocks that receive the blocks of a migrating slot
+*/
+void * r_allocator_alloc_new_empty_block_of_size(int slot, size_t size)
 {
     // struct timeval start, end;
     // gettimeofday(&start, NULL);
 
-    alloc_bloc_t *new_blk = allocate_new_bloc();
+    alloc_bloc_t *new_blk = allocate_new_bloc(size);
+    if (size > r_allocator.block_size_max) {
+        __atomic_add_fetch(&r_allocator.overflow_blocks, 1, __ATOMIC_RELAXED);
+    }
+    r_allocator.slot_bytes_blocks[slot] += size;
+    __atomic_add_fetch(&r_allocator.bytes_blocks, size, __ATOMIC_RELAXED);
 
     // if this is the first block of the slot
     if (r_allocator.slot_blocks[slot] == NULL) {
@@ -534,46 +1090,33 @@ void * r_allocator_alloc_new_empty_block(int slot)
     return new_blk->block_start;
 }
 
-// public API
-/* returns pointer at the header of the segment
-* creates a new segment in a block that has enough space for the segment
-* segment layout: <seg header> <payload> <padding> <seg footer>
-* seg header/footer: 4bytes that contain the size of the segment and a flag (lowest bit) indicating if segment is free/used
-* padding: is used to align segments at 8bytes addresses (so last 2 bits are always 0. We use these bits as flags)
-* payload layout: <key meta> <value meta> <key size> <key> <value size> <value>
-*/
-void * r_allocator_insert_kv(int slot, 
-                            void *key, size_t key_size, 
-                            void *value, size_t value_size,
-                            robj *key_meta, size_t key_meta_size,
-                            robj *value_meta, size_t value_meta_size,
-                            int *allocated_new_block,
-                            robj **ptr_key_meta,
-                            robj **ptr_val_meta)
+// internal use, the caller holds the slot mutex
+// if the slot is tracked, stamps the block that contains ptr with a new generation of the slot.
+// Called after the write: the migration thread that reads the generation of the slot (acquire)
+// and then the block sees the written data, or finds the block stamped after it
+static inline void track_block_write(int slot, void *ptr)
 {
-    //TODO: optimize: instead of ENTRY_HEADER_SIZE use WSIZE to write the size of each item in the segment
-    // size_t total_data_size = key_size + value_size + key_meta_size + value_meta_size + (4*ENTRY_HEADER_SIZE);
-    size_t total_data_size = key_size + value_size + key_meta_size + value_meta_size + (2*ENTRY_HEADER_SIZE);
-    size_t final_size_aligned = MAX( ALIGN(total_data_size) + OVERHEAD, MIN_SEGMENT_SIZE );
-    //////
-    // size_t padding_size = final_size_aligned - (total_data_size + 2*WSIZE);
-    // printf("\n\n%s:%d %s() key=%s ks %zu, vs %zu, kms: %zu, vms %zu, 2*header: %u, total data size %zu, HDR+FTR: %u aligned size: %zu padding: %zu\n", 
-    //         __FILE__, __LINE__, __func__, (char*) key, key_size, value_size, key_meta_size, 
-    //         value_meta_size, (2*ENTRY_HEADER_SIZE), total_data_size, (2*WSIZE), final_size_aligned, padding_size);
-    ///////
-    assert(BLOCK_SIZE_BYTES >= final_size_aligned && "Reguested K-V size larger than allocator block size");
-
-    *allocated_new_block = 0;
-
-    // Acquire the lock for the slot. So other threads that want to modify the free list will be blocked
-    // We ensure that write will be complete when we release the lock and the lock_slot can acquire it
-    // Guarantee that when lock_slot resets the free list there are no active writes
-    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    if (!r_allocator.slot_tracked[slot]) return;
+    alloc_bloc_t *blk = get_block_from_ptr(slot, ptr);
+    assert(blk != NULL);
+    uint64_t gen = __atomic_add_fetch(&r_allocator.slot_gen[slot], 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&blk->gen, gen, __ATOMIC_RELEASE);
+}
 
+// internal use, the caller holds the slot mutex
+// takes a segment of at least 'size' bytes (8-aligned, including header and footer) out of
+// the free list of the slot and marks it as used. The remaining space is split in a new free segment
+// if no free segment fits, a new block is allocated if allow_new_block is set, otherwise NULL is returned
+// returns a pointer at the segment after its header
+static char * alloc_segment(int slot, size_t final_size_aligned, int allow_new_block, int *allocated_new_block)
+{
     char * free_segment = freelist_find_fit(slot, final_size_aligned);
     if (!free_segment) {
+        if (!allow_new_block) {
+            return NULL;
+        }
         // // printf("%s:%d %s() not found any free entry to fit\n", __FILE__, __LINE__, __func__);
-        char * block_data_buffer = r_allocator_alloc_new_empty_block(slot);
+        char * block_data_buffer = r_allocator_alloc_new_empty_block_of_size(slot, next_block_size(slot, final_size_aligned));
 
         *allocated_new_block = 1;
         // void *first_segment_ptr = new_blk->block_start + WSIZE; // the first WSIZE bytes is the prologue/dummy header
@@ -614,6 +1157,47 @@ void * r_allocator_insert_kv(int slot,
         // bytes_used = GET_SIZE(HDRP(free_segment));
     }
 
+    return free_segment;
+}
+
+// public API
+/* returns pointer at the header of the segment
+* creates a new segment in a block that has enough space for the segment
+* segment layout: <seg header> <payload> <padding> <seg footer>
+* seg header/footer: 4bytes that contain the size of the segment and a flag (lowest bit) indicating if segment is free/used
+* padding: is used to align segments at 8bytes addresses (so last 2 bits are always 0. We use these bits as flags)
+* payload layout: <key meta> <value meta> <key size> <key> <value size> <value>
+*/
+void * r_allocator_insert_kv(int slot, 
+                            void *key, size_t key_size, 
+                            void *value, size_t value_size,
+                            robj *key_meta, size_t key_meta_size,
+                            robj *value_meta, size_t value_meta_size,
+                            int *allocated_new_block,
+                            robj **ptr_key_meta,
+                            robj **ptr_val_meta)
+{
+    //TODO: optimize: instead of ENTRY_HEADER_SIZE use WSIZE to write the size of each item in the segment
+    // size_t total_data_size = key_size + value_size + key_meta_size + value_meta_size + (4*ENTRY_HEADER_SIZE);
+    size_t total_data_size = key_size + value_size + key_meta_size + value_meta_size + (2*ENTRY_HEADER_SIZE);
+    size_t final_size_aligned = MAX( ALIGN(total_data_size) + OVERHEAD, MIN_SEGMENT_SIZE );
+    //////
+    // size_t padding_size = final_size_aligned - (total_data_size + 2*WSIZE);
+    // printf("\n\n%s:%d %s() key=%s ks %zu, vs %zu, kms: %zu, vms %zu, 2*header: %u, total data size %zu, HDR+FTR: %u aligned size: %zu padding: %zu\n", 
+    //         __FILE__, __LINE__, __func__, (char*) key, key_size, value_size, key_meta_size, 
+    //         value_meta_size, (2*ENTRY_HEADER_SIZE), total_data_size, (2*WSIZE), final_size_aligned, padding_size);
+    ///////
+    assert(MAX_SEGMENT_SIZE >= final_size_aligned && "Reguested K-V size larger than the maximum segment size");
+
+    *allocated_new_block = 0;
+
+    // Acquire the lock for the slot. So other threads that want to modify the free list will be blocked
+    // We ensure that write will be complete when we release the lock and the lock_slot can acquire it
+    // Guarantee that when lock_slot resets the free list there are no active writes
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+
+    char *free_segment = alloc_segment(slot, final_size_aligned, 1, allocated_new_block);
+
     //DEBUG
     // char *next_segment = NEXT_SEGMENT(free_segment);
     // printf("%s:%d %s() free_segment: %p  next seg: %p\n",  __FILE__, __LINE__, __func__, free_segment, next_segment);
@@ -628,18 +1212,21 @@ void * r_allocator_insert_kv(int slot,
     //         GET_SIZE(FTRP(next_segment)), GET_ALLOC(HDRP(next_segment)));  // footer
 
     void *return_ptr = HDRP(free_segment);
+    /* K-Vs of different slots are inserted by several threads. */
+    __atomic_fetch_add(&r_allocator.bytes_size, final_size_aligned, __ATOMIC_RELAXED);
+    r_allocator.slot_bytes_used[slot] += GET_SIZE(return_ptr);
 
-    // write <key meta size> (without header)
-    // modify the offset in key metadata to the actual key
-    // key_meta->data_offset = key_meta_size + ENTRY_HEADER_SIZE;
-    key_meta->data_offset = key_meta_size + value_meta_size + ENTRY_HEADER_SIZE;
+    // write <key meta> (without header)
+    // the copy gets the offset to the actual key, relative to the meta itself
     (*ptr_key_meta) = add_data_no_header(&free_segment, (void *) key_meta, key_meta_size);    
+    (*ptr_key_meta)->data_offset = key_meta_size + value_meta_size + ENTRY_HEADER_SIZE;
+    (*ptr_key_meta)->ptr = segment_object_data(*ptr_key_meta);
 
-    // modify the offset back to actual value in the value metadata obj
-    // value_meta->data_offset = value_meta_size + ENTRY_HEADER_SIZE;
-    value_meta->data_offset = value_meta_size + ENTRY_HEADER_SIZE + key_size + ENTRY_HEADER_SIZE;
     // write <value meta> (without header)
+    // the copy gets the offset to the actual value, relative to the meta itself
     (*ptr_val_meta) = add_data_no_header(&free_segment, (void *) value_meta, value_meta_size);
+    (*ptr_val_meta)->data_offset = value_meta_size + ENTRY_HEADER_SIZE + key_size + ENTRY_HEADER_SIZE;
+    (*ptr_val_meta)->ptr = segment_object_data(*ptr_val_meta);
    
     // write <key size> <key>
     add_data_with_header(&free_segment, key, key_size);
@@ -647,7 +1234,7 @@ void * r_allocator_insert_kv(int slot,
     // write <value size> <value>
     add_data_with_header(&free_segment, value, value_size);
 
-    r_allocator.bytes_size += final_size_aligned;
+    track_block_write(slot, return_ptr);
 
     pthread_mutex_unlock(&r_allocator.mutexes[slot]);
 
@@ -689,6 +1276,46 @@ char ** r_allocator_get_block_buffers_for_slot(int slot, int *number_of_results)
     return block_buffers;
 }
 
+/* public API
+* returns an array with the buffer length of each of the first number_of_blocks blocks of the slot,
+* in the order of r_allocator_get_block_buffers_for_slot(). This is the length to register/transfer
+* starting from the block buffer pointer (the block size plus the dummy headers)
+*/
+uint32_t * r_allocator_get_block_buffer_lengths_for_slot(int slot, int number_of_blocks)
+{
+    uint32_t *lengths = (uint32_t *) malloc(number_of_blocks * sizeof(uint32_t));
+
+    alloc_bloc_t *curr = r_allocator.slot_blocks[slot];
+    for (int index = 0; index < number_of_blocks; index++) {
+        assert(curr != NULL);
+        lengths[index] = BLOCK_BUF_SIZE(curr->size);
+        curr = curr->next;
+    }
+
+    return lengths;
+}
+
+/* public API
+* block size needed to receive a block buffer of 'buffer_length' bytes (see above)
+*/
+size_t r_allocator_block_size_from_buffer_length(size_t buffer_length)
+{
+    return buffer_length - 2*WSIZE;
+}
+
+/* public API
+* checks a block buffer length before it goes to r_allocator_block_size_from_buffer_length(),
+* which underflows below the dummy headers, and allocate_new_bloc(), which asserts on the size
+*/
+int r_allocator_block_buffer_length_valid(size_t buffer_length)
+{
+    size_t size;
+
+    if (buffer_length < BLOCK_BUF_SIZE(MIN_SEGMENT_SIZE)) return 0;
+    size = r_allocator_block_size_from_buffer_length(buffer_length);
+    return size <= MAX_SEGMENT_SIZE && (size & 0x7) == 0;
+}
+
 /* Public API
 * Locks the current allocated blocks for the slot 
 * i.e., no more writes are applied in the free segments of the existing blocks
@@ -703,9 +1330,82 @@ void r_allocator_lock_slot_blocks(int slot)
     r_allocator.slot_locked[slot] = 1;
 
     // 2. reset free list for block
-    r_allocator.free_list[slot] = NULL;
+    freelist_reset(slot);
+
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+}
 
+/* Public API
+* Pins of the replies that reference K-Vs of the slot in place instead of copying them.
+* The K-Vs are only freed or moved by the main thread between two commands, so the
+* command that adds the reply pins the slot before anything can happen to its K-V
+*/
+void r_allocator_pin_slot(int slot)
+{
+    __atomic_fetch_add(&r_allocator.slot_pins[slot], 1, __ATOMIC_ACQ_REL);
+}
+
+void r_allocator_unpin_slot(int slot)
+{
+    unsigned int prev = __atomic_fetch_sub(&r_allocator.slot_pins[slot], 1, __ATOMIC_ACQ_REL);
+    assert(prev > 0);
+}
+
+int r_allocator_slot_pinned(int slot)
+{
+    return __atomic_load_n(&r_allocator.slot_pins[slot], __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Public API
+* Dirty block tracking for the iterative pre-copy of a migrating slot.
+* While the slot is tracked every write stamps its block with a new generation of the slot,
+* the blocks of the slot are never deleted (their position in the list does not change) and
+* the slot is not compacted. The slot mutex orders the writes with the calls below
+*/
+void r_allocator_track_slot(int slot)
+{
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    r_allocator.slot_tracked[slot] = 1;
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+}
+
+void r_allocator_untrack_slot(int slot)
+{
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    r_allocator.slot_tracked[slot] = 0;
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+}
+
+uint64_t r_allocator_slot_generation(int slot)
+{
+    return __atomic_load_n(&r_allocator.slot_gen[slot], __ATOMIC_ACQUIRE);
+}
+
+/* Public API
+* Looks for the blocks written after generation 'since' among the first number_of_blocks
+* blocks of the slot. Their positions (in the order of r_allocator_get_block_buffers_for_slot())
+* are stored in 'positions' if not NULL, and their buffer lengths are added up in dirty_bytes
+* returns the number of dirty blocks
+*/
+int r_allocator_get_dirty_blocks(int slot, int number_of_blocks, uint64_t since, int *positions, size_t *dirty_bytes)
+{
+    int dirty = 0;
+    size_t bytes = 0;
+
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    alloc_bloc_t *curr = r_allocator.slot_blocks[slot];
+    for (int index = 0; index < number_of_blocks && curr != NULL; index++) {
+        if (__atomic_load_n(&curr->gen, __ATOMIC_ACQUIRE) > since) {
+            if (positions) positions[dirty] = index;
+            bytes += BLOCK_BUF_SIZE(curr->size);
+            dirty++;
+        }
+        curr = curr->next;
+    }
     pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+
+    if (dirty_bytes) *dirty_bytes = bytes;
+    return dirty;
 }
 
 // public API
@@ -726,8 +1426,12 @@ void r_allocator_free_kv(int slot, void *key_meta_ptr)
         return;
     }
 
+    // the mutex orders the write with r_allocator_track_slot(): either the segment is freed before
+    // the slot is tracked (and before its blocks are sent) or the block is stamped
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+
     size_t size = GET_SIZE(HDRP(segment));
-    //DEBUG fing the corresponding block and update used bytes counters
+    r_allocator.slot_bytes_used[slot] -= size;
 
     // mark this segment as free and then try to coalesce
     // if we use the old pointer and try to delete the already deleted key in this segment
@@ -738,65 +1442,276 @@ void r_allocator_free_kv(int slot, void *key_meta_ptr)
     // char *del_key = key_meta_ptr + KEY_META_SIZE + VALUE_META_SIZE + ENTRY_HEADER_SIZE;
     // printf("%s:%d %s() delete: %s\n", __FILE__, __LINE__, __func__, del_key);
 
-    //if slot is not locked, then coalsce, else not
-    if (r_allocator.slot_locked[slot] == 0) {
-        coalesce(slot, segment);
+    //if slot is not locked, then coalsce, else not
+    if (r_allocator.slot_locked[slot] == 0) {
+        coalesce(slot, segment);
+    }
+
+    track_block_write(slot, segment);
+
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+}
+
+// public API
+/*
+* free all blocks of slot
+*/
+void free_slot(int slot)
+{
+    alloc_bloc_t *slot_blocklist = r_allocator.slot_blocks[slot];
+    while (slot_blocklist != NULL) {
+        alloc_bloc_t *del = slot_blocklist;
+        slot_blocklist = slot_blocklist->next;
+        // printf("%s:%d %s() block @ %p \tblock start @ %p\n", __FILE__, __LINE__, __func__, del, del->block_start);
+        release_bloc(del);
+    }
+    r_allocator.slot_blocks[slot] = NULL;
+    r_allocator.slot_blocks_tail[slot] = NULL;
+    r_allocator.slot_blocks_num[slot] = 0;
+    __atomic_sub_fetch(&r_allocator.bytes_blocks, r_allocator.slot_bytes_blocks[slot], __ATOMIC_RELAXED);
+    r_allocator.slot_bytes_blocks[slot] = 0;
+    r_allocator.slot_bytes_used[slot] = 0;
+
+    //reset free list
+    freelist_reset(slot);
+    // printf("%s:%d %s() END\n", __FILE__, __LINE__, __func__);
+}
+
+void r_allocator_free_world()
+{
+    // printf("%s:%d %s() FREE WORLD\n", __FILE__, __LINE__, __func__);
+    for (int i = 0; i < SLOTS; ++i) {
+        alloc_bloc_t *block_list = r_allocator.slot_blocks[i];
+        if (block_list == NULL) {
+            continue;
+        }
+
+        while (block_list != NULL) {
+            alloc_bloc_t *tmp = block_list;
+            block_list = block_list->next;
+            release_bloc(tmp);
+        }
+    }
+    // printf("\n==== FREE END ====\n");
+}
+
+
+// public API
+/*
+* aggregated block usage of all slots
+* A slot is sparse if its used segments fit in less than one block of the maximum size:
+* the difference between its block bytes and used bytes is the overhead of keeping it in its own blocks
+*/
+allocator_info_t r_allocator_get_info()
+{
+    allocator_info_t info;
+    memset(&info, 0, sizeof(info));
+
+    info.block_size_min = r_allocator.block_size_min;
+    info.block_size_max = r_allocator.block_size_max;
+    info.overflow_blocks = __atomic_load_n(&r_allocator.overflow_blocks, __ATOMIC_RELAXED);
+    info.max_kv_size = MAX_SEGMENT_SIZE - OVERHEAD - 2*ENTRY_HEADER_SIZE - KEY_META_SIZE - VAL_META_SIZE;
+
+    for (int i = 0; i < SLOTS; ++i) {
+        size_t bytes_blocks = r_allocator.slot_bytes_blocks[i];
+        size_t bytes_used = r_allocator.slot_bytes_used[i];
+        if (bytes_blocks == 0) {
+            continue;
+        }
+        info.slots++;
+        info.blocks += r_allocator.slot_blocks_num[i];
+        info.bytes_blocks += bytes_blocks;
+        info.bytes_used += bytes_used;
+        if (bytes_used < r_allocator.block_size_max) {
+            info.sparse_slots++;
+            info.sparse_overhead += bytes_blocks - bytes_used;
+        }
+    }
+    return info;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+/* * * * * * * * * *  COMPACTION  * * * * * * * * */
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* A block is released only when all its segments are free, so deletes
+ * scattered over many blocks leave them half empty. The compactor moves the
+ * used segments of the sparsest block of a slot into the free segments of
+ * the other blocks of the slot and then releases the emptied block.
+ * The caller is told about every moved K-V so it can update the pointers
+ * to it (the key and value of the dictEntry). */
+
+void update_block_stats(alloc_bloc_t *blk);
+
+// internal use
+// removes the free segments of the block from the free list of the slot
+static void block_detach_free_segments(int slot, alloc_bloc_t *blk)
+{
+    char *ptr = WSIZE + blk->block_start + WSIZE;
+    while ( GET_SIZE(HDRP(ptr)) ) {
+        if ( !GET_ALLOC(HDRP(ptr)) ) {
+            freelist_remove_segment(slot, ptr);
+        }
+        ptr = NEXT_SEGMENT(ptr);
+    }
+}
+
+// internal use
+// merges consecutive free segments of the block and adds them to the free list of the slot
+static void block_attach_free_segments(int slot, alloc_bloc_t *blk)
+{
+    char *ptr = WSIZE + blk->block_start + WSIZE;
+    while ( GET_SIZE(HDRP(ptr)) ) {
+        if ( GET_ALLOC(HDRP(ptr)) ) {
+            ptr = NEXT_SEGMENT(ptr);
+            continue;
+        }
+        size_t size = GET_SIZE(HDRP(ptr));
+        char *next = NEXT_SEGMENT(ptr);
+        while ( GET_SIZE(HDRP(next)) && !GET_ALLOC(HDRP(next)) ) {
+            size += GET_SIZE(HDRP(next));
+            next = NEXT_SEGMENT(next);
+        }
+        PUT_WTAG(HDRP(ptr), PACK(size, 0));
+        PUT_WTAG(FTRP(ptr), PACK(size, 0));
+        freelist_insert_segment(slot, ptr);
+        ptr = next;
+    }
+}
+
+// internal use
+// the cached ptr of the key/value meta of a moved segment points inside the segment (data_offset is
+// relative and stays valid). Move the pointer along
+static inline void relocate_meta_ptr(robj *meta, char *old_segment, char *new_segment, size_t size)
+{
+    char *p = meta->ptr;
+    if (p >= old_segment && p < old_segment + size) {
+        meta->ptr = new_segment + (p - old_segment);
+    }
+}
+
+// public API
+/*
+* Evacuates the sparsest block of the slot if less than fill_threshold percent of it is used
+* and the other blocks of the slot have room for its segments.
+* relocate is called for every moved K-V with the old and the new key meta, before the old one is freed
+* blocks_released is set to 1 if the block was emptied and released
+* returns the number of moved K-Vs or -1 if there is nothing to compact
+* (the slot is locked for migration, has a single block or no block is sparse enough)
+*/
+long r_allocator_compact_slot(int slot, int fill_threshold, r_allocator_relocate_fn relocate, void *privdata, int *blocks_released)
+{
+    *blocks_released = 0;
+
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    if (r_allocator.slot_locked[slot] || r_allocator.slot_tracked[slot] || r_allocator.slot_blocks_num[slot] < 2 ||
+        r_allocator_slot_pinned(slot)) {
+        pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+        return -1;
+    }
+
+    // pick the block with the lowest fill
+    alloc_bloc_t *victim = NULL;
+    size_t slot_free = 0;
+    for (alloc_bloc_t *blk = r_allocator.slot_blocks[slot]; blk != NULL; blk = blk->next) {
+        update_block_stats(blk);
+        slot_free += blk->bytes_free;
+        if (blk->bytes_total_in_use * 100 >= blk->size * fill_threshold) {
+            continue;
+        }
+        if (victim == NULL || blk->bytes_total_in_use * victim->size < victim->bytes_total_in_use * blk->size) {
+            victim = blk;
+        }
+    }
+    if (victim == NULL || slot_free - victim->bytes_free < victim->bytes_total_in_use) {
+        pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+        return -1;
+    }
+
+    // no new segment may land in the victim
+    block_detach_free_segments(slot, victim);
+
+    long moved = 0;
+    int emptied = 1;
+    char *segment = WSIZE + victim->block_start + WSIZE;
+    while ( GET_SIZE(HDRP(segment)) ) {
+        size_t size = GET_SIZE(HDRP(segment));
+        if ( GET_ALLOC(HDRP(segment)) ) {
+            int unused;
+            char *dest = alloc_segment(slot, size, 0, &unused);
+            if (dest == NULL) { // the free space of the other blocks is too fragmented
+                emptied = 0;
+                break;
+            }
+            memcpy(dest, segment, size - DSIZE);
+            relocate_meta_ptr((robj *) dest, segment, dest, size);
+            relocate_meta_ptr((robj *) (dest + KEY_META_SIZE), segment, dest, size);
+            relocate(slot, (robj *) segment, (robj *) dest, privdata);
+
+            r_allocator.slot_bytes_used[slot] += GET_SIZE(HDRP(dest));
+            r_allocator.slot_bytes_used[slot] -= size;
+            PUT_WTAG(HDRP(segment), PACK(size, 0));
+            PUT_WTAG(FTRP(segment), PACK(size, 0));
+            moved++;
+        }
+        segment = NEXT_SEGMENT(segment);
+    }
+
+    if (emptied) {
+        delete_slot_block(slot, victim);
+        *blocks_released = 1;
+    } else {
+        block_attach_free_segments(slot, victim);
     }
+
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+    return moved;
 }
 
 // public API
-/*
-* free all blocks of slot
-*/
-void free_slot(int slot)
+slot_usage_t r_allocator_get_slot_usage(int slot)
 {
-    alloc_bloc_t *slot_blocklist = r_allocator.slot_blocks[slot];
-    while (slot_blocklist != NULL) {
-        alloc_bloc_t *del = slot_blocklist;
-        slot_blocklist = slot_blocklist->next;
-        // printf("%s:%d %s() block @ %p \tblock start @ %p\n", __FILE__, __LINE__, __func__, del, del->block_start);
-        free(del->block_start);
-        // printf("%s:%d %s() while spot 2\n", __FILE__, __LINE__, __func__);
-        free(del);
-    }
-    r_allocator.slot_blocks[slot] = NULL;
-
-    //reset free list
-    r_allocator.free_list[slot] = NULL;
-    // printf("%s:%d %s() END\n", __FILE__, __LINE__, __func__);
+    slot_usage_t usage;
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    usage.blocks = r_allocator.slot_blocks_num[slot];
+    usage.bytes_blocks = r_allocator.slot_bytes_blocks[slot];
+    usage.bytes_used = r_allocator.slot_bytes_used[slot];
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+    return usage;
 }
 
-void r_allocator_free_world()
+// public API
+/*
+* usage of the block of the slot that contains ptr (blocks is 0 if no block contains it,
+* e.g. the block was released). The used bytes are counted scanning the block
+*/
+slot_usage_t r_allocator_get_block_usage(int slot, void *ptr)
 {
-    // printf("%s:%d %s() FREE WORLD\n", __FILE__, __LINE__, __func__);
-    for (int i = 0; i < SLOTS; ++i) {
-        alloc_bloc_t *block_list = r_allocator.slot_blocks[i];
-        if (block_list == NULL) {
-            continue;
-        }
+    slot_usage_t usage = {0, 0, 0};
 
-        while (block_list != NULL) {
-            free(block_list->block_start);
-            alloc_bloc_t *tmp = block_list;
-            block_list = block_list->next;
-            free(tmp);
-        }
+    pthread_mutex_lock(&r_allocator.mutexes[slot]);
+    alloc_bloc_t *blk = get_block_from_ptr(slot, ptr);
+    if (blk != NULL) {
+        update_block_stats(blk);
+        usage.blocks = 1;
+        usage.bytes_blocks = blk->size;
+        usage.bytes_used = blk->bytes_total_in_use;
     }
-    // printf("\n==== FREE END ====\n");
+    pthread_mutex_unlock(&r_allocator.mutexes[slot]);
+    return usage;
 }
 
+// public API
+size_t r_allocator_used_memory()
+{
+    return __atomic_load_n(&r_allocator.bytes_blocks, __ATOMIC_RELAXED);
+}
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
 /* * * * * * * * DEBUG FUNCTIONS * * * * * * * * * */
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
-void print_full_kv_segment_in_a_file(void *ptr, const char *filename)
+void print_full_kv_segment_in_a_file(void *ptr, FILE *file)
 {
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        perror("Failed to open file");
-        return;
-    }
-
     // Header size
     fprintf(file, "(%u)", GET_SIZE(HDRP(ptr)));
     fprintf(file, "|");
@@ -817,7 +1732,6 @@ void print_full_kv_segment_in_a_file(void *ptr, const char *filename)
     char *key = (char *) malloc(key_size + 1);
     if (!key) {
         perror("Failed to allocate memory for key");
-        fclose(file);
         return;
     }
     memcpy(key, ptr, key_size);
@@ -834,7 +1748,6 @@ void print_full_kv_segment_in_a_file(void *ptr, const char *filename)
     char *val = (char *) malloc(val_size + 1);
     if (!val) {
         perror("Failed to allocate memory for value");
-        fclose(file);
         return;
     }
     memcpy(val, ptr, val_size);
@@ -844,8 +1757,6 @@ void print_full_kv_segment_in_a_file(void *ptr, const char *filename)
     free(val);
 
     fprintf(file, "|");
-
-    fclose(file);
 }
 
 // print segment that contains K-V
@@ -909,11 +1820,16 @@ void print_empty_kv_segment(void *ptr)
 //TODO: disable this in production
 alloc_bloc_t * get_block_from_ptr(int slot, void *ptr)
 {
+    // blocks of the arena are found without walking the block list of the slot
+    if (arena_owns(ptr)) {
+        return &arena.headers[arena_block_index(ptr)];
+    }
+
     alloc_bloc_t *cur_blk = r_allocator.slot_blocks[slot];
 
     while (cur_blk) {
         void *blk_start = cur_blk->block_start;
-        void *blk_end = blk_start + BLOCK_SIZE_BYTES;
+        void *blk_end = blk_start + cur_blk->size;
         if ( (ptr >= blk_start) && (ptr <= blk_end) ){
             return cur_blk;
         }
@@ -951,9 +1867,9 @@ void traverse_print_slot_blocks_filename(int slot, const char *filename)
         char *ptr = WSIZE + cur_block->block_start + WSIZE;
         while (GET_SIZE(HDRP(ptr))) {
             if (GET_ALLOC(HDRP(ptr))) {
-                print_full_kv_segment(ptr, file);
+                print_full_kv_segment_in_a_file(ptr, file);
             } else {
-                print_empty_kv_segment(ptr, file);
+                fprintf(file, "| EMPTY SEG of %u bytes|", GET_SIZE(HDRP(ptr)));
             }
             ptr = NEXT_SEGMENT(ptr);
             fprintf(file, "\n");
@@ -1049,12 +1965,12 @@ size_t free_list_size(int slot)
 {
     // printf("%s:%d %s() start\n", __FILE__, __LINE__, __func__);
     size_t free_segments = 0;
-    void *free_list = r_allocator.free_list[slot];
-    void *fp = free_list;
-    /* Search free list for big enough block */
-   while (fp) { 
-       free_segments++;
-        fp = NEXT_FREEP(fp);
+    for (int bin = freelist_next_bin(slot, 0); bin != -1; bin = freelist_next_bin(slot, bin + 1)) {
+        void *fp = r_allocator.free_lists[slot]->bins[bin];
+        while (fp) {
+            free_segments++;
+            fp = NEXT_FREEP(fp);
+        }
     }
 
     // printf("%s:%d %s() end\n", __FILE__, __LINE__, __func__);
@@ -1070,6 +1986,7 @@ slot_stats_t update_slot_stats(int slot)
     slot_stats_t stats = {
         .slot_id = slot,
         .blocks = 0,
+        .bytes_blocks = 0,
         .bytes_free = 0,
         .bytes_used =0,
         .segments_used = 0,
@@ -1087,6 +2004,7 @@ slot_stats_t update_slot_stats(int slot)
         update_block_stats(cur_block);
 
         stats.blocks += 1;
+        stats.bytes_blocks += cur_block->size;
         stats.bytes_used += cur_block->bytes_total_in_use;
         stats.bytes_free += cur_block->bytes_free;
         stats.segments_used += cur_block->segments_used;
@@ -1152,11 +2070,14 @@ int dump_slot(int slot, char *fileName)
         return -1;
     }
 
+    // every block is written as <block size (4 bytes)> <block buffer>
     int bytes_written = 0;
     alloc_bloc_t *cur_block = slot_head;
     while (cur_block != NULL) {
         // printf("%s:%d %s() write block", __FILE__, __LINE__, __func__);
-        bytes_written += fwrite(cur_block->block_start, 1, BLOCK_SIZE_BYTES, data_file);
+        uint32_t size = cur_block->size;
+        bytes_written += fwrite(&size, 1, sizeof(size), data_file);
+        bytes_written += fwrite(cur_block->block_start, 1, BLOCK_BUF_SIZE(cur_block->size), data_file);
         cur_block = cur_block->next;
         // printf(" (total written: %d)\n", bytes_written);
     }
@@ -1176,16 +2097,18 @@ int load_slot_from_file(int slot, char *fileName)
     }
 
     int bytes_read = 0;
-    char *tmp_block = (char *) malloc(BLOCK_SIZE_BYTES);
-    while (fread(tmp_block, 1, BLOCK_SIZE_BYTES, f) == BLOCK_SIZE_BYTES) {
-        bytes_read += BLOCK_SIZE_BYTES;
+    uint32_t size;
+    while (fread(&size, 1, sizeof(size), f) == sizeof(size)) {
         // printf("%s:%d %s() read block (total bytes read: %d)\n", __FILE__, __LINE__, __func__, bytes_read);
-        char *block_start = r_allocator_alloc_new_empty_block(slot);
-        memcpy(block_start, tmp_block, BLOCK_SIZE_BYTES);
+        char *block_start = r_allocator_alloc_new_empty_block_of_size(slot, size);
+        if (fread(block_start, 1, BLOCK_BUF_SIZE(size), f) != BLOCK_BUF_SIZE(size)) {
+            fprintf(stderr, "ERROR truncated block in file %s for slot %d\n", fileName, slot);
+            break;
+        }
+        bytes_read += sizeof(size) + BLOCK_BUF_SIZE(size);
     }
 
     fclose(f);
-    free(tmp_block);
     return bytes_read;
 }
 
@@ -1193,70 +2116,871 @@ int load_slot_from_file(int slot, char *fileName)
 /* * * * * * * * * *  ITERATOR  * * * * * * * * * */
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
 
-//TODO: init iterator in r_allocator_init
-segment_iterator_t *iter = NULL;
+/*
+* internal use
+* points the iterator at the first segment of 'block' (or at nothing if block is the end of the range)
+* the first WSIZE bytes is the prologue/dummy header. We add more WSIZE to go over the header of the 1st useful segment
+*/
+static inline void segment_iterator_set_block(segment_iterator_t *iter, alloc_bloc_t *block)
+{
+    iter->cur_block = block;
+    if (block == iter->end_block) {
+        iter->cur_block = NULL;
+        iter->cur_segment = NULL;
+        return;
+    }
+    iter->cur_segment = WSIZE + block->block_start + WSIZE;
+    __builtin_prefetch(HDRP(iter->cur_segment));
+}
+
+/*
+* internal use (SEGMENT_ITER_REBUILD)
+* adds the bytes of the used segments visited so far to the slot counter. The counter is shared
+* by all the iterators of the slot, so it is updated once per block under the slot mutex
+*/
+static void segment_iterator_flush(segment_iterator_t *iter)
+{
+    if (iter->pending_bytes_used == 0) return;
+    pthread_mutex_lock(&r_allocator.mutexes[iter->slot]);
+    r_allocator.slot_bytes_used[iter->slot] += iter->pending_bytes_used;
+    pthread_mutex_unlock(&r_allocator.mutexes[iter->slot]);
+    iter->pending_bytes_used = 0;
+}
+
+// public API
+void segment_iterator_init(segment_iterator_t *iter, int slot, int flags)
+{
+    segment_iterator_init_range(iter, slot, 0, -1, flags);
+}
 
-//will appear as public API through the struct field that points to this function
-// return ptr at the segment after its header or NULL if no KV left for the slot
-void * _getNext(int slot, robj **key_meta, robj **value_meta)
+// public API
+int segment_iterator_init_block(segment_iterator_t *iter, int slot, void *ptr, int flags)
 {
-    if (iter == NULL) {
-        fprintf(stderr, "%s:%d %s() ERROR! iterator has not been initialized\n", __FILE__, __LINE__, __func__);
-        exit(-1);
+    alloc_bloc_t *blk = get_block_from_ptr(slot, ptr);
+
+    iter->slot = slot;
+    iter->flags = flags;
+    iter->pending_bytes_used = 0;
+    iter->segments_used = 0;
+    iter->segments_free = 0;
+    if (blk == NULL) {
+        iter->end_block = NULL;
+        iter->cur_block = NULL;
+        iter->cur_segment = NULL;
+        return 0;
     }
-    if (iter->cur_block == NULL) {
-        return NULL;
+    iter->end_block = blk->next;
+    segment_iterator_set_block(iter, blk);
+    return 1;
+}
+
+// public API
+int segment_iterator_init_range(segment_iterator_t *iter, int slot, int first_block, int num_blocks, int flags)
+{
+    iter->slot = slot;
+    iter->flags = flags;
+    iter->end_block = NULL;
+    iter->pending_bytes_used = 0;
+    iter->segments_used = 0;
+    iter->segments_free = 0;
+
+    alloc_bloc_t *first = r_allocator.slot_blocks[slot];
+    for (int i = 0; i < first_block && first != NULL; i++) {
+        first = first->next;
+    }
+
+    if (num_blocks >= 0) {
+        alloc_bloc_t *end = first;
+        for (int i = 0; i < num_blocks && end != NULL; i++) {
+            end = end->next;
+        }
+        iter->end_block = end;
+    }
+
+    if (first == NULL) {
+        iter->cur_block = NULL;
+        iter->cur_segment = NULL;
+        return 0;
     }
+    segment_iterator_set_block(iter, first);
+    return 1;
+}
+
+// public API
+// return ptr at the segment after its header or NULL if no KV left in the range of the iterator
+void * segment_iterator_next(segment_iterator_t *iter, robj **key_meta, robj **value_meta)
+{
+    int rebuild = iter->flags & SEGMENT_ITER_REBUILD;
 
     while (iter->cur_block != NULL) {
-        while ( GET_SIZE(HDRP(iter->cur_segment)) ) {   //if size of segment is 0, we reached the end of the block (the dummy/epilogue header)
-            // printf("\n%s:%d %s() current segment ptr: %p\n", __FILE__, __LINE__, __func__, iter->cur_segment);
-            void *return_segment = NULL;
-            if ( GET_ALLOC(HDRP(iter->cur_segment)) ) {
-                // print_full_kv_segment(iter->cur_segment);
-                // printf("\n");
-                return_segment = iter->cur_segment;
-                *key_meta = (iter->cur_segment);
-                *value_meta = (iter->cur_segment) + KEY_META_SIZE;
-                // printf("\n%s:%d %s() km ptr: %p  vm ptr: %p\n", __FILE__, __LINE__, __func__, (*key_meta), (*value_meta));
-                //TODO: update used/free bytes
-                iter->cur_block->bytes_total_in_use += GET_SIZE(HDRP(iter->cur_segment));
-                iter->cur_block->bytes_free -= GET_SIZE(HDRP(iter->cur_segment));
-            } else {
-                freelist_insert_segment(slot, iter->cur_segment);
+        void *segment = iter->cur_segment;
+        size_t size;
+        //if size of segment is 0, we reached the end of the block (the dummy/epilogue header)
+        while ( (size = GET_SIZE(HDRP(segment))) ) {
+            void *next = NEXT_SEGMENT(segment);
+            // the header of the next segment is likely on a cache line we have not touched yet
+            __builtin_prefetch(HDRP(next));
+
+            if ( GET_ALLOC(HDRP(segment)) ) {
+                iter->segments_used++;
+                if (rebuild) {
+                    iter->cur_block->bytes_total_in_use += size;
+                    iter->cur_block->bytes_free -= size;
+                    iter->pending_bytes_used += size;
+                }
+                iter->cur_segment = next;
+                *key_meta = segment;
+                *value_meta = (robj *)((char *)segment + KEY_META_SIZE);
+                return segment;
             }
-            iter->cur_segment = NEXT_SEGMENT(iter->cur_segment);
-            // if we visit an non-empty segment, return_segment is non-null. stop moving and return this segment
-            if (return_segment != NULL) {
-                return return_segment;
+
+            iter->segments_free++;
+            if (rebuild) {
+                pthread_mutex_lock(&r_allocator.mutexes[iter->slot]);
+                freelist_insert_segment(iter->slot, segment);
+                pthread_mutex_unlock(&r_allocator.mutexes[iter->slot]);
             }
+            segment = next;
         }
-        // printf("\n");
-        iter->cur_block = iter->cur_block->next;
-        if (iter->cur_block == NULL) {
-            return NULL;
+
+        if (rebuild) segment_iterator_flush(iter);
+        segment_iterator_set_block(iter, iter->cur_block->next);
+    }
+
+    return NULL;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+/* * * * * * * * * *  TESTING  * * * * * * * * * * */
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef REDIS_TEST
+#include <time.h>
+
+#define ALLOCATOR_TEST_LIVE_KEYS 100000
+
+static int allocatorTestCompareLatency(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+    return (la > lb) - (la < lb);
+}
+
+/* Runs 'ops' mixed inserts and deletes against 'slot': the slot is first filled
+ * with ALLOCATOR_TEST_LIVE_KEYS keys (values of 16 to 1024 bytes), then inserts
+ * and deletes of random live keys are issued with the same probability
+ * and reports the insert latency percentiles.
+ * Returns 0 if the slot accounting is consistent at the end of the run. */
+static int allocatorTestRun(int slot, long ops, int legacy_first_fit)
+{
+    char key[32], val[1024];
+    void **live = malloc(ALLOCATOR_TEST_LIVE_KEYS * sizeof(void *));
+    uint32_t *lat = malloc(ops * sizeof(uint32_t));
+    long live_num = 0, inserts = 0, deletes = 0;
+    struct timespec start, end;
+    int failed = 0;
+
+    memset(val, 'v', sizeof(val));
+    freelist_legacy_first_fit = legacy_first_fit;
+    srand(1234);
+
+    for (long j = 0; j < ops; j++) {
+        if (live_num == ALLOCATOR_TEST_LIVE_KEYS || (j >= ALLOCATOR_TEST_LIVE_KEYS && rand() % 2)) {
+            long victim = rand() % live_num;
+            r_allocator_free_kv(slot, live[victim]);
+            live[victim] = live[--live_num];
+            deletes++;
+            continue;
         }
-        //if we move to the next block, set the current segment ot the 1st segment of the current block
-        // the first WSIZE bytes is the prologue/dummy header. We add more WSIZE to go over the header of the 1st useful segment
-        iter->cur_segment = WSIZE + iter->cur_block->block_start + WSIZE;
+
+        robj key_meta, val_meta, *ptr_key_meta, *ptr_val_meta;
+        int allocated_new_block;
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j);
+        size_t val_size = 16 + rand() % (sizeof(val) - 16);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        r_allocator_insert_kv(slot, key, key_size, val, val_size,
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &ptr_key_meta, &ptr_val_meta);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        lat[inserts++] = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+        live[live_num++] = ptr_key_meta;
+    }
+
+    qsort(lat, inserts, sizeof(uint32_t), allocatorTestCompareLatency);
+    slot_stats_t stats = update_slot_stats(slot);
+    printf("%s: %ld inserts, %ld deletes, %u blocks, %u free segments: "
+           "insert p50 %u ns, p99 %u ns, max %u ns\n",
+           legacy_first_fit ? "first-fit list" : "segregated bins",
+           inserts, deletes, stats.blocks, stats.segments_free,
+           lat[inserts / 2], lat[(inserts * 99) / 100], lat[inserts - 1]);
+
+    if (stats.segments_used != live_num) {
+        printf("[failed] %u used segments, %ld live keys\n", stats.segments_used, live_num);
+        failed = 1;
+    }
+    if (stats.freelist_len != stats.segments_free) {
+        printf("[failed] %u segments in the free lists, %u free segments\n", stats.freelist_len, stats.segments_free);
+        failed = 1;
+    }
+    if ((size_t) stats.bytes_used + stats.bytes_free != stats.bytes_blocks) {
+        printf("[failed] used + free bytes do not add up to the block size\n");
+        failed = 1;
+    }
+    if (stats.bytes_used != r_allocator.slot_bytes_used[slot] || stats.bytes_blocks != r_allocator.slot_bytes_blocks[slot]) {
+        printf("[failed] slot byte counters do not match the blocks\n");
+        failed = 1;
     }
 
-	return NULL;
+    free_slot(slot);
+    freelist_legacy_first_fit = 0;
+    free(live);
+    free(lat);
+    return failed;
 }
 
-segment_iterator_t * create_iterator_for_slot(int slot)
+/* A slot with a single small key must only pin a block of the minimum size,
+ * and K-Vs larger than the maximum block size must go in overflow blocks
+ * that are released with them. */
+static int allocatorTestBlockSizes(int slot)
 {
-	// segment_iterator_t *iter = (segment_iterator_t *)malloc(sizeof(segment_iterator_t));
-    if (iter == NULL) {
-        iter = (segment_iterator_t *)malloc(sizeof(segment_iterator_t));
+    size_t sizes[] = {100, BLOCK_SIZE_BYTES / 2, BLOCK_SIZE_BYTES + 1, 3 * BLOCK_SIZE_BYTES + 12345};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    robj *kv[4];
+    int failed = 0;
+
+    for (int j = 0; j < nsizes; j++) {
+        robj key_meta, val_meta, *ptr_val_meta;
+        int allocated_new_block;
+        char key[32];
+        char *val = malloc(sizes[j]);
+        size_t key_size = snprintf(key, sizeof(key), "big:%d", j);
+
+        memset(val, 'a' + j, sizes[j]);
+        r_allocator_insert_kv(slot, key, key_size, val, sizes[j],
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &kv[j], &ptr_val_meta);
+        free(val);
+
+        if (j == 0 && r_allocator.slot_bytes_blocks[slot] != r_allocator.block_size_min) {
+            printf("[failed] sparse slot pins %zu bytes, min block size is %zu\n",
+                   r_allocator.slot_bytes_blocks[slot], r_allocator.block_size_min);
+            failed = 1;
+        }
     }
-	iter->cur_block = r_allocator_get_block_list_for_slot(slot);
-	if (iter->cur_block == NULL) {
-		iter->cur_segment = NULL;
-	} else {
-        // the first WSIZE bytes is the prologue/dummy header. We add more WSIZE to go over the header of the 1st useful segment
-		iter->cur_segment = WSIZE + ( (iter->cur_block)->block_start) + WSIZE; 
-	}
-	iter->getNext = _getNext;
-	return iter;
+
+    allocator_info_t info = r_allocator_get_info();
+    slot_stats_t stats = update_slot_stats(slot);
+    printf("block sizes %zu..%zu: %u blocks, %zu block bytes, %lu overflow blocks, max K-V size %zu\n",
+           info.block_size_min, info.block_size_max, stats.blocks, stats.bytes_blocks,
+           info.overflow_blocks, info.max_kv_size);
+    if (info.overflow_blocks != 2) {
+        printf("[failed] %lu overflow blocks, expected 2\n", info.overflow_blocks);
+        failed = 1;
+    }
+
+    /* <key meta> <value meta> <key size> <key> <value size> <value> */
+    for (int j = 0; j < nsizes; j++) {
+        char *p = (char *)kv[j] + KEY_META_SIZE + VAL_META_SIZE;
+        p += ENTRY_HEADER_SIZE + GET(p);
+        if (GET(p) != sizes[j] || p[ENTRY_HEADER_SIZE] != 'a' + j || p[ENTRY_HEADER_SIZE + sizes[j] - 1] != 'a' + j) {
+            printf("[failed] value %d was not read back\n", j);
+            failed = 1;
+        }
+    }
+
+    /* A recipient accepts the buffer lengths of the blocks, and refuses the
+     * ones it could not allocate. */
+    int nblocks = r_allocator.slot_blocks_num[slot];
+    uint32_t *lengths = r_allocator_get_block_buffer_lengths_for_slot(slot, nblocks);
+    for (int j = 0; j < nblocks; j++) {
+        if (!r_allocator_block_buffer_length_valid(lengths[j])) {
+            printf("[failed] buffer length %u of block %d is refused\n", lengths[j], j);
+            failed = 1;
+        }
+    }
+    free(lengths);
+    size_t bad_lengths[] = {0, 2 * WSIZE, BLOCK_BUF_SIZE(MIN_SEGMENT_SIZE) - 8,
+                            BLOCK_BUF_SIZE(1024) + 4, BLOCK_BUF_SIZE(MAX_SEGMENT_SIZE) + 8};
+    for (size_t j = 0; j < sizeof(bad_lengths) / sizeof(bad_lengths[0]); j++) {
+        if (r_allocator_block_buffer_length_valid(bad_lengths[j])) {
+            printf("[failed] buffer length %zu is accepted\n", bad_lengths[j]);
+            failed = 1;
+        }
+    }
+
+    for (int j = nsizes - 1; j >= 0; j--) r_allocator_free_kv(slot, kv[j]);
+    info = r_allocator_get_info();
+    if (r_allocator.slot_blocks_num[slot] != 0 || info.overflow_blocks != 0 || r_allocator.slot_bytes_blocks[slot] != 0) {
+        printf("[failed] %u blocks, %lu overflow blocks left after deleting every K-V\n",
+               r_allocator.slot_blocks_num[slot], info.overflow_blocks);
+        failed = 1;
+    }
+    free_slot(slot);
+    return failed;
+}
+
+/* Relocation callback of the compaction test: privdata is the array of live key metas */
+static void allocatorTestRelocate(int slot, robj *old_key_meta, robj *new_key_meta, void *privdata)
+{
+    robj **live = privdata;
+    char *key = (char *)old_key_meta + KEY_META_SIZE + VAL_META_SIZE + ENTRY_HEADER_SIZE;
+    UNUSED(slot);
+    live[strtol(key + 4, NULL, 10)] = new_key_meta;
+}
+
+/* Fills a slot, deletes three keys out of four at random and compacts it.
+ * Every surviving K-V must still be reachable through its (relocated) key and
+ * value pointers and the slot must end up with fewer blocks. */
+static int allocatorTestCompact(int slot, long keys)
+{
+    robj **live = calloc(keys, sizeof(robj *));
+    char key[32], val[512];
+    long moved = 0, released = 0;
+    int failed = 0;
+
+    memset(val, 'c', sizeof(val));
+    srand(4321);
+    for (long j = 0; j < keys; j++) {
+        robj key_meta, val_meta, *ptr_val_meta;
+        int allocated_new_block;
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j) + 1;
+        size_t val_size = 64 + rand() % (sizeof(val) - 64);
+
+        r_allocator_insert_kv(slot, key, key_size, val, val_size,
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &live[j], &ptr_val_meta);
+        /* like genericSetKey(): the metas point at the key and value in the segment */
+        live[j]->ptr = (char *)live[j] + live[j]->data_offset;
+        ptr_val_meta->ptr = (char *)ptr_val_meta + ptr_val_meta->data_offset;
+    }
+    for (long j = 0; j < keys; j++) {
+        if (rand() % 4) {
+            r_allocator_free_kv(slot, live[j]);
+            live[j] = NULL;
+        }
+    }
+
+    slot_usage_t before = r_allocator_get_slot_usage(slot);
+    while (1) {
+        int blocks_released;
+        long n = r_allocator_compact_slot(slot, 50, allocatorTestRelocate, live, &blocks_released);
+        if (n < 0) break;
+        moved += n;
+        released += blocks_released;
+        if (!blocks_released) break;
+    }
+    slot_usage_t after = r_allocator_get_slot_usage(slot);
+
+    printf("compaction: %u -> %u blocks, frag ratio %.2f -> %.2f, %ld K-Vs moved, %ld blocks released\n",
+           before.blocks, after.blocks,
+           (double) before.bytes_blocks / before.bytes_used, (double) after.bytes_blocks / after.bytes_used,
+           moved, released);
+    if (after.blocks >= before.blocks) {
+        printf("[failed] compaction released no block\n");
+        failed = 1;
+    }
+
+    for (long j = 0; j < keys && !failed; j++) {
+        if (live[j] == NULL) continue;
+        robj *val_meta = (robj *)((char *)live[j] + KEY_META_SIZE);
+        snprintf(key, sizeof(key), "key:%ld", j);
+        if (strcmp(live[j]->ptr, key) != 0 || ((char *)val_meta->ptr)[0] != 'c') {
+            printf("[failed] key %ld is not reachable after compaction\n", j);
+            failed = 1;
+        }
+    }
+
+    slot_stats_t stats = update_slot_stats(slot);
+    if (stats.bytes_used != after.bytes_used || stats.freelist_len != stats.segments_free) {
+        printf("[failed] slot accounting is inconsistent after compaction\n");
+        failed = 1;
+    }
+
+    free_slot(slot);
+    free(live);
+    return failed;
+}
+
+/* Eviction: deleting a quarter of the K-Vs of a slot at random gives back no
+ * memory, as no block gets empty, while deleting the K-Vs of one block (found
+ * from one of its keys) releases the whole block. */
+static int allocatorTestEvictBlock(int slot, long keys)
+{
+    robj **live = calloc(keys, sizeof(robj *));
+    char key[32], val[256];
+    long evicted = 0;
+    size_t base = r_allocator_used_memory();
+    int failed = 0;
+
+    memset(val, 'e', sizeof(val));
+    srand(777);
+    for (long j = 0; j < keys; j++) {
+        robj key_meta, val_meta, *ptr_val_meta;
+        int allocated_new_block;
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j) + 1;
+
+        r_allocator_insert_kv(slot, key, key_size, val, sizeof(val),
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &live[j], &ptr_val_meta);
+    }
+
+    size_t start = r_allocator_used_memory();
+    for (long j = 0; j < keys; j++) {
+        if (rand() % 4 == 0) {
+            r_allocator_free_kv(slot, live[j]);
+            live[j] = NULL;
+            evicted++;
+        }
+    }
+    size_t scattered = start - r_allocator_used_memory();
+
+    /* The block of a live key in the middle of the slot. */
+    long victim = keys / 2;
+    while (live[victim] == NULL) victim++;
+    slot_usage_t blk = r_allocator_get_block_usage(slot, live[victim]);
+    robj **in_block = malloc(sizeof(robj *) * keys);
+    long n = 0;
+    segment_iterator_t iter;
+    robj *key_meta, *val_meta;
+    segment_iterator_init_block(&iter, slot, live[victim], SEGMENT_ITER_READONLY);
+    while (segment_iterator_next(&iter, &key_meta, &val_meta)) in_block[n++] = key_meta;
+
+    size_t before = r_allocator_used_memory();
+    for (long j = 0; j < n; j++) r_allocator_free_kv(slot, in_block[j]);
+    size_t reclaimed = before - r_allocator_used_memory();
+
+    printf("eviction: %ld scattered K-Vs freed %zu bytes, the %ld K-Vs of one block freed %zu bytes\n",
+           evicted, scattered, n, reclaimed);
+    if (n == 0 || reclaimed != blk.bytes_blocks ||
+        r_allocator_get_block_usage(slot, live[victim]).blocks != 0)
+    {
+        printf("[failed] evicting the K-Vs of a block did not release it (%zu of %zu bytes)\n",
+               reclaimed, blk.bytes_blocks);
+        failed = 1;
+    }
+
+    free_slot(slot);
+    if (r_allocator_used_memory() != base) {
+        printf("[failed] %zu block bytes left after the slot was freed\n", r_allocator_used_memory() - base);
+        failed = 1;
+    }
+    free(in_block);
+    free(live);
+    return failed;
+}
+
+/* Iterative pre-copy of a tracked slot: the blocks are copied once, then
+ * every round overwrites a shrinking share of the keys and copies again only
+ * the blocks written since the previous round. After the last round (with the
+ * slot locked) the copies must match the blocks. */
+static int allocatorTestPrecopy(int slot, long keys)
+{
+    robj **live = calloc(keys, sizeof(robj *));
+    char key[32], val[256];
+    int failed = 0;
+
+    memset(val, 'p', sizeof(val));
+    srand(1234);
+    for (long j = 0; j < keys; j++) {
+        robj key_meta, val_meta, *ptr_val_meta;
+        int allocated_new_block;
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j) + 1;
+        r_allocator_insert_kv(slot, key, key_size, val, sizeof(val),
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &live[j], &ptr_val_meta);
+    }
+
+    r_allocator_track_slot(slot);
+    uint64_t since = r_allocator_slot_generation(slot);
+    int nblocks;
+    char **blocks = r_allocator_get_block_buffers_for_slot(slot, &nblocks);
+    uint32_t *lengths = r_allocator_get_block_buffer_lengths_for_slot(slot, nblocks);
+    char **copies = malloc(nblocks * sizeof(char *));
+    int *positions = malloc(nblocks * sizeof(int));
+    size_t slot_bytes = 0;
+    for (int b = 0; b < nblocks; b++) {
+        copies[b] = malloc(lengths[b]);
+        memcpy(copies[b], blocks[b], lengths[b]);
+        slot_bytes += lengths[b];
+    }
+
+    /* Overwrite keys of a hot sixteenth of the slot, fewer every round, then lock and catch up */
+    for (int round = 1; round <= 4; round++) {
+        long writes = round < 4 ? keys >> (3 * round) : 0;
+        for (long w = 0; w < writes; w++) {
+            robj key_meta, val_meta, *ptr_val_meta;
+            int allocated_new_block;
+            long j = rand() % (keys / 16);
+            size_t key_size = snprintf(key, sizeof(key), "key:%ld", j) + 1;
+            r_allocator_free_kv(slot, live[j]);
+            r_allocator_insert_kv(slot, key, key_size, val, sizeof(val),
+                                  &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                                  &allocated_new_block, &live[j], &ptr_val_meta);
+        }
+        if (round == 4) r_allocator_lock_slot_blocks(slot);
+
+        uint64_t gen = r_allocator_slot_generation(slot);
+        size_t dirty_bytes;
+        int dirty = r_allocator_get_dirty_blocks(slot, nblocks, since, positions, &dirty_bytes);
+        for (int d = 0; d < dirty; d++) {
+            memcpy(copies[positions[d]], blocks[positions[d]], lengths[positions[d]]);
+        }
+        since = gen;
+        printf("pre-copy round %d: %ld writes, %d of %d blocks dirty (%.1f%% of %zu bytes)\n",
+               round, writes, dirty, nblocks, (double) dirty_bytes * 100 / slot_bytes, slot_bytes);
+    }
+    r_allocator_untrack_slot(slot);
+
+    if (r_allocator_get_slot_usage(slot).blocks < (unsigned int) nblocks) {
+        printf("[failed] a block of the tracked slot was deleted\n");
+        failed = 1;
+    }
+    for (int b = 0; b < nblocks && !failed; b++) {
+        if (memcmp(copies[b], blocks[b], lengths[b]) != 0) {
+            printf("[failed] block %d differs from its pre-copied version\n", b);
+            failed = 1;
+        }
+    }
+
+    for (int b = 0; b < nblocks; b++) free(copies[b]);
+    free(copies);
+    free(positions);
+    free(lengths);
+    free(blocks);
+    free(live);
+    free_slot(slot);
+    return failed;
+}
+
+static long long allocatorTestElapsedNs(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+#define ALLOCATOR_TEST_ITER_THREADS 4
+
+typedef struct allocatorTestIterArgs {
+    int slot, first_block, num_blocks, flags;
+    unsigned long segments;
+    uint64_t key_sum;
+} allocatorTestIterArgs;
+
+static void *allocatorTestIterThread(void *arg)
+{
+    allocatorTestIterArgs *a = arg;
+    segment_iterator_t iter;
+    robj *key_meta, *val_meta;
+
+    segment_iterator_init_range(&iter, a->slot, a->first_block, a->num_blocks, a->flags);
+    while (segment_iterator_next(&iter, &key_meta, &val_meta) != NULL) {
+        char *key = (char *)key_meta + KEY_META_SIZE + VAL_META_SIZE + ENTRY_HEADER_SIZE;
+        a->key_sum += strtol(key + 4, NULL, 10);
+    }
+    a->segments = iter.segments_used;
+    return NULL;
+}
+
+/* Scans the slot with 'threads' iterators over disjoint block ranges.
+ * Returns the time it took in ns, the number of segments and the sum of the key ids seen. */
+static long long allocatorTestIterScan(int slot, int threads, int flags, unsigned long *segments, uint64_t *key_sum)
+{
+    pthread_t tids[ALLOCATOR_TEST_ITER_THREADS];
+    allocatorTestIterArgs args[ALLOCATOR_TEST_ITER_THREADS];
+    int blocks = r_allocator.slot_blocks_num[slot];
+    int per_thread = (blocks + threads - 1) / threads;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < threads; t++) {
+        args[t] = (allocatorTestIterArgs){slot, t * per_thread, per_thread, flags, 0, 0};
+        pthread_create(&tids[t], NULL, allocatorTestIterThread, &args[t]);
+    }
+    *segments = 0;
+    *key_sum = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        *segments += args[t].segments;
+        *key_sum += args[t].key_sum;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return allocatorTestElapsedNs(&start, &end);
+}
+
+/* Fills a slot and deletes one K-V out of four. A read-only scan must see every
+ * live K-V without changing the slot accounting, and so must a scan split in
+ * block ranges over several threads. The blocks are then copied to another slot
+ * the way a migration receives them and a parallel REBUILD scan must restore
+ * the accounting of the source slot. */
+static int allocatorTestIterator(int slot, int dst_slot, long keys)
+{
+    robj **live = calloc(keys, sizeof(robj *));
+    char key[32], val[256];
+    unsigned long live_keys = 0, segments;
+    uint64_t live_sum = 0, key_sum;
+    int failed = 0;
+
+    memset(val, 'i', sizeof(val));
+    srand(1234);
+    for (long j = 0; j < keys; j++) {
+        robj key_meta, val_meta, *ptr_val_meta;
+        int allocated_new_block;
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j) + 1;
+
+        r_allocator_insert_kv(slot, key, key_size, val, 32 + rand() % (sizeof(val) - 32),
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &live[j], &ptr_val_meta);
+    }
+    for (long j = 0; j < keys; j++) {
+        if (rand() % 4 == 0) {
+            r_allocator_free_kv(slot, live[j]);
+        } else {
+            live_keys++;
+            live_sum += j;
+        }
+    }
+
+    size_t bytes_used = r_allocator.slot_bytes_used[slot];
+    size_t freelist_len = free_list_size(slot);
+    long long ns1 = allocatorTestIterScan(slot, 1, SEGMENT_ITER_READONLY, &segments, &key_sum);
+    if (segments != live_keys || key_sum != live_sum) {
+        printf("[failed] read-only scan saw %lu of %lu K-Vs\n", segments, live_keys);
+        failed = 1;
+    }
+    long long nsn = allocatorTestIterScan(slot, ALLOCATOR_TEST_ITER_THREADS, SEGMENT_ITER_READONLY, &segments, &key_sum);
+    if (segments != live_keys || key_sum != live_sum) {
+        printf("[failed] partitioned scan saw %lu of %lu K-Vs\n", segments, live_keys);
+        failed = 1;
+    }
+    if (r_allocator.slot_bytes_used[slot] != bytes_used || free_list_size(slot) != freelist_len) {
+        printf("[failed] read-only scan changed the slot accounting\n");
+        failed = 1;
+    }
+
+    /* receive the blocks of the slot like registerRDMABlockSlots + RDMA writes */
+    for (alloc_bloc_t *blk = r_allocator.slot_blocks[slot]; blk != NULL; blk = blk->next) {
+        char *buf = r_allocator_alloc_new_empty_block_of_size(dst_slot, blk->size);
+        memcpy(buf, blk->block_start, BLOCK_BUF_SIZE(blk->size));
+    }
+    long long nsr = allocatorTestIterScan(dst_slot, ALLOCATOR_TEST_ITER_THREADS, SEGMENT_ITER_REBUILD, &segments, &key_sum);
+    slot_stats_t src = update_slot_stats(slot), dst = update_slot_stats(dst_slot);
+    if (segments != live_keys || key_sum != live_sum ||
+        r_allocator.slot_bytes_used[dst_slot] != bytes_used || dst.freelist_len != src.freelist_len)
+    {
+        printf("[failed] rebuild scan: %lu of %lu K-Vs, %zu of %zu bytes used, %u of %u free segments\n",
+               segments, live_keys, r_allocator.slot_bytes_used[dst_slot], bytes_used,
+               dst.freelist_len, src.freelist_len);
+        failed = 1;
+    }
+
+    printf("iterator: %u blocks, %lu K-Vs: read-only scan %.0f keys/sec (1 thread), %.0f keys/sec (%d threads); "
+           "rebuild scan %.0f keys/sec (%d threads)\n", src.blocks, live_keys,
+           (double) live_keys * 1e9 / ns1, (double) live_keys * 1e9 / nsn, ALLOCATOR_TEST_ITER_THREADS,
+           (double) live_keys * 1e9 / nsr, ALLOCATOR_TEST_ITER_THREADS);
+
+    free_slot(slot);
+    free_slot(dst_slot);
+    free(live);
+    return failed;
+}
+
+static uint64_t allocatorTestHash(const void *key)
+{
+    return dictGenHashFunction(key, sdslen((sds) key));
+}
+
+static int allocatorTestKeyCompare(void *privdata, const void *key1, const void *key2)
+{
+    UNUSED(privdata);
+    return sdslen((sds) key1) == sdslen((sds) key2) && memcmp(key1, key2, sdslen((sds) key1)) == 0;
+}
+
+static void allocatorTestKeyDestructor(void *privdata, void *key)
+{
+    UNUSED(privdata);
+    sdsfree(key);
+}
+
+/* sds key -> key meta of its segment */
+static dictType allocatorTestDictType = {
+    allocatorTestHash, NULL, NULL, allocatorTestKeyCompare, allocatorTestKeyDestructor, NULL, NULL
+};
+
+/* Fills 'slot' with 'keys' keys of 'val_size' bytes, then reads the values
+ * back in random order, first straight from the segments, then like GET
+ * does: the key is looked up in a dict and the value copied in a reply
+ * buffer. Reports the latency of the inserts that had to allocate a new
+ * block, the fill throughput (first write of every page of the blocks), the
+ * random read throughput and the GET throughput.
+ * Returns 0 if every key read back the value it was written with. */
+static int allocatorTestBlocks(const char *name, int slot, long keys, size_t val_size)
+{
+    robj **live = malloc(keys * sizeof(robj *));
+    uint32_t *blk_lat = malloc((keys / 8 + 1) * sizeof(uint32_t));
+    char key[32], *val = malloc(val_size);
+    long blk_allocs = 0, reads = keys * 4;
+    struct timespec start, end, fill_start, fill_end;
+    uint64_t sum = 0;
+    int failed = 0;
+
+    memset(val, 'v', val_size);
+    clock_gettime(CLOCK_MONOTONIC, &fill_start);
+    for (long j = 0; j < keys; j++) {
+        robj key_meta, val_meta, *ptr_val_meta;
+        int allocated_new_block = 0;
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        r_allocator_insert_kv(slot, key, key_size, val, val_size,
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &live[j], &ptr_val_meta);
+        if (allocated_new_block) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            blk_lat[blk_allocs++] = allocatorTestElapsedNs(&start, &end);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &fill_end);
+    long long fill_ns = allocatorTestElapsedNs(&fill_start, &fill_end);
+
+    /* Random reads: the segment is <key meta> <value meta> <key size> <key> <value size> <value> */
+    uint64_t x = 88172645463325252ULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long j = 0; j < reads; j++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        char *p = (char *)live[x % keys] + KEY_META_SIZE + VAL_META_SIZE;
+        p += ENTRY_HEADER_SIZE + GET(p);
+        u_int vlen = GET(p);
+        p += ENTRY_HEADER_SIZE;
+        for (u_int k = 0; k + 8 <= vlen; k += 8) sum += *(uint64_t *)(p + k);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long read_ns = allocatorTestElapsedNs(&start, &end);
+
+    if (sum != (uint64_t) reads * (val_size / 8) * 0x7676767676767676ULL) {
+        printf("[failed] %s: values read back do not match\n", name);
+        failed = 1;
+    }
+
+    /* GET: the dict lookup touches the key in the block, the reply copies the
+     * value out of it. */
+    dict *d = dictCreate(&allocatorTestDictType, NULL);
+    char *reply = malloc(val_size);
+    long gets = keys * 2, misses = 0;
+    dictExpand(d, keys);
+    for (long j = 0; j < keys; j++) {
+        size_t key_size = snprintf(key, sizeof(key), "key:%ld", j);
+        dictAdd(d, sdsnewlen(key, key_size), live[j]);
+    }
+    sds get_key = sdsempty();
+    sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long j = 0; j < gets; j++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        sdsclear(get_key);
+        get_key = sdscatfmt(get_key, "key:%I", (long long) (x % keys));
+        dictEntry *de = dictFind(d, get_key);
+        if (de == NULL) {
+            misses++;
+            continue;
+        }
+        char *p = (char *)dictGetVal(de) + KEY_META_SIZE + VAL_META_SIZE;
+        if (GET(p) != sdslen(get_key) || memcmp(p + ENTRY_HEADER_SIZE, get_key, sdslen(get_key))) {
+            misses++;
+            continue;
+        }
+        p += ENTRY_HEADER_SIZE + GET(p);
+        u_int vlen = GET(p);
+        memcpy(reply, p + ENTRY_HEADER_SIZE, vlen);
+        sum += (unsigned char) reply[vlen - 1];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long get_ns = allocatorTestElapsedNs(&start, &end);
+
+    if (misses || sum != (uint64_t) gets * 'v') {
+        printf("[failed] %s: %ld GETs missed their key\n", name, misses);
+        failed = 1;
+    }
+    sdsfree(get_key);
+    free(reply);
+    dictRelease(d);
+
+    qsort(blk_lat, blk_allocs, sizeof(uint32_t), allocatorTestCompareLatency);
+    printf("%s: %ld blocks: block alloc p50 %u ns, max %u ns; fill %.0f keys/sec (%.2f GB/s); "
+           "random read %.0f ops/sec; GET %.0f ops/sec\n", name, blk_allocs,
+           blk_allocs ? blk_lat[blk_allocs / 2] : 0, blk_allocs ? blk_lat[blk_allocs - 1] : 0,
+           (double) keys * 1e9 / fill_ns, (double) keys * val_size / fill_ns,
+           (double) reads * 1e9 / read_ns, (double) gets * 1e9 / get_ns);
+
+    free_slot(slot);
+    free(live);
+    free(blk_lat);
+    free(val);
+    return failed;
+}
+
+/* ./redis-server test allocator [<count> | --accurate] */
+int allocatorTest(int argc, char **argv, int accurate)
+{
+    long ops;
+    int failed = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            ops = 10000000;
+        } else {
+            ops = strtol(argv[3],NULL,10);
+        }
+    } else {
+        ops = 300000;
+    }
+
+    r_allocator_init();
+    r_allocator_set_block_size(64 * 1024, BLOCK_SIZE_BYTES);
+    failed |= allocatorTestBlockSizes(3);
+    failed |= allocatorTestCompact(4, 200000);
+    failed |= allocatorTestIterator(5, 6, 500000);
+    failed |= allocatorTestPrecopy(7, 200000);
+    failed |= allocatorTestEvictBlock(8, 100000);
+    failed |= allocatorTestRun(0, ops, 0);
+    failed |= allocatorTestRun(1, ops, 1);
+
+    /* Block arena vs one malloc per block */
+    long keys = accurate ? 4000000 : 1000000;
+    size_t val_size = 256;
+    size_t arena_size = (size_t) keys * (val_size + 128) * 5 / 4;
+    static const char *hugepages_names[] = {"no", "thp", "2mb", "1gb"};
+
+    static const struct { int hugepages; int prefault; } modes[] = {
+        {ALLOCATOR_HUGEPAGES_NO, 0}, {ALLOCATOR_HUGEPAGES_THP, 0},
+        {ALLOCATOR_HUGEPAGES_THP, 1}, {ALLOCATOR_HUGEPAGES_2MB, 1}
+    };
+
+    failed |= allocatorTestBlocks("malloc blocks", 2, keys, val_size);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        int hp = modes[m].hugepages;
+        char name[64];
+        if (r_allocator_arena_init(arena_size, hp, -1, modes[m].prefault ? UINT_MAX : 0) == -1) {
+            printf("[failed] unable to reserve the block arena\n");
+            return 1;
+        }
+        arena_stats_t as = r_allocator_arena_stats();
+        if (as.hugepages != hp) {
+            /* The mode fell back to one that was already measured */
+            r_allocator_arena_release();
+            continue;
+        }
+        snprintf(name, sizeof(name), "arena blocks (hugepages %s%s)", hugepages_names[as.hugepages],
+                 modes[m].prefault ? ", prefaulted" : "");
+        failed |= allocatorTestBlocks(name, 2, keys, val_size);
+
+        as = r_allocator_arena_stats();
+        if (as.blocks_free != as.blocks_total || as.fallback_blocks != 0) {
+            printf("[failed] %u of %u arena blocks free, %llu blocks malloc'd\n",
+                   as.blocks_free, as.blocks_total, as.fallback_blocks);
+            failed = 1;
+        }
+        r_allocator_arena_release();
+    }
+    return failed;
 }
+#endif
@@ -5,7 +5,8 @@
 #include <stdio.h>
 
 
-/* BLOCK_SIZE_BYTES must be 8-aligned aligned e.g. 120, 128, 136 but NOT 130 */
+/* BLOCK_SIZE_BYTES must be 8-aligned aligned e.g. 120, 128, 136 but NOT 130
+ * It is the default maximum block size (allocator-block-size) */
 // #define BLOCK_SIZE_BYTES 1*1024*1024//1024//192//4000000//256//224//1024//256
 //#define BLOCK_SIZE_BYTES 3.5 * 1024 *1024//1024//192//4000000//256//224//1024//256
 //#define BLOCK_SIZE_BYTES 3 * 1024 *1024//1024//192//4000000//256//224//1024//256
@@ -19,6 +20,7 @@ typedef struct r_allocator r_allocator_t;
 typedef struct slot_stats {
     unsigned int    slot_id;
     unsigned int    blocks;
+    size_t          bytes_blocks;
     unsigned int    bytes_used;
     unsigned int    bytes_free;
     unsigned int    segments_used;
@@ -28,6 +30,68 @@ typedef struct slot_stats {
 
 void r_allocator_init();
 
+/*
+* Sets the size of the blocks. The first block of a slot is min_size bytes and every new block
+* of the slot is as large as all the blocks the slot already has, up to max_size bytes.
+* K-Vs larger than max_size are stored in an overflow block of their own.
+* min_size = max_size gives fixed size blocks. Call before any block is allocated
+*/
+void r_allocator_set_block_size(size_t min_size, size_t max_size);
+
+typedef struct allocator_info {
+    size_t              block_size_min;
+    size_t              block_size_max;
+    size_t              max_kv_size;        /* largest key + value (bytes passed to insert_kv) */
+    unsigned int        slots;              /* slots that have at least one block */
+    unsigned long       blocks;
+    unsigned long       overflow_blocks;
+    size_t              bytes_blocks;       /* sum of the block sizes */
+    size_t              bytes_used;         /* bytes of used segments */
+    unsigned int        sparse_slots;       /* slots whose data fits in less than a max size block */
+    size_t              sparse_overhead;    /* unused block bytes of the sparse slots */
+} allocator_info_t;
+
+allocator_info_t r_allocator_get_info();
+
+/* allocator-arena-hugepages: page size backing the block arena */
+#define ALLOCATOR_HUGEPAGES_NO  0   /* regular pages */
+#define ALLOCATOR_HUGEPAGES_THP 1   /* transparent huge pages (madvise) */
+#define ALLOCATOR_HUGEPAGES_2MB 2   /* MAP_HUGETLB 2MB pages, falls back to thp */
+#define ALLOCATOR_HUGEPAGES_1GB 3   /* MAP_HUGETLB 1GB pages, falls back to thp */
+
+typedef struct arena_stats {
+    size_t              region_size;
+    unsigned int        blocks_total;
+    unsigned int        blocks_free;
+    unsigned int        blocks_prefaulted;
+    int                 hugepages;      /* mode in use, may be lower than the configured one */
+    int                 numa_node;      /* -1 if the region is not bound */
+    unsigned long long  fallback_blocks;    /* blocks malloc'd because the arena was full */
+} arena_stats_t;
+
+/*
+* Reserves 'size' bytes (a pre-faulted, optionally huge page backed and NUMA bound region)
+* that new blocks are carved out of. With size 0 blocks are malloc'd one by one.
+* returns 0 on success, -1 if the region could not be reserved
+*/
+int r_allocator_arena_init(size_t size, int hugepages, int numa_node, unsigned int prefault_blocks);
+void r_allocator_arena_release();
+arena_stats_t r_allocator_arena_stats();
+void * r_allocator_arena_region(size_t *size);
+
+/*
+* Released blocks of the maximum size that are not in the arena are kept in a pool of
+* up to max_blocks blocks and reused, instead of being freed
+*/
+void r_allocator_set_block_pool(unsigned int max_blocks);
+unsigned int r_allocator_block_pool_fill(unsigned int blocks);
+void r_allocator_block_pool_foreach(void (*fn)(void *buffer, size_t len, void *privdata), void *privdata);
+unsigned int r_allocator_block_pool_size();
+
+/* Called with the buffer of every block whose memory is given back to the system */
+typedef void (*r_allocator_release_hook_fn)(void *buffer, size_t len);
+void r_allocator_set_release_hook(r_allocator_release_hook_fn fn);
+
 /* 
 * Allocates a new empty block for the given slot. 
 * If slot already has block, it will add the new block at the front of the block list
@@ -37,12 +101,20 @@ void r_allocator_init();
 */
 void * r_allocator_alloc_new_empty_block(int slot);
 
+/* 
+* Same as r_allocator_alloc_new_empty_block() but the block has exactly 'size' bytes for segments
+* (8-aligned). Used to receive the blocks of a migrating slot
+*/
+void * r_allocator_alloc_new_empty_block_of_size(int slot, size_t size);
+
 /* 
 * creates a new segment in a block that has enough space for the segment
 * segment layout: <seg header> <payload> <padding> <seg footer>
 * seg header/footer: 4bytes that contain the size of the segment and a flag (lowest bit) indicating if segment is free/used
 * padding: is used to align segments at 8bytes addresses (so the last 2 bits are always 0. We use these bits as flags)
 * payload layout: <key meta size> <key meta> <key size> <key> <value meta size> <value meta> <value size> <value>
+* the copies of the metas get the data_offset of the key/value (see SEGMENT OBJECTS below) and their ptr
+* points at the data in the segment. key_meta and value_meta are not modified
 * returns pointer at the header of the segment
 */
 void * r_allocator_insert_kv(int slot, 
@@ -65,12 +137,52 @@ alloc_bloc_t * r_allocator_get_block_list_for_slot(int slot);
 */
 char ** r_allocator_get_block_buffers_for_slot(int slot, int *number_of_results);
 
+/*
+* returns an array with the buffer length of each of the first number_of_blocks blocks of the slot
+* (same order as r_allocator_get_block_buffers_for_slot). It is the number of bytes to register
+* and transfer starting from the block buffer pointer
+*/
+uint32_t * r_allocator_get_block_buffer_lengths_for_slot(int slot, int number_of_blocks);
+
+/* size to pass to r_allocator_alloc_new_empty_block_of_size() to receive a buffer of buffer_length bytes */
+size_t r_allocator_block_size_from_buffer_length(size_t buffer_length);
+
+/* 1 if a block buffer of buffer_length bytes, e.g. as sent by a donor, can be received: the block
+ * size is a multiple of 8 bytes between the minimum and maximum segment sizes */
+int r_allocator_block_buffer_length_valid(size_t buffer_length);
+
 /*
 * free the segment of the whole K-V
 * parameter: pointer to the key metadata
 */
 void r_allocator_free_kv(int slot, void *key_meta_ptr);
 
+typedef struct slot_usage {
+    unsigned int    blocks;
+    size_t          bytes_blocks;   /* sum of the block sizes */
+    size_t          bytes_used;     /* bytes of used segments */
+} slot_usage_t;
+
+slot_usage_t r_allocator_get_slot_usage(int slot);
+
+/* usage of the block of the slot that contains ptr, blocks is 0 if there is none */
+slot_usage_t r_allocator_get_block_usage(int slot, void *ptr);
+
+/* bytes of the blocks of all the slots (they are not malloc'd through zmalloc) */
+size_t r_allocator_used_memory();
+
+/* Called by the compactor for every moved K-V: old_key_meta is still readable, 
+* the value meta follows the key meta in both segments */
+typedef void (*r_allocator_relocate_fn)(int slot, robj *old_key_meta, robj *new_key_meta, void *privdata);
+
+/*
+* Evacuates the sparsest block of the slot (less than fill_threshold percent used) into the
+* free space of the other blocks of the slot and releases it.
+* returns the number of moved K-Vs or -1 if there is nothing to compact. Does nothing on slots
+* locked for migration or pinned by replies
+*/
+long r_allocator_compact_slot(int slot, int fill_threshold, r_allocator_relocate_fn relocate, void *privdata, int *blocks_released);
+
 /* free ALL blocks of the slot */
 void free_slot(int slot);
 
@@ -82,21 +194,99 @@ void r_allocator_free_world();
 * Future writes will be performed in newly allocated blocks */
 void r_allocator_lock_slot_blocks(int slot);
 
+/* Dirty block tracking, for the iterative pre-copy of a migrating slot.
+* While the slot is tracked every write stamps its block with a new generation of the slot,
+* and the blocks of the slot are neither deleted nor compacted, so the blocks already sent
+* keep their position. r_allocator_get_dirty_blocks() returns the number of blocks, among the
+* first number_of_blocks, written after generation 'since', their positions (if not NULL) and
+* the sum of their buffer lengths */
+void r_allocator_track_slot(int slot);
+void r_allocator_untrack_slot(int slot);
+uint64_t r_allocator_slot_generation(int slot);
+int r_allocator_get_dirty_blocks(int slot, int number_of_blocks, uint64_t since, int *positions, size_t *dirty_bytes);
+
+/* Pins of the replies that reference K-Vs of the slot in place (zero copy replies).
+* While the slot is pinned its segments must not be freed nor moved: r_allocator_compact_slot()
+* does nothing and the callers of r_allocator_free_kv() leave the segments in place */
+void r_allocator_pin_slot(int slot);
+void r_allocator_unpin_slot(int slot);
+int r_allocator_slot_pinned(int slot);
+
 /* get total execution time of allocate_new_empty_block in microsec */
 // long get_empty_blocks_alloc_exec_time();
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+/* * * * * * * * * SEGMENT OBJECTS * * * * * * * * */
+/* * * * * * * * * * * * * * * * * * * * * * * * * */
+/*
+* The key and value metas of a segment are position independent: data_offset is the offset of
+* the data from the meta itself, so a segment is valid at any address (e.g. right after an RDMA
+* transfer) without patching. The ptr of an embedded meta is only a cache of that address, use
+* segment_object_ptr() to read it. Objects that are not embedded in a segment have data_offset 0.
+* Keys and values are sds strings, stored with the SEGMENT_SDS_PREFIX bytes before the string
+* (the sds header) by genericSetKey()
+*/
+#define SEGMENT_SDS_PREFIX 8
+
+#define segment_object_is_embedded(o) ((o)->data_offset != 0)
+
+/* address of the sds string of an embedded meta */
+static inline void *segment_object_data(robj *meta)
+{
+    return (char *) meta + meta->data_offset + SEGMENT_SDS_PREFIX;
+}
+
+/* the value meta follows the key meta in the segment */
+static inline robj *segment_value_meta(robj *key_meta)
+{
+    return (robj *) ((char *) key_meta + sizeof(robj));
+}
+
+/* returns o->ptr, refreshing it first if the object is embedded in a segment */
+static inline void *segment_object_ptr(robj *o)
+{
+    if (segment_object_is_embedded(o)) o->ptr = segment_object_data(o);
+    return o->ptr;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
 /* * * * * * * * * *  ITERATOR * * * * * * * * * * */
 /* * * * * * * * * * * * * * * * * * * * * * * * * */
-typedef void * (*getNextFunction)(int slot, robj **key_meta, robj **value_meta);
+/*
+* Iterators are owned by the caller (usually on the stack) and share no state, so several threads
+* can scan the same slot at once as long as they visit disjoint block ranges.
+* SEGMENT_ITER_READONLY only visits the used segments and does not touch the allocator.
+* SEGMENT_ITER_REBUILD is for blocks received by RDMA: it also accounts the used segments in the
+* block/slot stats and puts the free segments in the free list of the slot.
+*/
+#define SEGMENT_ITER_READONLY   0
+#define SEGMENT_ITER_REBUILD    (1<<0)
 
 typedef struct segment_iterator {
+	int				slot;
+	int				flags;
 	alloc_bloc_t	*cur_block;
+	alloc_bloc_t	*end_block;     //first block after the range (NULL: end of the slot list)
 	void 			*cur_segment;   //points to current segment (after the seg header)
-	getNextFunction	getNext;
+	size_t			pending_bytes_used;     //REBUILD: used bytes of cur_block not yet added to the slot
+	unsigned long	segments_used;  //segments visited so far
+	unsigned long	segments_free;
 } segment_iterator_t;
 
-segment_iterator_t * create_iterator_for_slot(int slot);
+/* iterate all the blocks of the slot */
+void segment_iterator_init(segment_iterator_t *iter, int slot, int flags);
+
+/*
+* iterate num_blocks blocks of the slot starting from block number first_block (0 is the head of the list).
+* num_blocks = -1 iterates up to the last block. returns 0 if the range is empty
+*/
+int segment_iterator_init_range(segment_iterator_t *iter, int slot, int first_block, int num_blocks, int flags);
+
+/* iterate the block of the slot that contains ptr. returns 0 if no block contains it */
+int segment_iterator_init_block(segment_iterator_t *iter, int slot, void *ptr, int flags);
+
+/* returns the next used segment (the key meta) and sets key_meta/value_meta, or NULL at the end of the range */
+void * segment_iterator_next(segment_iterator_t *iter, robj **key_meta, robj **value_meta);
 
 
 /////////// DEBUG
@@ -120,4 +310,8 @@ size_t calculate_required_space_for_segment(
 int dump_slot(int slot, char *fileName);
 int load_slot_from_file(int slot, char *fileName);
 
+#ifdef REDIS_TEST
+int allocatorTest(int argc, char *argv[], int accurate);
+#endif
+
 #endif
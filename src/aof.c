@@ -30,6 +30,7 @@
 #include "server.h"
 #include "bio.h"
 #include "rio.h"
+#include "allocator.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -1468,11 +1469,18 @@ int rewriteAppendOnlyFileRio(rio *aof) {
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
             sds keystr;
-            robj key, *o;
+            robj key, *o, segval;
             long long expiretime;
 
             keystr = dictGetKey(de);
             o = dictGetVal(de);
+            /* Values stored in slot blocks: derive the pointer on a copy
+             * so the child doesn't write to (and copy) the block pages. */
+            if (segment_object_is_embedded(o)) {
+                segval = *o;
+                segval.ptr = segment_object_data(o);
+                o = &segval;
+            }
             initStaticStringObject(key,keystr);
 
             expiretime = getExpire(db,&key);
@@ -97,6 +97,10 @@ void blockClient(client *c, int btype) {
         c->paused_list_node = listLast(server.paused_clients);
         /* Mark this client to execute its command */
         c->flags |= CLIENT_PENDING_COMMAND;
+    } else if (btype == BLOCKED_SLOT) {
+        listAddNodeTail(server.parked_clients, c);
+        c->paused_list_node = listLast(server.parked_clients);
+        c->flags |= CLIENT_PENDING_COMMAND;
     }
 }
 
@@ -184,6 +188,9 @@ void unblockClient(client *c) {
     } else if (c->btype == BLOCKED_PAUSE) {
         listDelNode(server.paused_clients,c->paused_list_node);
         c->paused_list_node = NULL;
+    } else if (c->btype == BLOCKED_SLOT) {
+        listDelNode(server.parked_clients,c->paused_list_node);
+        c->paused_list_node = NULL;
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -191,8 +198,10 @@ void unblockClient(client *c) {
     /* Reset the client for a new query since, for blocking commands
      * we do not do it immediately after the command returns (when the
      * client got blocked) in order to be still able to access the argument
-     * vector from module callbacks and updateStatsOnUnblock. */
-    if (c->btype != BLOCKED_PAUSE) {
+     * vector from module callbacks and updateStatsOnUnblock. A parked write
+     * is executed again, unless it timed out. */
+    if (c->btype != BLOCKED_PAUSE &&
+        !(c->btype == BLOCKED_SLOT && c->flags & CLIENT_PENDING_COMMAND)) {
         freeClientOriginalArgv(c);
         resetClient(c);
     }
@@ -219,6 +228,11 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_SLOT) {
+        addReplyError(c,"-TRYAGAIN Slot is being handed over");
+        server.stat_migration_parked_timeouts++;
+        server.stat_cluster_tryagain_replies++;
+        c->flags &= ~CLIENT_PENDING_COMMAND;
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -244,7 +258,7 @@ void disconnectAllBlockedClients(void) {
              * command processing will start from scratch, and the command will
              * be either executed or rejected. (unlike LIST blocked clients for
              * which the command is already in progress in a way. */
-            if (c->btype == BLOCKED_PAUSE)
+            if (c->btype == BLOCKED_PAUSE || c->btype == BLOCKED_SLOT)
                 continue;
 
             addReplyError(c,
@@ -34,6 +34,7 @@
 #include "connection.h"
 
 #include "allocator.h"
+#include "latency.h"
 #include <infiniband/verbs.h>
 
 #include <time.h>
@@ -46,6 +47,7 @@
 #include <sys/file.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>   // for gettimeofday()
 #include <stdatomic.h>
 
@@ -90,6 +92,13 @@ uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
 void moduleCallClusterReceivers(const char *sender_id, uint64_t module_id, uint8_t type, const unsigned char *payload, uint32_t len);
 void printTimevalInMilliseconds(struct timeval *tv_start, struct timeval *tv_end, char *timerName);
+void bitmapSetBit(unsigned char *bitmap, int pos);
+static void clusterHandoffSlot(clusterNode *n, int slot);
+static int clusterSendShadowLog(connection *conn, sds *args, int start, int end);
+void clusterHandoffInit(void);
+void clusterHandoffCron(void);
+void clusterProcessHandoff(clusterLink *link, clusterNode *sender, clusterMsg *hdr);
+void clusterProcessHandoffAck(clusterNode *sender, clusterMsg *hdr);
 
 rdmaCachedConnection* rdmaGetConnection(client *c);
 #define RCVBUF_INIT_LEN 1024
@@ -556,11 +565,7 @@ void clusterInit(void) {
 	if (createSocketAcceptHandler(&server.cfd, clusterAcceptHandler) != C_OK) {
 		serverPanic("Unrecoverable error creating Redis Cluster socket accept handler.");
 	}
-
-	/* The slots -> keys map is a radix tree. Initialize it here. */
-	server.cluster->slots_to_keys = raxNew();
-	memset(server.cluster->slots_keys_count,0,
-			sizeof(server.cluster->slots_keys_count));
+	clusterHandoffInit();
 
 	/* Set myself->port/cport/pport to my listening ports, we'll just need to
 	 * discover the IP address via MEET messages. */
@@ -1016,8 +1021,10 @@ void clusterDelNode(clusterNode *delnode) {
 		pthread_mutex_lock(&(server.lock_slots[j]));
 		if (server.cluster->importing_slots_from[j] == delnode)
 			server.cluster->importing_slots_from[j] = NULL;
-		if (server.cluster->migrating_slots_to[j] == delnode)
+		if (server.cluster->migrating_slots_to[j] == delnode) {
 			server.cluster->migrating_slots_to[j] = NULL;
+			shadowLogDiscard(j);
+		}
 		if (server.cluster->slots[j] == delnode)
 			clusterDelSlot(j);
 		pthread_mutex_unlock(&(server.lock_slots[j]));
@@ -1776,14 +1783,11 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
 		 * a slave.
 		 *
 		 * In order to maintain a consistent state between keys and slots
-		 * we need to remove all the keys from the slots we lost. */
-
-		//STRATOS DELETE KEYS IN SLOT IN UNLOCK START
-		//        for (j = 0; j < dirty_slots_count; j++)
-		//            delKeysInSlot(dirty_slots[j]);
-		//STRATOS DELETE KEYS IN SLOT IN UNLOCK STOP
-		//
-		//delKeysInSlotAllocator(dirty_slots[j]);
+		 * we need to remove all the keys from the slots we lost. The slots
+		 * are migrated by RDMA, so the K-Vs stay in the allocator blocks and
+		 * only the keys are dropped. */
+		for (j = 0; j < dirty_slots_count; j++)
+			delKeysInSlotAllocator(dirty_slots[j]);
 	}
 }
 
@@ -1860,6 +1864,13 @@ int clusterProcessPacket(clusterLink *link) {
 		explen += sizeof(clusterMsgModule) -
 			3 + ntohl(hdr->data.module.msg.len);
 		if (totlen != explen) return 1;
+	} else if (type == CLUSTERMSG_TYPE_HANDOFF ||
+			type == CLUSTERMSG_TYPE_HANDOFF_ACK)
+	{
+		uint32_t explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
+
+		explen += sizeof(clusterMsgDataHandoff);
+		if (totlen != explen) return 1;
 	}
 
 	/* Check if the sender is a known node. Note that for incoming connections
@@ -2281,6 +2292,12 @@ int clusterProcessPacket(clusterLink *link) {
 		uint8_t type = hdr->data.module.msg.type;
 		unsigned char *payload = hdr->data.module.msg.bulk_data;
 		moduleCallClusterReceivers(sender->name,module_id,type,payload,len);
+	} else if (type == CLUSTERMSG_TYPE_HANDOFF) {
+		if (!sender) return 1;  /* We don't know the sender. */
+		clusterProcessHandoff(link,sender,hdr);
+	} else if (type == CLUSTERMSG_TYPE_HANDOFF_ACK) {
+		if (!sender) return 1;  /* We don't know the sender. */
+		clusterProcessHandoffAck(sender,hdr);
 	} else {
 		serverLog(LL_WARNING,"Received unknown packet type: %d", type);
 	}
@@ -2545,6 +2562,10 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
 	} else if (type == CLUSTERMSG_TYPE_UPDATE) {
 		totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
 		totlen += sizeof(clusterMsgDataUpdate);
+	} else if (type == CLUSTERMSG_TYPE_HANDOFF ||
+			type == CLUSTERMSG_TYPE_HANDOFF_ACK) {
+		totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
+		totlen += sizeof(clusterMsgDataHandoff);
 	}
 	hdr->totlen = htonl(totlen);
 	/* For PING, PONG, and MEET, fixing the totlen field is up to the caller. */
@@ -3786,6 +3807,11 @@ void clusterCron(void) {
 	/* Abort a manual failover if the timeout is reached. */
 	manualFailoverCheckTimeout();
 
+	/* Complete a slot hand-off whose ACKs didn't all arrive in time. */
+	clusterHandoffCron();
+	if (listLength(server.parked_clients)) clusterReleaseParkedClients();
+	migrationStatusCron();
+
 	if (nodeIsSlave(myself)) {
 		clusterHandleManualFailover();
 		if (!(server.cluster_module_flags & CLUSTER_MODULE_FLAG_NO_FAILOVER))
@@ -3966,6 +3992,8 @@ int clusterDelNodeSlots(clusterNode *node) {
 /* Clear the migrating / importing state for all the slots.
  * This is useful at initialization and when turning a master into slave. */
 void clusterCloseAllSlots(void) {
+	for (int j = 0; j < CLUSTER_SLOTS; j++)
+		if (server.cluster->migrating_slots_to[j]) shadowLogDiscard(j);
 	memset(server.cluster->migrating_slots_to,0,
 			sizeof(server.cluster->migrating_slots_to));
 	memset(server.cluster->importing_slots_from,0,
@@ -4394,6 +4422,10 @@ const char *clusterGetMessageTypeString(int type) {
 			return "mfstart";
 		case CLUSTERMSG_TYPE_MODULE:
 			return "module";
+		case CLUSTERMSG_TYPE_HANDOFF:
+			return "handoff";
+		case CLUSTERMSG_TYPE_HANDOFF_ACK:
+			return "handoff-ack";
 	}
 	return "unknown";
 }
@@ -4681,6 +4713,7 @@ void clusterCommand(client *c) {
 			/* CLUSTER SETSLOT <SLOT> STABLE */
 			server.cluster->importing_slots_from[slot] = NULL;
 			server.cluster->migrating_slots_to[slot] = NULL;
+			shadowLogDiscard(slot);
 		} else if (!strcasecmp(c->argv[3]->ptr,"node") && c->argc == 5) {
 			/* CLUSTER SETSLOT <SLOT> NODE <NODE ID> */
 			clusterNode *n = clusterLookupNode(c->argv[4]->ptr);
@@ -4704,8 +4737,10 @@ void clusterCommand(client *c) {
 			 * for it assigning the slot to another node will clear
 			 * the migrating status. */
 			if (countKeysInSlot(slot) == 0 &&
-					server.cluster->migrating_slots_to[slot])
+					server.cluster->migrating_slots_to[slot]) {
 				server.cluster->migrating_slots_to[slot] = NULL;
+				shadowLogDiscard(slot);
+			}
 
 			clusterDelSlot(slot);
 			clusterAddSlot(n,slot);
@@ -4761,36 +4796,9 @@ void clusterCommand(client *c) {
 		for(int j = 2; j<c->argc - 2; j++) {
 			int slot;
 			slot = atoi(c->argv[j]->ptr);
-			pthread_mutex_lock(&server.ownership_lock_slots[slot]);
 			//serverLog(LL_WARNING, "STRATOS slotID on setslots is %d", slot);
 			//	    serverLog(LL_WARNING, "STRATOS slotID on setslots is %s 2",  c->argv[j]->ptr);
-			// DO I STILL HOLD KEYS FOR THIS NODE?
-			if (server.cluster->slots[slot] == myself && n != myself) {
-				if (countKeysInSlot(slot) != 0) {
-					addReplyErrorFormat(c,
-							"Can't assign hashslot %d to a different node "
-							"while I still hold keys for this hash slot.", slot);
-
-					pthread_mutex_unlock(&server.ownership_lock_slots[slot]);
-					return;
-				}
-			}
-
-			if (countKeysInSlot(slot) == 0 && server.cluster->migrating_slots_to[slot]) {
-				server.cluster->migrating_slots_to[slot] = NULL;
-
-			}
-
-			clusterDelSlot(slot);
-			clusterAddSlot(n,slot);
-
-			if (n == myself &&
-					server.cluster->importing_slots_from[slot])
-			{
-				server.cluster->importing_slots_from[slot] = NULL;
-			}
-
-			pthread_mutex_unlock(&server.ownership_lock_slots[slot]);
+			clusterHandoffSlot(n,slot);
 		}
 
 		if (clusterBumpConfigEpochWithoutConsensus() == C_OK) {
@@ -6142,6 +6150,996 @@ struct threadArgs {
 };
 
 
+static void rdmaRegisterPoolBlock(void *buffer, size_t len, void *privdata) {
+	uint32_t lkey, rkey;
+	rdma_mr_cache_get(privdata, buffer, len, &lkey, &rkey);
+}
+
+/* The registrations of the slot blocks are cached across migrations, see
+ * rdma_mr_cache.c. Returns the cache of the registrations on 'pd', creating
+ * it the first time the PD is used: the allocator arena (if
+ * migration-rdma-region-chunk is set) and the blocks of the block pool are
+ * registered right away, so that the next migration finds them ready. */
+static struct rdma_mr_cache *rdmaGetMRCache(struct ibv_pd *pd) {
+	struct rdma_mr_cache *mc = server.rdma_mr_cache;
+	struct rdma_mr_cache_ops ops;
+	struct rdma_mr_cache_stats st;
+	size_t region_size;
+	void *region;
+
+	if(mc && server.rdma_mr_cache_pd == pd) return mc;
+	server.rdma_mr_cache = NULL;
+	if(mc) rdma_mr_cache_release(mc);
+
+	ops = rdma_mr_cache_verbs_ops(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	mc = rdma_mr_cache_create(&ops);
+	region = r_allocator_arena_region(&region_size);
+	if(region && server.migration_rdma_region_chunk) {
+		if(rdma_mr_cache_register_region(mc, region, region_size, server.migration_rdma_region_chunk) == -1) {
+			serverLog(LL_WARNING, "STRATOS COULD NOT REGISTER THE ALLOCATOR ARENA, ITS BLOCKS ARE REGISTERED ONE BY ONE");
+		}
+	}
+	r_allocator_block_pool_foreach(rdmaRegisterPoolBlock, mc);
+	st = rdma_mr_cache_get_stats(mc);
+	serverLog(LL_WARNING, "STRATOS RDMA REGISTERED %lld bytes of arena and %lld pooled blocks in %.3f ms",
+			st.region_bytes, st.misses, (double) st.reg_usec / 1000);
+	server.stat_migration_rdma_reg_usec += st.reg_usec;
+	server.rdma_mr_cache_pd = pd;
+	server.rdma_mr_cache = mc;
+	return mc;
+}
+
+/* Adds the registrations done since 'before' to the stats and logs them. */
+static void rdmaMRCacheUpdateStats(struct rdma_mr_cache *mc, struct rdma_mr_cache_stats *before) {
+	struct rdma_mr_cache_stats st = rdma_mr_cache_get_stats(mc);
+
+	serverLog(LL_WARNING, "STRATOS RDMA REGISTRATION: %lld blocks registered in %.3f ms, %lld already registered",
+			st.misses - before->misses, (double) (st.reg_usec - before->reg_usec) / 1000,
+			st.hits - before->hits);
+	server.stat_migration_rdma_reg_usec += st.reg_usec - before->reg_usec;
+	server.stat_migration_rdma_mr_hits += st.hits - before->hits;
+	server.stat_migration_rdma_mr_misses += st.misses - before->misses;
+}
+
+/* Allocator release hook: the memory of a slot block is given back to the
+ * system, its registration (if any) must not outlive it. */
+void rdmaBlockReleased(void *buffer, size_t len) {
+	struct rdma_mr_cache *mc = server.rdma_mr_cache;
+
+	UNUSED(len);
+	if(mc) rdma_mr_cache_invalidate(mc, buffer);
+	if(server.migration_receiver) migration_receiver_unexpose(server.migration_receiver, buffer);
+}
+
+/* Without RDMA (migration-transport tcp or shm) the writes of the donor are
+ * applied by a receiver thread, see migration_transport.c. It is kept for
+ * the next migrations from the same port. */
+static sds migrationReceiverPort = NULL;
+
+static void migrationStopReceiver(void) {
+	if(!server.migration_receiver) return;
+	migration_receiver_stop(server.migration_receiver);
+	server.migration_receiver = NULL;
+	sdsfree(migrationReceiverPort);
+	migrationReceiverPort = NULL;
+}
+
+/* The receiver listens on the first address of 'bind', like the clients and
+ * the cluster bus, not on every interface: anyone reaching it with the rkey
+ * can write the exposed blocks. NULL (all the interfaces) for "*". */
+static const char *migrationReceiverBindAddr(void) {
+	const char *addr;
+
+	if (server.bindaddr_count == 0) return NULL;
+	addr = server.bindaddr[0];
+	if (*addr == '-') addr++;
+	if (!strcmp(addr,"*") || !strcmp(addr,"::*")) return NULL;
+	return addr;
+}
+
+static int migrationStartReceiver(int transport, char *port, char *err, size_t errlen) {
+	struct migration_receiver *r = server.migration_receiver;
+
+	if(r && migration_receiver_transport(r) == transport && !strcmp(migrationReceiverPort, port))
+		return C_OK;
+	migrationStopReceiver();
+	r = migration_receiver_start(transport, migrationReceiverBindAddr(), port, err, errlen);
+	if(!r) return C_ERR;
+	server.migration_receiver = r;
+	migrationReceiverPort = sdsnew(port);
+	return C_OK;
+}
+
+/* -----------------------------------------------------------------------------
+ * Migration status
+ *
+ * The migration thread reports the phase it is in (MIGRATION_PHASE_*) and
+ * the blocks it wrote; the main thread adds the latency of the commands it
+ * served meanwhile. MIGRATION STATUS and the Migration section of INFO show
+ * the current (or last) migration, and the phase durations and the command
+ * latency are sampled by the latency monitor (migration-register,
+ * migration-transfer, migration-patch-in, migration-ownership and
+ * migration-command events), so they can be followed with LATENCY HISTORY.
+ * -------------------------------------------------------------------------- */
+
+#define MIGRATION_MAX_LATENCY_US (60*1000000)
+
+static const char *migrationPhaseNames[MIGRATION_PHASES] = {
+	"none", "register", "transfer", "patch-in", "ownership"
+};
+
+static const char *migrationPhaseEvents[MIGRATION_PHASES] = {
+	NULL, "migration-register", "migration-transfer", "migration-patch-in", "migration-ownership"
+};
+
+static struct {
+	pthread_mutex_t lock;           /* Everything below but phase. */
+	int phase;                      /* MIGRATION_PHASE_*, read without the lock. */
+	long long phase_start;          /* When the current phase started, us. */
+	long long started;              /* When the migration started, us, 0 if none did. */
+	long long finished;             /* When it finished, 0 while it runs. */
+	long long slots_total;
+	long long slots_done;           /* Slots handed off. */
+	int failed;                     /* A chunk was aborted, see migrationAbortChunk(). */
+	long long blocks;               /* Blocks written with RDMA (resent ones too). */
+	long long bytes;
+	long long phase_usec[MIGRATION_PHASES];     /* Time spent in every phase. */
+	long long pending_usec[MIGRATION_PHASES];   /* Phases not sampled by the latency monitor yet. */
+	struct hdr_histogram *rdma_latency;         /* Block completion latency, us. */
+	struct hdr_histogram *command_latency;      /* Commands served meanwhile, us. */
+} migrationStatus = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void migrationStatusInit(void) {
+	if (migrationStatus.rdma_latency) return;
+	hdr_init(1, MIGRATION_MAX_LATENCY_US, 2, &migrationStatus.rdma_latency);
+	hdr_init(1, MIGRATION_MAX_LATENCY_US, 2, &migrationStatus.command_latency);
+}
+
+/* Resets the status to a migration of 'slots' slots started at 'started'.
+ * Called with the lock held. */
+static void migrationStatusReset(long long started, int slots) {
+	migrationStatusInit();
+	migrationStatus.started = started;
+	migrationStatus.finished = 0;
+	migrationStatus.slots_total = slots;
+	migrationStatus.slots_done = 0;
+	migrationStatus.failed = 0;
+	migrationStatus.blocks = 0;
+	migrationStatus.bytes = 0;
+	memset(migrationStatus.phase_usec, 0, sizeof(migrationStatus.phase_usec));
+	hdr_reset(migrationStatus.rdma_latency);
+	hdr_reset(migrationStatus.command_latency);
+}
+
+/* Called by the thread that starts migrating 'slots' slots. */
+void migrationBegin(int slots) {
+	pthread_mutex_lock(&migrationStatus.lock);
+	migrationStatusReset(ustime(), slots);
+	pthread_mutex_unlock(&migrationStatus.lock);
+}
+
+/* Forgets the last migration. A migration runs from migrationBegin() to
+ * migrationSetPhase(MIGRATION_PHASE_NONE), before its first phase starts:
+ * checking it under the lock, a thread starting a migration meanwhile is
+ * either reset before it begins or not reset at all. Returns C_ERR if a
+ * migration is running. */
+static int migrationReset(void) {
+	int retval = C_ERR;
+
+	pthread_mutex_lock(&migrationStatus.lock);
+	if (!migrationStatus.started || migrationStatus.finished) {
+		migrationStatusReset(0, 0);
+		retval = C_OK;
+	}
+	pthread_mutex_unlock(&migrationStatus.lock);
+	return retval;
+}
+
+/* Ends the current phase and starts 'phase'. MIGRATION_PHASE_NONE ends the
+ * migration. */
+void migrationSetPhase(int phase) {
+	long long now = ustime();
+	pthread_mutex_lock(&migrationStatus.lock);
+	int cur = migrationStatus.phase;
+	if (cur != MIGRATION_PHASE_NONE) {
+		migrationStatus.phase_usec[cur] += now - migrationStatus.phase_start;
+		migrationStatus.pending_usec[cur] += now - migrationStatus.phase_start;
+	}
+	if (phase == MIGRATION_PHASE_NONE && migrationStatus.started && !migrationStatus.finished)
+		migrationStatus.finished = now;
+	migrationStatus.phase_start = now;
+	__atomic_store_n(&migrationStatus.phase, phase, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&migrationStatus.lock);
+}
+
+int migrationInProgress(void) {
+	return __atomic_load_n(&migrationStatus.phase, __ATOMIC_ACQUIRE) != MIGRATION_PHASE_NONE;
+}
+
+/* Adds the blocks of the last rdma_engine_write() to the migration. */
+static void migrationRecordWrite(struct rdma_engine_stats *st) {
+	pthread_mutex_lock(&migrationStatus.lock);
+	migrationStatusInit();
+	migrationStatus.blocks += st->blocks;
+	migrationStatus.bytes += st->bytes;
+	hdr_add(migrationStatus.rdma_latency, st->latency);
+	pthread_mutex_unlock(&migrationStatus.lock);
+}
+
+static void migrationSlotsDone(int slots) {
+	pthread_mutex_lock(&migrationStatus.lock);
+	migrationStatus.slots_done += slots;
+	pthread_mutex_unlock(&migrationStatus.lock);
+}
+
+static void migrationFailed(void) {
+	pthread_mutex_lock(&migrationStatus.lock);
+	migrationStatus.failed = 1;
+	pthread_mutex_unlock(&migrationStatus.lock);
+}
+
+/* Called by call() for the commands executed while migrating, 'duration' in
+ * us. */
+void migrationRecordCommand(long long duration) {
+	pthread_mutex_lock(&migrationStatus.lock);
+	migrationStatusInit();
+	hdr_record_value(migrationStatus.command_latency, duration);
+	pthread_mutex_unlock(&migrationStatus.lock);
+	latencyAddSampleIfNeeded("migration-command", duration/1000);
+}
+
+/* Feeds the durations of the phases that ended to the latency monitor, that
+ * can only be used by the main thread. Called by clusterCron(). */
+void migrationStatusCron(void) {
+	long long pending[MIGRATION_PHASES];
+
+	pthread_mutex_lock(&migrationStatus.lock);
+	memcpy(pending, migrationStatus.pending_usec, sizeof(pending));
+	memset(migrationStatus.pending_usec, 0, sizeof(pending));
+	pthread_mutex_unlock(&migrationStatus.lock);
+
+	for (int j = 1; j < MIGRATION_PHASES; j++) {
+		if (pending[j]) latencyAddSampleIfNeeded(migrationPhaseEvents[j], pending[j]/1000);
+	}
+}
+
+sds genMigrationInfoString(sds info) {
+	long long now = ustime();
+
+	pthread_mutex_lock(&migrationStatus.lock);
+	migrationStatusInit();
+	int phase = migrationStatus.phase;
+	long long end = migrationStatus.finished ? migrationStatus.finished : now;
+	long long elapsed = migrationStatus.started ? end - migrationStatus.started : 0;
+	struct hdr_histogram *rl = migrationStatus.rdma_latency, *cl = migrationStatus.command_latency;
+
+	info = sdscatprintf(info,
+		"migration_phase:%s\r\n"
+		"migration_phase_ms:%.3f\r\n"
+		"migration_elapsed_ms:%.3f\r\n"
+		"migration_slots_total:%lld\r\n"
+		"migration_slots_done:%lld\r\n"
+		"migration_failed:%d\r\n"
+		"migration_blocks:%lld\r\n"
+		"migration_bytes:%lld\r\n"
+		"migration_gbps:%.2f\r\n",
+		migrationPhaseNames[phase],
+		phase != MIGRATION_PHASE_NONE ? (double)(now - migrationStatus.phase_start)/1000 : 0,
+		(double)elapsed/1000,
+		migrationStatus.slots_total,
+		migrationStatus.slots_done,
+		migrationStatus.failed,
+		migrationStatus.blocks,
+		migrationStatus.bytes,
+		elapsed ? (double)migrationStatus.bytes/elapsed/1000 : 0);
+	for (int j = 1; j < MIGRATION_PHASES; j++) {
+		/* The time spent so far in the current phase counts too. */
+		long long usec = migrationStatus.phase_usec[j];
+		if (j == phase) usec += now - migrationStatus.phase_start;
+		info = sdscatprintf(info, "migration_%s_ms:%.3f\r\n",
+			migrationPhaseEvents[j] + strlen("migration-"), (double)usec/1000);
+	}
+	info = sdscatprintf(info,
+		"migration_rdma_latency_p50_us:%lld\r\n"
+		"migration_rdma_latency_p99_us:%lld\r\n"
+		"migration_rdma_latency_p999_us:%lld\r\n"
+		"migration_rdma_latency_max_us:%lld\r\n"
+		"migration_patch_in_keys_per_sec:%.0f\r\n"
+		"migration_moved_replies:%lld\r\n"
+		"migration_ask_replies:%lld\r\n"
+		"migration_tryagain_replies:%lld\r\n"
+		"migration_commands:%lld\r\n"
+		"migration_command_latency_p50_us:%lld\r\n"
+		"migration_command_latency_p99_us:%lld\r\n"
+		"migration_command_latency_max_us:%lld\r\n",
+		(long long) hdr_value_at_percentile(rl, 50),
+		(long long) hdr_value_at_percentile(rl, 99),
+		(long long) hdr_value_at_percentile(rl, 99.9),
+		(long long) hdr_max(rl),
+		server.stat_migration_index_usec ?
+			(double)server.stat_migration_indexed_keys*1000000/server.stat_migration_index_usec : 0,
+		server.stat_cluster_moved_replies,
+		server.stat_cluster_ask_replies,
+		server.stat_cluster_tryagain_replies,
+		(long long) cl->total_count,
+		(long long) hdr_value_at_percentile(cl, 50),
+		(long long) hdr_value_at_percentile(cl, 99),
+		(long long) hdr_max(cl));
+	pthread_mutex_unlock(&migrationStatus.lock);
+	return info;
+}
+
+/* MIGRATION STATUS | RESET | HELP */
+void migrationCommand(client *c) {
+	if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
+		const char *help[] = {
+			"STATUS",
+			"    Return the phase, progress, throughput and latencies of the current or last",
+			"    slot migration.",
+			"RESET",
+			"    Forget the last migration.",
+			NULL
+		};
+		addReplyHelp(c, help);
+	} else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"status")) {
+		sds info = genMigrationInfoString(sdsempty());
+		addReplyVerbatim(c,info,sdslen(info),"txt");
+		sdsfree(info);
+	} else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"reset")) {
+		if (migrationReset() == C_ERR) {
+			addReplyError(c,"A slot migration is in progress");
+			return;
+		}
+		addReply(c,shared.ok);
+	} else {
+		addReplySubcommandSyntaxError(c);
+	}
+}
+
+/* Write the blocks of 'nslots' slots to the recipient buffers described by
+ * 'remote' with the transfer engine. For slot j the blocks from
+ * first_block[j] (0 if first_block is NULL) to first_block[j]+nblocks[j] are
+ * written, in order, to the next entries of 'remote'. */
+static int rdmaWriteSlotBlocks(char ***slot_blocks, uint32_t **lengths, int *first_block,
+		int *nblocks, int nslots, rdmaRemoteBufferInfo *remote, long total)
+{
+	struct rdma_write_block *blocks = zcalloc(sizeof(*blocks) * (total ? total : 1));
+	long b = 0;
+	int res;
+
+	for(int j=0; j<nslots; j++) {
+		int first = first_block ? first_block[j] : 0;
+		for(int i=first; i<first+nblocks[j]; i++) {
+			blocks[b].local_addr = slot_blocks[j][i];
+			blocks[b].length = lengths[j][i];
+			blocks[b].remote_addr = remote[b].ptr;
+			blocks[b].rkey = remote[b].rkey;
+			b++;
+		}
+	}
+	serverAssert(b == total);
+
+	struct rdma_engine *e = server.rdma_engine;
+	/* No registration cache with migration-transport tcp and shm. */
+	struct rdma_mr_cache *mc = server.rdma_mr_cache;
+	struct rdma_mr_cache_stats mr_before;
+	if(!e) {
+		serverLog(LL_WARNING, "STRATOS NOT CONNECTED TO THE RECIPIENT, %ld blocks not written", total);
+		zfree(blocks);
+		return -1;
+	}
+	if(mc) mr_before = rdma_mr_cache_get_stats(mc);
+	rdma_engine_reset_stats(e);
+	res = rdma_engine_write(e, blocks, total);
+	if(mc) rdmaMRCacheUpdateStats(mc, &mr_before);
+	if(res != 0) {
+		serverLog(LL_WARNING, "STRATOS RDMA WRITE ERROR after %lld of %ld blocks", e->stats.blocks, total);
+	}
+	serverLog(LL_WARNING, "STRATOS RDMA WROTE %lld blocks, %lld bytes in %.3f ms: %.2f GB/s "
+			"(window %d, signal every %d, %lld CQEs, %lld polls), block latency p50 %lld us p99 %lld us max %lld us",
+			e->stats.blocks, e->stats.bytes, (double) e->stats.usec / 1000, rdma_engine_gbps(e),
+			e->window, e->signal_every, e->stats.signaled, e->stats.polls,
+			(long long) hdr_value_at_percentile(e->stats.latency, 50),
+			(long long) hdr_value_at_percentile(e->stats.latency, 99),
+			(long long) hdr_max(e->stats.latency));
+	server.stat_migration_rdma_bytes += e->stats.bytes;
+	server.stat_migration_rdma_usec += e->stats.usec;
+	server.stat_migration_rdma_p99_usec = hdr_value_at_percentile(e->stats.latency, 99);
+	migrationRecordWrite(&e->stats);
+	zfree(blocks);
+	return res;
+}
+
+/* The slots args[start..end) are migrated together, as a chunk: at most
+ * migration-chunk-slots slots whose blocks add up to at most
+ * migration-chunk-bytes (0 is no limit), and at least one slot. The recipient
+ * allocates the blocks of the chunk only and the chunk is handed off before
+ * the next one is sent, so the memory a migration takes on both sides is
+ * bounded by the chunk, not by the slot range. Returns end. */
+static int clusterMigrationChunkEnd(sds *args, int start, int argc) {
+	size_t bytes = 0;
+	int end = start;
+
+	while(end < argc && end - start < server.migration_chunk_slots) {
+		size_t slot_bytes = r_allocator_get_slot_usage(atoi(args[end])).bytes_blocks;
+		if(end > start && server.migration_chunk_bytes &&
+				bytes + slot_bytes > server.migration_chunk_bytes) break;
+		bytes += slot_bytes;
+		end++;
+	}
+	if((long long) bytes > __atomic_load_n(&server.stat_migration_chunk_max_bytes, __ATOMIC_RELAXED))
+		__atomic_store_n(&server.stat_migration_chunk_max_bytes, (long long) bytes, __ATOMIC_RELAXED);
+	return end;
+}
+
+/* Iterative pre-copy (migration-precopy-rounds > 0). The blocks of the
+ * 'nslots' slots were written to 'remote' while the slots are tracked and keep
+ * taking writes in place. Every round writes again, to the same recipient
+ * buffers, the blocks written since the previous round (gens[j] is the
+ * generation of slot j when it was last sent), until they add up to at most
+ * migration-precopy-threshold bytes or the rounds are over. Then the blocks
+ * are locked, so the next writes go to new blocks sent with the rest of the
+ * slot, and the blocks written before the lock are sent one last time.
+ * Returns -1 if a write failed. */
+static int rdmaPrecopySlotBlocks(int *slots, char ***slot_blocks, uint32_t **lengths,
+		int *nblocks, int nslots, rdmaRemoteBufferInfo *remote, uint64_t *gens)
+{
+	int res = 0;
+
+	char ***dirty_blocks = zmalloc(sizeof(char **) * nslots);
+	uint32_t **dirty_lengths = zmalloc(sizeof(uint32_t *) * nslots);
+	int *ndirty = zmalloc(sizeof(int) * nslots);
+	long total_blocks = 0;
+
+	for(int j=0; j<nslots; j++) {
+		dirty_blocks[j] = zmalloc(sizeof(char *) * (nblocks[j] ? nblocks[j] : 1));
+		dirty_lengths[j] = zmalloc(sizeof(uint32_t) * (nblocks[j] ? nblocks[j] : 1));
+		total_blocks += nblocks[j];
+	}
+	rdmaRemoteBufferInfo *dirty_remote = zmalloc(sizeof(*dirty_remote) * (total_blocks ? total_blocks : 1));
+	int *positions = zmalloc(sizeof(int) * (total_blocks ? total_blocks : 1));
+
+	for(int round = 1; ; round++) {
+		int last = round > server.migration_precopy_rounds;
+		size_t bytes = 0, slot_bytes;
+
+		if(!last) {
+			for(int j=0; j<nslots; j++) {
+				r_allocator_get_dirty_blocks(slots[j], nblocks[j], gens[j], NULL, &slot_bytes);
+				bytes += slot_bytes;
+			}
+			last = bytes <= server.migration_precopy_threshold;
+		}
+
+		long total = 0, first = 0;
+		bytes = 0;
+		for(int j=0; j<nslots; j++) {
+			if(last) r_allocator_lock_slot_blocks(slots[j]);
+			uint64_t gen = r_allocator_slot_generation(slots[j]);
+			ndirty[j] = r_allocator_get_dirty_blocks(slots[j], nblocks[j], gens[j], positions, &slot_bytes);
+			gens[j] = gen;
+			if(last) r_allocator_untrack_slot(slots[j]);
+			for(int i=0; i<ndirty[j]; i++) {
+				dirty_blocks[j][i] = slot_blocks[j][positions[i]];
+				dirty_lengths[j][i] = lengths[j][positions[i]];
+				dirty_remote[total++] = remote[first + positions[i]];
+			}
+			first += nblocks[j];
+			bytes += slot_bytes;
+		}
+
+		serverLog(LL_VERBOSE, "Migration pre-copy round %d%s: %ld dirty blocks, %zu bytes",
+				round, last ? " (writes locked)" : "", total, bytes);
+		if(total) {
+			res = rdmaWriteSlotBlocks(dirty_blocks, dirty_lengths, NULL, ndirty, nslots, dirty_remote, total);
+			if(res != 0) break;
+			server.stat_migration_precopy_rounds++;
+			server.stat_migration_precopy_blocks += total;
+			server.stat_migration_precopy_bytes += bytes;
+		}
+		if(last) break;
+	}
+
+	for(int j=0; j<nslots; j++) {
+		zfree(dirty_blocks[j]);
+		zfree(dirty_lengths[j]);
+	}
+	zfree(dirty_blocks);
+	zfree(dirty_lengths);
+	zfree(ndirty);
+	zfree(dirty_remote);
+	zfree(positions);
+	return res == 0 ? 0 : -1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Slot ownership state
+ *
+ * The ownership of every slot is published in server.slot_ownership[] as a
+ * single word, (epoch << 2) | CLUSTER_SLOT_* state, that the main thread and
+ * the migration thread read without locks. The epoch is bumped on every state
+ * change.
+ *
+ * The migration thread freezes a slot before it copies its last blocks:
+ * writes to a frozen slot are parked (BLOCKED_SLOT) instead of failing, and
+ * once the hand-off completes the slot is MOVED and the parked writes are
+ * processed again, that is redirected to the new owner. Reads are served
+ * from the local copy until then. A write parked for more than
+ * cluster-node-timeout gets -TRYAGAIN.
+ *
+ * A write counts itself in server.slot_writers[] for every slot of its keys
+ * before it checks their state, and the migration thread sets the state
+ * before it waits for the count of the slot to drop to zero: with
+ * sequentially consistent accesses either the write sees the slot frozen, or
+ * the freeze waits for the write to complete.
+ * -------------------------------------------------------------------------- */
+
+#define CLUSTER_SLOT_STATE_MASK 3
+
+int clusterSlotState(int slot) {
+	return __atomic_load_n(&server.slot_ownership[slot], __ATOMIC_SEQ_CST) &
+		CLUSTER_SLOT_STATE_MASK;
+}
+
+uint64_t clusterSlotEpoch(int slot) {
+	return __atomic_load_n(&server.slot_ownership[slot], __ATOMIC_ACQUIRE) >> 2;
+}
+
+static void clusterSetSlotState(int slot, int state) {
+	uint64_t old = __atomic_load_n(&server.slot_ownership[slot], __ATOMIC_RELAXED);
+	uint64_t word;
+
+	do {
+		word = (((old >> 2) + 1) << 2) | state;
+	} while (!__atomic_compare_exchange_n(&server.slot_ownership[slot], &old, word,
+				0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+/* Called by the migration thread: once it returns no write to 'slot' is in
+ * progress, and the next ones are parked. */
+void clusterFreezeSlot(int slot) {
+	clusterSetSlotState(slot,CLUSTER_SLOT_FROZEN);
+	while (__atomic_load_n(&server.slot_writers[slot], __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+}
+
+/* Returns 0 if the write must be parked, otherwise clusterEndSlotWrite()
+ * must be called once it was executed. */
+int clusterBeginSlotWrite(int slot) {
+	__atomic_add_fetch(&server.slot_writers[slot], 1, __ATOMIC_SEQ_CST);
+	if (clusterSlotState(slot) != CLUSTER_SLOT_FROZEN) return 1;
+	__atomic_sub_fetch(&server.slot_writers[slot], 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void clusterEndSlotWrite(int slot) {
+	__atomic_sub_fetch(&server.slot_writers[slot], 1, __ATOMIC_SEQ_CST);
+}
+
+/* The keys of the write the main thread is executing, and their slots, see
+ * clusterBeginCommandWrite(). */
+static struct {
+	robj **keys;
+	int *slots;
+	int count;
+	int size;
+} commandWrite;
+
+static void clusterAddCommandKeys(struct redisCommand *cmd, robj **argv, int argc) {
+	getKeysResult result = GETKEYS_RESULT_INIT;
+	int numkeys = getKeysFromCommand(cmd, argv, argc, &result);
+
+	for (int j = 0; j < numkeys; j++) {
+		robj *key = argv[result.keys[j]];
+
+		if (commandWrite.count == commandWrite.size) {
+			commandWrite.size = commandWrite.size ? commandWrite.size*2 : 16;
+			commandWrite.keys = zrealloc(commandWrite.keys,
+				sizeof(robj*)*commandWrite.size);
+			commandWrite.slots = zrealloc(commandWrite.slots,
+				sizeof(int)*commandWrite.size);
+		}
+		incrRefCount(key);
+		commandWrite.keys[commandWrite.count] = key;
+		commandWrite.slots[commandWrite.count] = keyHashSlot(key->ptr, sdslen(key->ptr));
+		commandWrite.count++;
+	}
+	getKeysFreeResult(&result);
+}
+
+static void clusterResetCommandWrite(void) {
+	for (int j = 0; j < commandWrite.count; j++)
+		decrRefCount(commandWrite.keys[j]);
+	commandWrite.count = 0;
+}
+
+/* Begins the write of every slot touched by the command of 'c': its keys,
+ * or the keys of the writes queued by MULTI for EXEC. The keys are retained
+ * since EXEC frees the queued commands. Returns 0 if one of the slots is
+ * frozen and the client must be parked, the slot is then recorded in
+ * c->parked_slot. Otherwise clusterEndCommandWrite() must be called once the
+ * command was executed. */
+int clusterBeginCommandWrite(client *c) {
+	if (c->cmd->proc == execCommand) {
+		for (int j = 0; j < c->mstate.count; j++) {
+			multiCmd *mc = c->mstate.commands+j;
+
+			if (mc->cmd->flags & (CMD_WRITE|CMD_MAY_REPLICATE))
+				clusterAddCommandKeys(mc->cmd, mc->argv, mc->argc);
+		}
+	} else {
+		clusterAddCommandKeys(c->cmd, c->argv, c->argc);
+	}
+
+	for (int j = 0; j < commandWrite.count; j++) {
+		if (!clusterBeginSlotWrite(commandWrite.slots[j])) {
+			c->parked_slot = commandWrite.slots[j];
+			while (j--) clusterEndSlotWrite(commandWrite.slots[j]);
+			clusterResetCommandWrite();
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Logs the post-image of the keys of the migrating slots, the log is
+ * complete once the slot is frozen, then ends the writes. */
+void clusterEndCommandWrite(client *c) {
+	for (int j = 0; j < commandWrite.count; j++) {
+		int slot = commandWrite.slots[j];
+
+		if (server.cluster->migrating_slots_to[slot])
+			shadowLogKey(c->db, commandWrite.keys[j], slot);
+		clusterEndSlotWrite(slot);
+	}
+	clusterResetCommandWrite();
+}
+
+void clusterParkClient(client *c) {
+	c->parked_start = ustime();
+	c->bpop.timeout = c->parked_start/1000 + server.cluster_node_timeout;
+	server.stat_migration_parked_writes++;
+	blockClient(c,BLOCKED_SLOT);
+}
+
+/* Process again the parked writes of the slots that are no longer frozen. */
+void clusterReleaseParkedClients(void) {
+	long long now = ustime(), max_usec = 0;
+	listIter li;
+	listNode *ln;
+
+	listRewind(server.parked_clients,&li);
+	while ((ln = listNext(&li))) {
+		client *c = listNodeValue(ln);
+
+		/* The write checks again all its slots once it is processed. */
+		if (clusterSlotState(c->parked_slot) == CLUSTER_SLOT_FROZEN) continue;
+		if (now - c->parked_start > max_usec) max_usec = now - c->parked_start;
+		unblockClient(c);
+	}
+	if (max_usec > server.stat_migration_parked_max_usec)
+		server.stat_migration_parked_max_usec = max_usec;
+	latencyAddSampleIfNeeded("migration-parked", max_usec/1000);
+}
+
+/* -----------------------------------------------------------------------------
+ * Slot ownership hand-off
+ *
+ * Once the blocks of a batch of slots are on the recipient, the migration
+ * thread hands the slots over with clusterHandoffSlots(). The main thread
+ * sends a single HANDOFF message with the bitmap of the slots to every node
+ * over the cluster bus, all at once, and every node assigns the slots to the
+ * recipient and replies with a HANDOFF_ACK. The recipient also bumps its
+ * configEpoch, once for the whole batch, and broadcasts it, so that the new
+ * ownership wins over stale gossip. Once every node acked, or after
+ * cluster-node-timeout, the slots are assigned to the recipient locally too
+ * and the migration thread is woken up. The keys of the slots are only
+ * dropped if the recipient itself acked: otherwise the hand-off fails, the
+ * donor keeps serving the slots and bumps its configEpoch so that its
+ * ownership wins over the nodes that acked.
+ * -------------------------------------------------------------------------- */
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pipe[2];                /* Wakes up the main thread for a request. */
+	/* Protected by the lock. */
+	int requested;              /* A request is waiting for the main thread. */
+	int done;                   /* The request was completed. */
+	clusterNode *owner;
+	unsigned char slots[CLUSTER_SLOTS/8];
+	int numslots;
+	long long start;            /* ustime() of the request. */
+	long long usec;             /* Time it took to complete the request. */
+	int failed;                 /* The recipient did not ack the request. */
+	/* Accessed by the main thread only. */
+	uint64_t id;                /* Hand-off in progress, 0 if none. */
+	char (*waiting)[CLUSTER_NAMELEN];   /* Nodes that didn't ack yet. */
+	int numwaiting;
+	int numsent;
+	int owner_acked;
+	mstime_t deadline;
+} handoff = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.pipe = {-1, -1},
+};
+
+/* Assign 'slot' to 'n' as the result of a hand-off, CLUSTER SETSLOTS or a
+ * HANDOFF message. */
+static void clusterHandoffSlot(clusterNode *n, int slot) {
+	/* The slots are migrated by RDMA: their K-Vs are already in the blocks
+	 * of the new owner, so the keys we still index are dropped. */
+	if (server.cluster->slots[slot] == myself && n != myself)
+		delKeysInSlotAllocator(slot);
+
+	/* If this slot is in migrating status but we have no keys for it
+	 * assigning the slot to another node will clear the migrating status. */
+	if (countKeysInSlot(slot) == 0 && server.cluster->migrating_slots_to[slot]) {
+		server.cluster->migrating_slots_to[slot] = NULL;
+		shadowLogDiscard(slot);
+	}
+
+	clusterDelSlot(slot);
+	clusterAddSlot(n,slot);
+	if (n == myself) {
+		server.cluster->importing_slots_from[slot] = NULL;
+		clusterSetSlotState(slot,CLUSTER_SLOT_OWNED);
+	}
+}
+
+/* Complete the hand-off in progress: the nodes that didn't ack yet will
+ * learn about the new owner from its configEpoch. */
+static void clusterHandoffDone(void) {
+	clusterNode *owner = handoff.owner;
+	int failed = !handoff.owner_acked;
+
+	if (handoff.numwaiting) {
+		serverLog(LL_WARNING,
+			"Hand-off of %d slots to %.40s: %d of %d nodes did not ack in time",
+			handoff.numslots, owner->name, handoff.numwaiting, handoff.numsent);
+	}
+	for (int j = 0; j < CLUSTER_SLOTS; j++) {
+		if (!bitmapTestBit(handoff.slots,j)) continue;
+		if (failed) {
+			/* Our copy is the only one we know about: keep serving it. */
+			clusterSetSlotState(j,CLUSTER_SLOT_OWNED);
+			continue;
+		}
+		if (server.cluster->slots[j] == myself) delKeysInSlotAllocator(j);
+		clusterDelSlot(j);
+		clusterAddSlot(owner,j);
+		server.cluster->migrating_slots_to[j] = NULL;
+		server.cluster->importing_slots_from[j] = NULL;
+		clusterSetSlotState(j,CLUSTER_SLOT_MOVED);
+		shadowLogDiscard(j);
+	}
+	if (failed) {
+		serverLog(LL_WARNING,"Hand-off of %d slots to %.40s failed: the recipient did not ack",
+			handoff.numslots, owner->name);
+		clusterBumpConfigEpochWithoutConsensus();
+		clusterBroadcastPong(CLUSTER_BROADCAST_ALL);
+	}
+	clusterReleaseParkedClients();
+	clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
+			CLUSTER_TODO_UPDATE_STATE|
+			CLUSTER_TODO_FSYNC_CONFIG);
+
+	if (!failed) server.stat_migration_handoff_slots += handoff.numslots;
+	server.stat_migration_handoff_timeouts += handoff.numwaiting;
+	zfree(handoff.waiting);
+	handoff.waiting = NULL;
+	handoff.numwaiting = 0;
+	handoff.id = 0;
+
+	pthread_mutex_lock(&handoff.lock);
+	handoff.usec = ustime() - handoff.start;
+	server.stat_migration_handoff_usec = handoff.usec;
+	handoff.failed = failed;
+	handoff.done = 1;
+	pthread_cond_signal(&handoff.cond);
+	pthread_mutex_unlock(&handoff.lock);
+	if (!failed) {
+		serverLog(LL_NOTICE,"Handed %d slots over to %.40s in %.3f ms (%d nodes)",
+			handoff.numslots, owner->name, (double)handoff.usec/1000, handoff.numsent);
+	}
+}
+
+/* Send the HANDOFF message of the request to every reachable node. */
+static void clusterHandoffStart(void) {
+	static uint64_t last_id = 0;
+	clusterMsg buf[1];
+	clusterMsg *hdr = (clusterMsg*) buf;
+	dictIterator *di;
+	dictEntry *de;
+
+	handoff.id = ++last_id;
+	clusterBuildMessageHdr(hdr,CLUSTERMSG_TYPE_HANDOFF);
+	hdr->data.handoff.msg.id = htonu64(handoff.id);
+	memcpy(hdr->data.handoff.msg.nodename,handoff.owner->name,CLUSTER_NAMELEN);
+	memcpy(hdr->data.handoff.msg.slots,handoff.slots,sizeof(handoff.slots));
+
+	handoff.waiting = zmalloc(sizeof(*handoff.waiting) * dictSize(server.cluster->nodes));
+	handoff.numwaiting = 0;
+	handoff.owner_acked = 0;
+	di = dictGetSafeIterator(server.cluster->nodes);
+	while((de = dictNext(di)) != NULL) {
+		clusterNode *node = dictGetVal(de);
+
+		if (node == myself || node->link == NULL) continue;
+		if (node->flags & (CLUSTER_NODE_HANDSHAKE|CLUSTER_NODE_NOADDR|CLUSTER_NODE_FAIL))
+			continue;
+		clusterSendMessage(node->link,(unsigned char*)buf,ntohl(hdr->totlen));
+		memcpy(handoff.waiting[handoff.numwaiting++],node->name,CLUSTER_NAMELEN);
+	}
+	dictReleaseIterator(di);
+	handoff.numsent = handoff.numwaiting;
+	handoff.deadline = mstime() + server.cluster_node_timeout;
+	if (handoff.numwaiting == 0) clusterHandoffDone();
+}
+
+static void clusterHandoffPipeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+	char buf[64];
+	int requested;
+	UNUSED(el);
+	UNUSED(privdata);
+	UNUSED(mask);
+
+	while (read(fd,buf,sizeof(buf)) > 0);
+	pthread_mutex_lock(&handoff.lock);
+	requested = handoff.requested;
+	handoff.requested = 0;
+	pthread_mutex_unlock(&handoff.lock);
+	if (requested) clusterHandoffStart();
+}
+
+void clusterHandoffInit(void) {
+	if (pipe(handoff.pipe) == -1) {
+		serverLog(LL_WARNING,"Can't create the pipe for slot hand-offs: %s",
+			strerror(errno));
+		exit(1);
+	}
+	anetNonBlock(NULL,handoff.pipe[0]);
+	anetNonBlock(NULL,handoff.pipe[1]);
+	anetCloexec(handoff.pipe[0]);
+	anetCloexec(handoff.pipe[1]);
+	if (aeCreateFileEvent(server.el,handoff.pipe[0],AE_READABLE,
+			clusterHandoffPipeHandler,NULL) == AE_ERR)
+	{
+		serverPanic("Unrecoverable error creating the slot hand-off pipe handler.");
+	}
+}
+
+/* Called by clusterCron(): don't wait forever for nodes that went away. */
+void clusterHandoffCron(void) {
+	if (handoff.id && mstime() > handoff.deadline) clusterHandoffDone();
+}
+
+/* A node handed some slots over to another node. Only the slots 'sender'
+ * owns are reassigned: a stale or replayed HANDOFF, for example from a node
+ * that lost its slots in a failover meanwhile, can't take over the slots of
+ * another node, ours included. */
+void clusterProcessHandoff(clusterLink *link, clusterNode *sender, clusterMsg *hdr) {
+	clusterMsgDataHandoff *h = &hdr->data.handoff.msg;
+	clusterNode *n = clusterLookupNode(h->nodename);
+	clusterMsg buf[1];
+	clusterMsg *ack = (clusterMsg*) buf;
+	int numslots = 0, skipped = 0;
+
+	if (!n) return; /* We don't know the new owner: no ACK. */
+	for (int j = 0; j < CLUSTER_SLOTS; j++) {
+		if (bitmapTestBit(h->slots,j) && server.cluster->slots[j] != sender)
+			skipped++;
+	}
+	if (skipped) {
+		serverLog(LL_WARNING,
+			"Hand-off from %.40s: %d slots it doesn't own are ignored",
+			sender->name, skipped);
+		/* The new owner takes all the slots or none, without its ACK the
+		 * donor keeps them. */
+		if (n == myself) return;
+	}
+	for (int j = 0; j < CLUSTER_SLOTS; j++) {
+		if (!bitmapTestBit(h->slots,j) || server.cluster->slots[j] != sender) continue;
+		clusterHandoffSlot(n,j);
+		numslots++;
+	}
+	if (n == myself) {
+		if (clusterBumpConfigEpochWithoutConsensus() == C_OK) {
+			serverLog(LL_WARNING,
+				"configEpoch updated after importing %d slots", numslots);
+		}
+		clusterBroadcastPong(CLUSTER_BROADCAST_ALL);
+	}
+	clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
+			CLUSTER_TODO_UPDATE_STATE|
+			CLUSTER_TODO_FSYNC_CONFIG);
+
+	clusterBuildMessageHdr(ack,CLUSTERMSG_TYPE_HANDOFF_ACK);
+	memcpy(&ack->data.handoff.msg,h,sizeof(*h));
+	clusterSendMessage(link,(unsigned char*)buf,ntohl(ack->totlen));
+}
+
+void clusterProcessHandoffAck(clusterNode *sender, clusterMsg *hdr) {
+	if (handoff.id == 0 || ntohu64(hdr->data.handoff.msg.id) != handoff.id) return;
+	for (int j = 0; j < handoff.numwaiting; j++) {
+		if (memcmp(handoff.waiting[j],sender->name,CLUSTER_NAMELEN)) continue;
+		if (sender == handoff.owner) handoff.owner_acked = 1;
+		handoff.numwaiting--;
+		memcpy(handoff.waiting[j],handoff.waiting[handoff.numwaiting],CLUSTER_NAMELEN);
+		if (handoff.numwaiting == 0) clusterHandoffDone();
+		break;
+	}
+}
+
+/* Hand 'slots' over to 'owner' and wait for the whole cluster to know about
+ * it, see above. Called by the migration thread, that holds the ownership
+ * locks of the slots. Returns C_ERR if the recipient did not ack, the donor
+ * then still owns the slots and their keys. */
+int clusterHandoffSlots(clusterNode *owner, int *slots, int numslots) {
+	int failed;
+
+	pthread_mutex_lock(&handoff.lock);
+	handoff.owner = owner;
+	memset(handoff.slots,0,sizeof(handoff.slots));
+	for (int j = 0; j < numslots; j++) bitmapSetBit(handoff.slots,slots[j]);
+	handoff.numslots = numslots;
+	handoff.start = ustime();
+	handoff.done = 0;
+	handoff.requested = 1;
+	pthread_mutex_unlock(&handoff.lock);
+
+	/* A full pipe already has a wake up pending. */
+	if (write(handoff.pipe[1],"H",1) != 1) {}
+
+	pthread_mutex_lock(&handoff.lock);
+	while (!handoff.done) pthread_cond_wait(&handoff.cond,&handoff.lock);
+	failed = handoff.failed;
+	pthread_mutex_unlock(&handoff.lock);
+	return failed ? C_ERR : C_OK;
+}
+
+/* The chunk args[start..end) could not be moved to the recipient: the donor
+ * keeps its slots, and nothing is handed off. The slots stay migrating with
+ * their shadow logs, the frozen ones take writes again and the writes parked
+ * on them are released by clusterCron(). The migration fails. */
+static void migrationAbortChunk(sds *args, int start, int end, const char *reason) {
+	serverLog(LL_WARNING,"Migration of slots %s-%s aborted: %s",
+		args[start], args[end-1], reason);
+	for (int j = start; j < end; j++) {
+		int slot = atoi(args[j]);
+
+		r_allocator_untrack_slot(slot);
+		if (clusterSlotState(slot) == CLUSTER_SLOT_FROZEN)
+			clusterSetSlotState(slot,CLUSTER_SLOT_OWNED);
+	}
+	migrationFailed();
+}
+
+/* Reads the reply of registerRDMABlockSlots: the 'count' remote buffers the
+ * blocks are written to. Returns C_ERR if the recipient refused the blocks,
+ * e.g. with lengths it can't allocate, or the reply can't be read. */
+static int migrationReadRemoteBuffers(connection *conn, rdmaRemoteBufferInfo *buffers,
+		int count, long long timeout) {
+	char line[1024];
+	long long len;
+
+	if(connSyncReadLine(conn, line, sizeof(line), timeout) <= 0) {
+		serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG READING connSyncReadLine %s", strerror(errno));
+		return C_ERR;
+	}
+	if(line[0] != '$' || !string2ll(line+1, strlen(line+1), &len) ||
+			len != (long long) count * (long long) sizeof(rdmaRemoteBufferInfo)) {
+		serverLog(LL_WARNING, "STRATOS THE RECIPIENT DID NOT REGISTER THE BLOCKS: %s", line);
+		return C_ERR;
+	}
+	if(len && connSyncRead(conn, (char *) buffers, len, timeout) <= 0) {
+		serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG READING connSyncRead %s", strerror(errno));
+		return C_ERR;
+	}
+	return C_OK;
+}
+
 // Thread code that it is handling the RDMA Migration//
 void *migrateRDMASlotsCommandThread(void *arg) {
 
@@ -6199,17 +7197,19 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 	cs = migrateGetSocketOtherParams(c, args[3], args[4], args[3], args[4], 10000);
 
 
-	long long active_slots[16385];
-	int number_of_active_slots = 0;
 	rio serverCmd;
 	rioInitWithBuffer(&serverCmd,sdsempty());
 
 	char *rdma_port = (char *) args[5];
-	serverAssertWithInfo(c,NULL,rioWriteBulkCount(&serverCmd, '*', 4));
+	int transport = server.migration_transport;
+	const char *transport_name = migration_transport_name(transport);
+	serverAssertWithInfo(c,NULL,rioWriteBulkCount(&serverCmd, '*', transport == MIGRATION_TRANSPORT_RDMA ? 4 : 5));
 	serverAssertWithInfo(c,NULL,rioWriteBulkString(&serverCmd,"initRDMAServer", 14));
 	serverAssertWithInfo(c,NULL,rioWriteBulkString(&serverCmd, rdma_port, strlen(rdma_port)));
 	serverAssertWithInfo(c,NULL,rioWriteBulkString(&serverCmd, args[1], strlen(args[1])));
 	serverAssertWithInfo(c,NULL,rioWriteBulkString(&serverCmd, args[2], strlen(args[2])));
+	if(transport != MIGRATION_TRANSPORT_RDMA)
+		serverAssertWithInfo(c,NULL,rioWriteBulkString(&serverCmd, transport_name, strlen(transport_name)));
 
 	// SEND RDMA SERVER COMMAND AND WAIT FOR ACK
 	int nwritten = 0;
@@ -6221,32 +7221,54 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 	}
 	// 1 readline for the reply and one for the +OK ack
 	connSyncReadLine(cs->conn, serverCmdReply, sizeof(serverCmdReply), 1000000);
-	connSyncReadLine(cs->conn, serverCmdReply, sizeof(serverCmdReply), 1000000);
+	if(serverCmdReply[0] == '-') {
+		serverLog(LL_WARNING, "STRATOS INIT RDMA SERVER ERROR: %s", serverCmdReply);
+	} else {
+		connSyncReadLine(cs->conn, serverCmdReply, sizeof(serverCmdReply), 1000000);
+		serverLog(LL_WARNING, "STRATOS INIT RDMA SERVER OK");
+	}
 	sdsfree(serverCmd.io.buffer.ptr);
-	serverLog(LL_WARNING, "STRATOS INIT RDMA SERVER OK");
 	// PREPARE RDMAClient
 	char *ip = (char *)args[3];
 	char *port = (char *)args[5];
 
-	server.rdma_client = init_rdma_client(ip, port);
-	int res = server.rdma_client->connect_ops.RDMA_connect_to_server(server.rdma_client);
-
-	if(res) {
-		serverLog(LL_WARNING, "CLIENT CONNECTED TO SERVER SUCCESSFULLY ");
+	if(transport != MIGRATION_TRANSPORT_RDMA) {
+		/* The receiver serves one donor at a time: close the previous
+		 * connection first. */
+		struct rdma_engine_backend backend;
+		char err[256];
+		if(server.rdma_engine) rdma_engine_release(server.rdma_engine);
+		server.rdma_engine = NULL;
+		if(migration_transport_connect(transport, ip, port, &backend, err, sizeof(err)) == 0) {
+			serverLog(LL_WARNING, "STRATOS CONNECTED TO THE %s RECEIVER", backend.name);
+			server.rdma_engine = rdma_engine_create(&backend, server.migration_rdma_window,
+					server.migration_rdma_signal_every);
+		} else {
+			serverLog(LL_WARNING, "STRATOS %s CONNECT ERROR: %s", transport_name, err);
+		}
 	} else {
-		//SIMPLY TEMRINATE
-		serverLog(LL_WARNING, "CLIENT CONNECT ERROR");
+		server.rdma_client = init_rdma_client(ip, port);
+		int res = server.rdma_client->connect_ops.RDMA_connect_to_server(server.rdma_client);
+
+		if(res) {
+			serverLog(LL_WARNING, "CLIENT CONNECTED TO SERVER SUCCESSFULLY ");
+			struct rdma_engine_backend backend = rdma_client_engine_backend(server.rdma_client,
+					rdmaGetMRCache(server.rdma_client->id->pd));
+			if(server.rdma_engine) rdma_engine_release(server.rdma_engine);
+			server.rdma_engine = rdma_engine_create(&backend, server.migration_rdma_window,
+					server.migration_rdma_signal_every);
+		} else {
+			//SIMPLY TEMRINATE
+			serverLog(LL_WARNING, "CLIENT CONNECT ERROR");
+		}
 	}
 
 
 
-	int chunk_size = 4098;
-	for(int start=7; start<number_of_arguments; start +=chunk_size){
+	migrationBegin(number_of_arguments - 7);
+	for(int start=7, end; start<number_of_arguments; start=end){
 
-		int end = start + chunk_size;
-		if (end > number_of_arguments) {
-			end = number_of_arguments;
-		}
+		end = clusterMigrationChunkEnd(args, start, number_of_arguments);
 		for(int j=start; j<end; j++) {
 			int slotInt = atoi(args[j]);
 			sds slotString = args[j];
@@ -6256,61 +7278,69 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 			rio lockCmdRecipient;
 			rioInitWithBuffer(&lockCmdRecipient,sdsempty());
 
-			pthread_mutex_lock(&server.ownership_lock_slots[slotInt]);
-			server.cluster->migrating_slots_to[slotInt] = recipientNode;
-			pthread_mutex_unlock(&server.ownership_lock_slots[slotInt]);
+			__atomic_store_n(&server.cluster->migrating_slots_to[slotInt],
+					recipientNode, __ATOMIC_RELEASE);
 
 		}
 
 		serverLog(LL_WARNING, "STRATOS IMPORTING AND MIGRATING STATE SET");
 		serverLog(LL_WARNING, "STRATOS START REGISTERING RDMA BLOCKS");
+		migrationSetPhase(MIGRATION_PHASE_REGISTER);
 		//		// REGISTER MEMORY REGIONS AND PREPARE WORK REQUEST AT MIGRATE PATH START
 		int total_number_of_remote_buffers = 0;
 		int number_of_slots = end - start;
 		rio prepareBlocksCmd;
 		rioInitWithBuffer(&prepareBlocksCmd,sdsempty());
-		serverAssertWithInfo(c,NULL,rioWriteBulkCount(&prepareBlocksCmd, '*', 2 + (2*number_of_slots)));
+		serverAssertWithInfo(c,NULL,rioWriteBulkCount(&prepareBlocksCmd, '*', 2 + (3*number_of_slots)));
 		serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareBlocksCmd,"registerRDMABlockSlots", 22));
 		serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareBlocksCmd, "SLOTS", 5));
 		int total_blocks_allocated = 0;
 
-		//realloc seems not to be working, thats why i cound the total rdma buffers and then do malloc
-		char ***all_slots = (char ***) malloc(5000 * sizeof(char **));
-		int slots_number_of_blocks[5000];
-		int slot_is_for_migration[5000];
-		for(int i=0; i<5000; i++) {
-			slot_is_for_migration[i] = 0;
-			slots_number_of_blocks[i] = 0;
-			all_slots[i] = NULL;
-		}
+		// the arrays of the chunk are indexed by j-start
+		char ***all_slots = (char ***) zcalloc(number_of_slots * sizeof(char **));
+		uint32_t **all_slots_lengths = (uint32_t **) zcalloc(number_of_slots * sizeof(uint32_t *));
+		int *slots_number_of_blocks = zcalloc(number_of_slots * sizeof(int));
+		int *precopy_slots = zcalloc(number_of_slots * sizeof(int));
+		uint64_t *precopy_gens = zcalloc(number_of_slots * sizeof(uint64_t));
+		int precopy = server.migration_precopy_rounds > 0;
+		/* The blocks written after the first transfer, the rest of the chunk. */
+		char ***all_rest_slots = (char ***) zcalloc(number_of_slots * sizeof(char **));
+		uint32_t **all_rest_slots_lengths = (uint32_t **) zcalloc(number_of_slots * sizeof(uint32_t *));
+		int *slots_number_of_rest_blocks = zcalloc(number_of_slots * sizeof(int));
+		rio prepareRestBlocksCmd;
+		rioInitWithBuffer(&prepareRestBlocksCmd,sdsempty());
+		int failed = 0;
 
 		for(int j=start; j<end; j++) {
 			unsigned int intSlot = atoi(args[j]);
 			sds slotString = args[j];
 			pthread_mutex_lock(&(server.lock_slots[intSlot]));
-			r_allocator_lock_slot_blocks(intSlot);
+			if(precopy) {
+				/* The blocks keep taking writes while they are sent, the
+				 * written ones are sent again by rdmaPrecopySlotBlocks(). */
+				r_allocator_track_slot(intSlot);
+				precopy_slots[j-start] = intSlot;
+				precopy_gens[j-start] = r_allocator_slot_generation(intSlot);
+			} else {
+				r_allocator_lock_slot_blocks(intSlot);
+			}
 			char **slots;
 			int number_of_blocks;
 			slots = r_allocator_get_block_buffers_for_slot(intSlot, &number_of_blocks);
+			all_slots_lengths[j-start] = r_allocator_get_block_buffer_lengths_for_slot(intSlot, number_of_blocks);
 			pthread_mutex_unlock(&(server.lock_slots[intSlot]));
-			all_slots[j-7] = slots;
-			slots_number_of_blocks[j-7] = number_of_blocks;
-			slot_is_for_migration[j-7] = 1;
+			all_slots[j-start] = slots;
+			slots_number_of_blocks[j-start] = number_of_blocks;
 			total_number_of_remote_buffers += number_of_blocks;
 		}
 
-		int buffer_index = 0;
-		struct rdma_buffer_info **rdma_buffers = (struct rdma_buffer_info **) malloc(total_number_of_remote_buffers  * sizeof(struct rdma_buffer_info *));
 		for(int j=start; j<end; j++) {
 			unsigned int intSlot = atoi(args[j]);
 			sds slotString = args[j];
-			int number_of_blocks = slots_number_of_blocks[j-7];
-			char **slots = all_slots[j-7];
-			for(int i=0; i<number_of_blocks; i++) {
-				rdma_buffers[buffer_index] = init_rdma_buffer(server.rdma_client->id, (char *) slots[i], BLOCK_SIZE_BYTES, 10);
-				total_blocks_allocated++;
-				buffer_index++;
-			}
+			int number_of_blocks = slots_number_of_blocks[j-start];
+			uint32_t *lengths = all_slots_lengths[j-start];
+			// the blocks are registered by the transfer engine while they are sent
+			total_blocks_allocated += number_of_blocks;
 			//Prepare the rpc
 			serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareBlocksCmd, slotString, sdslen(slotString)));
 
@@ -6319,9 +7349,9 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 			sds sdsTotalBlocks = sdsnew(intBuff);
 
 			serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareBlocksCmd, sdsTotalBlocks, sdslen(sdsTotalBlocks)));
-
-			active_slots[number_of_active_slots] = (long long) intSlot;
-			number_of_active_slots++;
+			sdsfree(sdsTotalBlocks);
+			// blocks are not of the same size: send the buffer length of each block
+			serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareBlocksCmd, (char *) lengths, number_of_blocks * sizeof(uint32_t)));
 
 		}
 
@@ -6329,7 +7359,6 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 		char prepareBuffersCmdReply[1024];
 		size_t size_of_remotebuffer =  sizeof(rdmaRemoteBufferInfo);
 		rdmaRemoteBufferInfo *all_remote_data = (rdmaRemoteBufferInfo *) zmalloc(total_number_of_remote_buffers * sizeof(rdmaRemoteBufferInfo));
-		char remote_keys[1024];
 
 
 		buf = prepareBlocksCmd.io.buffer.ptr;
@@ -6338,16 +7367,10 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 			serverLog(LL_WARNING, "SOCKET WRITE prepareBlocks CMD");
 		}
 		// 1 readline for the reply and one for the +OK ack
+		int registered = migrationReadRemoteBuffers(cs->conn, all_remote_data,
+				total_number_of_remote_buffers, 10000);
 
-		if(connSyncReadLine(cs->conn, remote_keys, 1024, 10000) <=0) {
-			serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG READING connSyncReadLine %s", strerror(errno));
-		}
-
-		if(connSyncRead(cs->conn, (char *) all_remote_data, total_number_of_remote_buffers * sizeof(rdmaRemoteBufferInfo), 10000) <=0) {
-			serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG READING connSyncRead %s", strerror(errno));
-		}
-
-		//		sdsfree(prepareBlocksCmd.io.buffer.ptr);
+		sdsfree(prepareBlocksCmd.io.buffer.ptr);
 		//		serverLog(LL_WARNING, "STRATOS  DONOR number of buffers %ld", total_number_of_remote_buffers);
 		//		/* DONOR SIDE DEBUG BUFFERS START */
 		//		//    serverLogHexDump(LL_WARNING, "STRATOS ALL REMOTE BUFFERS SERVER SIDE", (char *) all_remote_data, total_number_of_remote_buffers * sizeof(rdmaRemoteBufferInfo));
@@ -6360,101 +7383,31 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 		serverLog(LL_WARNING, "STRATOS RECIP SIDE LAST BUFFER POINTER AT %d is %p - key:%d", total_number_of_remote_buffers-1, (void *)all_remote_data[total_number_of_remote_buffers-1].ptr, all_remote_data[total_number_of_remote_buffers-1].rkey);
 		int SPLIT_SLOTS = 200;
 
-		serverLog(LL_WARNING, "STRATOS START PREPARING BUFFERS SLOT");
-		/* PREPARE WORK REQUEST AND SEND IT START*/
-		struct ibv_sge sges[total_number_of_remote_buffers];
-		struct ibv_send_wr wrs[total_number_of_remote_buffers];
-
-		int current_buffer_index = 0;
-		for(int j=start; j<end; j++) {
-			unsigned int intSlot = atoi(args[j]);
-			sds slotString = args[j];
-			int number_of_blocks = slots_number_of_blocks[j-7];
-			//serverLog(LL_WARNING, "STRATOS NUMBER OF BLOCKS FOR SLOT:%s is %d", slotString, number_of_blocks);
-			char **slots = all_slots[j-7];
-			for(int i=0; i<number_of_blocks; i++) {
-				memset(&(sges[current_buffer_index]), 0, sizeof(struct ibv_sge));
-				memset(&(wrs[current_buffer_index]), 0, sizeof(struct ibv_send_wr));
-				// PREPARE SGE STOP
-				sges[current_buffer_index].addr = (uint64_t)(uintptr_t) slots[i];
-				sges[current_buffer_index].length = (uint32_t)BLOCK_SIZE_BYTES;
-				sges[current_buffer_index].lkey = rdma_buffers[current_buffer_index]->mr->lkey;
-				// PREPARE SGE STOP
-				// PREPARE WR START
-				wrs[current_buffer_index].wr_id = current_buffer_index;
-				wrs[current_buffer_index].sg_list = &(sges[current_buffer_index]);
-				wrs[current_buffer_index].next = NULL;
-				wrs[current_buffer_index].num_sge = 1;
-				wrs[current_buffer_index].opcode = IBV_WR_RDMA_WRITE;
-				if(intSlot % SPLIT_SLOTS == 0){
-					//serverLog(LL_WARNING, "STRATOS SPLITTING SLOT ON %d",  intSlot);
-					// wrs[current_buffer_index].send_flags = IBV_SEND_SIGNALED;
-
-				}
-				wrs[current_buffer_index].send_flags = IBV_SEND_SIGNALED;
-				wrs[current_buffer_index].wr.rdma.remote_addr = all_remote_data[current_buffer_index].ptr;
-				wrs[current_buffer_index].wr.rdma.rkey = all_remote_data[current_buffer_index].rkey;
-				current_buffer_index++;
-			}
-		}
-
-		int total_acks = 0;
-		int lastSlot;
-
-		lastSlot = (int)strtol(args[end-1], NULL, 10);
-		if(lastSlot % SPLIT_SLOTS != 0){
-			wrs[total_number_of_remote_buffers-1].send_flags = IBV_SEND_SIGNALED;
-
-		}
-
-		unsigned int prevSlot = atoi(args[start]);
-		unsigned int currentSlot = atoi(args[start]);
-
-		int awaiting_acks = ((end - start)/SPLIT_SLOTS) - 1 > 0 ? ((end - start)/SPLIT_SLOTS) - 1 : 0 ;
-		serverLog(LL_WARNING, "STRATOS end-start:%d, SPLIT_SLOTS:%d", end-start, SPLIT_SLOTS);
-
-		for(int i=0; i<total_number_of_remote_buffers; i++) {
-			struct ibv_send_wr bad_wr;
-			if(ibv_post_send(rdma_buffers[0]->id->qp, &(wrs[i]), &bad_wr)!=0) {
-				serverLog(LL_WARNING, "IBV_POST_SEND ERROR:%d, %s", i, strerror(errno));
-			}
-			struct ibv_wc *_completion = server.rdma_client->buffer_ops.wait_for_send_completion_with_wc(server.rdma_client);
-
-			// int ret = server.rdma_client->buffer_ops.wait_for_send_completion_non_blocking(server.rdma_client);
-			// if(ret > 0){
-			// 	currentSlot = prevSlot + SPLIT_SLOTS;
-			// 	rio rdmaDoneBatchCmd;
-			// 	rioInitWithBuffer(&rdmaDoneBatchCmd,sdsempty());
-			// 	serverAssertWithInfo(c,NULL,rioWriteBulkCount(&rdmaDoneBatchCmd, '*', 4));
-			// 	serverAssertWithInfo(c,NULL,rioWriteBulkString(&rdmaDoneBatchCmd,"rdmaDoneBatch", 13));
-
-			// 	serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&rdmaDoneBatchCmd, (long)prevSlot));
-			// 	serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&rdmaDoneBatchCmd, (long)currentSlot));
-			// 	if(total_acks == awaiting_acks){
-			// 		serverAssertWithInfo(c,NULL,rioWriteBulkString(&rdmaDoneBatchCmd, "LAST", 4));
-			// 	}else{
-			// 		serverAssertWithInfo(c,NULL,rioWriteBulkString(&rdmaDoneBatchCmd, "INTERMEDIATE", 12));
-			// 	}
-			// 	serverLog(LL_WARNING, "STRATOS AWAITING ACKS:%d, %d", awaiting_acks, total_acks);
-			// 	serverLog(LL_WARNING, "STRATOS RECEIVED COMPLETION");
-
-			// 	buf = rdmaDoneBatchCmd.io.buffer.ptr;
-			// 	nwritten = connSyncWrite(cs->conn, buf, sdslen(buf), 1000000000);
-			// 	if(nwritten != (int) sdslen(buf)) {
-			// 		serverLog(LL_WARNING, "SOCKET WRITE prepareBlocks CMD");
-			// 	}
-			// 	prevSlot += SPLIT_SLOTS;
-			// 	total_acks++;
-
-
-			// }
-
-			//EXPERIMENTAL LINE TO BE CHANGED FROM SCRIPT
-
-			//	usleep(3600);
-			//	usleep(1800);
-		}
+		serverLog(LL_WARNING, "STRATOS START SENDING BUFFERS");
+		migrationSetPhase(MIGRATION_PHASE_TRANSFER);
+		int written = -1;
+		if(registered == C_OK)
+			written = rdmaWriteSlotBlocks(all_slots, all_slots_lengths, NULL, slots_number_of_blocks,
+					end - start, all_remote_data, total_number_of_remote_buffers);
+		if(written == 0 && precopy) {
+			written = rdmaPrecopySlotBlocks(precopy_slots, all_slots, all_slots_lengths, slots_number_of_blocks,
+					end - start, all_remote_data, precopy_gens);
+		}
+		for(int j=start; j<end; j++) free(all_slots_lengths[j-start]);
+		zfree(all_slots_lengths);
+		zfree(all_remote_data);
+		zfree(precopy_slots);
+		zfree(precopy_gens);
+		/* The recipient must not take blocks that were never written. */
+		if(written != 0) {
+			migrationAbortChunk(args, start, end, "the blocks could not be written");
+			failed = 1;
+			goto chunk_done;
+		}
+
+		unsigned int prevSlot, currentSlot;
 		serverLog(LL_WARNING, "STRATOS SENT ALL BUFFERS");
+		migrationSetPhase(MIGRATION_PHASE_PATCHIN);
 		prevSlot = atoi(args[start]);
 		currentSlot = atoi(args[end-1]);
 
@@ -6537,38 +7490,32 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 			SPLIT_SLOTS = end-start;
 		}
 
-		char ***all_rest_slots = (char ***) malloc(5000 * sizeof(char **));
-		int slots_number_of_rest_blocks[5000];
 		int total_number_of_remote_rest_buffers = 0;
 		int total_rest_blocks_allocated = 0;
 		int total_number_of_active_slots = 0;
-		rio prepareRestBlocksCmd;
-		rioInitWithBuffer(&prepareRestBlocksCmd,sdsempty());
-		serverAssertWithInfo(c,NULL,rioWriteBulkCount(&prepareRestBlocksCmd, '*', 2 + (2*number_of_slots)));
+		serverAssertWithInfo(c,NULL,rioWriteBulkCount(&prepareRestBlocksCmd, '*', 2 + (3*number_of_slots)));
 		serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareRestBlocksCmd,"registerRDMABlockSlots", 22));
 		serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareRestBlocksCmd, "SLOTS", 5));
 
-		for(int i=0; i<5000; i++) {
-			slots_number_of_rest_blocks[i] = 0;
-			all_rest_slots[i] = NULL;
-		}
 
 
 
+		migrationSetPhase(MIGRATION_PHASE_REGISTER);
 		for(int j=start; j<end; j++) {
 			unsigned int intSlot = atoi(args[j]);
 			sds slotString = args[j];
 			//pthread_mutex_lock(&server.lock_slots[intSlot]);
-			pthread_mutex_lock(&server.ownership_lock_slots[intSlot]);
+			clusterFreezeSlot(intSlot);
 			r_allocator_lock_slot_blocks(intSlot);
 			char **slots;
 			int number_of_blocks;
 			slots = r_allocator_get_block_buffers_for_slot(intSlot, &number_of_blocks);
+			all_rest_slots_lengths[j-start] = r_allocator_get_block_buffer_lengths_for_slot(intSlot, number_of_blocks);
 			//pthread_mutex_unlock(&(server.lock_slots[intSlot]));
-			int blocksDiff = number_of_blocks - slots_number_of_blocks[j-7];
-			//serverLog(LL_WARNING, "STRATOS %d, %d -> %d", number_of_blocks, slots_number_of_blocks[j-7], blocksDiff);
-			all_rest_slots[j-7] = slots;
-			slots_number_of_rest_blocks[j-7] = blocksDiff;
+			int blocksDiff = number_of_blocks - slots_number_of_blocks[j-start];
+			//serverLog(LL_WARNING, "STRATOS %d, %d -> %d", number_of_blocks, slots_number_of_blocks[j-start], blocksDiff);
+			all_rest_slots[j-start] = slots;
+			slots_number_of_rest_blocks[j-start] = blocksDiff;
 			total_number_of_remote_rest_buffers += blocksDiff;
 			total_number_of_active_slots++;
 		}
@@ -6580,18 +7527,12 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 				//lock and keep the lock because we want to freeze the writes
 				//pthread_mutex_lock(&(server.lock_slots[intSlot]));
 			}
-			buffer_index = 0;
-			struct rdma_buffer_info **rdma_rest_buffers = (struct rdma_buffer_info **) malloc(total_number_of_remote_rest_buffers  * sizeof(struct rdma_buffer_info *));
 			for(int j=start; j<end; j++) {
 				unsigned int intSlot = atoi(args[j]);
 				sds slotString = args[j];
-				int number_of_blocks = slots_number_of_rest_blocks[j-7];
-				char **slots = all_rest_slots[j-7];
-				for(int i=slots_number_of_blocks[j-7]; i<(slots_number_of_blocks[j-7] + slots_number_of_rest_blocks[j-7]); i++) {
-					rdma_rest_buffers[buffer_index] = init_rdma_buffer(server.rdma_client->id, (char *) slots[i], BLOCK_SIZE_BYTES, 10);
-					total_rest_blocks_allocated++;
-					buffer_index++;
-				}
+				int number_of_blocks = slots_number_of_rest_blocks[j-start];
+				uint32_t *lengths = all_rest_slots_lengths[j-start];
+				total_rest_blocks_allocated += number_of_blocks;
 				//Prepare the rpc
 				serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareRestBlocksCmd, slotString, sdslen(slotString)));
 
@@ -6600,79 +7541,36 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 				sds sdsTotalBlocks = sdsnew(intBuff);
 
 				serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareRestBlocksCmd, sdsTotalBlocks, sdslen(sdsTotalBlocks)));
-
-				active_slots[number_of_active_slots] = (long long) intSlot;
-				number_of_active_slots++;
+				sdsfree(sdsTotalBlocks);
+				serverAssertWithInfo(c,NULL,rioWriteBulkString(&prepareRestBlocksCmd, (char *) (lengths + slots_number_of_blocks[j-start]), number_of_blocks * sizeof(uint32_t)));
 
 			}
 			nwritten = 0;
 
 			rdmaRemoteBufferInfo *all_remote_rest_data = (rdmaRemoteBufferInfo *) zmalloc(total_number_of_remote_rest_buffers * sizeof(rdmaRemoteBufferInfo));
 			memset(all_remote_rest_data, 0, total_number_of_remote_rest_buffers * sizeof(rdmaRemoteBufferInfo));
-			memset(remote_keys, 0, 1024);
 			buf = prepareRestBlocksCmd.io.buffer.ptr;
 			nwritten = connSyncWrite(cs->conn, buf, sdslen(buf), 1000000000);
 			// 1 readline for the reply and one for the +OK ack
 			serverLog(LL_WARNING, "STRATOS DONOR number of REST buffers %ld", total_number_of_remote_rest_buffers);
-			if(connSyncReadLine(cs->conn, remote_keys, 1024, 10000) <=0) {
-				serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG READING connSyncReadLine %s", strerror(errno));
-			}
-
-			if(connSyncRead(cs->conn, (char *) all_remote_rest_data, total_number_of_remote_rest_buffers * sizeof(rdmaRemoteBufferInfo), 10000000) <=0) {
-				serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG READING connSyncRead %s", strerror(errno));
-			}
+			registered = migrationReadRemoteBuffers(cs->conn, all_remote_rest_data,
+					total_number_of_remote_rest_buffers, 10000000);
 			serverLog(LL_WARNING, "STRATOS RECIP SIDE REST FIRST BUFFER POINTER AT %d is %p - key:%d", 0, (void *) all_remote_rest_data[0].ptr, all_remote_rest_data[0].rkey);
 			serverLog(LL_WARNING, "STRATOS RECIP SIDE REST LAST BUFFER POINTER AT %d is %p - key:%d", total_number_of_remote_rest_buffers-1, (void *)all_remote_rest_data[total_number_of_remote_rest_buffers-1].ptr, all_remote_rest_data[total_number_of_remote_rest_buffers-1].rkey);
-			serverLog(LL_WARNING, "STRATOS START PREPARING REST BUFFERS SLOT");
-			/* PREPARE WORK REQUEST AND SEND IT START*/
-			struct ibv_sge sges_rest[total_number_of_remote_rest_buffers];
-			struct ibv_send_wr wrs_rest[total_number_of_remote_rest_buffers];
-			current_buffer_index = 0;
-			for(int j=start; j<end; j++) {
-				unsigned int intSlot = atoi(args[j]);
-				sds slotString = args[j];
-				int number_of_blocks = slots_number_of_rest_blocks[j-7];
-				//serverLog(LL_WARNING, "STRATOS NUMBER OF BLOCKS FOR SLOT:%s is %d", slotString, number_of_blocks);
-				char **slots = all_rest_slots[j-7];
-				for(int i=slots_number_of_blocks[j-7]; i<(slots_number_of_blocks[j-7] + slots_number_of_rest_blocks[j-7]); i++) {
-					memset(&(sges_rest[current_buffer_index]), 0, sizeof(struct ibv_sge));
-					memset(&(wrs_rest[current_buffer_index]), 0, sizeof(struct ibv_send_wr));
-					// PREPARE SGE STOP
-					sges_rest[current_buffer_index].addr = (uint64_t)(uintptr_t) slots[i];
-					sges_rest[current_buffer_index].length = (uint32_t)BLOCK_SIZE_BYTES;
-					sges_rest[current_buffer_index].lkey = rdma_rest_buffers[current_buffer_index]->mr->lkey;
-					// PREPARE SGE STOP
-					// PREPARE WR START
-					wrs_rest[current_buffer_index].wr_id = current_buffer_index;
-					wrs_rest[current_buffer_index].sg_list = &(sges_rest[current_buffer_index]);
-					wrs_rest[current_buffer_index].next = NULL;
-					wrs_rest[current_buffer_index].num_sge = 1;
-					wrs_rest[current_buffer_index].opcode = IBV_WR_RDMA_WRITE;
-					if(intSlot % SPLIT_SLOTS == 0){
-						//serverLog(LL_WARNING, "STRATOS REST SPLITTING SLOT ON %d",  intSlot);
-						//wrs_rest[current_buffer_index].send_flags = IBV_SEND_SIGNALED;
-
-					}
-					wrs_rest[current_buffer_index].send_flags = IBV_SEND_SIGNALED;
-					wrs_rest[current_buffer_index].wr.rdma.remote_addr = all_remote_rest_data[current_buffer_index].ptr;
-					wrs_rest[current_buffer_index].wr.rdma.rkey = all_remote_rest_data[current_buffer_index].rkey;
-					current_buffer_index++;
-				}
-			}
-			if(lastSlot % SPLIT_SLOTS != 0){
-				wrs_rest[current_buffer_index-1].send_flags = IBV_SEND_SIGNALED;
-
-			}
-			serverLog(LL_WARNING, "STRATOS QP IS:%d, rdma_buffres[0]->id->qp", rdma_rest_buffers[0]->id->qp);
 			serverLog(LL_WARNING, "STRATOS START SENDING REST BUFFERS");
-			for(int i=0; i<total_number_of_remote_rest_buffers; i++) {
-				struct ibv_send_wr bad_wr;
-				if(ibv_post_send(rdma_rest_buffers[0]->id->qp, &(wrs_rest[i]), &bad_wr)!=0) {
-					serverLog(LL_WARNING, "IBV_POST_SEND ERROR:%d, %s", i, strerror(errno));
-				}
-
-				struct ibv_wc *_completion = server.rdma_client->buffer_ops.wait_for_send_completion_with_wc(server.rdma_client);
+			migrationSetPhase(MIGRATION_PHASE_TRANSFER);
+			written = -1;
+			if(registered == C_OK)
+				written = rdmaWriteSlotBlocks(all_rest_slots, all_rest_slots_lengths, slots_number_of_blocks,
+						slots_number_of_rest_blocks, end - start, all_remote_rest_data,
+						total_number_of_remote_rest_buffers);
+			zfree(all_remote_rest_data);
+			if(written != 0) {
+				migrationAbortChunk(args, start, end, "the rest of the blocks could not be written");
+				failed = 1;
+				goto chunk_done;
 			}
+			migrationSetPhase(MIGRATION_PHASE_PATCHIN);
 			prevSlot = atoi(args[start]);
 			currentSlot = atoi(args[end-1]);
 
@@ -6699,6 +7597,7 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 			while(1) {
 				pthread_mutex_lock(&(server.generic_migration_mutex));
 				if(server.rdmaDoneAck==1) {
+					server.rdmaDoneAck=0;
 					pthread_mutex_unlock(&(server.generic_migration_mutex));
 					break;
 				}
@@ -6720,93 +7619,48 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 			serverLog(LL_WARNING, "STRATOS RECEIVED RDMA DONE ACK FOR REST BUFFERS");
 			//SPILL OVER BLOCKS STOP
 		}
-		serverLog(LL_WARNING, "STRATOS START OWNERSHIP");
-
-		// CHANGE OWNERSHIP START
-
-		int total_slots_transferred = end - start;
-		cs = migrateGetSocketOtherParams(c, args[3], args[4], args[3], args[4], 10000);
-		rio unlockCmdRecipient;
-		rioInitWithBuffer(&unlockCmdRecipient,sdsempty());
-		serverAssertWithInfo(c,NULL,rioWriteBulkCount(&unlockCmdRecipient, '*', 4 + total_slots_transferred));
-		serverAssertWithInfo(c,NULL,rioWriteBulkString(&unlockCmdRecipient,"CLUSTER", 7));
-		serverAssertWithInfo(c,NULL,rioWriteBulkString(&unlockCmdRecipient, "SETSLOTS", 8));
-		for(int j=start; j<end; j++) {
-			sds sdsSlot = args[j];
-			unsigned int intSlot;
-			sscanf(sdsSlot, "%d", &intSlot);
-			serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&unlockCmdRecipient, (long)intSlot));
+		// SHADOW WRITES START
+		migrationSetPhase(MIGRATION_PHASE_OWNERSHIP);
+		if (clusterSendShadowLog(cs->conn, args, start, end) != C_OK) {
+			migrationAbortChunk(args, start, end, "the recipient did not apply the shadow writes");
+			failed = 1;
 		}
+		// SHADOW WRITES STOP
 
-		serverAssertWithInfo(c,NULL,rioWriteBulkString(&unlockCmdRecipient, "NODE", 4));
-		serverAssertWithInfo(c,NULL,rioWriteBulkString(&unlockCmdRecipient, recipientNode->name, CLUSTER_NAMELEN));
-
-		serverLog(LL_WARNING, "PREPARED COMMAND FOR SLOTS %s until %s for recipientNode: %s", args[start], args[end-1], recipientNode->name);
-
-		dictIterator *di;
-		dictEntry *de;
-
-		di = dictGetSafeIterator(server.cluster->nodes);
-		nwritten = 0;
-		char changeOwnershipCmdReply[1024];
-		buf = unlockCmdRecipient.io.buffer.ptr;
-		while((de = dictNext(di)) != NULL) {
-			clusterNode *node = dictGetVal(de);
-			if(strcmp(node->ip, myself->ip) == 0) {
-				// DO NOT SEND OWNERSHIP CHANGE RPC TO MYSELF.
-				continue;
-			}
-			char tempPortBuffer[20];
-			sprintf(tempPortBuffer, "%d", node->port);
-			robj *host = createObject(OBJ_STRING,sdsnew(node->ip));
-			robj *port = createObject(OBJ_STRING,sdsnew(tempPortBuffer));
-			connection *conn;
-			conn = server.tls_cluster ? connCreateTLS() : connCreateSocket();
-			connBlockingConnect(conn, host->ptr, atoi(port->ptr), 1000);
-			connEnableTcpNoDelay(conn);
-			serverLog(LL_WARNING, "SENDING change ownershp rpc to %s", node->ip);
-			char changeOwnershipCmdReply[1024];
-			sds changeOwnershipBuf = unlockCmdRecipient.io.buffer.ptr;
-
-			nwritten = connSyncWrite(conn, buf, sdslen(buf), 1000000);
-			if(nwritten != (int) sdslen(buf)) {
-				serverLog(LL_WARNING, "SOCKET WRITE ERROR changeOwnership SERVER");
+		// CHANGE OWNERSHIP START
+		if (!failed && recipientNode == NULL) {
+			migrationAbortChunk(args, start, end, "the recipient is not a known node");
+			failed = 1;
+		}
+		if (!failed) {
+			serverLog(LL_WARNING, "STRATOS START OWNERSHIP");
+			int total_slots_transferred = end - start;
+			int *handoff_slots = zmalloc(sizeof(int) * total_slots_transferred);
+			for(int j=start; j<end; j++) handoff_slots[j-start] = atoi(args[j]);
+			if (clusterHandoffSlots(recipientNode, handoff_slots, total_slots_transferred) != C_OK) {
+				migrationAbortChunk(args, start, end, "the recipient did not ack the hand-off");
+				failed = 1;
 			}
-			connSyncReadLine(conn, changeOwnershipCmdReply, sizeof(changeOwnershipCmdReply), 10000000);
-			freeStringObject(host);
-			freeStringObject(port);
-			connClose(conn);
-			//serverLog(LL_WARNING, "RECEIVED WHAT? %s", changeOwnershipCmdReply);
-
+			zfree(handoff_slots);
 		}
-		dictReleaseIterator(di);
-		// 1 readline for the reply and one for the +OK ack
-		sdsfree(unlockCmdRecipient.io.buffer.ptr);
+		// CHANGE OWNERSHIP STOP
 
-		//UNLOCK ALL THE SLOTS
+chunk_done:
+		// the chunk is handed off: nothing of it is kept before the next one
 		for(int j=start; j<end; j++) {
-			unsigned int intSlot = atoi(args[j]);
-			server.migration_ownership_changed[intSlot] = 1;
-			
-			clusterDelSlot(intSlot);
-			clusterAddSlot(recipientNode,intSlot);
-			server.cluster->importing_slots_from[intSlot] = NULL;
-			if (clusterBumpConfigEpochWithoutConsensus() == C_OK) {
-				serverLog(LL_WARNING,
-						"configEpoch updated after importing slot");
-			}
-			clusterBroadcastPong(CLUSTER_BROADCAST_ALL);
-			clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
-					CLUSTER_TODO_UPDATE_STATE|
-					CLUSTER_TODO_FSYNC_CONFIG);
-
-			pthread_mutex_unlock(&server.ownership_lock_slots[intSlot]);
-			//pthread_mutex_unlock(&server.lock_slots[intSlot]);
+			free(all_slots[j-start]);
+			free(all_rest_slots[j-start]);
+			free(all_rest_slots_lengths[j-start]);
 		}
-		serverLog(LL_WARNING, "STRATOS , OWNERSHIP CHANGE DONE, ALL THE NODES KNOW ABOUT RECIPIENT");
-		
-		
-		// CHANGE OWNERSHIP STOP
+		zfree(all_slots);
+		zfree(slots_number_of_blocks);
+		zfree(all_rest_slots);
+		zfree(all_rest_slots_lengths);
+		zfree(slots_number_of_rest_blocks);
+		sdsfree(prepareRestBlocksCmd.io.buffer.ptr);
+		if (failed) break;
+		__atomic_add_fetch(&server.stat_migration_chunks, 1, __ATOMIC_RELAXED);
+		migrationSlotsDone(end - start);
 
 	}
 	for(int i=0;i<100;i++){
@@ -6823,6 +7677,7 @@ void *migrateRDMASlotsCommandThread(void *arg) {
 
 
 
+	migrationSetPhase(MIGRATION_PHASE_NONE);
 	serverLog(LL_WARNING, "STRATOS ENDED MIGRATION ON DONOR SIDE");
 	//SOS TODO CLEAN ARGUMETNS TAKEN FROM migrateRDMASlots Command
 	return;
@@ -6858,6 +7713,47 @@ void *threadFunc(void * arg)
 }
 
 
+static int rdmaCompareServableTimes(const void *a, const void *b) {
+	long long ta = *(const long long *) a, tb = *(const long long *) b;
+	return (ta > tb) - (ta < tb);
+}
+
+/* Add the K-Vs of the received slots to the keyspace with a pool of
+ * migration-index-threads threads, logging the indexing rate and the time it
+ * took for the slots to become servable. Returns the number of keys added.
+ *
+ * With migration-lazy-index the slots are servable once their pending index
+ * is published, and the keys are added to the keyspace on demand or by the
+ * background indexer, after this function returns. */
+static long long rdmaIndexReceivedSlots(redisDb *db, int *slots, int nslots) {
+	slotIndexStats st;
+	long long *servable;
+
+	if (nslots == 0) return 0;
+	servable = zmalloc(sizeof(long long) * nslots);
+
+	if (server.migration_lazy_index)
+		slotIndexRebuildLazy(db->dict, slots, nslots, server.migration_index_threads, servable, &st);
+	else
+		slotIndexRebuild(db->dict, slots, nslots, server.migration_index_threads, servable, &st);
+	qsort(servable, nslots, sizeof(long long), rdmaCompareServableTimes);
+
+	serverLog(LL_WARNING, "STRATOS INDEXED %d SLOTS%s: %lld keys added, %lld existing in %.3f ms "
+			"(scan %.3f ms, insert %.3f ms, %d threads) %.0f keys/sec, "
+			"slots servable after p50 %.3f ms max %.3f ms",
+			nslots, server.migration_lazy_index ? " (LAZY)" : "",
+			st.keys_added, st.keys_existing, (double) st.total_us / 1000,
+			(double) st.scan_us / 1000, (double) st.insert_us / 1000, server.migration_index_threads,
+			st.total_us ? (double) st.keys_added * 1000000 / st.total_us : 0,
+			(double) servable[nslots / 2] / 1000, (double) servable[nslots - 1] / 1000);
+
+	server.stat_migration_indexed_keys += st.keys_added;
+	server.stat_migration_index_usec += st.total_us;
+	server.stat_migration_servable_usec = servable[nslots - 1];
+	zfree(servable);
+	return st.keys_added;
+}
+
 void *rdmaDoneSlotsThread(void *arg) {
 
 	// Spin and wait for rehashing to be done
@@ -6882,32 +7778,18 @@ void *rdmaDoneSlotsThread(void *arg) {
 	size_t number_of_arguments = tArgs->number_of_arguments;
 
 	int total_keys_added = 0;
-	long long active_slots[number_of_arguments - 2];
+	int active_slots[number_of_arguments - 2];
 
 	rdmaCachedConnection *cs =  rdmaGetConnection(c);
 
 	for(long unsigned int j = 2; j < number_of_arguments; j++) {
 		int slotInt = atoi(args[j]);
 		active_slots[j-2] = slotInt;
-
 		r_allocator_lock_slot_blocks(slotInt);
-		segment_iterator_t *iter = create_iterator_for_slot(slotInt);
-		robj *key_meta, *val_meta;
-		while (iter->getNext(slotInt, &key_meta, &val_meta) != NULL) {
-			key_meta->ptr = (char *) key_meta + key_meta->data_offset + 8;
-			val_meta->ptr = (char *) val_meta + val_meta->data_offset + 8;
-			//if key does not exist then add it to dictionary, else ignore
-			if (lookupKeyWrite(c->db,key_meta) == NULL) {
-				dbAddNoCopy(c->db, key_meta, val_meta);
-				total_keys_added++;
-				//serverLog(LL_WARNING, "STRATOS ADDING KEY %s", key_meta->ptr);
-			}
-			if(total_keys_added % 10 == 0){
-				//usleep(10);
-			}
-		}
-
 	}
+	//if a key already exists in the dictionary it is ignored
+	total_keys_added = rdmaIndexReceivedSlots(c->db, active_slots, number_of_arguments - 2);
+	dictDisableConcurrency(c->db->dict);
 
 	serverLog(LL_WARNING, "STRATOS PATCHING AND ADDING DONE");
 
@@ -6959,7 +7841,7 @@ void *rdmaDoneBatchThreadFunc(void *arg) {
 	int i=0;
 	int total_keys_added = 0;
 	serverLog(LL_WARNING, "STRATOS STARTED BATCH THREAD");
-	while(true){
+	while(1){
 		if (!isQueueEmpty(&queue)) {
 			MessageData* item = (MessageData*)dequeue(&queue);
 
@@ -6973,25 +7855,15 @@ void *rdmaDoneBatchThreadFunc(void *arg) {
 			firstSlot = (int)strtol(item->first_slot, NULL, 10);
 			lastSlot = (int)strtol(item->last_slot, NULL, 10);
 
-			for(long unsigned int j = firstSlot; j <= lastSlot ; j++) {
-
-				int slotInt = j;
-				segment_iterator_t *iter = create_iterator_for_slot(slotInt);
-				robj *key_meta, *val_meta;
-				while (iter->getNext(slotInt, &key_meta, &val_meta) != NULL) {
-					key_meta->ptr = (char *) key_meta + key_meta->data_offset + 8;
-					val_meta->ptr = (char *) val_meta + val_meta->data_offset + 8;
-					//if key does not exist then add it to dictionary, else ignore
-					if (lookupKeyWrite(item->c->db,key_meta) == NULL) {
-						dbAddNoCopy(item->c->db, key_meta, val_meta);
-						total_keys_added++;
-						//serverLog(LL_WARNING, "STRATOS ADDING KEY %s", key_meta->ptr);
-					}
-					if(total_keys_added % 10 == 0){
-						//usleep(10);
-					}
-				}
-				r_allocator_lock_slot_blocks(slotInt);
+			int batch_slots[lastSlot - firstSlot + 1];
+			for(int j = firstSlot; j <= lastSlot ; j++) {
+				batch_slots[j - firstSlot] = j;
+			}
+			//if a key already exists in the dictionary it is ignored
+			total_keys_added += rdmaIndexReceivedSlots(item->c->db, batch_slots, lastSlot - firstSlot + 1);
+			dictDisableConcurrency(item->c->db->dict);
+			for(int j = firstSlot; j <= lastSlot ; j++) {
+				r_allocator_lock_slot_blocks(j);
 			}
 
 
@@ -7049,6 +7921,8 @@ void rdmaDoneBatchCommand(client *c) {
 		initializeQueue(&queue);
 		pthread_create(&rdmaDoneBatchThread, NULL, rdmaDoneBatchThreadFunc, NULL);
 	}
+	/* The batch thread adds the keys while we keep serving the db. */
+	dictEnableConcurrency(c->db->dict);
 	enqueue(&queue, data);
 	//	serverLog(LL_WARNING, "STRATOS INSIDE COMMAND %s, %s, %s", item->first_slot, item->last_slot, item->message);
 	//	MessageData* item = (MessageData*)dequeue(&queue);
@@ -7073,6 +7947,8 @@ void rdmaDoneSlotsCommand(client *c) {
 	tArgs->c = c;
 	tArgs->_args = _args;
 	tArgs->number_of_arguments = c->argc;
+	/* The thread adds the keys while we keep serving the db. */
+	dictEnableConcurrency(c->db->dict);
 	pthread_create(&rdmaDoneThread, NULL, rdmaDoneSlotsThread, (void *) tArgs);
 	//pthread_join(rdmaDoneThread, NULL);
 	addReply(c, shared.ok);
@@ -7096,11 +7972,32 @@ void initRDMAServerCommand(client *c) {
 	serverLog(LL_WARNING, " arg is %s", (char *)c->argv[2]->ptr);
 	serverLog(LL_WARNING, " arg is %s", (char *)c->argv[3]->ptr);
 	char *rdma_server_port = (char *) c->argv[1]->ptr;
-	struct rdma_server_info *s;
-	s = init_rdma_server(rdma_server_port);
-	rdmaAddConnection(c, s, rdma_server_port);
-	if(s->id == NULL) {
-		serverLog(LL_WARNING, "STRATOS CONNECTION IS NULL");
+	int transport = MIGRATION_TRANSPORT_RDMA;
+	if(c->argc > 4 && (transport = migration_transport_by_name(c->argv[4]->ptr)) == -1) {
+		addReplyErrorFormat(c, "Unknown migration transport '%s'", (char *) c->argv[4]->ptr);
+		return;
+	}
+	if(transport != MIGRATION_TRANSPORT_RDMA) {
+		char err[256];
+		if(migrationStartReceiver(transport, rdma_server_port, err, sizeof(err)) == C_ERR) {
+			serverLog(LL_WARNING, "STRATOS COULD NOT START THE %s RECEIVER: %s", (char *) c->argv[4]->ptr, err);
+			addReplyErrorFormat(c, "Can't start the migration receiver: %s", err);
+			return;
+		}
+	} else {
+		struct rdma_server_info *s;
+		migrationStopReceiver();
+		s = init_rdma_server(rdma_server_port);
+		rdmaAddConnection(c, s, rdma_server_port);
+		if(s->id == NULL) {
+			serverLog(LL_WARNING, "STRATOS CONNECTION IS NULL");
+		}
+	}
+	/* Blocks for the slots about to be received, registered with the
+	 * connection (see rdmaGetMRCache()). */
+	if(server.allocator_block_pool) {
+		serverLog(LL_WARNING, "STRATOS BLOCK POOL HAS %u BLOCKS",
+				r_allocator_block_pool_fill(server.allocator_block_pool));
 	}
 	serverLog(LL_WARNING, "RDMA ADDED CONNECTION");
 	serverLog(LL_WARNING, "STRATOS STOPPED INIT RDMA SERVER");
@@ -7115,18 +8012,24 @@ void registerRDMABufferClientCommand(client *c) {
 }
 
 
-// INCOMING COMMAND SLOTS [ID] [NUMBER_OF_BLOCKS]
+// INCOMING COMMAND SLOTS [ID] [NUMBER_OF_BLOCKS] [BUFFER LENGTHS (NUMBER_OF_BLOCKS x uint32)]
 void registerRDMABlockSlotsCommand(client *c) {
 	serverLog(LL_WARNING, "STRATOS STARTED REGISTERING SLOT BLOCKS ON SERVER SIDE");
 
 	rdmaRemoteBufferInfo *remote_buffers;
-	// WARNING THIS IS STATIC
-	remote_buffers = (rdmaRemoteBufferInfo *) zmalloc(2000 * sizeof(rdmaRemoteBufferInfo));
 	int total_remote_buffers = 0;
 
-	rdmaCachedConnection *cs =  rdmaGetConnection(c);
-	if(!cs) {
-		serverLog(LL_WARNING, "STRATOS RDMA CONNECTION NOT FOUND");
+	/* Without RDMA the blocks are exposed to the receiver instead. */
+	struct migration_receiver *receiver = server.migration_receiver;
+	struct rdma_mr_cache *mr_cache = NULL;
+	struct rdma_mr_cache_stats mr_before;
+	if(!receiver) {
+		rdmaCachedConnection *cs =  rdmaGetConnection(c);
+		if(!cs) {
+			serverLog(LL_WARNING, "STRATOS RDMA CONNECTION NOT FOUND");
+		}
+		mr_cache = rdmaGetMRCache(cs->s->id->pd);
+		mr_before = rdma_mr_cache_get_stats(mr_cache);
 	}
 	int number_of_arguments = c->argc;
 	int start_blocks_index = 0;
@@ -7136,33 +8039,79 @@ void registerRDMABlockSlotsCommand(client *c) {
 		}
 	}
 
+	if(start_blocks_index == 0) {
+		addReplyErrorObject(c,shared.syntaxerr);
+		return;
+	}
+
+	/* One remote buffer per block of every slot. The lengths come from the
+	 * donor: all of them are checked before any block is allocated. */
+	long total_blocks = 0;
+	for(int j=start_blocks_index; j<number_of_arguments-2; j+=3) {
+		long long slot, number_of_blocks;
+		sds lengths = c->argv[j+2]->ptr;
+
+		if(getLongLongFromObject(c->argv[j],&slot) != C_OK ||
+				slot < 0 || slot >= CLUSTER_SLOTS) {
+			addReplyErrorFormat(c, "Invalid slot '%s'", (char *) c->argv[j]->ptr);
+			return;
+		}
+		if(getLongLongFromObject(c->argv[j+1],&number_of_blocks) != C_OK ||
+				number_of_blocks < 0 ||
+				sdslen(lengths) != (size_t) number_of_blocks * sizeof(uint32_t)) {
+			addReplyErrorFormat(c, "Wrong number of block lengths for slot %lld", slot);
+			return;
+		}
+		for(long long i=0; i<number_of_blocks; i++) {
+			uint32_t length;
+			memcpy(&length, lengths + i*sizeof(uint32_t), sizeof(length));
+			if(!r_allocator_block_buffer_length_valid(length)) {
+				addReplyErrorFormat(c, "Invalid length %u of block %lld of slot %lld", length, i, slot);
+				return;
+			}
+		}
+		total_blocks += number_of_blocks;
+	}
+	remote_buffers = (rdmaRemoteBufferInfo *) zmalloc((total_blocks ? total_blocks : 1) * sizeof(rdmaRemoteBufferInfo));
+
 	int block_index = start_blocks_index;
-	while(block_index < number_of_arguments-1) {
+	while(block_index < number_of_arguments-2) {
 
 		int number_of_blocks;
 		int slotID;
 		sscanf(c->argv[block_index]->ptr, "%d", &slotID);
 		sscanf(c->argv[block_index+1]->ptr, "%d", &number_of_blocks);
+		char *lengths = c->argv[block_index+2]->ptr;
 		//serverLog(LL_WARNING, "STRATOS SLOT %d with Blocks %d", slotID, number_of_blocks);
 		for(int i=0; i<number_of_blocks; i++) {
-			void *allocated_block_ptr = r_allocator_alloc_new_empty_block(slotID);
+			/* The lengths are not aligned in the argument. */
+			uint32_t length;
+			memcpy(&length, lengths + i*sizeof(uint32_t), sizeof(length));
+			// same size as the donor block so the whole buffer (segments and dummy headers) lands in place
+			void *allocated_block_ptr = r_allocator_alloc_new_empty_block_of_size(slotID, r_allocator_block_size_from_buffer_length(length));
 			if(!allocated_block_ptr) {
 				serverLog(LL_WARNING, "STRATOS COULD NOT ALLOCATE BLOCK");
 			}
-			struct rdma_buffer_info *rdma_buffer = init_rdma_buffer(cs->s->id, allocated_block_ptr, BLOCK_SIZE_BYTES, 0);
+			uint32_t lkey, rkey;
+			int reg_err = 0;
 
-			if(rdma_buffer == NULL) {
+			if(receiver) {
+				rkey = migration_receiver_expose(receiver, allocated_block_ptr, length);
+			} else {
+				reg_err = rdma_mr_cache_get(mr_cache, allocated_block_ptr, length, &lkey, &rkey);
+			}
+			if(reg_err) {
 				serverLog(LL_WARNING, "STRATOS SOMETHING WENT WRONG REGISTERING BUFFER ON SERVER SIDE FOR SLOT %d", slotID);
 			} else {
 				rdmaRemoteBufferInfo remote_side_data;
-				remote_side_data.rkey =  rdma_buffer->buffer_ops.getRemoteKey(rdma_buffer);
+				remote_side_data.rkey = rkey;
 				remote_side_data.ptr = (uint64_t) allocated_block_ptr;
 				remote_buffers[total_remote_buffers] = remote_side_data;
 				total_remote_buffers++;
 			}
 		}
 
-		block_index+=2;
+		block_index+=3;
 		//r_allocator_lock_slot_blocks(slotID);
 	}
 
@@ -7170,6 +8119,7 @@ void registerRDMABlockSlotsCommand(client *c) {
 	addReplyBulkCBuffer(c, (char *)remote_buffers, total_remote_buffers * sizeof(rdmaRemoteBufferInfo));
 	serverLog(LL_WARNING, "STRATOS STOPPED REGISTERING SLOT BLOCKS ON SERVER SIDE");
 	serverLog(LL_WARNING, "STRATOS RECIP number of buffers %d", total_remote_buffers);
+	if(mr_cache) rdmaMRCacheUpdateStats(mr_cache, &mr_before);
 	//serverLog(LL_WARNING, "STRATOS TOTAL EXECUTION TIME OF allocate_new_empty_blocks: %ld micros", get_empty_blocks_alloc_exec_time());
 	serverLog(LL_WARNING, "STRATOS RECIP SIDE FIRST BUFFER POINTER AT %d is %p - key:%d", 0, (void *)remote_buffers[0].ptr, remote_buffers[0].rkey);
 	serverLog(LL_WARNING, "STRATOS RECIP SIDE LAST BUFFER POINTER AT %d is %p - key:%d", total_remote_buffers-1, (void *)remote_buffers[total_remote_buffers-1].ptr, remote_buffers[total_remote_buffers-1].rkey);
@@ -7413,67 +8363,9 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
 	//        return server.cluster->migrating_slots_to[slot];
 	//    }
 	//
-	int write_command = (c->cmd->flags & CMD_WRITE) ||
-		(c->cmd->proc == execCommand && (c->mstate.cmd_flags & CMD_WRITE));
-
-	if(!write_command){
-				if(pthread_mutex_trylock(&server.ownership_lock_slots[slot])){
-		
-		
-					if(server.migration_ownership_changed[slot] == 1) {
-						server.migration_ownership_changed[slot] = 0;
-						clusterNode *recipientNode = server.cluster->migrating_slots_to[slot];
-						if(error_code) {
-							*error_code = CLUSTER_REDIR_MOVED;
-						}
-						if(recipientNode != NULL) {
-							server.cluster->slots[slot] = recipientNode;
-							server.cluster->migrating_slots_to[slot] = NULL;
-							server.cluster->importing_slots_from[slot] = NULL;
-							pthread_mutex_unlock(&(server.ownership_lock_slots[slot]));
-							return recipientNode;
-						}
-		
-						pthread_mutex_unlock(&server.ownership_lock_slots[slot]);
-					}else{
-						return myself;
-					}
-		
-		
-		
-				}else{
-					return myself;
-				}
-
-	}
-	if(write_command){
-				pthread_mutex_lock(&server.ownership_lock_slots[slot]);
-		
-				if(server.migration_ownership_changed[slot] == 1) {
-					//server.migration_ownership_changed[slot] = 0;
-					clusterNode *recipientNode = server.cluster->migrating_slots_to[slot];
-					if(error_code) {
-						*error_code = CLUSTER_REDIR_MOVED;
-					}
-					if(recipientNode != NULL) {
-						server.cluster->slots[slot] = recipientNode;
-						server.cluster->migrating_slots_to[slot] = NULL;
-						server.cluster->importing_slots_from[slot] = NULL;
-						pthread_mutex_unlock(&(server.ownership_lock_slots[slot]));
-						return recipientNode;
-					}
-		
-				}else{
-					pthread_mutex_unlock(&server.ownership_lock_slots[slot]);
-					return myself;
-				}
-				pthread_mutex_unlock(&server.ownership_lock_slots[slot]);
-
-	}
-
-
-
-
+	/* Writes to a slot being handed over are parked by processCommand(),
+	 * once the hand-off completes the slot is assigned to the new owner and
+	 * they are redirected by the base case. */
 	if(migrating_slot) {
 		if (error_code) {
 			*error_code = CLUSTER_REDIR_NONE;
@@ -7540,6 +8432,7 @@ void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_co
 		 * but the slot is not "stable" currently as there is
 		 * a migration or import in progress. */
 		addReplyError(c,"-TRYAGAIN Multiple keys request during rehashing of slot");
+		server.stat_cluster_tryagain_replies++;
 	} else if (error_code == CLUSTER_REDIR_DOWN_STATE) {
 		addReplyError(c,"-CLUSTERDOWN The cluster is down");
 	} else if (error_code == CLUSTER_REDIR_DOWN_RO_STATE) {
@@ -7554,6 +8447,10 @@ void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_co
 		int use_pport = (server.tls_cluster &&
 				c->conn && connGetType(c->conn) != CONN_TYPE_TLS);
 		int port = use_pport && n->pport ? n->pport : n->port;
+		if (error_code == CLUSTER_REDIR_ASK)
+			server.stat_cluster_ask_replies++;
+		else
+			server.stat_cluster_moved_replies++;
 		addReplyErrorSds(c,sdscatprintf(sdsempty(),
 					"-%s %d %s:%d",
 					(error_code == CLUSTER_REDIR_ASK) ? "ASK" : "MOVED",
@@ -7630,15 +8527,15 @@ int clusterRedirectBlockedClientIfNeeded(client *c) {
 	return 0;
 }
 
-void shadowWriteCommand(client *c) {
-	robj *key = c->argv[1];
-	robj *val = c->argv[2];
+/* Set 'key' to 'val' in the blocks of its slot. The objects are copied in
+ * the segment, so the caller keeps its references. */
+static void shadowSetKey(client *c, robj *key, robj *val) {
 	robj *allocator_key;
 	robj *allocator_value;
 	int allocated_block;
-	//serverLog(LL_WARNING, "STRATOS RECEIVED SHADOW WRITE COMMAND");
-	//pthread_mutex_lock(&(server.general_db_lock));
 	int hashSlot = keyHashSlot((char *) key->ptr, sdslen(key->ptr));
+
+	pthread_mutex_lock(&(server.lock_slots[hashSlot]));
 	r_allocator_insert_kv(hashSlot,
 			(char *)key->ptr-8, sdslen(key->ptr)+ 8 + 1,
 			(char *)val->ptr-8, sdslen(val->ptr)+ 8 + 1,
@@ -7647,24 +8544,136 @@ void shadowWriteCommand(client *c) {
 			&allocated_block,
 			&allocator_key,
 			&allocator_value);
-	allocator_key->ptr = (char *) allocator_key + allocator_key->data_offset + 8;
-	allocator_value->ptr = (char *) allocator_value + allocator_value->data_offset + 8;
-
-	//TODO IF LOOKUP RETURNS NON NULL VALUE WE HAVE TO ALSO DELETE FROM THE ALLOCATOR THE OLD VALUE
-	//    serverLog(LL_WARNING, "---------------------------------------"); 
-	//    serverLog(LL_WARNING, "STRATOS PTR IS %s, and from the allocator is: %s", (char *) key->ptr, (char *)allocator_key + allocator_key->data_offset + 8);
-	//    serverLog(LL_WARNING, "STRATOS PTR IS %s, and from the allocator is: %s", (char *) val->ptr, (char *)allocator_value + allocator_key->data_offset + 8);
-	//    serverLog(LL_WARNING, "---------------------------------------"); 
+	/* The old K-V stays in the blocks until the slot is compacted. */
 	if (lookupKeyWrite(c->db,key) == NULL) {
 		dbAddNoCopy(c->db, allocator_key, allocator_value);
-		signalModifiedKey(c,c->db,key);
 	} else {
-		dbOverwriteNoFree(c->db, key, val);
-		signalModifiedKey(c,c->db,key);
+		dbOverwriteNoFree(c->db, key, allocator_value);
 	}
+	pthread_mutex_unlock(&(server.lock_slots[hashSlot]));
+	signalModifiedKey(c,c->db,key);
+}
+
+void shadowWriteCommand(client *c) {
+	shadowSetKey(c, c->argv[1], c->argv[2]);
 	addReply(c, shared.ok);
 }
 
+/* SHADOWAPPLY <frame>
+ *
+ * Apply a frame of the writes the donor served while the slot was migrated,
+ * see shadowlog.c. Replies with the number of records applied. */
+void shadowApplyCommand(client *c) {
+	sds frame = c->argv[1]->ptr;
+	size_t len = sdslen(frame), pos = 0;
+	uint32_t count;
+	shadowRecord r;
+	long long applied = 0;
+	int res;
+
+	if (shadowFrameSlot(frame, len, &count) == -1) {
+		addReplyError(c,"Invalid shadow frame");
+		return;
+	}
+	while ((res = shadowFrameNext(frame, len, &pos, &r)) == 1) {
+		robj *key = createObject(OBJ_STRING, sdsnewlen(r.key, r.keylen));
+
+		if (r.op == SHADOWLOG_SET) {
+			robj *val = createObject(OBJ_STRING, sdsnewlen(r.val, r.vallen));
+			shadowSetKey(c, key, val);
+			decrRefCount(val);
+		} else {
+			int slot = keyHashSlot((char *) key->ptr, sdslen(key->ptr)), deleted = 0;
+
+			pthread_mutex_lock(&(server.lock_slots[slot]));
+			if (lookupKeyWrite(c->db,key) != NULL) {
+				dbSyncDeleteNoFree(c->db,key);
+				deleted = 1;
+			}
+			pthread_mutex_unlock(&(server.lock_slots[slot]));
+			if (deleted) signalModifiedKey(c,c->db,key);
+		}
+		decrRefCount(key);
+		applied++;
+	}
+	if (res == -1 || applied != count) {
+		addReplyErrorFormat(c,"Corrupted shadow frame: %lld of %u records applied",
+				applied, count);
+		return;
+	}
+	server.dirty += applied;
+	addReplyLongLong(c, applied);
+}
+
+/* Send the writes logged for the slots args[start..end-1] to the recipient:
+ * all the frames back to back, then the replies are read. Called by the
+ * migration thread once the slots are frozen, so their logs are complete and
+ * the frames are applied after the blocks copied by RDMA. */
+static int clusterSendShadowLog(connection *conn, sds *args, int start, int end) {
+	sds cmds = sdsempty();
+	sds **logs = zcalloc(sizeof(sds *) * (end - start));
+	int *counts = zcalloc(sizeof(int) * (end - start));
+	long long frames = 0, records = 0, bytes = 0;
+	char reply[1024];
+	int ok = 1;
+
+	for (int j = start; j < end; j++) {
+		int count;
+		sds *log = shadowLogTakeFrames(atoi(args[j]), &count);
+
+		logs[j-start] = log;
+		counts[j-start] = count;
+		for (int k = 0; k < count; k++) {
+			uint32_t n;
+
+			shadowFrameSlot(log[k], sdslen(log[k]), &n);
+			cmds = sdscatfmt(cmds, "*2\r\n$11\r\nshadowApply\r\n$%U\r\n",
+					(unsigned long long) sdslen(log[k]));
+			cmds = sdscatsds(cmds, log[k]);
+			cmds = sdscatlen(cmds, "\r\n", 2);
+			bytes += sdslen(log[k]);
+			records += n;
+			frames++;
+			if (sdslen(cmds) >= PROTO_IOBUF_LEN*16) {
+				if (ok && connSyncWrite(conn, cmds, sdslen(cmds), 1000000) != (ssize_t) sdslen(cmds))
+					ok = 0;
+				sdsclear(cmds);
+			}
+		}
+	}
+	if (ok && sdslen(cmds) && connSyncWrite(conn, cmds, sdslen(cmds), 1000000) != (ssize_t) sdslen(cmds))
+		ok = 0;
+	sdsfree(cmds);
+
+	for (long long j = 0; ok && j < frames; j++) {
+		if (connSyncReadLine(conn, reply, sizeof(reply), 10000) <= 0 || reply[0] != ':') {
+			serverLog(LL_WARNING, "Shadow frame not applied by the recipient: %s", reply);
+			ok = 0;
+		}
+	}
+
+	/* The frames of a failed send are kept for the next attempt: applying
+	 * again the post-images that made it is harmless. */
+	for (int j = start; j < end; j++) {
+		if (!ok) {
+			shadowLogRestoreFrames(atoi(args[j]), logs[j-start], counts[j-start]);
+			continue;
+		}
+		for (int k = 0; k < counts[j-start]; k++) sdsfree(logs[j-start][k]);
+		zfree(logs[j-start]);
+	}
+	zfree(logs);
+	zfree(counts);
+	if (!ok) return C_ERR;
+
+	server.stat_migration_shadow_frames += frames;
+	server.stat_migration_shadow_records += records;
+	server.stat_migration_shadow_bytes += bytes;
+	serverLog(LL_NOTICE, "Sent %lld shadow writes in %lld frames (%lld bytes)",
+			records, frames, bytes);
+	return C_OK;
+}
+
 void rdmaDoneAckCommand(client *c) {
 	pthread_mutex_lock(&(server.generic_migration_mutex));
 	server.rdmaDoneAck = 1;
@@ -31,6 +31,19 @@
 #define CLUSTER_REDIR_DOWN_UNBOUND 6  /* -CLUSTERDOWN, unbound slot. */
 #define CLUSTER_REDIR_DOWN_RO_STATE 7 /* -CLUSTERDOWN, allow reads. */
 
+/* Ownership state of a slot, see clusterSlotState(). */
+#define CLUSTER_SLOT_OWNED 0    /* Writes are executed. */
+#define CLUSTER_SLOT_FROZEN 1   /* Being handed over: writes are parked. */
+#define CLUSTER_SLOT_MOVED 2    /* Handed over: commands are redirected. */
+
+/* Phase of the slot migration of this node, see MIGRATION STATUS. */
+#define MIGRATION_PHASE_NONE 0
+#define MIGRATION_PHASE_REGISTER 1  /* Recipient blocks allocated and registered. */
+#define MIGRATION_PHASE_TRANSFER 2  /* Blocks written with RDMA. */
+#define MIGRATION_PHASE_PATCHIN 3   /* Received K-Vs added to the recipient keyspace. */
+#define MIGRATION_PHASE_OWNERSHIP 4 /* Shadow writes and slot hand-off. */
+#define MIGRATION_PHASES 5
+
 struct clusterNode;
 
 /* clusterLink encapsulates everything needed to talk with a remote node. */
@@ -97,7 +110,9 @@ typedef struct clusterLink {
 #define CLUSTERMSG_TYPE_UPDATE 7        /* Another node slots configuration */
 #define CLUSTERMSG_TYPE_MFSTART 8       /* Pause clients for manual failover */
 #define CLUSTERMSG_TYPE_MODULE 9        /* Module cluster API message. */
-#define CLUSTERMSG_TYPE_COUNT 10        /* Total number of message types. */
+#define CLUSTERMSG_TYPE_HANDOFF 10      /* Slots handed over to another node */
+#define CLUSTERMSG_TYPE_HANDOFF_ACK 11  /* Hand-off applied */
+#define CLUSTERMSG_TYPE_COUNT 12        /* Total number of message types. */
 
 /* Flags that a module can set in order to prevent certain Redis Cluster
  * features to be enabled. Useful when implementing a different distributed
@@ -168,8 +183,6 @@ typedef struct clusterState {
     clusterNode *migrating_slots_to[CLUSTER_SLOTS];
     clusterNode *importing_slots_from[CLUSTER_SLOTS];
     clusterNode *slots[CLUSTER_SLOTS];
-    uint64_t slots_keys_count[CLUSTER_SLOTS];
-    rax *slots_to_keys;
     /* The following fields are used to take the slave state on elections. */
     mstime_t failover_auth_time; /* Time of previous or next election. */
     int failover_auth_count;    /* Number of votes received so far. */
@@ -238,6 +251,13 @@ typedef struct {
     unsigned char bulk_data[3]; /* 3 bytes just as placeholder. */
 } clusterMsgModule;
 
+/* HANDOFF and HANDOFF_ACK: the ACK echoes the hand-off it acknowledges. */
+typedef struct {
+    uint64_t id;            /* Hand-off ID, unique for the sender. */
+    char nodename[CLUSTER_NAMELEN]; /* New owner of the slots. */
+    unsigned char slots[CLUSTER_SLOTS/8]; /* Slots bitmap. */
+} clusterMsgDataHandoff;
+
 union clusterMsgData {
     /* PING, MEET and PONG */
     struct {
@@ -264,6 +284,11 @@ union clusterMsgData {
     struct {
         clusterMsgModule msg;
     } module;
+
+    /* HANDOFF and HANDOFF_ACK */
+    struct {
+        clusterMsgDataHandoff msg;
+    } handoff;
 };
 
 #define CLUSTER_PROTO_VER 1 /* Cluster bus protocol version. */
@@ -307,5 +332,20 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
 int clusterRedirectBlockedClientIfNeeded(client *c);
 void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_code);
 unsigned long getClusterConnectionsCount(void);
+int clusterSlotState(int slot);
+uint64_t clusterSlotEpoch(int slot);
+void clusterFreezeSlot(int slot);
+int clusterBeginSlotWrite(int slot);
+void clusterEndSlotWrite(int slot);
+int clusterBeginCommandWrite(client *c);
+void clusterEndCommandWrite(client *c);
+void clusterParkClient(client *c);
+void clusterReleaseParkedClients(void);
+void migrationBegin(int slots);
+void migrationSetPhase(int phase);
+int migrationInProgress(void);
+void migrationRecordCommand(long long duration);
+void migrationStatusCron(void);
+sds genMigrationInfoString(sds info);
 
 #endif /* __CLUSTER_H */
@@ -30,6 +30,7 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "allocator.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -126,6 +127,21 @@ configEnum sanitize_dump_payload_enum[] = {
     {NULL, 0}
 };
 
+configEnum allocator_hugepages_enum[] = {
+    {"no", ALLOCATOR_HUGEPAGES_NO},
+    {"thp", ALLOCATOR_HUGEPAGES_THP},
+    {"2mb", ALLOCATOR_HUGEPAGES_2MB},
+    {"1gb", ALLOCATOR_HUGEPAGES_1GB},
+    {NULL, 0}
+};
+
+configEnum migration_transport_enum[] = {
+    {"rdma", MIGRATION_TRANSPORT_RDMA},
+    {"tcp", MIGRATION_TRANSPORT_TCP},
+    {"shm", MIGRATION_TRANSPORT_SHM},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -2294,6 +2310,13 @@ static int updateSighandlerEnabled(int val, int prev, const char **err) {
     return 1;
 }
 
+static int updateAllocatorBlockPool(long long val, long long prev, const char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    r_allocator_set_block_pool(val);
+    return 1;
+}
+
 static int updateMaxclients(long long val, long long prev, const char **err) {
     /* Try to check if the OS is capable of supporting so many FDs. */
     if (val > prev) {
@@ -2400,6 +2423,7 @@ standardConfig configs[] = {
     createBoolConfig("rdbchecksum", NULL, IMMUTABLE_CONFIG, server.rdb_checksum, 1, NULL, NULL),
     createBoolConfig("daemonize", NULL, IMMUTABLE_CONFIG, server.daemonize, 0, NULL, NULL),
     createBoolConfig("io-threads-do-reads", NULL, IMMUTABLE_CONFIG, server.io_threads_do_reads, 0,NULL, NULL), /* Read + parse from threads? */
+    createBoolConfig("io-threads-exec-slots", NULL, MODIFIABLE_CONFIG, server.io_threads_exec_slots, 0, NULL, NULL), /* Execute GET / SET of owned slots in threads? */
     createBoolConfig("lua-replicate-commands", NULL, MODIFIABLE_CONFIG, server.lua_always_replicate_commands, 1, NULL, NULL),
     createBoolConfig("always-show-logo", NULL, IMMUTABLE_CONFIG, server.always_show_logo, 0, NULL, NULL),
     createBoolConfig("protected-mode", NULL, MODIFIABLE_CONFIG, server.protected_mode, 1, NULL, NULL),
@@ -2430,6 +2454,8 @@ standardConfig configs[] = {
     createBoolConfig("replica-ignore-maxmemory", "slave-ignore-maxmemory", MODIFIABLE_CONFIG, server.repl_slave_ignore_maxmemory, 1, NULL, NULL),
     createBoolConfig("jemalloc-bg-thread", NULL, MODIFIABLE_CONFIG, server.jemalloc_bg_thread, 1, NULL, updateJemallocBgThread),
     createBoolConfig("activedefrag", NULL, MODIFIABLE_CONFIG, server.active_defrag_enabled, 0, isValidActiveDefrag, NULL),
+    createBoolConfig("allocator-compact", NULL, MODIFIABLE_CONFIG, server.allocator_compact, 0, NULL, NULL),
+    createBoolConfig("allocator-evict-blocks", NULL, MODIFIABLE_CONFIG, server.allocator_evict_blocks, 1, NULL, NULL),
     createBoolConfig("syslog-enabled", NULL, IMMUTABLE_CONFIG, server.syslog_enabled, 0, NULL, NULL),
     createBoolConfig("cluster-enabled", NULL, IMMUTABLE_CONFIG, server.cluster_enabled, 0, NULL, NULL),
     createBoolConfig("appendonly", NULL, MODIFIABLE_CONFIG, server.aof_enabled, 0, NULL, updateAppendonly),
@@ -2472,6 +2498,8 @@ standardConfig configs[] = {
     createEnumConfig("oom-score-adj", NULL, MODIFIABLE_CONFIG, oom_score_adj_enum, server.oom_score_adj, OOM_SCORE_ADJ_NO, NULL, updateOOMScoreAdj),
     createEnumConfig("acl-pubsub-default", NULL, MODIFIABLE_CONFIG, acl_pubsub_default_enum, server.acl_pubsub_default, USER_FLAG_ALLCHANNELS, NULL, NULL),
     createEnumConfig("sanitize-dump-payload", NULL, MODIFIABLE_CONFIG, sanitize_dump_payload_enum, server.sanitize_dump_payload, SANITIZE_DUMP_NO, NULL, NULL),
+    createEnumConfig("allocator-arena-hugepages", NULL, IMMUTABLE_CONFIG, allocator_hugepages_enum, server.allocator_arena_hugepages, ALLOCATOR_HUGEPAGES_THP, NULL, NULL),
+    createEnumConfig("migration-transport", NULL, MODIFIABLE_CONFIG, migration_transport_enum, server.migration_transport, MIGRATION_TRANSPORT_RDMA, NULL, NULL),
 
     /* Integer configs */
     createIntConfig("databases", NULL, IMMUTABLE_CONFIG, 1, INT_MAX, server.dbnum, 16, INTEGER_CONFIG, NULL, NULL),
@@ -2507,6 +2535,17 @@ standardConfig configs[] = {
     createIntConfig("hz", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.config_hz, CONFIG_DEFAULT_HZ, INTEGER_CONFIG, NULL, updateHZ),
     createIntConfig("min-replicas-to-write", "min-slaves-to-write", MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_min_slaves_to_write, 0, INTEGER_CONFIG, NULL, updateGoodSlaves),
     createIntConfig("min-replicas-max-lag", "min-slaves-max-lag", MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_min_slaves_max_lag, 10, INTEGER_CONFIG, NULL, updateGoodSlaves),
+    createIntConfig("allocator-arena-numa-node", NULL, IMMUTABLE_CONFIG, -1, 1023, server.allocator_arena_numa_node, -1, INTEGER_CONFIG, NULL, NULL), /* -1: don't bind */
+    createIntConfig("allocator-arena-prefault-blocks", NULL, IMMUTABLE_CONFIG, 0, INT_MAX, server.allocator_arena_prefault_blocks, 0, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("allocator-compact-threshold", NULL, MODIFIABLE_CONFIG, 1, 100, server.allocator_compact_threshold, 50, INTEGER_CONFIG, NULL, NULL), /* Default: evacuate blocks less than half used */
+    createIntConfig("allocator-compact-cycle-max", NULL, MODIFIABLE_CONFIG, 1, 99, server.allocator_compact_cycle_max, 10, INTEGER_CONFIG, NULL, NULL), /* Default: 10% CPU max */
+    createBoolConfig("migration-lazy-index", NULL, MODIFIABLE_CONFIG, server.migration_lazy_index, 0, NULL, NULL),
+    createIntConfig("migration-rdma-window", NULL, MODIFIABLE_CONFIG, 1, 4096, server.migration_rdma_window, RDMA_ENGINE_DEFAULT_WINDOW, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("migration-rdma-signal-every", NULL, MODIFIABLE_CONFIG, 1, 4096, server.migration_rdma_signal_every, RDMA_ENGINE_DEFAULT_SIGNAL_EVERY, INTEGER_CONFIG, NULL, NULL),
+    createUIntConfig("allocator-block-pool", NULL, MODIFIABLE_CONFIG, 0, UINT_MAX, server.allocator_block_pool, 0, INTEGER_CONFIG, NULL, updateAllocatorBlockPool), /* Default: free released slot blocks */
+    createIntConfig("migration-index-threads", NULL, MODIFIABLE_CONFIG, 1, 64, server.migration_index_threads, 4, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("migration-chunk-slots", NULL, MODIFIABLE_CONFIG, 1, CLUSTER_SLOTS, server.migration_chunk_slots, 4098, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("migration-precopy-rounds", NULL, MODIFIABLE_CONFIG, 0, 64, server.migration_precopy_rounds, 0, INTEGER_CONFIG, NULL, NULL), /* Default: lock the slot blocks before they are sent */
 
     /* Unsigned int configs */
     createUIntConfig("maxclients", NULL, MODIFIABLE_CONFIG, 1, UINT_MAX, server.maxclients, 10000, INTEGER_CONFIG, NULL, updateMaxclients),
@@ -2533,11 +2572,18 @@ standardConfig configs[] = {
     createSizeTConfig("set-max-intset-entries", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.set_max_intset_entries, 512, INTEGER_CONFIG, NULL, NULL),
     createSizeTConfig("zset-max-ziplist-entries", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.zset_max_ziplist_entries, 128, INTEGER_CONFIG, NULL, NULL),
     createSizeTConfig("active-defrag-ignore-bytes", NULL, MODIFIABLE_CONFIG, 1, LLONG_MAX, server.active_defrag_ignore_bytes, 100<<20, MEMORY_CONFIG, NULL, NULL), /* Default: don't defrag if frag overhead is below 100mb */
+    createSizeTConfig("allocator-arena-size", NULL, IMMUTABLE_CONFIG, 0, LLONG_MAX, server.allocator_arena_size, 0, MEMORY_CONFIG, NULL, NULL), /* Default: malloc each slot block */
+    createSizeTConfig("allocator-block-size", NULL, IMMUTABLE_CONFIG, 1024, 1024*1024*1024, server.allocator_block_size, BLOCK_SIZE_BYTES, MEMORY_CONFIG, NULL, NULL), /* Max slot block size, larger K-Vs get an overflow block */
+    createSizeTConfig("migration-rdma-region-chunk", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.migration_rdma_region_chunk, 0, MEMORY_CONFIG, NULL, NULL), /* Default: register arena blocks one by one */
+    createSizeTConfig("migration-chunk-bytes", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.migration_chunk_bytes, 1024LL*1024*1024, MEMORY_CONFIG, NULL, NULL),
+    createSizeTConfig("migration-precopy-threshold", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.migration_precopy_threshold, 4*1024*1024, MEMORY_CONFIG, NULL, NULL),
+    createSizeTConfig("allocator-block-min-size", NULL, IMMUTABLE_CONFIG, 1024, 1024*1024*1024, server.allocator_block_min_size, 64*1024, MEMORY_CONFIG, NULL, NULL), /* First block of a slot, blocks grow up to allocator-block-size */
     createSizeTConfig("hash-max-ziplist-value", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.hash_max_ziplist_value, 64, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("stream-node-max-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.stream_node_max_bytes, 4096, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("zset-max-ziplist-value", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.zset_max_ziplist_value, 64, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("hll-sparse-max-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.hll_sparse_max_bytes, 3000, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("tracking-table-max-keys", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.tracking_table_max_keys, 1000000, INTEGER_CONFIG, NULL, NULL), /* Default: 1 million keys max. */
+    createSizeTConfig("reply-zero-copy-threshold", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.reply_zero_copy_threshold, 512, MEMORY_CONFIG, NULL, NULL), /* Smaller values are copied to the output buffers. */
     createSizeTConfig("client-query-buffer-limit", NULL, MODIFIABLE_CONFIG, 1024*1024, LONG_MAX, server.client_max_querybuf_len, 1024*1024*1024, MEMORY_CONFIG, NULL, NULL), /* Default: 1GB max query buffer. */
 
     /* Other configs */
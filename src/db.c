@@ -40,8 +40,6 @@
 /* Database backup. */
 struct dbBackup {
 	redisDb *dbarray;
-	rax *slots_to_keys;
-	uint64_t slots_keys_count[CLUSTER_SLOTS];
 };
 
 /*-----------------------------------------------------------------------------
@@ -66,9 +64,16 @@ void updateLFU(robj *val) {
 robj *lookupKey(redisDb *db, robj *key, int flags) {
 
 	dictEntry *de = dictFind(db->dict,key->ptr);
+	/* The key may be in a migrated slot that is not fully indexed yet. */
+	if (!de && slotIndexPromoteKey(db->dict,key->ptr))
+		de = dictFind(db->dict,key->ptr);
 	if (de) {
 		robj *val = dictGetVal(de);
 
+		/* Values stored in slot blocks only carry the offset of their data,
+		 * the pointer is derived here so migrated blocks need no patching. */
+		segment_object_ptr(val);
+
 		/* Update the access time for the ageing algorithm.
 		 * Don't do it if we have a saving child, as this will trigger
 		 * a copy on write madness. */
@@ -207,14 +212,12 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 	int retval = dictAdd(db->dict, copy, val);
 	serverAssertWithInfo(NULL,key,retval == DICT_OK);
 	signalKeyAsReady(db, key, val->type);
-	if (server.cluster_enabled) slotToKeyAdd(key->ptr);
 }
 
 void dbAddNoCopy(redisDb *db, robj *key, robj *val) {
 	int retval = dictAdd(db->dict, key->ptr, val);
 	serverAssertWithInfo(NULL,key,retval == DICT_OK);
 	signalKeyAsReady(db, key, val->type);
-	if (server.cluster_enabled) slotToKeyAdd(key->ptr);
 }
 
 /* This is a special version of dbAdd() that is used only when loading
@@ -233,7 +236,6 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
 	//	if (retval != DICT_OK) {
 	//		return 0;
 	//	}
-	//if (server.cluster_enabled) slotToKeyAdd(key);
 	//return 1;
 }
 
@@ -349,8 +351,6 @@ void genericSetKey(client *c, redisDb *db, robj *key, robj *val, int keepttl, in
 		///serverLog(LL_WARNING, "STRATOS DICTIONARY SIZE:%d", server.db[0].dict->ht[0].size);
 		//serverLog(LL_WARNING, "STRATOS DICTIONARY SIZE 2:%d", server.db[0].dict->ht[1].size);
 		//ALLOCATOR DEBUG STOP
-		allocator_key->ptr = (char *) allocator_key + allocator_key->data_offset + 8;
-		allocator_value->ptr = (char *) allocator_value + allocator_value->data_offset + 8;
 		//serverLog(LL_WARNING, "STRATOS PTR IS %s, and from the allocator is: %s", (char *) _key->ptr, (char *)allocator_key + allocator_key->data_offset + 8);
 		//serverLog(LL_WARNING, "STRATOS PTR IS %s, and from the allocator is: %s", (char *) _value->ptr, (char *)allocator_value + allocator_value->data_offset + 8);
 		dbAddNoCopy(db, allocator_key, allocator_value);
@@ -449,13 +449,14 @@ int dbSyncDelete(redisDb *db, robj *key) {
 	/* Deleting an entry from the expires dict will not free the sds of
 	 * the key, because it is shared with the main dictionary. */
 	if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+	/* Move a pending key to the dict first, or it would be added back. */
+	slotIndexPromoteKey(db->dict,key->ptr);
 	dictEntry *de = dictUnlink(db->dict,key->ptr);
 	if (de) {
 		robj *val = dictGetVal(de);
 		/* Tells the module that the key has been unlinked from the database. */
 		moduleNotifyKeyUnlink(key,val);
 		dictFreeUnlinkedEntry(db->dict,de);
-		//if (server.cluster_enabled) slotToKeyDel(key->ptr);
 		return 1;
 	} else {
 		return 0;
@@ -467,6 +468,8 @@ int dbSyncDeleteNoFree(redisDb *db, robj *key) {
 	/* Deleting an entry from the expires dict will not free the sds of
 	 * the key, because it is shared with the main dictionary. */
 	if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+	/* Move a pending key to the dict first, or it would be added back. */
+	slotIndexPromoteKey(db->dict,key->ptr);
 	dictEntry *de = dictUnlink(db->dict,key->ptr);
 	if (de) {
 		//serverLog(LL_WARNING, "ENTRY FOUND FOR KEY %s", key->ptr);
@@ -475,7 +478,6 @@ int dbSyncDeleteNoFree(redisDb *db, robj *key) {
 		moduleNotifyKeyUnlink(key,val);
 		dictFreeUnlinkedEntry(db->dict,de);
 		//zfree(de);
-		if (server.cluster_enabled) slotToKeyDel(key->ptr);
 		return 1;
 	} else {
 		serverLog(LL_WARNING, "ENTRY NOT FOUND FOR KEY %s", (char *)key->ptr);
@@ -546,6 +548,10 @@ long long emptyDbStructure(redisDb *dbarray, int dbnum, int async,
 		startdb = enddb = dbnum;
 	}
 
+	/* Keys of migrated slots not indexed yet would be added to the
+	 * emptied dict. */
+	if (dbarray == server.db) slotIndexDiscardPending();
+
 	for (int j = startdb; j <= enddb; j++) {
 		removed += dictSize(dbarray[j].dict);
 		if (async) {
@@ -599,11 +605,6 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
 	/* Empty redis database structure. */
 	removed = emptyDbStructure(server.db, dbnum, async, callback);
 
-	/* Flush slots to keys map if enable cluster, we can flush entire
-	 * slots to keys map whatever dbnum because only support one DB
-	 * in cluster mode. */
-	if (server.cluster_enabled) slotToKeyFlush(async);
-
 	if (dbnum == -1) flushSlaveKeysWithExpireList();
 
 	/* Also fire the end event. Note that this event will fire almost
@@ -624,20 +625,10 @@ dbBackup *backupDb(void) {
 	backup->dbarray = zmalloc(sizeof(redisDb)*server.dbnum);
 	for (int i=0; i<server.dbnum; i++) {
 		backup->dbarray[i] = server.db[i];
-		server.db[i].dict = dictCreate(&dbDictType,NULL);
+		server.db[i].dict = createKeyspace();
 		server.db[i].expires = dictCreate(&dbExpiresDictType,NULL);
 	}
 
-	/* Backup cluster slots to keys map if enable cluster. */
-	if (server.cluster_enabled) {
-		backup->slots_to_keys = server.cluster->slots_to_keys;
-		memcpy(backup->slots_keys_count, server.cluster->slots_keys_count,
-				sizeof(server.cluster->slots_keys_count));
-		server.cluster->slots_to_keys = raxNew();
-		memset(server.cluster->slots_keys_count, 0,
-				sizeof(server.cluster->slots_keys_count));
-	}
-
 	moduleFireServerEvent(REDISMODULE_EVENT_REPL_BACKUP,
 			REDISMODULE_SUBEVENT_REPL_BACKUP_CREATE,
 			NULL);
@@ -657,9 +648,6 @@ void discardDbBackup(dbBackup *buckup, int flags, void(callback)(void*)) {
 		dictRelease(buckup->dbarray[i].expires);
 	}
 
-	/* Release slots to keys map backup if enable cluster. */
-	if (server.cluster_enabled) freeSlotsToKeysMap(buckup->slots_to_keys, async);
-
 	/* Release buckup. */
 	zfree(buckup->dbarray);
 	zfree(buckup);
@@ -683,15 +671,6 @@ void restoreDbBackup(dbBackup *buckup) {
 		server.db[i] = buckup->dbarray[i];
 	}
 
-	/* Restore slots to keys map backup if enable cluster. */
-	if (server.cluster_enabled) {
-		serverAssert(server.cluster->slots_to_keys->numele == 0);
-		raxFree(server.cluster->slots_to_keys);
-		server.cluster->slots_to_keys = buckup->slots_to_keys;
-		memcpy(server.cluster->slots_keys_count, buckup->slots_keys_count,
-				sizeof(server.cluster->slots_keys_count));
-	}
-
 	/* Release buckup. */
 	zfree(buckup->dbarray);
 	zfree(buckup);
@@ -2086,124 +2065,73 @@ int xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysResult
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
-void slotToKeyUpdateKey(sds key, int add) {
-//	size_t keylen = sdslen(key);
-//	unsigned int hashslot = keyHashSlot(key,keylen);
-//	unsigned char buf[64];
-//	unsigned char *indexed = buf;
-//
-//	server.cluster->slots_keys_count[hashslot] += add ? 1 : -1;
-//	if (keylen+2 > 64) indexed = zmalloc(keylen+2);
-//	indexed[0] = (hashslot >> 8) & 0xff;
-//	indexed[1] = hashslot & 0xff;
-//	memcpy(indexed+2,key,keylen);
-//	if (add) {
-//		raxInsert(server.cluster->slots_to_keys,indexed,keylen+2,NULL,NULL);
-//	} else {
-//		raxRemove(server.cluster->slots_to_keys,indexed,keylen+2,NULL);
-//	}
-//	if (indexed != buf) zfree(indexed);
-}
-
-void slotToKeyAdd(sds key) {
-	slotToKeyUpdateKey(key,1);
-}
-
-void slotToKeyDel(sds key) {
-	slotToKeyUpdateKey(key,0);
-}
-
-/* Release the radix tree mapping Redis Cluster keys to slots. If 'async'
- * is true, we release it asynchronously. */
-void freeSlotsToKeysMap(rax *rt, int async) {
-	if (async) {
-		freeSlotsToKeysMapAsync(rt);
-	} else {
-		raxFree(rt);
-	}
-}
-
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one and
- * freeing the old one. */
-void slotToKeyFlush(int async) {
-	rax *old = server.cluster->slots_to_keys;
+ * understand if we have keys for a given hash slot.
+ *
+ * In cluster mode the keyspace is a dict sliced by hash slot, so the keys of
+ * a slot are the keys of its slice: no other index has to be kept in sync
+ * with the keyspace, and dropping a slot costs the keys of the slot. */
 
-	server.cluster->slots_to_keys = raxNew();
-	memset(server.cluster->slots_keys_count,0,
-			sizeof(server.cluster->slots_keys_count));
-	freeSlotsToKeysMap(old, async);
+/* Create an empty keyspace: a dict per hash slot in cluster mode. */
+dict *createKeyspace(void) {
+	if (server.cluster_enabled)
+		return dictCreateSliced(&dbDictType,NULL,CLUSTER_SLOTS);
+	return dictCreate(&dbDictType,NULL);
 }
 
 /* Populate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-	raxIterator iter;
+	dict *slice = dictGetSlice(server.db[0].dict,hashslot,0);
+	dictIterator *di;
+	dictEntry *de;
 	int j = 0;
-	unsigned char indexed[2];
 
-	indexed[0] = (hashslot >> 8) & 0xff;
-	indexed[1] = hashslot & 0xff;
-	raxStart(&iter,server.cluster->slots_to_keys);
-	raxSeek(&iter,">=",indexed,2);
-	while(count-- && raxNext(&iter)) {
-		if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-		keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
+	if (slice == NULL) return 0;
+	di = dictGetIterator(slice);
+	while(count-- && (de = dictNext(di)) != NULL) {
+		sds key = dictGetKey(de);
+		keys[j++] = createStringObject(key,sdslen(key));
 	}
-	raxStop(&iter);
+	dictReleaseIterator(di);
 	return j;
 }
 
-/* Remove all the keys in the specified hash slot.
- * The number of removed items is returned. */
-unsigned int delKeysInSlot(unsigned int hashslot) {
-	raxIterator iter;
+/* Remove all the keys in the specified hash slot, deleting them with
+ * 'delfn'. The number of removed items is returned. */
+static unsigned int delKeysInSlotWith(unsigned int hashslot,
+		int (*delfn)(redisDb *db, robj *key))
+{
+	dict *slice = dictGetSlice(server.db[0].dict,hashslot,0);
+	dictIterator *di;
+	dictEntry *de;
 	int j = 0;
-	unsigned char indexed[2];
-
-	indexed[0] = (hashslot >> 8) & 0xff;
-	indexed[1] = hashslot & 0xff;
-	raxStart(&iter,server.cluster->slots_to_keys);
-	while(server.cluster->slots_keys_count[hashslot]) {
-		raxSeek(&iter,">=",indexed,2);
-		raxNext(&iter);
 
-		robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
-		dbDelete(&server.db[0],key);
+	if (slice == NULL) return 0;
+	di = dictGetSafeIterator(slice);
+	while((de = dictNext(di)) != NULL) {
+		robj key;
 
-		decrRefCount(key);
+		initStaticStringObject(key,dictGetKey(de));
+		delfn(&server.db[0],&key);
 		j++;
 	}
-	raxStop(&iter);
+	dictReleaseIterator(di);
 	return j;
 }
 
+unsigned int delKeysInSlot(unsigned int hashslot) {
+	return delKeysInSlotWith(hashslot,dbDelete);
+}
 
+/* Like delKeysInSlot(), but the K-Vs are left in the allocator blocks of the
+ * slot, for the slots migrated by RDMA. */
 unsigned int delKeysInSlotAllocator(unsigned int hashslot) {
-	raxIterator iter;
-	int j = 0;
-	unsigned char indexed[2];
-
-	indexed[0] = (hashslot >> 8) & 0xff;
-	indexed[1] = hashslot & 0xff;
-	raxStart(&iter,server.cluster->slots_to_keys);
-	while(server.cluster->slots_keys_count[hashslot]) {
-		raxSeek(&iter,">=",indexed,2);
-		raxNext(&iter);
-
-		robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
-		//serverLog(LL_WARNING, "STRATOS DELETING KEY %s", key->ptr);
-		dbSyncDeleteNoFree(&server.db[0], key);
-		//dbDelete(&server.db[0],key);
-
-		//decrRefCount(key);
-		j++;
-	}
-	raxStop(&iter);
-	return j;
+	return delKeysInSlotWith(hashslot,dbSyncDeleteNoFree);
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-	return server.cluster->slots_keys_count[hashslot];
+	dict *slice = dictGetSlice(server.db[0].dict,hashslot,0);
+
+	return slice ? dictSize(slice) : 0;
 }
@@ -657,7 +657,8 @@ NULL
         if (getPositiveLongFromObjectOrReply(c, c->argv[2], &keys, NULL) != C_OK)
             return;
 
-        dictExpand(c->db->dict,keys);
+        /* The slices of the keyspace of cluster mode grow on their own. */
+        if (!dictIsSliced(c->db->dict)) dictExpand(c->db->dict,keys);
         long valsize = 0;
         if ( c->argc == 5 && getPositiveLongFromObjectOrReply(c, c->argv[4], &valsize, NULL) != C_OK ) 
             return;
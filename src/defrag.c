@@ -34,6 +34,8 @@
  */
 
 #include "server.h"
+#include "cluster.h"
+#include "allocator.h"
 #include <time.h>
 #include <assert.h>
 #include <stddef.h>
@@ -1213,3 +1215,103 @@ robj *activeDefragStringOb(robj *ob, long *defragged) {
 }
 
 #endif
+
+/* -----------------------------------------------------------------------------
+ * Slot blocks compaction
+ * -------------------------------------------------------------------------- */
+
+/* Deletes free segments of the slot allocator, but a block is released only
+ * once all of its segments are free. With overwrite heavy workloads slots keep
+ * many half empty blocks that waste memory and that a migration still has to
+ * register and transfer. slotCompactCycle() incrementally moves the K-Vs of
+ * the sparsest blocks into the free space of the other blocks of their slot,
+ * in the same fashion activeDefragCycle() reallocates keys. */
+
+/* The K-V moved from old_key to new_key: point the dictEntry (and the expire
+ * entry that shares its key) at the new copies of the key and value. */
+static void slotCompactRelocate(int slot, robj *old_key, robj *new_key, void *privdata) {
+    redisDb *db = privdata;
+    robj *old_val = segment_value_meta(old_key);
+    robj *new_val = segment_value_meta(new_key);
+    sds old_keystr = segment_object_data(old_key);
+    sds new_keystr = segment_object_data(new_key);
+    dictEntry *de;
+    UNUSED(slot);
+
+    de = dictFind(db->dict, old_keystr);
+    if (de && dictGetKey(de) == old_keystr) {
+        de->key = new_keystr;
+        if (dictGetVal(de) == old_val) de->v.val = new_val;
+    }
+    if (dictSize(db->expires)) {
+        de = dictFind(db->expires, old_keystr);
+        if (de && dictGetKey(de) == old_keystr) de->key = new_keystr;
+    }
+}
+
+/* Slots being migrated are left alone: their blocks are registered for RDMA
+ * (donor) or are being written and indexed (recipient). */
+int slotCompactIsMigrating(int slot) {
+    if (slotIndexIsPending(slot)) return 1;
+    if (!server.cluster_enabled) return 0;
+    return server.cluster->migrating_slots_to[slot] != NULL ||
+           server.cluster->importing_slots_from[slot] != NULL;
+}
+
+/* Moves the K-Vs of the sparsest block of the slot (used less than
+ * allocator-compact-threshold percent) into the other blocks of the slot and
+ * releases it. Returns the number of released blocks (0 or 1). */
+int slotCompactSlot(int slot) {
+    int released;
+    pthread_mutex_lock(&server.lock_slots[slot]);
+    long moved = r_allocator_compact_slot(slot, server.allocator_compact_threshold,
+                                          slotCompactRelocate, &server.db[0], &released);
+    pthread_mutex_unlock(&server.lock_slots[slot]);
+
+    if (moved > 0) server.stat_allocator_compact_moved += moved;
+    server.stat_allocator_compact_released += released;
+    return released;
+}
+
+/* Perform incremental compaction work from the serverCron, using at most
+ * allocator-compact-cycle-max percent of the CPU. */
+void slotCompactCycle(void) {
+    static int cursor = 0;
+    long long start, timelimit, endtime;
+    mstime_t latency;
+    int scanned = 0;
+
+    if (!server.allocator_compact) return;
+    if (hasActiveChildProcess())
+        return; /* Moving keys while there's a fork will just do copy-on-write. */
+
+    start = ustime();
+    timelimit = 1000000*server.allocator_compact_cycle_max/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    endtime = start + timelimit;
+    latencyStartMonitor(latency);
+
+    while (scanned < CLUSTER_SLOTS && ustime() < endtime) {
+        int slot = cursor;
+        slot_usage_t usage = r_allocator_get_slot_usage(slot);
+
+        /* Not even the smallest block could be released. */
+        if (usage.blocks < 2 ||
+            usage.bytes_blocks - usage.bytes_used < server.allocator_block_min_size ||
+            slotCompactIsMigrating(slot))
+        {
+            cursor = (cursor + 1) % CLUSTER_SLOTS;
+            scanned++;
+            continue;
+        }
+
+        /* Stay on the slot while there are blocks to release. */
+        if (!slotCompactSlot(slot)) {
+            cursor = (cursor + 1) % CLUSTER_SLOTS;
+            scanned++;
+        }
+    }
+
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("allocator-compact-cycle",latency);
+}
@@ -42,16 +42,36 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "dict.h"
 #include "zmalloc.h"
 #include "redisassert.h"
 
-// Migration variables
-static FILE *log_file;
-static pthread_mutex_t* general_dict_lock; 
-static pthread_mutex_t* migration_dict_locks; 
-static dict *target_db;
+/* A dict is used by a single thread, except the keyspace while the keys of
+ * migrated slots are added by threads running next to the main thread. After
+ * dictEnableConcurrency() every access to the buckets of a dict takes the
+ * lock of a stripe, out of DICT_LOCK_STRIPES locks shared by all the dicts.
+ * The stripe of a bucket is its index modulo DICT_LOCK_STRIPES: when both
+ * tables have at least DICT_LOCK_STRIPES buckets a key maps to the same
+ * stripe in both of them. A dict with a smaller table uses a single stripe
+ * for all its buckets, 0 or for a slice the stripe of its range of slices:
+ * threads using different ranges of slices, like the I/O threads each in
+ * the slots it owns, neither wait for each other nor share a stripe.
+ * The tables are only resized, and a finished rehash only swaps them, while
+ * holding every stripe, or just the stripe of the dict if it keeps using a
+ * single one (see _dictLockTables()). A rehash step moves a bucket of the old
+ * table holding its stripe, which is also the stripe of the buckets of the
+ * new table its keys go to. Dicts that are not concurrent never take a lock,
+ * the slices of a sliced dict are concurrent when it is. */
+#define DICT_LOCK_STRIPES 1024
+
+typedef struct dictLockStripe {
+	pthread_mutex_t lock;
+} __attribute__((aligned(64))) dictLockStripe;
+
+static dictLockStripe dict_lock_stripes[DICT_LOCK_STRIPES];
+static pthread_once_t dict_lock_stripes_once = PTHREAD_ONCE_INIT;
 
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
@@ -67,11 +87,96 @@ static unsigned int dict_force_resize_ratio = 5;
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
-static unsigned long _dictNextPower(unsigned long size);
+static unsigned long _dictNextPower(dict *d, unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
 static int _dictInitBig(dict *ht, dictType *type, void *privDataPtr);
 
+/* -------------------------- concurrent access ----------------------------- */
+
+static void _dictInitLockStripes(void) {
+	for (int j = 0; j < DICT_LOCK_STRIPES; j++)
+		pthread_mutex_init(&dict_lock_stripes[j].lock, NULL);
+}
+
+static int _dictConcurrent(dict *d) {
+	return __atomic_load_n(d->parent ? &d->parent->concurrent : &d->concurrent, __ATOMIC_RELAXED);
+}
+
+/* The stripe of all the buckets of a dict with a small table. */
+static unsigned long _dictOwnStripe(dict *d) {
+	if (d->slice < 0 || d->parent == NULL) return 0;
+	return (unsigned long)d->slice * DICT_LOCK_STRIPES / d->parent->slices->count;
+}
+
+static int _dictSingleStripe(unsigned long size0, unsigned long size1) {
+	return size0 < DICT_LOCK_STRIPES || (size1 != 0 && size1 < DICT_LOCK_STRIPES);
+}
+
+static unsigned long _dictStripe(dict *d, uint64_t hash) {
+	if (_dictSingleStripe(d->ht[0].size, d->ht[1].size)) return _dictOwnStripe(d);
+	return hash & (DICT_LOCK_STRIPES-1);
+}
+
+/* Lock the stripe of the buckets of 'hash' (or of a bucket index) if the
+ * dict is concurrent. Returns the lock to pass to _dictUnlock(), NULL if no
+ * lock was needed. */
+static pthread_mutex_t *_dictLock(dict *d, uint64_t hash) {
+	if (!_dictConcurrent(d)) return NULL;
+	while (1) {
+		unsigned long stripe = _dictStripe(d, hash);
+		pthread_mutex_t *lock = &dict_lock_stripes[stripe].lock;
+
+		pthread_mutex_lock(lock);
+		/* The tables may have been resized while we were waiting. */
+		if (_dictStripe(d, hash) == stripe) return lock;
+		pthread_mutex_unlock(lock);
+	}
+}
+
+static void _dictUnlock(pthread_mutex_t *lock) {
+	if (lock) pthread_mutex_unlock(lock);
+}
+
+#define DICT_UNLOCKED 0
+#define DICT_LOCKED_OWN 1
+#define DICT_LOCKED_ALL 2
+
+/* Lock a concurrent dict before creating a table of 'size' buckets, or
+ * swapping the tables at the end of a rehash if 'size' is 0. If all its
+ * buckets use the stripe of the dict before and after the change, only that
+ * stripe is locked, otherwise every stripe is. Returns what to pass to
+ * _dictUnlockTables(). */
+static int _dictLockTables(dict *d, unsigned long size) {
+	pthread_mutex_t *own;
+	int single;
+
+	if (!_dictConcurrent(d)) return DICT_UNLOCKED;
+	own = &dict_lock_stripes[_dictOwnStripe(d)].lock;
+	pthread_mutex_lock(own);
+	/* Holding the stripe of the dict the sizes can't change under us while
+	 * it uses a single stripe. */
+	single = _dictSingleStripe(d->ht[0].size, d->ht[1].size);
+	if (size == 0)
+		single = single && d->ht[1].size < DICT_LOCK_STRIPES;
+	else if (d->ht[0].table == NULL)
+		single = single && size < DICT_LOCK_STRIPES;
+	if (single) return DICT_LOCKED_OWN;
+	pthread_mutex_unlock(own);
+	for (int j = 0; j < DICT_LOCK_STRIPES; j++)
+		pthread_mutex_lock(&dict_lock_stripes[j].lock);
+	return DICT_LOCKED_ALL;
+}
+
+static void _dictUnlockTables(dict *d, int locked) {
+	if (locked == DICT_LOCKED_OWN) {
+		pthread_mutex_unlock(&dict_lock_stripes[_dictOwnStripe(d)].lock);
+	} else if (locked == DICT_LOCKED_ALL) {
+		for (int j = DICT_LOCK_STRIPES-1; j >= 0; j--)
+			pthread_mutex_unlock(&dict_lock_stripes[j].lock);
+	}
+}
+
 /* -------------------------- hash functions -------------------------------- */
 
 static uint8_t dict_hash_function_seed[16];
@@ -110,46 +215,12 @@ static void _dictReset(dictht *ht)
 	ht->used = 0;
 }
 
-
-void dictInitLocks(){
-	
-	if(migration_dict_locks == NULL){
-		if (pthread_mutex_init(&general_dict_lock, NULL) != 0) {
-			
-		}
-		unsigned long numLocks = DICT_HT_BIG_INITIAL_SIZE;
-		migration_dict_locks = (pthread_mutex_t *) zmalloc(numLocks * sizeof(pthread_mutex_t));
-		for (unsigned long i = 0; i < numLocks; i++) {
-			if (pthread_mutex_init(&migration_dict_locks[i], NULL) != 0) {
-				
-			}
-		}
-
-
-	}
-}
-
 /* Create a new hash table */
 dict *dictCreate(dictType *type,
 		void *privDataPtr)
 {
-
 	dict *d = zmalloc(sizeof(*d));
 
-	if(migration_dict_locks == NULL){
-		if (pthread_mutex_init(&general_dict_lock, NULL) != 0) {
-			
-		}
-		unsigned long numLocks = 67108864;
-		migration_dict_locks = (pthread_mutex_t *) zmalloc(numLocks * sizeof(pthread_mutex_t));
-		for (unsigned long i = 0; i < numLocks; i++) {
-			if (pthread_mutex_init(&migration_dict_locks[i], NULL) != 0) {
-				
-			}
-		}
-
-
-	}
 	_dictInit(d,type,privDataPtr);
 	return d;
 }
@@ -157,25 +228,127 @@ dict *dictCreate(dictType *type,
 dict *dictCreateBig(dictType *type,
 		void *privDataPtr)
 {
-
 	dict *d = zmalloc(sizeof(*d));
 
-	if(migration_dict_locks == NULL){
-		if (pthread_mutex_init(&general_dict_lock, NULL) != 0) {
-			
-		}
-		unsigned long numLocks = 67108864;
-		migration_dict_locks = (pthread_mutex_t *) zmalloc(numLocks * sizeof(pthread_mutex_t));
-		for (unsigned long i = 0; i < numLocks; i++) {
-			if (pthread_mutex_init(&migration_dict_locks[i], NULL) != 0) {
-				
-			}
-		}
+	_dictInitBig(d,type,privDataPtr);
+	return d;
+}
 
+/* Create a dict split in 'slices' independent tables, 'slices' being a power
+ * of two. Every key goes in the table of its slice, type->keySlice(key), that
+ * is created with its first key and resized on its own. The dict API works
+ * across the slices: the iterators and dictScan() visit them in order, the
+ * random keys are picked fairly across them. dictGetSlice() gives access to
+ * the dict of a single slice. */
+dict *dictCreateSliced(dictType *type, void *privDataPtr, int slices)
+{
+	dict *d = dictCreate(type,privDataPtr);
+	dictSlices *sl = zmalloc(sizeof(*sl));
+
+	assert(type->keySlice != NULL && slices > 0 && (slices & (slices-1)) == 0);
+	sl->d = zcalloc(sizeof(dict*)*slices);
+	sl->count = slices;
+	sl->bits = 0;
+	while ((1 << sl->bits) < slices) sl->bits++;
+	sl->tree = zcalloc(sizeof(long long)*(slices+1));
+	sl->tree_stale = 0;
+	sl->rehash_next = 0;
+	d->slices = sl;
+	return d;
+}
 
+/* Returns the dict of the slice 'slice' of a sliced dict, creating it if
+ * 'create' is set, otherwise NULL if the slice has no table yet. Returns 'd'
+ * itself if it is not sliced. Slices can be created by several threads at
+ * the same time while the dict is concurrent. */
+dict *dictGetSlice(dict *d, int slice, int create) {
+	dict *sd, *expected = NULL;
+
+	if (!d->slices) return d;
+	sd = __atomic_load_n(&d->slices->d[slice], __ATOMIC_ACQUIRE);
+	if (sd || !create) return sd;
+
+	sd = dictCreate(d->type,d->privdata);
+	sd->slice = slice;
+	dictExpand(sd,DICT_HT_SLICE_INITIAL_SIZE);
+	sd->parent = d;
+	if (!__atomic_compare_exchange_n(&d->slices->d[slice], &expected, sd, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Another thread created it first. */
+		sd->parent = NULL;
+		dictRelease(sd);
+		return expected;
 	}
-	_dictInitBig(d,type,privDataPtr);
-	return d;
+	__atomic_fetch_add(&d->ht[0].size, sd->ht[0].size, __ATOMIC_RELAXED);
+	return sd;
+}
+
+static dict *_dictKeySlice(dict *d, const void *key, int create) {
+	return dictGetSlice(d, d->type->keySlice(key), create);
+}
+
+static void _dictSliceTreeAdd(dictSlices *sl, int slice, long long delta) {
+	for (int i = slice+1; i <= sl->count; i += i & -i) sl->tree[i] += delta;
+}
+
+static void _dictSliceTreeRebuild(dictSlices *sl) {
+	for (int i = 1; i <= sl->count; i++) {
+		dict *sd = sl->d[i-1];
+		sl->tree[i] = sd ? (long long)dictSize(sd) : 0;
+	}
+	for (int i = 1; i <= sl->count; i++) {
+		int parent = i + (i & -i);
+		if (parent <= sl->count) sl->tree[parent] += sl->tree[i];
+	}
+	sl->tree_stale = 0;
+}
+
+/* Account 'keys' keys added to (or removed from, if negative) the slice 'd'
+ * in its sliced dict. */
+static void _dictSliceUsed(dict *d, long keys) {
+	dict *p = d->parent;
+
+	if (!p) return;
+	__atomic_fetch_add(&p->ht[0].used, (unsigned long)keys, __ATOMIC_RELAXED);
+	if (_dictConcurrent(d)) {
+		/* Only the first key dirties the line shared by all the threads. */
+		if (!__atomic_load_n(&p->slices->tree_stale, __ATOMIC_RELAXED))
+			__atomic_store_n(&p->slices->tree_stale, 1, __ATOMIC_RELAXED);
+	} else if (!p->slices->tree_stale) {
+		_dictSliceTreeAdd(p->slices, d->slice, keys);
+	}
+}
+
+/* Returns a random slice of a sliced dict with keys, the slices being picked
+ * with a probability proportional to their number of keys. While the dict is
+ * concurrent the tree of the sizes is not maintained: a random non empty
+ * slice is returned instead. */
+static dict *_dictRandomSlice(dict *d) {
+	dictSlices *sl = d->slices;
+
+	if (dictSize(d) == 0) return NULL;
+	if (!_dictConcurrent(d)) {
+		long long rank;
+		int pos = 0;
+
+		if (sl->tree_stale) _dictSliceTreeRebuild(sl);
+		rank = randomULong() % dictSize(d);
+		for (int step = sl->count; step; step >>= 1) {
+			if (pos+step <= sl->count && sl->tree[pos+step] <= rank) {
+				pos += step;
+				rank -= sl->tree[pos];
+			}
+		}
+		return sl->d[pos];
+	}
+	for (int tries = 0; tries < sl->count; tries++) {
+		dict *sd = sl->d[randomULong() & (sl->count-1)];
+		if (sd && dictSize(sd)) return sd;
+	}
+	for (int j = 0; j < sl->count; j++) {
+		if (sl->d[j] && dictSize(sl->d[j])) return sl->d[j];
+	}
+	return NULL;
 }
 
 int _dictInitBig(dict *d, dictType *type,
@@ -187,7 +360,12 @@ int _dictInitBig(dict *d, dictType *type,
 	d->privdata = privDataPtr;
 	d->rehashidx = -1;
 	d->pauserehash = 0;
+	d->concurrent = 0;
+	d->rehashbusy = 0;
 	d->isBig = 1;
+	d->slices = NULL;
+	d->parent = NULL;
+	d->slice = -1;
 	return DICT_OK;
 }
 
@@ -201,7 +379,12 @@ int _dictInit(dict *d, dictType *type,
 	d->privdata = privDataPtr;
 	d->rehashidx = -1;
 	d->pauserehash = 0;
+	d->concurrent = 0;
+	d->rehashbusy = 0;
 	d->isBig = 0;
+	d->slices = NULL;
+	d->parent = NULL;
+	d->slice = -1;
 	return DICT_OK;
 }
 
@@ -211,7 +394,8 @@ int dictResize(dict *d)
 {
 	unsigned long minimal;
 
-	if (!dict_can_resize || dictIsRehashing(d)){
+	/* The slices of a sliced dict are resized one by one. */
+	if (!dict_can_resize || dictIsRehashing(d) || d->slices){
 		return DICT_ERR;
 	}
 	
@@ -222,6 +406,10 @@ int dictResize(dict *d)
 			minimal = DICT_HT_BIG_INITIAL_SIZE;
 		}
 
+	}else if(d->slice >= 0){
+		if (minimal < DICT_HT_SLICE_INITIAL_SIZE){
+			minimal = DICT_HT_SLICE_INITIAL_SIZE;
+		}
 	}else{
 		if (minimal < DICT_HT_INITIAL_SIZE){
 			minimal = DICT_HT_INITIAL_SIZE;
@@ -239,16 +427,25 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
 
 	if (malloc_failed) *malloc_failed = 0;
 
+	/* The slices of a sliced dict grow on their own. */
+	if (d->slices) return DICT_ERR;
+
+	dictht n; /* the new hash table */
+	unsigned long realsize = _dictNextPower(d, size);
+	int locked = _dictLockTables(d, realsize);
+
 	/* the size is invalid if it is smaller than the number of
 	 * elements already inside the hash table */
-	if (dictIsRehashing(d) || d->ht[0].used > size)
+	if (dictIsRehashing(d) || d->ht[0].used > size) {
+		_dictUnlockTables(d, locked);
 		return DICT_ERR;
-
-	dictht n; /* the new hash table */
-	unsigned long realsize = _dictNextPower(size);
+	}
 
 	/* Rehashing to the same table size is not useful. */
-	if (realsize == d->ht[0].size) return DICT_ERR;
+	if (realsize == d->ht[0].size) {
+		_dictUnlockTables(d, locked);
+		return DICT_ERR;
+	}
 
 	/* Allocate the new hash table and initialize all pointers to NULL */
 	n.size = realsize;
@@ -259,23 +456,29 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
 	if (malloc_failed) {
 		n.table = ztrycalloc(realsize*sizeof(dictEntry*));
 		*malloc_failed = n.table == NULL;
-		if (*malloc_failed)
+		if (*malloc_failed) {
+			_dictUnlockTables(d, locked);
 			return DICT_ERR;
+		}
 	} else
 		n.table = zcalloc(realsize*sizeof(dictEntry*));
 
 	n.used = 0;
+	if (d->parent) __atomic_fetch_add(&d->parent->ht[0].size, realsize, __ATOMIC_RELAXED);
 
 	/* Is this the first initialization? If so it's not really a rehashing
 	 * we just set the first hash table so that it can accept keys. */
 	if (d->ht[0].table == NULL) {
 		d->ht[0] = n;
+		_dictUnlockTables(d, locked);
 		return DICT_OK;
 	}
 
 	/* Prepare a second hash table for incremental rehashing */
 	d->ht[1] = n;
 	d->rehashidx = 0;
+	if (d->parent) __atomic_fetch_add(&d->parent->rehashidx, 1, __ATOMIC_RELAXED);
+	_dictUnlockTables(d, locked);
 	return DICT_OK;
 }
 
@@ -291,6 +494,23 @@ int dictTryExpand(dict *d, unsigned long size) {
 	return malloc_failed? DICT_ERR : DICT_OK;
 }
 
+/* dictRehash() of a sliced dict: N steps on the next slice being rehashed,
+ * skipping the ones paused by an iterator. */
+static int _dictRehashSlices(dict *d, int n) {
+	dictSlices *sl = d->slices;
+
+	for (int j = 0; j < sl->count; j++) {
+		int idx = (sl->rehash_next + j) & (sl->count-1);
+		dict *sd = sl->d[idx];
+
+		if (!sd || !dictIsRehashing(sd) || sd->pauserehash > 0) continue;
+		sl->rehash_next = idx;
+		dictRehash(sd, n);
+		return dictIsRehashing(d);
+	}
+	return 0;
+}
+
 /* Performs N steps of incremental rehashing. Returns 1 if there are still
  * keys to move from the old to the new hash table, otherwise 0 is returned.
  *
@@ -303,34 +523,38 @@ int dictTryExpand(dict *d, unsigned long size) {
 int dictRehash(dict *d, int n) {
 
 	int empty_visits = n*10; /* Max number of empty buckets to visit. */
+	int busy = 0, ret = 1;
 	if (!dictIsRehashing(d)){
 		return 0;
 	}
-	
-	if(migration_activated){
-		return 0;
+	if (d->slices) return _dictRehashSlices(d, n);
+
+	/* Other threads add keys to a concurrent dict while it is rehashed, but
+	 * only one thread at a time moves them. During a rehash they are only
+	 * added to the new table. */
+	if (_dictConcurrent(d)) {
+		if (__atomic_exchange_n(&d->rehashbusy, 1, __ATOMIC_ACQUIRE)) return 1;
+		busy = 1;
 	}
 
 	while(n-- && d->ht[0].used != 0) {
 		dictEntry *de, *nextde;
+		pthread_mutex_t *lock;
+		unsigned long moved = 0;
 
 		/* Note that rehashidx can't overflow as we are sure there are more
 		 * elements because ht[0].used != 0 */
-		pthread_mutex_lock(&migration_dict_locks[d->rehashidx]);
 		assert(d->ht[0].size > (unsigned long)d->rehashidx);
-		while(d->ht[0].table[d->rehashidx] == NULL) {
-			pthread_mutex_unlock(&migration_dict_locks[d->rehashidx]);
-			//pthread_mutex_lock(&general_dict_lock);
+		while(1) {
+			/* The stripe of the bucket also orders us after the thread
+			 * that created the new table. */
+			lock = _dictLock(d, d->rehashidx);
+			if (d->ht[0].table[d->rehashidx] != NULL) break;
+			_dictUnlock(lock);
 			d->rehashidx++;
-			//pthread_mutex_unlock(&general_dict_lock);
-			if (--empty_visits == 0){
-				return 1;
-			}
+			if (--empty_visits == 0) goto done;
 		}
-		pthread_mutex_unlock(&migration_dict_locks[d->rehashidx]);
-		pthread_mutex_lock(&migration_dict_locks[d->rehashidx]);
 		de = d->ht[0].table[d->rehashidx];
-		pthread_mutex_unlock(&migration_dict_locks[d->rehashidx]);
 		/* Move all the keys in this bucket from the old to the new hash HT */
 		while(de) {
 			uint64_t h;
@@ -338,35 +562,37 @@ int dictRehash(dict *d, int n) {
 			nextde = de->next;
 			/* Get the index in the new hash table */
 			h = dictHashKey(d, de->key) & d->ht[1].sizemask;
-			pthread_mutex_lock(&migration_dict_locks[h]);
 			de->next = d->ht[1].table[h];
 			d->ht[1].table[h] = de;
-			//pthread_mutex_lock(&general_dict_lock);
-			d->ht[0].used--;
-			d->ht[1].used++;
-			//pthread_mutex_unlock(&general_dict_lock);
+			moved++;
 			de = nextde;
-			pthread_mutex_unlock(&migration_dict_locks[h]);
 		}
-		pthread_mutex_lock(&migration_dict_locks[d->rehashidx]);
 		d->ht[0].table[d->rehashidx] = NULL;
-		pthread_mutex_unlock(&migration_dict_locks[d->rehashidx]);
-		//pthread_mutex_lock(&general_dict_lock);
+		__atomic_fetch_sub(&d->ht[0].used, moved, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&d->ht[1].used, moved, __ATOMIC_RELAXED);
+		_dictUnlock(lock);
 		d->rehashidx++;
-		//pthread_mutex_unlock(&general_dict_lock);
 	}
 
 	/* Check if we already rehashed the whole table... */
 	if (d->ht[0].used == 0) {
+		int locked = _dictLockTables(d, 0);
+
+		if (d->parent) {
+			__atomic_fetch_sub(&d->parent->ht[0].size, d->ht[0].size, __ATOMIC_RELAXED);
+			__atomic_fetch_sub(&d->parent->rehashidx, 1, __ATOMIC_RELAXED);
+		}
 		zfree(d->ht[0].table);
 		d->ht[0] = d->ht[1];
 		_dictReset(&d->ht[1]);
 		d->rehashidx = -1;
-		return 0;
+		_dictUnlockTables(d, locked);
+		ret = 0;
 	}
 
-	/* More to rehash... */
-	return 1;
+done:
+	if (busy) __atomic_store_n(&d->rehashbusy, 0, __ATOMIC_RELEASE);
+	return ret;
 }
 
 long long timeInMilliseconds(void) {
@@ -437,13 +663,24 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 	long index;
 	dictEntry *entry;
 	dictht *ht;
+	uint64_t hash;
+	pthread_mutex_t *lock;
 
+	if (d->slices) return dictAddRaw(_dictKeySlice(d, key, 1), key, existing);
 	if (dictIsRehashing(d)) _dictRehashStep(d);
 
+	/* Expand the hash table if needed */
+	if (_dictExpandIfNeeded(d) == DICT_ERR)
+		return NULL;
+
 	/* Get the index of the new element, or -1 if
 	 * the element already exists. */
-	if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+	hash = dictHashKey(d,key);
+	lock = _dictLock(d, hash);
+	if ((index = _dictKeyIndex(d, key, hash, existing)) == -1) {
+		_dictUnlock(lock);
 		return NULL;
+	}
 
 	/* Allocate the memory and store the new entry.
 	 * Insert the element in top, with the assumption that in a database
@@ -451,16 +688,15 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 	 * more frequently. */
 	ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
 	entry = zmalloc(sizeof(*entry));
-	pthread_mutex_lock(&migration_dict_locks[index]);
 	entry->next = ht->table[index];
 	ht->table[index] = entry;
-	//pthread_mutex_lock(&general_dict_lock);
-	ht->used++;
-	//pthread_mutex_unlock(&general_dict_lock);
+	/* Keys of migrated slots are added concurrently by dictAddPrehashed(). */
+	__atomic_fetch_add(&ht->used, 1, __ATOMIC_RELAXED);
 
 	/* Set the hash entry fields. */
 	dictSetKey(d, entry, key);
-	pthread_mutex_unlock(&migration_dict_locks[index]);
+	_dictUnlock(lock);
+	_dictSliceUsed(d, 1);
 	return entry;
 }
 
@@ -505,6 +741,57 @@ dictEntry *dictAddOrFind(dict *d, void *key) {
 	return entry ? entry : existing;
 }
 
+/* Add an element whose hash was already computed by the caller.
+ *
+ * Unlike dictAdd() no rehashing step is performed: callers adding many keys
+ * at once (the index rebuild of migrated slots) size the dict with
+ * dictExpand() before, the table is only expanded if it grows past that.
+ * Several threads can add keys at the same time to a dict made concurrent
+ * with dictEnableConcurrency(), the thread owning it moves the keys to the
+ * new table with its rehash steps.
+ *
+ * Return DICT_ERR if the key already exists, DICT_OK otherwise. */
+int dictAddPrehashed(dict *d, void *key, void *val, uint64_t hash)
+{
+	dictEntry *he;
+	dictht *ht;
+	uint64_t idx;
+	pthread_mutex_t *lock;
+
+	if (d->slices) return dictAddPrehashed(_dictKeySlice(d, key, 1), key, val, hash);
+	lock = _dictLock(d, hash);
+
+	if (dictIsRehashing(d)) {
+		idx = hash & d->ht[0].sizemask;
+		for (he = d->ht[0].table[idx]; he; he = he->next) {
+			if (key==he->key || dictCompareKeys(d, key, he->key)) {
+				_dictUnlock(lock);
+				return DICT_ERR;
+			}
+		}
+	}
+
+	ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+	assert(ht->size != 0);
+	idx = hash & ht->sizemask;
+	for (he = ht->table[idx]; he; he = he->next) {
+		if (key==he->key || dictCompareKeys(d, key, he->key)) {
+			_dictUnlock(lock);
+			return DICT_ERR;
+		}
+	}
+	he = zmalloc(sizeof(*he));
+	he->next = ht->table[idx];
+	dictSetKey(d, he, key);
+	dictSetVal(d, he, val);
+	ht->table[idx] = he;
+	__atomic_fetch_add(&ht->used, 1, __ATOMIC_RELAXED);
+	_dictUnlock(lock);
+	_dictSliceUsed(d, 1);
+	_dictExpandIfNeeded(d);
+	return DICT_OK;
+}
+
 /* Search and remove an element. This is an helper function for
  * dictDelete() and dictUnlink(), please check the top comment
  * of those functions. */
@@ -512,15 +799,20 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
 	uint64_t h, idx;
 	dictEntry *he, *prevHe;
 	int table;
+	pthread_mutex_t *lock;
 
+	if (d->slices) {
+		d = _dictKeySlice(d, key, 0);
+		if (d == NULL) return NULL;
+	}
 	if (d->ht[0].used == 0 && d->ht[1].used == 0) return NULL;
 
 	if (dictIsRehashing(d)) _dictRehashStep(d);
 	h = dictHashKey(d, key);
 
+	lock = _dictLock(d, h);
 	for (table = 0; table <= 1; table++) {
 		idx = h & d->ht[table].sizemask;
-		pthread_mutex_lock(&migration_dict_locks[idx]);
 		he = d->ht[table].table[idx];
 		prevHe = NULL;
 		while(he) {
@@ -535,16 +827,17 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
 					dictFreeVal(d, he);
 					zfree(he);
 				}
-				d->ht[table].used--;
-				pthread_mutex_unlock(&migration_dict_locks[idx]);
+				__atomic_fetch_sub(&d->ht[table].used, 1, __ATOMIC_RELAXED);
+				_dictUnlock(lock);
+				_dictSliceUsed(d, -1);
 				return he;
 			}
 			prevHe = he;
 			he = he->next;
 		}
-		pthread_mutex_unlock(&migration_dict_locks[idx]);
 		if (!dictIsRehashing(d)) break;
 	}
+	_dictUnlock(lock);
 	return NULL; /* not found */
 }
 
@@ -615,9 +908,35 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
 	return DICT_OK; /* never fails */
 }
 
+/* Release the slices of a sliced dict, calling 'callback' like _dictClear()
+ * does, and reset its counters. */
+static void _dictClearSlices(dict *d, void(callback)(void *)) {
+	dictSlices *sl = d->slices;
+
+	for (int j = 0; j < sl->count; j++) {
+		dict *sd = sl->d[j];
+
+		if (!sd) continue;
+		_dictClear(sd,&sd->ht[0],callback);
+		_dictClear(sd,&sd->ht[1],callback);
+		zfree(sd);
+		sl->d[j] = NULL;
+	}
+	memset(sl->tree,0,sizeof(long long)*(sl->count+1));
+	sl->tree_stale = 0;
+	_dictReset(&d->ht[0]);
+	d->rehashidx = -1;
+}
+
 /* Clear & Release the hash table */
 void dictRelease(dict *d)
 {
+	if (d->slices) {
+		_dictClearSlices(d,NULL);
+		zfree(d->slices->d);
+		zfree(d->slices->tree);
+		zfree(d->slices);
+	}
 	_dictClear(d,&d->ht[0],NULL);
 	_dictClear(d,&d->ht[1],NULL);
 	zfree(d);
@@ -627,26 +946,29 @@ dictEntry *dictFind(dict *d, const void *key)
 {
 	dictEntry *he;
 	uint64_t h, idx, table;
+	pthread_mutex_t *lock;
 
-	clock_t start, end;
-	double cpu_time_used;
 	if (dictSize(d) == 0) return NULL; /* dict is empty */
+	if (d->slices) {
+		d = _dictKeySlice(d, key, 0);
+		if (d == NULL || dictSize(d) == 0) return NULL;
+	}
 	if (dictIsRehashing(d)) _dictRehashStep(d);
 	h = dictHashKey(d, key);
+	lock = _dictLock(d, h);
 	for (table = 0; table <= 1; table++) {
 		idx = h & d->ht[table].sizemask;
-		pthread_mutex_lock(&migration_dict_locks[idx]);
 		he = d->ht[table].table[idx];
 		while(he) {
 			if (key==he->key || dictCompareKeys(d, key, he->key)){
-				pthread_mutex_unlock(&migration_dict_locks[idx]);
+				_dictUnlock(lock);
 				return he;
 			}
 			he = he->next;
 		}
-		pthread_mutex_unlock(&migration_dict_locks[idx]);
-		if (!dictIsRehashing(d)) return NULL;
+		if (!dictIsRehashing(d)) break;
 	}
+	_dictUnlock(lock);
 	return NULL;
 }
 
@@ -705,6 +1027,7 @@ dictIterator *dictGetIterator(dict *d)
 	iter->safe = 0;
 	iter->entry = NULL;
 	iter->nextEntry = NULL;
+	iter->slice_iter = NULL;
 	return iter;
 }
 
@@ -715,8 +1038,36 @@ dictIterator *dictGetSafeIterator(dict *d) {
 	return i;
 }
 
+/* dictNext() of a sliced dict: 'index' is the slice visited by the iterator
+ * 'slice_iter'. */
+static dictEntry *_dictNextSliced(dictIterator *iter)
+{
+	dictSlices *sl = iter->d->slices;
+
+	if (iter->index == -1) {
+		if (iter->safe)
+			dictPauseRehashing(iter->d);
+		else
+			iter->fingerprint = dictFingerprint(iter->d);
+	}
+	while (1) {
+		if (iter->slice_iter) {
+			dictEntry *de = dictNext(iter->slice_iter);
+			if (de) return de;
+			dictReleaseIterator(iter->slice_iter);
+			iter->slice_iter = NULL;
+		}
+		if (iter->index+1 >= sl->count) return NULL;
+		iter->index++;
+		dict *sd = sl->d[iter->index];
+		if (sd && dictSize(sd))
+			iter->slice_iter = iter->safe ? dictGetSafeIterator(sd) : dictGetIterator(sd);
+	}
+}
+
 dictEntry *dictNext(dictIterator *iter)
 {
+	if (iter->d->slices) return _dictNextSliced(iter);
 	while (1) {
 		if (iter->entry == NULL) {
 			dictht *ht = &iter->d->ht[iter->table];
@@ -752,6 +1103,7 @@ dictEntry *dictNext(dictIterator *iter)
 
 void dictReleaseIterator(dictIterator *iter)
 {
+	if (iter->slice_iter) dictReleaseIterator(iter->slice_iter);
 	if (!(iter->index == -1 && iter->table == 0)) {
 		if (iter->safe)
 			dictResumeRehashing(iter->d);
@@ -767,26 +1119,32 @@ dictEntry *dictGetRandomKey(dict *d)
 {
 	dictEntry *he, *orighe;
 	unsigned long h;
-	int listlen, listele;
+	int listlen, listele, table;
+	pthread_mutex_t *lock;
 
 	if (dictSize(d) == 0) return NULL;
+	if (d->slices) {
+		dict *sd = _dictRandomSlice(d);
+		return sd ? dictGetRandomKey(sd) : NULL;
+	}
 	if (dictIsRehashing(d)) _dictRehashStep(d);
 	if (dictIsRehashing(d)) {
 		do {
 			/* We are sure there are no elements in indexes from 0
 			 * to rehashidx-1 */
 			h = d->rehashidx + (randomULong() % (dictSlots(d) - d->rehashidx));
-			pthread_mutex_lock(&migration_dict_locks[h - d->ht[0].size]);
-			he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
-				d->ht[0].table[h];
-			pthread_mutex_unlock(&migration_dict_locks[h - d->ht[0].size]);
+			table = h >= d->ht[0].size;
+			if (table) h -= d->ht[0].size;
+			lock = _dictLock(d, h);
+			he = d->ht[table].table[h];
+			if (he == NULL) _dictUnlock(lock);
 		} while(he == NULL);
 	} else {
 		do {
 			h = randomULong() & d->ht[0].sizemask;
-			pthread_mutex_lock(&migration_dict_locks[h]);
+			lock = _dictLock(d, h);
 			he = d->ht[0].table[h];
-			pthread_mutex_unlock(&migration_dict_locks[h]);
+			if (he == NULL) _dictUnlock(lock);
 		} while(he == NULL);
 	}
 
@@ -803,6 +1161,7 @@ dictEntry *dictGetRandomKey(dict *d)
 	listele = random() % listlen;
 	he = orighe;
 	while(listele--) he = he->next;
+	_dictUnlock(lock);
 	return he;
 }
 
@@ -835,6 +1194,15 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
 	unsigned long maxsteps;
 
 	if (dictSize(d) < count) count = dictSize(d);
+	if (d->slices) {
+		/* Sample the slices, picked fairly, until we have enough keys. */
+		for (j = 0; j < count && stored < count; j++) {
+			dict *sd = _dictRandomSlice(d);
+			if (sd == NULL) break;
+			stored += dictGetSomeKeys(sd, des+stored, count-stored);
+		}
+		return stored;
+	}
 	maxsteps = count*10;
 
 	/* Try to do a rehashing work proportional to 'count'. */
@@ -1017,6 +1385,35 @@ static unsigned long rev(unsigned long v) {
 	* 3) The reverse cursor is somewhat hard to understand at first, but this
 	*    comment is supposed to help.
 	*/
+/* dictScan() of a sliced dict. The low bits of the cursor are the slice
+ * being scanned, the others the cursor of dictScan() in the slice: the
+ * slices are scanned one after the other, each with the guarantees of
+ * dictScan(). */
+static unsigned long _dictScanSliced(dict *d,
+		unsigned long v,
+		dictScanFunction *fn,
+		dictScanBucketFunction* bucketfn,
+		void *privdata)
+{
+	dictSlices *sl = d->slices;
+	int slice = v & (sl->count-1);
+	unsigned long cursor = v >> sl->bits;
+	dict *sd;
+
+	/* Skip the empty slices, the ones we reach here start from cursor 0. */
+	while ((sd = sl->d[slice]) == NULL || dictSize(sd) == 0) {
+		if (++slice == sl->count) return 0;
+		cursor = 0;
+	}
+	cursor = dictScan(sd, cursor, fn, bucketfn, privdata);
+	if (cursor == 0) {
+		do {
+			if (++slice == sl->count) return 0;
+		} while ((sd = sl->d[slice]) == NULL || dictSize(sd) == 0);
+	}
+	return (cursor << sl->bits) | slice;
+}
+
 unsigned long dictScan(dict *d,
 		unsigned long v,
 		dictScanFunction *fn,
@@ -1028,6 +1425,7 @@ unsigned long dictScan(dict *d,
 	unsigned long m0, m1;
 
 	if (dictSize(d) == 0) return 0;
+	if (d->slices) return _dictScanSliced(d, v, fn, bucketfn, privdata);
 
 	/* This is needed in case the scan callback tries to do dictFind or alike. */
 	dictPauseRehashing(d);
@@ -1111,7 +1509,7 @@ unsigned long dictScan(dict *d,
 static int dictTypeExpandAllowed(dict *d) {
 	if (d->type->expandAllowed == NULL) return 1;
 	return d->type->expandAllowed(
-			_dictNextPower(d->ht[0].used + 1) * sizeof(dictEntry*),
+			_dictNextPower(d, d->ht[0].used + 1) * sizeof(dictEntry*),
 			(double)d->ht[0].used / d->ht[0].size);
 }
 
@@ -1150,9 +1548,9 @@ static int _dictExpandIfNeeded(dict *d)
 }
 
 /* Our hash table capability is a power of two */
-static unsigned long _dictNextPower(unsigned long size)
+static unsigned long _dictNextPower(dict *d, unsigned long size)
 {
-	unsigned long i = DICT_HT_INITIAL_SIZE;
+	unsigned long i = d->slice >= 0 ? DICT_HT_SLICE_INITIAL_SIZE : DICT_HT_INITIAL_SIZE;
 
 	if (size >= LONG_MAX){
  		return LONG_MAX + 1LU;
@@ -1172,45 +1570,59 @@ static unsigned long _dictNextPower(unsigned long size)
  * and the optional output parameter may be filled.
  *
  * Note that if we are in the process of rehashing the hash table, the
- * index is always returned in the context of the second (new) hash table. */
+ * index is always returned in the context of the second (new) hash table.
+ *
+ * The caller expands the table if needed and, for concurrent dicts, holds the
+ * lock of the stripe of 'hash'. */
 static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **existing)
 {
 	unsigned long idx, table;
 	dictEntry *he;
 	if (existing) *existing = NULL;
 
-	/* Expand the hash table if needed */
-	if (_dictExpandIfNeeded(d) == DICT_ERR)
-		return -1;
 	for (table = 0; table <= 1; table++) {
 		idx = hash & d->ht[table].sizemask;
-		
 		/* Search if this slot does not already contain the given key */
-		pthread_mutex_lock(&migration_dict_locks[idx]);
 		he = d->ht[table].table[idx];
 		while(he) {
 			if (key==he->key || dictCompareKeys(d, key, he->key)) {
-				if (existing){ 
-					*existing = he;
-				}
-				pthread_mutex_unlock(&migration_dict_locks[idx]);
+				if (existing) *existing = he;
 				return -1;
 			}
 			he = he->next;
 		}
-		pthread_mutex_unlock(&migration_dict_locks[idx]);
 		if (!dictIsRehashing(d)) break;
 	}
 	return idx;
 }
 
 void dictEmpty(dict *d, void(callback)(void*)) {
+	if (d->slices) {
+		_dictClearSlices(d,callback);
+		d->pauserehash = 0;
+		return;
+	}
 	_dictClear(d,&d->ht[0],callback);
 	_dictClear(d,&d->ht[1],callback);
 	d->rehashidx = -1;
 	d->pauserehash = 0;
 }
 
+/* Make the dict safe to use from several threads at the same time, until the
+ * matching dictDisableConcurrency(). Calls nest. The first call must be made
+ * by the thread using the dict before the other threads start, since the
+ * operations already in progress don't take the locks. The owning thread
+ * keeps rehashing the dict with its usual steps (lookups, dictRehash()). */
+void dictEnableConcurrency(dict *d) {
+	pthread_once(&dict_lock_stripes_once, _dictInitLockStripes);
+	__atomic_fetch_add(&d->concurrent, 1, __ATOMIC_RELEASE);
+}
+
+void dictDisableConcurrency(dict *d) {
+	int prev = __atomic_fetch_sub(&d->concurrent, 1, __ATOMIC_RELEASE);
+	assert(prev > 0);
+}
+
 void dictEnableResize(void) {
 	dict_can_resize = 1;
 }
@@ -1231,24 +1643,27 @@ uint64_t dictGetHash(dict *d, const void *key) {
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
 	dictEntry *he, **heref;
 	unsigned long idx, table;
+	pthread_mutex_t *lock;
 
+	/* The slice of a dead key is unknown. */
+	assert(d->slices == NULL);
 	if (dictSize(d) == 0) return NULL; /* dict is empty */
+	lock = _dictLock(d, hash);
 	for (table = 0; table <= 1; table++) {
 		idx = hash & d->ht[table].sizemask;
-		pthread_mutex_lock(&migration_dict_locks[idx]);
 		heref = &d->ht[table].table[idx];
 		he = *heref;
 		while(he) {
 			if (oldptr==he->key){
-				pthread_mutex_unlock(&migration_dict_locks[idx]);
+				_dictUnlock(lock);
 				return heref;
 			}
 			heref = &he->next;
 			he = *heref;
 		}
-		pthread_mutex_unlock(&migration_dict_locks[idx]);
-		if (!dictIsRehashing(d)) return NULL;
+		if (!dictIsRehashing(d)) break;
 	}
+	_dictUnlock(lock);
 	return NULL;
 }
 
@@ -1321,6 +1736,27 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
 	char *orig_buf = buf;
 	size_t orig_bufsize = bufsize;
 
+	if (d->slices) {
+		/* Summary of the slices, and the stats of the biggest one. */
+		dict *biggest = NULL;
+		int used = 0;
+
+		for (int j = 0; j < d->slices->count; j++) {
+			dict *sd = d->slices->d[j];
+			if (!sd || dictSize(sd) == 0) continue;
+			used++;
+			if (!biggest || dictSize(sd) > dictSize(biggest)) biggest = sd;
+		}
+		l = snprintf(buf,bufsize,
+				"Sliced dict: %d of %d slices used, %lu elements, %lu buckets\n",
+				used, d->slices->count, dictSize(d), dictSlots(d));
+		if (biggest && l < bufsize) {
+			l += snprintf(buf+l,bufsize-l,"Slice %d:\n",biggest->slice);
+			if (l < bufsize) dictGetStats(buf+l,bufsize-l,biggest);
+		}
+		if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
+		return;
+	}
 	l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
 	buf += l;
 	bufsize -= l;
@@ -1331,6 +1767,42 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
 	if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
 }
 
+/* Walk the chains of 'samples' random buckets of both tables, the cost of
+ * a lookup, without visiting the whole dict like dictGetStats() does.
+ * Returns the longest chain seen and sets '*avg' to the average length of
+ * the non empty buckets sampled. Safe on a concurrent dict. */
+unsigned long dictSampleChainLength(dict *d, int samples, double *avg) {
+	unsigned long max = 0, total = 0, nonempty = 0;
+	dict *sliced = d->slices ? d : NULL;
+
+	*avg = 0;
+	if (dictSize(d) == 0) return 0;
+	for (int j = 0; j < samples; j++) {
+		/* A bucket of a random slice of a sliced dict. */
+		if (sliced && (d = _dictRandomSlice(sliced)) == NULL) break;
+		unsigned long s0 = d->ht[0].size, s1 = d->ht[1].size;
+		unsigned long h = randomULong() % (s0 + s1);
+		int table = h >= s0;
+		pthread_mutex_t *lock;
+		dictEntry *he;
+		unsigned long len = 0;
+
+		if (table) h -= s0;
+		lock = _dictLock(d, h);
+		/* The tables may have been swapped before we got the lock. */
+		if (h < d->ht[table].size && d->ht[table].table) {
+			for (he = d->ht[table].table[h]; he; he = he->next) len++;
+		}
+		_dictUnlock(lock);
+		if (len == 0) continue;
+		nonempty++;
+		total += len;
+		if (len > max) max = len;
+	}
+	if (nonempty) *avg = (double)total/nonempty;
+	return max;
+}
+
 /* ------------------------------- Benchmark ---------------------------------*/
 
 #ifdef REDIS_TEST
@@ -1383,11 +1855,215 @@ dictType BenchmarkDictType = {
 	printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0)
 
+static long long usecTime(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+typedef struct benchmarkInsertJob {
+	dict *d;
+	char **keys;
+	uint64_t *hashes;
+	long first, last;
+} benchmarkInsertJob;
+
+static void *benchmarkInsertThread(void *arg) {
+	benchmarkInsertJob *job = arg;
+
+	for (long j = job->first; j < job->last; j++) {
+		int retval = dictAddPrehashed(job->d,job->keys[j],NULL,job->hashes[j]);
+		assert(retval == DICT_OK);
+	}
+	return NULL;
+}
+
+/* Add 'count' keys to a new dict with 'threads' threads, made concurrent
+ * unless threads is 0, in which case the keys are added by the caller
+ * without any locking. */
+static void benchmarkConcurrentInsert(char **keys, uint64_t *hashes, long count, int threads) {
+	dictType type = BenchmarkDictType;
+	pthread_t tids[16];
+	benchmarkInsertJob jobs[16];
+	long long start, elapsed;
+	dict *d;
+
+	type.keyDestructor = NULL; /* The keys are shared between the runs. */
+	d = dictCreate(&type,NULL);
+	dictExpand(d,count);
+	start = usecTime();
+	if (threads == 0) {
+		jobs[0] = (benchmarkInsertJob) {d, keys, hashes, 0, count};
+		benchmarkInsertThread(&jobs[0]);
+	} else {
+		dictEnableConcurrency(d);
+		for (int t = 0; t < threads; t++) {
+			jobs[t] = (benchmarkInsertJob) {d, keys, hashes, count*t/threads, count*(t+1)/threads};
+			pthread_create(&tids[t],NULL,benchmarkInsertThread,&jobs[t]);
+		}
+		for (int t = 0; t < threads; t++) pthread_join(tids[t],NULL);
+		dictDisableConcurrency(d);
+	}
+	elapsed = usecTime()-start;
+	assert((long)dictSize(d) == count);
+	if (threads == 0)
+		printf("Inserting, no locking: %ld items in %lld ms, %.0f items/sec\n",
+			count, elapsed/1000, elapsed ? (double)count*1000000/elapsed : 0);
+	else
+		printf("Inserting, %d threads: %ld items in %lld ms, %.0f items/sec\n",
+			threads, count, elapsed/1000, elapsed ? (double)count*1000000/elapsed : 0);
+	dictRelease(d);
+}
+
+/* Add 'count' keys to a small concurrent dict with 'threads' threads while
+ * this thread keeps rehashing it as the table grows, the way the main thread
+ * does while slots are patched in. The chains are sampled as the dict grows
+ * and must stay short. */
+static void benchmarkRehashWhileInserting(char **keys, uint64_t *hashes, long count, int threads) {
+	dictType type = BenchmarkDictType;
+	pthread_t tids[16];
+	benchmarkInsertJob jobs[16];
+	long long start, elapsed, rehash_us = 0;
+	unsigned long max, worst = 0, next = count/8;
+	double avg, worst_avg = 0;
+	int done = 0;
+	dict *d;
+
+	type.keyDestructor = NULL;
+	d = dictCreate(&type,NULL);
+	dictExpand(d,16);
+	dictEnableResize();
+	dictEnableConcurrency(d);
+	start = usecTime();
+	for (int t = 0; t < threads; t++) {
+		jobs[t] = (benchmarkInsertJob) {d, keys, hashes, count*t/threads, count*(t+1)/threads};
+		pthread_create(&tids[t],NULL,benchmarkInsertThread,&jobs[t]);
+	}
+	while (!done) {
+		long long rehash_start = usecTime();
+		if (dictIsRehashing(d)) dictRehash(d,100);
+		rehash_us += usecTime()-rehash_start;
+		if (dictSize(d) >= next || dictSize(d) == (unsigned long)count) {
+			max = dictSampleChainLength(d,1024,&avg);
+			if (max > worst) worst = max;
+			if (avg > worst_avg) worst_avg = avg;
+			printf("  %lu keys, table %lu%s: chain avg %.2f max %lu\n",
+				dictSize(d), dictSlots(d), dictIsRehashing(d) ? " (rehashing)" : "",
+				avg, max);
+			next += count/8;
+			done = dictSize(d) == (unsigned long)count;
+		}
+	}
+	for (int t = 0; t < threads; t++) pthread_join(tids[t],NULL);
+	elapsed = usecTime()-start;
+	dictDisableConcurrency(d);
+	while (dictIsRehashing(d)) dictRehash(d,100);
+	assert((long)dictSize(d) == count);
+	for (long j = 0; j < count; j++) assert(dictFind(d,keys[j]) != NULL);
+	/* Without rehashing the chains would be count/16 keys long. */
+	assert(worst_avg < 4);
+	printf("Inserting while rehashing, %d threads: %ld items in %lld ms, "
+		"%lld ms rehashing, worst chain avg %.2f max %lu\n",
+		threads, count, elapsed/1000, rehash_us/1000, worst_avg, worst);
+	dictRelease(d);
+}
+
+#define BENCHMARK_SLICES 16384
+
+static int sliceCallback(const void *key) {
+	return (hashCallback(key) >> 48) & (BENCHMARK_SLICES-1);
+}
+
+static void scanCountCallback(void *privdata, const dictEntry *de) {
+	DICT_NOTUSED(de);
+	(*(long*)privdata)++;
+}
+
+/* Check the sliced dict API against 'count' keys, and time the removal of
+ * all the keys of a slice and the concurrent insert in a sliced dict. */
+static void benchmarkSlicedDict(char **keys, uint64_t *hashes, long count, int threads) {
+	dictType type = BenchmarkDictType;
+	pthread_t tids[16];
+	benchmarkInsertJob jobs[16];
+	long long start, elapsed;
+	dictIterator *di;
+	dictEntry *de;
+	unsigned long cursor = 0;
+	long j, seen = 0, slices = 0;
+	dict *d;
+
+	type.keyDestructor = NULL;
+	type.keySlice = sliceCallback;
+	d = dictCreateSliced(&type,NULL,BENCHMARK_SLICES);
+	start = usecTime();
+	for (j = 0; j < count; j++) assert(dictAdd(d,keys[j],NULL) == DICT_OK);
+	elapsed = usecTime()-start;
+	printf("Inserting, sliced dict: %ld items in %lld ms, %.0f items/sec\n",
+		count, elapsed/1000, elapsed ? (double)count*1000000/elapsed : 0);
+	assert((long)dictSize(d) == count);
+	for (j = 0; j < count; j++) {
+		assert(dictAdd(d,keys[j],NULL) == DICT_ERR);
+		de = dictFind(d,keys[j]);
+		assert(de != NULL && dictGetKey(de) == keys[j]);
+	}
+	for (j = 0; j < BENCHMARK_SLICES; j++) {
+		dict *sd = dictGetSlice(d,j,0);
+		if (sd) slices += dictSize(sd);
+	}
+	assert(slices == count);
+
+	di = dictGetSafeIterator(d);
+	while ((de = dictNext(di)) != NULL) seen++;
+	dictReleaseIterator(di);
+	assert(seen == count);
+	seen = 0;
+	do {
+		cursor = dictScan(d,cursor,scanCountCallback,NULL,&seen);
+	} while (cursor);
+	assert(seen == count);
+	for (j = 0; j < 1000; j++) assert(dictGetFairRandomKey(d) != NULL);
+
+	/* Drop a slice the way a migrated slot is dropped. */
+	dict *sd = dictGetSlice(d,sliceCallback(keys[0]),0);
+	long slice_keys = dictSize(sd);
+	start = usecTime();
+	di = dictGetSafeIterator(sd);
+	while ((de = dictNext(di)) != NULL) assert(dictDelete(d,dictGetKey(de)) == DICT_OK);
+	dictReleaseIterator(di);
+	elapsed = usecTime()-start;
+	printf("Deleting a slice: %ld items in %lld us\n", slice_keys, elapsed);
+	assert((long)dictSize(d) == count-slice_keys && dictSize(sd) == 0);
+	assert(dictFind(d,keys[0]) == NULL);
+
+	dictEmpty(d,NULL);
+	assert(dictSize(d) == 0 && dictSlots(d) == 0 && dictGetSlice(d,0,0) == NULL);
+
+	/* Threads adding keys of different slices use different stripes. */
+	dictEnableConcurrency(d);
+	start = usecTime();
+	for (int t = 0; t < threads; t++) {
+		jobs[t] = (benchmarkInsertJob) {d, keys, hashes, count*t/threads, count*(t+1)/threads};
+		pthread_create(&tids[t],NULL,benchmarkInsertThread,&jobs[t]);
+	}
+	for (int t = 0; t < threads; t++) pthread_join(tids[t],NULL);
+	elapsed = usecTime()-start;
+	dictDisableConcurrency(d);
+	assert((long)dictSize(d) == count);
+	for (j = 0; j < count; j++) assert(dictFind(d,keys[j]) != NULL);
+	printf("Inserting, sliced dict, %d threads: %ld items in %lld ms, %.0f items/sec\n",
+		threads, count, elapsed/1000, elapsed ? (double)count*1000000/elapsed : 0);
+	while (dictIsRehashing(d)) dictRehash(d,100);
+	dictRelease(d);
+}
+
 /* ./redis-server test dict [<count> | --accurate] */
 int dictTest(int argc, char **argv, int accurate) {
 	long j;
 	long long start, elapsed;
+	long long create_start = usecTime();
 	dict *dict = dictCreate(&BenchmarkDictType,NULL);
+	long long create_us = usecTime()-create_start;
 	long count = 0;
 
 	if (argc == 4) {
@@ -1400,6 +2076,9 @@ int dictTest(int argc, char **argv, int accurate) {
 		count = 5000;
 	}
 
+	/* Creating the first dict used to initialize the bucket locks. */
+	printf("Creating the first dict: %lld us\n", create_us);
+
 	start_benchmark();
 	for (j = 0; j < count; j++) {
 		int retval = dictAdd(dict,stringFromLongLong(j),(void*)j);
@@ -1467,7 +2146,35 @@ int dictTest(int argc, char **argv, int accurate) {
 		assert(retval == DICT_OK);
 	}
 	end_benchmark("Removing and adding");
+
+	/* Lookups in a concurrent dict take the stripe locks, the others don't. */
+	dictEnableConcurrency(dict);
+	start_benchmark();
+	for (j = 0; j < count; j++) {
+		char *key = stringFromLongLong(j);
+		key[0] += 17;
+		dictEntry *de = dictFind(dict,key);
+		assert(de != NULL);
+		zfree(key);
+	}
+	end_benchmark("Linear access of existing elements (concurrent dict)");
+	dictDisableConcurrency(dict);
 	dictRelease(dict);
+
+	char **keys = zmalloc(sizeof(char*)*count);
+	uint64_t *hashes = zmalloc(sizeof(uint64_t)*count);
+	for (j = 0; j < count; j++) {
+		keys[j] = stringFromLongLong(j);
+		hashes[j] = hashCallback(keys[j]);
+	}
+	benchmarkConcurrentInsert(keys,hashes,count,0);
+	for (int threads = 1; threads <= 8; threads *= 2)
+		benchmarkConcurrentInsert(keys,hashes,count,threads);
+	benchmarkRehashWhileInserting(keys,hashes,count,4);
+	benchmarkSlicedDict(keys,hashes,count,4);
+	for (j = 0; j < count; j++) zfree(keys[j]);
+	zfree(keys);
+	zfree(hashes);
 	return 0;
 }
 #endif
@@ -66,6 +66,7 @@ typedef struct dictType {
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
     int (*expandAllowed)(size_t moreMem, double usedRatio);
+    int (*keySlice)(const void *key);   /* Slice of a key, see dictCreateSliced(). */
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -77,15 +78,35 @@ typedef struct dictht {
     unsigned long used;
 } dictht;
 
+struct dictSlices;
+
 typedef struct dict {
     dictType *type;
     void *privdata;
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int16_t pauserehash; /* If >0 rehashing is paused (<0 indicates coding error) */
+    int concurrent; /* If >0 other threads use the dict, see dictEnableConcurrency() */
+    int rehashbusy; /* A thread is moving keys of the concurrent dict */
     int isBig;
+    struct dictSlices *slices; /* Tables of a sliced dict, see dictCreateSliced() */
+    struct dict *parent; /* Sliced dict this dict is a slice of */
+    int slice; /* Index of the slice in the parent, -1 if not a slice */
 } dict;
 
+/* A sliced dict has no table of its own: every key goes in the dict of its
+ * slice, created with its first key and resized on its own. ht[0].used and
+ * ht[0].size of the sliced dict count the keys and buckets of all its
+ * slices, rehashidx+1 the slices being rehashed. */
+typedef struct dictSlices {
+    dict **d;               /* NULL for the slices without a table yet. */
+    int count;              /* A power of two. */
+    int bits;
+    long long *tree;        /* Keys per slice as a Fenwick tree, to pick keys fairly. */
+    int tree_stale;         /* Not maintained while the dict is concurrent. */
+    int rehash_next;        /* Slice dictRehash() continues from. */
+} dictSlices;
+
 /* If safe is set to 1 this is a safe iterator, that means, you can call
  * dictAdd, dictFind, and other functions against the dictionary even while
  * iterating. Otherwise it is a non safe iterator, and only dictNext()
@@ -97,6 +118,7 @@ typedef struct dictIterator {
     dictEntry *entry, *nextEntry;
     /* unsafe iterator fingerprint for misuse detection. */
     long long fingerprint;
+    struct dictIterator *slice_iter; /* Of the slice 'index' of a sliced dict. */
 } dictIterator;
 
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
@@ -108,6 +130,7 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 // #define DICT_HT_INITIAL_SIZE 2048
 #define DICT_HT_INITIAL_SIZE 16384
 #define DICT_HT_BIG_INITIAL_SIZE 67108864
+#define DICT_HT_SLICE_INITIAL_SIZE 4
 //#define DICT_HT_INITIAL_SIZE 1048576
 
 /* ------------------------------- Macros ------------------------------------*/
@@ -156,6 +179,8 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsSliced(d) ((d)->slices != NULL)
+#define dictNumSlices(d) ((d)->slices ? (d)->slices->count : 0)
 #define dictPauseRehashing(d) (d)->pauserehash++
 #define dictResumeRehashing(d) (d)->pauserehash--
 
@@ -169,11 +194,14 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
 dict *dictCreateBig(dictType *type, void *privDataPtr);
+dict *dictCreateSliced(dictType *type, void *privDataPtr, int slices);
+dict *dictGetSlice(dict *d, int slice, int create);
 int dictExpand(dict *d, unsigned long size);
 int dictTryExpand(dict *d, unsigned long size);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
 dictEntry *dictAddOrFind(dict *d, void *key);
+int dictAddPrehashed(dict *d, void *key, void *val, uint64_t hash);
 int dictReplace(dict *d, void *key, void *val);
 int dictDelete(dict *d, const void *key);
 dictEntry *dictUnlink(dict *ht, const void *key);
@@ -190,6 +218,7 @@ dictEntry *dictGetRandomKey(dict *d);
 dictEntry *dictGetFairRandomKey(dict *d);
 unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
+unsigned long dictSampleChainLength(dict *d, int samples, double *avg);
 uint64_t dictGenHashFunction(const void *key, int len);
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
@@ -202,7 +231,8 @@ uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
-void dictInitLocks();
+void dictEnableConcurrency(dict *d);
+void dictDisableConcurrency(dict *d);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
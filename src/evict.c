@@ -33,6 +33,8 @@
 #include "server.h"
 #include "bio.h"
 #include "atomicvar.h"
+#include "cluster.h"
+#include "allocator.h"
 #include <math.h>
 
 /* ----------------------------------------------------------------------------
@@ -324,6 +326,13 @@ unsigned long LFUDecrAndReturn(robj *o) {
     return counter;
 }
 
+/* The memory counted against maxmemory: the zmalloc'd memory plus the slot
+ * blocks that store the K-Vs, malloc'd (or carved out of the arena) by the
+ * slot allocator without zmalloc knowing about them. */
+static size_t evictionUsedMemory(void) {
+    return zmalloc_used_memory() + r_allocator_used_memory();
+}
+
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size. This function
  * returns the sum of AOF and slaves buffer. */
@@ -376,7 +385,7 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 
     /* Check if we are over the memory usage limit. If we are not, no need
      * to subtract the slaves output buffers. We can just return ASAP. */
-    mem_reported = zmalloc_used_memory();
+    mem_reported = evictionUsedMemory();
     if (total) *total = mem_reported;
 
     /* We may return ASAP if there is no need to compute the level. */
@@ -419,7 +428,7 @@ int overMaxmemoryAfterAlloc(size_t moremem) {
     if (!server.maxmemory) return  0; /* No limit. */
 
     /* Check quickly. */
-    size_t mem_used = zmalloc_used_memory();
+    size_t mem_used = evictionUsedMemory();
     if (mem_used + moremem <= server.maxmemory) return 0;
 
     size_t overhead = freeMemoryGetNotCountedMemory();
@@ -485,6 +494,155 @@ static unsigned long evictionTimeLimitUs() {
     return ULONG_MAX;   /* No limit to eviction time */
 }
 
+/* Evicts 'key' from 'db', propagating the deletion, and returns the memory
+ * freed by the deletion alone (it may be negative). The K-Vs stored in the
+ * slot blocks are not owned by the dict destructors (see genericSetKey()):
+ * their segment is freed here, right away, as it costs no more than
+ * unlinking the key. */
+static long long evictKey(redisDb *db, sds key) {
+    robj *keyobj = createStringObject(key,sdslen(key));
+    dictEntry *de = dictFind(db->dict,key);
+    robj *val = de ? dictGetVal(de) : NULL;
+    mstime_t eviction_latency;
+    long long delta;
+    size_t blocks_mem;
+
+    propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
+    /* We compute the amount of memory freed by db*Delete() alone.
+     * It is possible that actually the memory needed to propagate
+     * the DEL in AOF and replication link is greater than the one
+     * we are freeing removing the key, but we can't account for
+     * that otherwise we would never exit the loop.
+     *
+     * Same for CSC invalidation messages generated by signalModifiedKey.
+     *
+     * AOF and Output buffer memory will be freed eventually so
+     * we only care about memory used by the key space. */
+    blocks_mem = r_allocator_used_memory();
+    delta = (long long) evictionUsedMemory();
+    latencyStartMonitor(eviction_latency);
+    if (val && segment_object_is_embedded(val)) {
+        int slot = keyHashSlot(keyobj->ptr,sdslen(keyobj->ptr));
+        robj *key_meta = (robj *)((char *)val - sizeof(robj));
+
+        pthread_mutex_lock(&server.lock_slots[slot]);
+        dbSyncDelete(db,keyobj);
+        /* While a reply references K-Vs of the slot the segment stays, it
+         * is freed later with the other orphans of its block. */
+        if (!r_allocator_slot_pinned(slot)) r_allocator_free_kv(slot,key_meta);
+        pthread_mutex_unlock(&server.lock_slots[slot]);
+    } else if (server.lazyfree_lazy_eviction) {
+        dbAsyncDelete(db,keyobj);
+    } else {
+        dbSyncDelete(db,keyobj);
+    }
+    latencyEndMonitor(eviction_latency);
+    latencyAddSampleIfNeeded("eviction-del",eviction_latency);
+    delta -= (long long) evictionUsedMemory();
+    /* Freeing a segment releases at most its block. */
+    if (r_allocator_used_memory() < blocks_mem) server.stat_evicted_blocks++;
+    server.stat_evicted_bytes += delta;
+    server.stat_evictedkeys++;
+    signalModifiedKey(NULL,db,keyobj);
+    notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
+        keyobj, db->id);
+    decrRefCount(keyobj);
+    return delta;
+}
+
+/* Returns 1 if the key, found in the block of the victim, may be evicted
+ * together with it: the policy applies to it and its score (as computed by
+ * evictionPoolPopulate()) is at least 'cold'. */
+static int evictionBlockCandidate(redisDb *db, sds key, robj *val, unsigned long long cold) {
+    dictEntry *ede = NULL;
+
+    if (!(server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) &&
+        (ede = dictFind(db->expires,key)) == NULL) return 0;
+
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU)
+        return estimateObjectIdleTime(val) >= cold;
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        return 255-LFUDecrAndReturn(val) >= cold;
+    if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+        return ULLONG_MAX - (long)dictGetVal(ede) >= cold;
+    return 1; /* Random policies. */
+}
+
+/* allocator-evict-blocks: the segment of an evicted K-V is freed, but its
+ * slot block is released only once all of its K-Vs are gone, so evicting
+ * the sampled keys one by one barely lowers the memory of the blocks: the
+ * victims are spread over all the blocks. Instead the block of the victim is
+ * scanned and its K-Vs that are at least as cold as 'cold' (the K-Vs the
+ * eviction pool would pick next anyway), or all of them with the random
+ * policies, are evicted with it, up to EVICT_BLOCK_MAX_KEYS. The segments of
+ * the block that are no longer in the keyspace (deleted keys, the dict
+ * destructors don't free them) are freed as well. If the block is then still
+ * there but sparse, its slot is compacted, which releases the sparsest block.
+ *
+ * Returns the memory freed, 'keys_freed' is incremented by the evicted keys. */
+#define EVICT_BLOCK_MAX_KEYS 1024
+static long long evictSlotBlock(redisDb *db, sds victim, unsigned long long cold, int *keys_freed) {
+    int slot = keyHashSlot(victim,sdslen(victim));
+    robj *val = dictGetVal(dictFind(db->dict,victim));
+    robj *victim_meta = (robj *)((char *)val - sizeof(robj));
+    sds *keys = zmalloc(sizeof(sds)*EVICT_BLOCK_MAX_KEYS);
+    robj **orphans = zmalloc(sizeof(robj *)*EVICT_BLOCK_MAX_KEYS);
+    int nkeys = 0, norphans = 0;
+    long long freed = 0, delta, released = server.stat_evicted_blocks;
+    segment_iterator_t iter;
+    robj *key_meta, *val_meta;
+
+    keys[nkeys++] = sdsdup(victim);
+    /* Writers of the slot (the migration thread, SHADOWAPPLY) change its
+     * blocks under the slot lock. */
+    pthread_mutex_lock(&server.lock_slots[slot]);
+    segment_iterator_init_block(&iter,slot,victim_meta,SEGMENT_ITER_READONLY);
+    while (nkeys < EVICT_BLOCK_MAX_KEYS && norphans < EVICT_BLOCK_MAX_KEYS &&
+           segment_iterator_next(&iter,&key_meta,&val_meta))
+    {
+        sds key = segment_object_data(key_meta);
+        dictEntry *de;
+
+        if (key_meta == victim_meta) continue;
+        de = dictFind(db->dict,key);
+        /* An overwrite in place (dbOverwriteNoFree()) keeps the key of the
+         * old segment and the value of the new one: a segment is an orphan
+         * only if the dict uses neither. */
+        if (de == NULL ||
+            (dictGetKey(de) != key && dictGetVal(de) != val_meta))
+        {
+            orphans[norphans++] = key_meta;
+        } else if (dictGetVal(de) == val_meta &&
+                   evictionBlockCandidate(db,key,val_meta,cold))
+        {
+            keys[nkeys++] = sdsdup(key);
+        }
+    }
+
+    delta = (long long) evictionUsedMemory();
+    for (int j = 0; j < norphans; j++) r_allocator_free_kv(slot,orphans[j]);
+    pthread_mutex_unlock(&server.lock_slots[slot]);
+    for (int j = 0; j < nkeys; j++) {
+        if (dictFind(db->dict,keys[j])) {
+            freed += evictKey(db,keys[j]);
+            (*keys_freed)++;
+        }
+        sdsfree(keys[j]);
+    }
+    if (server.stat_evicted_blocks == released) {
+        slot_usage_t usage = r_allocator_get_block_usage(slot,victim_meta);
+        if (usage.bytes_used*100 < usage.bytes_blocks*server.allocator_compact_threshold)
+            server.stat_evicted_blocks += slotCompactSlot(slot);
+    }
+    delta -= (long long) evictionUsedMemory();
+    /* What evictKey() did not see: the orphans and the compaction. */
+    server.stat_evicted_bytes += delta - freed;
+
+    zfree(keys);
+    zfree(orphans);
+    return delta;
+}
+
 /* Check that memory usage is within the current "maxmemory" limit.  If over
  * "maxmemory", attempt to free memory by evicting data (if it's safe to do so).
  *
@@ -515,8 +673,7 @@ int performEvictions(void) {
     int keys_freed = 0;
     size_t mem_reported, mem_tofree;
     long long mem_freed; /* May be negative */
-    mstime_t latency, eviction_latency;
-    long long delta;
+    mstime_t latency;
     int slaves = listLength(server.slaves);
     int result = EVICT_FAIL;
 
@@ -539,6 +696,7 @@ int performEvictions(void) {
         int j, k, i;
         static unsigned int next_db = 0;
         sds bestkey = NULL;
+        unsigned long long cold = 0; /* See evictSlotBlock(). */
         int bestdbid;
         redisDb *db;
         dict *dict;
@@ -580,6 +738,7 @@ int performEvictions(void) {
                     }
 
                     /* Remove the entry from the pool. */
+                    cold = pool[k].idle;
                     if (pool[k].key != pool[k].cached)
                         sdsfree(pool[k].key);
                     pool[k].key = NULL;
@@ -589,6 +748,13 @@ int performEvictions(void) {
                      * a ghost and we need to try the next element. */
                     if (de) {
                         bestkey = dictGetKey(de);
+                        /* The least cold candidate left in the pool. */
+                        for (i = 0; i < k; i++) {
+                            if (pool[i].key) {
+                                cold = pool[i].idle;
+                                break;
+                            }
+                        }
                         break;
                     } else {
                         /* Ghost... Iterate again. */
@@ -620,37 +786,22 @@ int performEvictions(void) {
 
         /* Finally remove the selected key. */
         if (bestkey) {
+            int block_pass = 0;
             db = server.db+bestdbid;
-            robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-            propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
-            /* We compute the amount of memory freed by db*Delete() alone.
-             * It is possible that actually the memory needed to propagate
-             * the DEL in AOF and replication link is greater than the one
-             * we are freeing removing the key, but we can't account for
-             * that otherwise we would never exit the loop.
-             *
-             * Same for CSC invalidation messages generated by signalModifiedKey.
-             *
-             * AOF and Output buffer memory will be freed eventually so
-             * we only care about memory used by the key space. */
-            delta = (long long) zmalloc_used_memory();
-            latencyStartMonitor(eviction_latency);
-            if (server.lazyfree_lazy_eviction)
-                dbAsyncDelete(db,keyobj);
-            else
-                dbSyncDelete(db,keyobj);
-            latencyEndMonitor(eviction_latency);
-            latencyAddSampleIfNeeded("eviction-del",eviction_latency);
-            delta -= (long long) zmalloc_used_memory();
-            mem_freed += delta;
-            server.stat_evictedkeys++;
-            signalModifiedKey(NULL,db,keyobj);
-            notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
-                keyobj, db->id);
-            decrRefCount(keyobj);
-            keys_freed++;
-
-            if (keys_freed % 16 == 0) {
+            if (server.allocator_evict_blocks) {
+                robj *val = dictGetVal(dictFind(db->dict,bestkey));
+                int slot = keyHashSlot(bestkey,sdslen(bestkey));
+                block_pass = segment_object_is_embedded(val) &&
+                    !slotCompactIsMigrating(slot) && !r_allocator_slot_pinned(slot);
+            }
+            if (block_pass) {
+                mem_freed += evictSlotBlock(db,bestkey,cold,&keys_freed);
+            } else {
+                mem_freed += evictKey(db,bestkey);
+                keys_freed++;
+            }
+
+            if (keys_freed % 16 == 0 || block_pass) {
                 /* When the memory to free starts to be big enough, we may
                  * start spending so much time here that is impossible to
                  * deliver data to the replicas fast enough, so we force the
@@ -0,0 +1,761 @@
+/* Transports of the slot migration without RDMA NICs.
+ *
+ * The transfer engine (rdma_engine.c) writes the blocks of the migrating
+ * slots through a backend: post chains of writes, poll their completions,
+ * register the local blocks. With RDMA the writes are one-sided and the NIC
+ * of the recipient places the data. The backends here emulate that on hosts
+ * without RDMA: the donor streams every write (remote address, rkey, length
+ * and the block itself) and a receiver thread of the recipient places the
+ * data in the block and acknowledges the signaled writes, which completes
+ * them on the donor. The recipient checks every write against the blocks it
+ * exposed for the migration, like the NIC checks the rkey.
+ *
+ * TCP: a connection per migration. Large blocks are sent with MSG_ZEROCOPY
+ * where the kernel supports it and received straight into the block.
+ *
+ * SHM: a ring in POSIX shared memory, for a donor and a recipient on the
+ * same host. The donor copies the writes into the ring, the receiver copies
+ * them out into the blocks, and the completions come back in a second ring. */
+
+#include "fmacros.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "migration_transport.h"
+#include "anet.h"
+#include "rax.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+#include "util.h"
+
+#define MT_MAGIC 0x4d545752         /* "MTWR" */
+#define MT_SIGNALED (1<<0)
+#define MT_ZEROCOPY_MIN (16*1024)   /* Smaller sends are cheaper to copy. */
+#define MT_SHM_DONE_SLOTS 4096      /* More than the signaled WRs of any window. */
+#define MT_IDLE_SPINS 1024          /* Empty polls of the receiver before it sleeps. */
+
+/* A write as sent by the donor, followed by 'length' bytes of data. The
+ * integers are little endian on the wire. */
+struct mt_write {
+    uint64_t remote_addr;
+    uint64_t wr_id;
+    uint32_t length;
+    uint32_t rkey;
+    uint32_t flags;
+    uint32_t magic;
+};
+
+/* The acknowledgement of a signaled write. */
+struct mt_ack {
+    uint64_t wr_id;
+    uint32_t status;        /* 0, or 1 if this or a previous write was rejected. */
+    uint32_t magic;
+};
+
+static void mtWriteEncode(struct mt_write *w) {
+    memrev64ifbe(&w->remote_addr);
+    memrev64ifbe(&w->wr_id);
+    memrev32ifbe(&w->length);
+    memrev32ifbe(&w->rkey);
+    memrev32ifbe(&w->flags);
+    memrev32ifbe(&w->magic);
+}
+
+static void mtAckEncode(struct mt_ack *a) {
+    memrev64ifbe(&a->wr_id);
+    memrev32ifbe(&a->status);
+    memrev32ifbe(&a->magic);
+}
+
+/* The shared memory of the SHM transport. Both sides run on the same host,
+ * so the fields are in host order. Each counter is written by one side only
+ * and has a cache line of its own. */
+struct mt_shm_ring {
+    uint64_t magic;
+    uint64_t size;              /* Bytes of data[], a power of two. */
+    char pad0[48];
+    uint64_t head;              /* Bytes written by the donor. */
+    char pad1[56];
+    uint64_t tail;              /* Bytes consumed by the receiver. */
+    char pad2[56];
+    uint64_t done_head;         /* Completions posted by the receiver. */
+    char pad3[56];
+    uint64_t done_tail;         /* Completions consumed by the donor. */
+    char pad4[56];
+    struct mt_ack done[MT_SHM_DONE_SLOTS];
+    char data[];
+};
+
+#define MT_SHM_RECORD(len) ((sizeof(struct mt_write) + (len) + 7) & ~(size_t)7)
+
+static void mtShmName(char *buf, size_t len, const char *port) {
+    snprintf(buf, len, "/redis-migration-%s", port);
+}
+
+static void mtShmCopyIn(struct mt_shm_ring *r, uint64_t pos, const void *src, size_t len) {
+    size_t off = pos & (r->size - 1), first = r->size - off;
+    if (first >= len) {
+        memcpy(r->data + off, src, len);
+    } else {
+        memcpy(r->data + off, src, first);
+        memcpy(r->data, (const char *) src + first, len - first);
+    }
+}
+
+static void mtShmCopyOut(struct mt_shm_ring *r, uint64_t pos, void *dst, size_t len) {
+    size_t off = pos & (r->size - 1), first = r->size - off;
+    if (first >= len) {
+        memcpy(dst, r->data + off, len);
+    } else {
+        memcpy(dst, r->data + off, first);
+        memcpy((char *) dst + first, r->data, len - first);
+    }
+}
+
+static const char *mt_names[] = {"rdma", "tcp", "shm"};
+
+int migration_transport_by_name(const char *name) {
+    for (size_t j = 0; j < sizeof(mt_names) / sizeof(mt_names[0]); j++) {
+        if (!strcasecmp(name, mt_names[j])) return j;
+    }
+    return -1;
+}
+
+const char *migration_transport_name(int transport) {
+    if (transport < 0 || transport >= (int) (sizeof(mt_names) / sizeof(mt_names[0]))) return NULL;
+    return mt_names[transport];
+}
+
+/* ------------------------------- Receiver ----------------------------------*/
+
+struct migration_receiver {
+    int transport;
+    uint32_t rkey;              /* The rkey of every exposed block. */
+    pthread_mutex_t lock;       /* blocks and stats. */
+    rax *blocks;                /* Big endian block address -> length. */
+    struct migration_receiver_stats stats;
+    pthread_t thread;
+    volatile int stop;
+    int listen_fd;              /* TCP */
+    int conn_fd;
+    char shm_name[64];          /* SHM */
+    struct mt_shm_ring *ring;
+    size_t ring_len;
+};
+
+uint32_t migration_receiver_expose(struct migration_receiver *r, void *addr, size_t len) {
+    uint64_t key = htonu64((uint64_t) (uintptr_t) addr);
+
+    pthread_mutex_lock(&r->lock);
+    raxInsert(r->blocks, (unsigned char *) &key, sizeof(key), (void *) (uintptr_t) len, NULL);
+    pthread_mutex_unlock(&r->lock);
+    return r->rkey;
+}
+
+void migration_receiver_unexpose(struct migration_receiver *r, void *addr) {
+    uint64_t key = htonu64((uint64_t) (uintptr_t) addr);
+
+    pthread_mutex_lock(&r->lock);
+    raxRemove(r->blocks, (unsigned char *) &key, sizeof(key), NULL);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Returns 1 if the write falls inside an exposed block, and accounts it. */
+static int mtReceiverCheck(struct migration_receiver *r, uint64_t addr, uint32_t len, uint32_t rkey) {
+    uint64_t key = htonu64(addr);
+    raxIterator ri;
+    int ok = 0;
+
+    pthread_mutex_lock(&r->lock);
+    if (rkey == r->rkey) {
+        raxStart(&ri, r->blocks);
+        raxSeek(&ri, "<=", (unsigned char *) &key, sizeof(key));
+        if (raxNext(&ri)) {
+            uint64_t start;
+            memcpy(&start, ri.key, sizeof(start));
+            start = ntohu64(start);
+            ok = addr + len <= start + (uintptr_t) ri.data;
+        }
+        raxStop(&ri);
+    }
+    if (ok) {
+        r->stats.writes++;
+        r->stats.bytes += len;
+    } else {
+        r->stats.rejected++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ok;
+}
+
+static int mtReadFull(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = recv(fd, p, len, MSG_WAITALL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mtWriteFull(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Applies the writes of one donor connection until it is closed. */
+static void mtReceiverServeTcp(struct migration_receiver *r, int fd) {
+    char scratch[64*1024];
+    uint32_t status = 0;
+    struct mt_write w;
+
+    while (mtReadFull(fd, &w, sizeof(w)) == 0) {
+        mtWriteEncode(&w);
+        if (w.magic != MT_MAGIC) break;
+        if (mtReceiverCheck(r, w.remote_addr, w.length, w.rkey)) {
+            if (mtReadFull(fd, (void *) (uintptr_t) w.remote_addr, w.length) == -1) break;
+        } else {
+            /* Drop the data, the donor learns it with the next ack. */
+            size_t left = w.length;
+            status = 1;
+            while (left) {
+                size_t n = left < sizeof(scratch) ? left : sizeof(scratch);
+                if (mtReadFull(fd, scratch, n) == -1) return;
+                left -= n;
+            }
+        }
+        if (w.flags & MT_SIGNALED) {
+            struct mt_ack a = { w.wr_id, status, MT_MAGIC };
+            mtAckEncode(&a);
+            if (mtWriteFull(fd, &a, sizeof(a)) == -1) break;
+            status = 0;
+        }
+    }
+}
+
+static void *mtReceiverTcpMain(void *arg) {
+    struct migration_receiver *r = arg;
+    char err[ANET_ERR_LEN], ip[64];
+    int port;
+
+    while (!r->stop) {
+        int fd = anetTcpAccept(err, r->listen_fd, ip, sizeof(ip), &port);
+        if (fd == ANET_ERR) {
+            if (r->stop || errno == EBADF || errno == EINVAL) break;
+            continue;
+        }
+        anetEnableTcpNoDelay(NULL, fd);
+        r->conn_fd = fd;
+        mtReceiverServeTcp(r, fd);
+        r->conn_fd = -1;
+        close(fd);
+    }
+    return NULL;
+}
+
+static void *mtReceiverShmMain(void *arg) {
+    struct migration_receiver *r = arg;
+    struct mt_shm_ring *ring = r->ring;
+    uint32_t status = 0;
+    int idle = 0;
+
+    while (!r->stop) {
+        uint64_t tail = ring->tail;
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            if (++idle < MT_IDLE_SPINS) {
+                sched_yield();
+            } else {
+                usleep(50);
+            }
+            continue;
+        }
+        idle = 0;
+
+        struct mt_write w;
+        mtShmCopyOut(ring, tail, &w, sizeof(w));
+        if (w.magic != MT_MAGIC) {
+            status = 1;
+            w.length = 0;
+            w.flags = MT_SIGNALED;
+        } else if (mtReceiverCheck(r, w.remote_addr, w.length, w.rkey)) {
+            mtShmCopyOut(ring, tail + sizeof(w), (void *) (uintptr_t) w.remote_addr, w.length);
+        } else {
+            status = 1;
+        }
+        __atomic_store_n(&ring->tail, tail + MT_SHM_RECORD(w.length), __ATOMIC_RELEASE);
+
+        if (w.flags & MT_SIGNALED) {
+            uint64_t head = ring->done_head;
+            while (head - __atomic_load_n(&ring->done_tail, __ATOMIC_ACQUIRE) == MT_SHM_DONE_SLOTS) {
+                if (r->stop) return NULL;
+                sched_yield();
+            }
+            ring->done[head % MT_SHM_DONE_SLOTS].wr_id = w.wr_id;
+            ring->done[head % MT_SHM_DONE_SLOTS].status = status;
+            __atomic_store_n(&ring->done_head, head + 1, __ATOMIC_RELEASE);
+            status = 0;
+        }
+    }
+    return NULL;
+}
+
+struct migration_receiver *migration_receiver_start(int transport, const char *bindaddr, const char *port,
+                                                     char *err, size_t errlen) {
+    struct migration_receiver *r = zcalloc(sizeof(*r));
+    void *(*main)(void *);
+
+    r->transport = transport;
+    r->listen_fd = r->conn_fd = -1;
+    r->blocks = raxNew();
+    pthread_mutex_init(&r->lock, NULL);
+    /* Only the donor is told the rkey, that a peer reaching the port must
+     * present to write the exposed blocks. */
+    getRandomBytes((unsigned char *) &r->rkey, sizeof(r->rkey));
+
+    if (transport == MIGRATION_TRANSPORT_TCP) {
+        char aerr[ANET_ERR_LEN];
+        if (bindaddr && strchr(bindaddr, ':'))
+            r->listen_fd = anetTcp6Server(aerr, atoi(port), (char *) bindaddr, 1);
+        else
+            r->listen_fd = anetTcpServer(aerr, atoi(port), (char *) bindaddr, 1);
+        if (r->listen_fd == ANET_ERR) {
+            snprintf(err, errlen, "%s", aerr);
+            goto error;
+        }
+        if (anetBlock(aerr, r->listen_fd) == ANET_ERR) {
+            snprintf(err, errlen, "%s", aerr);
+            goto error;
+        }
+        main = mtReceiverTcpMain;
+    } else if (transport == MIGRATION_TRANSPORT_SHM) {
+        r->ring_len = sizeof(struct mt_shm_ring) + MIGRATION_SHM_RING_SIZE;
+        mtShmName(r->shm_name, sizeof(r->shm_name), port);
+        shm_unlink(r->shm_name);
+        int fd = shm_open(r->shm_name, O_CREAT|O_EXCL|O_RDWR, 0600);
+        if (fd == -1 || ftruncate(fd, r->ring_len) == -1) {
+            snprintf(err, errlen, "shared memory %s: %s", r->shm_name, strerror(errno));
+            if (fd != -1) close(fd);
+            goto error;
+        }
+        r->ring = mmap(NULL, r->ring_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (r->ring == MAP_FAILED) {
+            r->ring = NULL;
+            snprintf(err, errlen, "mmap %s: %s", r->shm_name, strerror(errno));
+            goto error;
+        }
+        r->ring->size = MIGRATION_SHM_RING_SIZE;
+        __atomic_store_n(&r->ring->magic, MT_MAGIC, __ATOMIC_RELEASE);
+        main = mtReceiverShmMain;
+    } else {
+        snprintf(err, errlen, "the transport has no receiver");
+        goto error;
+    }
+
+    if (pthread_create(&r->thread, NULL, main, r) != 0) {
+        snprintf(err, errlen, "can't create the receiver thread");
+        goto error;
+    }
+    return r;
+
+error:
+    if (r->listen_fd != -1) close(r->listen_fd);
+    if (r->ring) munmap(r->ring, r->ring_len);
+    if (r->shm_name[0]) shm_unlink(r->shm_name);
+    raxFree(r->blocks);
+    zfree(r);
+    return NULL;
+}
+
+void migration_receiver_stop(struct migration_receiver *r) {
+    r->stop = 1;
+    if (r->listen_fd != -1) shutdown(r->listen_fd, SHUT_RDWR);
+    if (r->conn_fd != -1) shutdown(r->conn_fd, SHUT_RDWR);
+    pthread_join(r->thread, NULL);
+    if (r->listen_fd != -1) close(r->listen_fd);
+    if (r->ring) {
+        munmap(r->ring, r->ring_len);
+        shm_unlink(r->shm_name);
+    }
+    raxFree(r->blocks);
+    pthread_mutex_destroy(&r->lock);
+    zfree(r);
+}
+
+int migration_receiver_transport(struct migration_receiver *r) {
+    return r->transport;
+}
+
+struct migration_receiver_stats migration_receiver_get_stats(struct migration_receiver *r) {
+    struct migration_receiver_stats st;
+
+    pthread_mutex_lock(&r->lock);
+    st = r->stats;
+    pthread_mutex_unlock(&r->lock);
+    return st;
+}
+
+/* ---------------------------- Donor backends -------------------------------*/
+
+/* The blocks are read by the CPU (or the kernel), nothing to register. */
+static int mtRegister(void *ctx, char *addr, size_t len, void **mr, uint32_t *lkey) {
+    (void) ctx;
+    (void) addr;
+    (void) len;
+    *mr = NULL;
+    *lkey = 0;
+    return 0;
+}
+
+static void mtDeregister(void *ctx, void *mr) {
+    (void) ctx;
+    (void) mr;
+}
+
+struct mt_tcp_ctx {
+    int fd;
+    int zerocopy;               /* SO_ZEROCOPY is set on the socket. */
+    long long zerocopy_pending; /* Zero copy sends not reported done yet. */
+    char acks[sizeof(struct mt_ack) * RDMA_ENGINE_POLL_BATCH];
+    size_t acks_len;
+};
+
+/* Reads the notifications of the zero copy sends the kernel is done with. */
+static void mtTcpReapZerocopy(struct mt_tcp_ctx *t) {
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while (t->zerocopy_pending) {
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(t->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) break;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno == 0 && ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                t->zerocopy_pending -= (long long) (ee->ee_data - ee->ee_info) + 1;
+        }
+    }
+#else
+    (void) t;
+#endif
+}
+
+/* Sends 'len' bytes of 'buf'. With MSG_ZEROCOPY the kernel reads the pages
+ * after the call returns, fine for the blocks that stay locked until their
+ * write completes, not for a header on the stack. */
+static int mtTcpSend(struct mt_tcp_ctx *t, const char *buf, size_t len, int flags) {
+    while (len) {
+        ssize_t n = send(t->fd, buf, len, flags|MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == ENOBUFS && flags) {
+            /* Out of memory to pin the pages: copy the rest. */
+            mtTcpReapZerocopy(t);
+            flags = 0;
+            continue;
+        }
+        if (n <= 0) return -1;
+#ifdef MSG_ZEROCOPY
+        if (flags & MSG_ZEROCOPY) t->zerocopy_pending++;
+#endif
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mtTcpPost(void *ctx, struct rdma_engine_wr *wrs, int n) {
+    struct mt_tcp_ctx *t = ctx;
+
+    for (int i = 0; i < n; i++) {
+        struct mt_write w = { wrs[i].remote_addr, wrs[i].wr_id, wrs[i].length, wrs[i].rkey,
+                              wrs[i].signaled ? MT_SIGNALED : 0, MT_MAGIC };
+        int flags = 0;
+
+        mtWriteEncode(&w);
+#ifdef MSG_ZEROCOPY
+        if (t->zerocopy && wrs[i].length >= MT_ZEROCOPY_MIN) flags = MSG_ZEROCOPY;
+#endif
+        if (mtTcpSend(t, (char *) &w, sizeof(w), MSG_MORE) == -1 ||
+            mtTcpSend(t, wrs[i].local_addr, wrs[i].length, flags) == -1) return -1;
+    }
+    return 0;
+}
+
+static int mtTcpPoll(void *ctx, struct rdma_engine_wc *wc, int max) {
+    struct mt_tcp_ctx *t = ctx;
+    int got = 0;
+
+    mtTcpReapZerocopy(t);
+    if (max > RDMA_ENGINE_POLL_BATCH) max = RDMA_ENGINE_POLL_BATCH;
+    ssize_t n = recv(t->fd, t->acks + t->acks_len, sizeof(struct mt_ack) * max - t->acks_len, MSG_DONTWAIT);
+    if (n == 0) return -1;
+    if (n == -1) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    t->acks_len += n;
+
+    size_t used = 0;
+    while (t->acks_len - used >= sizeof(struct mt_ack)) {
+        struct mt_ack a;
+        memcpy(&a, t->acks + used, sizeof(a));
+        mtAckEncode(&a);
+        if (a.magic != MT_MAGIC) return -1;
+        wc[got].wr_id = a.wr_id;
+        wc[got].status = a.status;
+        got++;
+        used += sizeof(a);
+    }
+    memmove(t->acks, t->acks + used, t->acks_len - used);
+    t->acks_len -= used;
+    return got;
+}
+
+static void mtTcpRelease(void *ctx) {
+    struct mt_tcp_ctx *t = ctx;
+    close(t->fd);
+    zfree(t);
+}
+
+struct mt_shm_ctx {
+    struct mt_shm_ring *ring;
+    size_t ring_len;
+};
+
+static int mtShmPost(void *ctx, struct rdma_engine_wr *wrs, int n) {
+    struct mt_shm_ring *ring = ((struct mt_shm_ctx *) ctx)->ring;
+    size_t piece_max = ring->size / 4;
+
+    for (int i = 0; i < n; i++) {
+        size_t off = 0;
+        do {
+            size_t piece = wrs[i].length - off < piece_max ? wrs[i].length - off : piece_max;
+            int last = off + piece == wrs[i].length;
+            struct mt_write w = { wrs[i].remote_addr + off, wrs[i].wr_id, piece, wrs[i].rkey,
+                                  last && wrs[i].signaled ? MT_SIGNALED : 0, MT_MAGIC };
+            uint64_t head = ring->head;
+
+            /* Wait for the receiver to make room. */
+            while (ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < MT_SHM_RECORD(piece))
+                sched_yield();
+            mtShmCopyIn(ring, head, &w, sizeof(w));
+            mtShmCopyIn(ring, head + sizeof(w), wrs[i].local_addr + off, piece);
+            __atomic_store_n(&ring->head, head + MT_SHM_RECORD(piece), __ATOMIC_RELEASE);
+            off += piece;
+        } while (off < wrs[i].length);
+    }
+    return 0;
+}
+
+static int mtShmPoll(void *ctx, struct rdma_engine_wc *wc, int max) {
+    struct mt_shm_ring *ring = ((struct mt_shm_ctx *) ctx)->ring;
+    uint64_t tail = ring->done_tail, head = __atomic_load_n(&ring->done_head, __ATOMIC_ACQUIRE);
+    int got = 0;
+
+    while (tail < head && got < max) {
+        wc[got].wr_id = ring->done[tail % MT_SHM_DONE_SLOTS].wr_id;
+        wc[got].status = ring->done[tail % MT_SHM_DONE_SLOTS].status;
+        got++;
+        tail++;
+    }
+    __atomic_store_n(&ring->done_tail, tail, __ATOMIC_RELEASE);
+    return got;
+}
+
+static void mtShmRelease(void *ctx) {
+    struct mt_shm_ctx *s = ctx;
+    munmap(s->ring, s->ring_len);
+    zfree(s);
+}
+
+static int mtTcpConnect(const char *host, const char *port, char *err, size_t errlen) {
+    struct addrinfo hints = {0}, *servinfo, *p;
+    int rv, fd = -1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+        snprintf(err, errlen, "%s", gai_strerror(rv));
+        return -1;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) snprintf(err, errlen, "connect to %s:%s: %s", host, port, strerror(errno));
+    freeaddrinfo(servinfo);
+    return fd;
+}
+
+int migration_transport_connect(int transport, const char *host, const char *port,
+                                struct rdma_engine_backend *b, char *err, size_t errlen)
+{
+    b->register_block = mtRegister;
+    b->deregister_block = mtDeregister;
+
+    if (transport == MIGRATION_TRANSPORT_TCP) {
+        int fd = mtTcpConnect(host, port, err, errlen);
+        if (fd == -1) return -1;
+
+        struct mt_tcp_ctx *t = zcalloc(sizeof(*t));
+        int one = 1;
+        t->fd = fd;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_ZEROCOPY
+        t->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+        b->name = t->zerocopy ? "tcp-zerocopy" : "tcp";
+        b->ctx = t;
+        b->post_write_chain = mtTcpPost;
+        b->poll_completions = mtTcpPoll;
+        b->release = mtTcpRelease;
+        return 0;
+    } else if (transport == MIGRATION_TRANSPORT_SHM) {
+        char name[64];
+        struct stat st;
+        mtShmName(name, sizeof(name), port);
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct mt_shm_ring)) {
+            snprintf(err, errlen, "shared memory %s: %s (is the recipient on this host?)",
+                     name, fd == -1 ? strerror(errno) : "too small");
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        struct mt_shm_ring *ring = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ring == MAP_FAILED) {
+            snprintf(err, errlen, "mmap %s: %s", name, strerror(errno));
+            return -1;
+        }
+        if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != MT_MAGIC ||
+            sizeof(struct mt_shm_ring) + ring->size != (size_t) st.st_size) {
+            snprintf(err, errlen, "shared memory %s: not a migration ring", name);
+            munmap(ring, st.st_size);
+            return -1;
+        }
+
+        struct mt_shm_ctx *s = zcalloc(sizeof(*s));
+        s->ring = ring;
+        s->ring_len = st.st_size;
+        b->name = "shm";
+        b->ctx = s;
+        b->post_write_chain = mtShmPost;
+        b->poll_completions = mtShmPoll;
+        b->release = mtShmRelease;
+        return 0;
+    }
+    snprintf(err, errlen, "the transport has no software backend");
+    return -1;
+}
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef REDIS_TEST
+
+#include "monotonic.h"
+
+static int migrationTransportTestRun(int transport, const char *name, const char *port,
+                                     long blocks, size_t block_size, char *src, char *dst)
+{
+    char err[256];
+    struct rdma_engine_backend b;
+    struct migration_receiver *r = migration_receiver_start(transport, "127.0.0.1", port, err, sizeof(err));
+    int failed = 0;
+
+    if (r == NULL) {
+        printf("%s: no receiver (%s), skipped\n", name, err);
+        return 0;
+    }
+    if (migration_transport_connect(transport, "127.0.0.1", port, &b, err, sizeof(err)) == -1) {
+        printf("[failed] %s: %s\n", name, err);
+        migration_receiver_stop(r);
+        return 1;
+    }
+
+    struct rdma_engine *e = rdma_engine_create(&b, RDMA_ENGINE_DEFAULT_WINDOW, RDMA_ENGINE_DEFAULT_SIGNAL_EVERY);
+    struct rdma_write_block *wb = zcalloc(sizeof(*wb) * (blocks + 1));
+    uint32_t rkey = 0;
+    for (long j = 0; j < blocks; j++) rkey = migration_receiver_expose(r, dst + j * block_size, block_size);
+    for (long j = 0; j < blocks; j++) {
+        wb[j].local_addr = src + j * block_size;
+        wb[j].length = block_size;
+        wb[j].remote_addr = (uint64_t) (uintptr_t) (dst + j * block_size);
+        wb[j].rkey = rkey;
+    }
+    memset(dst, 0, blocks * block_size);
+    if (rdma_engine_write(e, wb, blocks) != 0 || memcmp(src, dst, blocks * block_size) != 0) {
+        printf("[failed] %s: the blocks were not copied\n", name);
+        failed = 1;
+    }
+    printf("%s (%s): %ld blocks of %zu bytes in %.3f ms: %.2f GB/s, latency p50 %lld us p99 %lld us\n",
+           name, b.name, blocks, block_size, (double) e->stats.usec / 1000, rdma_engine_gbps(e),
+           (long long) hdr_value_at_percentile(e->stats.latency, 50),
+           (long long) hdr_value_at_percentile(e->stats.latency, 99));
+
+    /* A write past the exposed blocks is rejected. */
+    migration_receiver_unexpose(r, dst + (blocks - 1) * block_size);
+    wb[0] = wb[blocks - 1];
+    rdma_engine_reset_stats(e);
+    if (rdma_engine_write(e, wb, 1) != -1 || migration_receiver_get_stats(r).rejected != 1) {
+        printf("[failed] %s: a write to a block that is not exposed was applied\n", name);
+        failed = 1;
+    }
+
+    rdma_engine_release(e);
+    migration_receiver_stop(r);
+    zfree(wb);
+    return failed;
+}
+
+/* ./redis-server test migrationtransport [<blocks> | --accurate] */
+int migrationTransportTest(int argc, char **argv, int accurate) {
+    size_t block_size = 1024 * 1024;
+    long blocks;
+    char port[16];
+    int failed = 0;
+
+    if (argc == 4) {
+        blocks = accurate ? 4096 : strtol(argv[3],NULL,10);
+    } else {
+        blocks = 512;
+    }
+
+    monotonicInit();
+    char *src = zmalloc(blocks * block_size);
+    char *dst = zmalloc(blocks * block_size);
+    for (size_t j = 0; j < blocks * block_size; j++) src[j] = (char) (j * 31 + (j >> 16));
+
+    snprintf(port, sizeof(port), "%d", 20000 + (int) (getpid() % 20000));
+    failed |= migrationTransportTestRun(MIGRATION_TRANSPORT_TCP, "tcp", port, blocks, block_size, src, dst);
+    failed |= migrationTransportTestRun(MIGRATION_TRANSPORT_SHM, "shm", port, blocks, block_size, src, dst);
+
+    zfree(src);
+    zfree(dst);
+    if (!failed) printf("migrationtransport test: OK\n");
+    return failed;
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef __MIGRATION_TRANSPORT_H
+#define __MIGRATION_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "rdma_engine.h"
+
+/* migration-transport: how the blocks of the migrating slots are written to
+ * the recipient. */
+#define MIGRATION_TRANSPORT_RDMA 0  /* RDMA WRITEs on a verbs QP. */
+#define MIGRATION_TRANSPORT_TCP 1   /* A TCP stream, MSG_ZEROCOPY if the kernel has it. */
+#define MIGRATION_TRANSPORT_SHM 2   /* A shared memory ring, donor and recipient on one host. */
+
+/* The names of the transports in the migration-transport config and in the
+ * initRDMAServer command, -1 / NULL if unknown. */
+int migration_transport_by_name(const char *name);
+const char *migration_transport_name(int transport);
+
+/* The bytes of the shared memory ring (a power of two). Larger writes are
+ * split in pieces of a quarter of the ring. */
+#define MIGRATION_SHM_RING_SIZE (64*1024*1024)
+
+/* Without RDMA the recipient runs a receiver thread that applies the writes
+ * of the donor to its blocks. The TCP receiver listens on 'bindaddr' (all the
+ * interfaces if NULL). Only the blocks exposed by the recipient can
+ * be written: the rkey of a write must be the one returned by
+ * migration_receiver_expose() and the write must fall inside the block. */
+struct migration_receiver;
+
+struct migration_receiver_stats {
+    long long writes;
+    long long bytes;
+    long long rejected;     /* Writes outside the exposed blocks. */
+};
+
+struct migration_receiver *migration_receiver_start(int transport, const char *bindaddr, const char *port,
+                                                     char *err, size_t errlen);
+void migration_receiver_stop(struct migration_receiver *r);
+int migration_receiver_transport(struct migration_receiver *r);
+uint32_t migration_receiver_expose(struct migration_receiver *r, void *addr, size_t len);
+void migration_receiver_unexpose(struct migration_receiver *r, void *addr);
+struct migration_receiver_stats migration_receiver_get_stats(struct migration_receiver *r);
+
+/* Donor side: connects to the receiver of 'host' and sets 'b' to a backend
+ * of the transfer engine writing to it. Returns 0 on success, -1 with the
+ * reason in 'err'. */
+int migration_transport_connect(int transport, const char *host, const char *port,
+                                struct rdma_engine_backend *b, char *err, size_t errlen);
+
+#ifdef REDIS_TEST
+int migrationTransportTest(int argc, char *argv[], int accurate);
+#endif
+
+#endif /* __MIGRATION_TRANSPORT_H */
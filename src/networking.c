@@ -30,10 +30,17 @@
 #include "server.h"
 #include "atomicvar.h"
 #include "cluster.h"
+#include "allocator.h"
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <math.h>
 #include <ctype.h>
+#include <limits.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static void setProtocolError(const char *errstr, client *c);
 int postponeClientRead(client *c);
@@ -78,12 +85,16 @@ size_t getStringObjectLen(robj *o) {
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
-    memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    size_t buflen = old->ref ? 0 : old->size;
+    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + buflen);
+    memcpy(buf, o, sizeof(clientReplyBlock) + buflen);
+    if (buf->ref) r_allocator_pin_slot(buf->slot);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *block = o;
+    if (block->ref) r_allocator_unpin_slot(block->slot);
     zfree(o);
 }
 
@@ -145,6 +156,7 @@ client *createClient(connection *conn) {
     c->argc = 0;
     c->argv = NULL;
     c->argv_len_sum = 0;
+    c->argv_cached = 0;
     c->original_argc = 0;
     c->original_argv = NULL;
     c->cmd = c->lastcmd = NULL;
@@ -186,6 +198,10 @@ client *createClient(connection *conn) {
     c->sockname = NULL;
     c->client_list_node = NULL;
     c->paused_list_node = NULL;
+    c->parked_start = 0;
+    c->parked_slot = -1;
+    c->io_thread = 0;
+    c->exec_slot = -1;
     c->client_tracking_redirection = 0;
     c->client_tracking_prefixes = NULL;
     c->client_cron_last_memory_usage = 0;
@@ -362,6 +378,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable_size(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->ref = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -651,6 +668,7 @@ void setDeferredReply(client *c, void *node, const char *s, size_t length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable_size(buf) - sizeof(clientReplyBlock);
         buf->used = length;
+        buf->ref = NULL;
         memcpy(buf->buf, s, length);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -847,6 +865,56 @@ void addReplyBulk(client *c, robj *obj) {
     addReply(c,shared.crlf);
 }
 
+/* Adds a node referencing the 'len' bytes at 's', in a block of 'slot', to
+ * the reply list. The block is full (size == used): nothing is ever appended
+ * to it, and its bytes count in the output buffer limits as if copied. */
+static void _addReplyRefToList(client *c, char *s, size_t len, int slot) {
+    clientReplyBlock *ref = zmalloc(sizeof(clientReplyBlock));
+
+    ref->size = ref->used = len;
+    ref->ref = s;
+    ref->slot = slot;
+    r_allocator_pin_slot(slot);
+
+    pthread_mutex_lock(&(server.socket_mutex));
+    listAddNodeTail(c->reply,ref);
+    c->reply_bytes += ref->size;
+    closeClientOnOutputBufferLimitReached(c, 1);
+    pthread_mutex_unlock(&(server.socket_mutex));
+}
+
+/* Add the value 'obj' of a key of 'slot' as bulk reply. A value stored in a
+ * slot block and at least reply-zero-copy-threshold bytes long is not copied
+ * to the output buffers: the reply references its segment, which is sent
+ * with writev() and stays pinned until then (see r_allocator_pin_slot()).
+ * Only the bulk length and the final CRLF are copied. */
+void addReplyBulkSlotValue(client *c, int slot, robj *obj) {
+    size_t len;
+
+    if (!sdsEncodedObject(obj)) {
+        addReplyBulk(c,obj);
+        return;
+    }
+    len = sdslen(obj->ptr);
+    atomicIncr(server.stat_reply_values, 1);
+    if (server.reply_zero_copy_threshold == 0 ||
+        len < server.reply_zero_copy_threshold ||
+        !segment_object_is_embedded(obj) ||
+        !c->conn || !connHasWritev(c->conn) ||
+        c->flags & (CLIENT_LUA|CLIENT_MODULE|CLIENT_SLAVE|CLIENT_CLOSE_AFTER_REPLY))
+    {
+        atomicIncr(server.stat_reply_value_bytes_copied, len);
+        addReplyBulk(c,obj);
+        return;
+    }
+
+    if (prepareClientToWrite(c) != C_OK) return;
+    atomicIncr(server.stat_reply_value_bytes_referenced, len);
+    addReplyLongLongWithPrefix(c,len,'$');
+    _addReplyRefToList(c,obj->ptr,len,slot);
+    addReply(c,shared.crlf);
+}
+
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
     addReplyLongLongWithPrefix(c,len,'$');
@@ -1217,13 +1285,28 @@ void freeClientOriginalArgv(client *c) {
 
 static void freeClientArgv(client *c) {
     int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+    for (j = 0; j < c->argc; j++) {
+        robj *o = c->argv[j];
+
+        /* Keep the EMBSTR arguments no one else references, the parser
+         * will build the small arguments of the next commands in them. */
+        if (o->refcount == 1 && o->encoding == OBJ_ENCODING_EMBSTR &&
+            c->argv_cached < PROTO_ARGV_CACHE_SIZE)
+        {
+            c->argv_cache[c->argv_cached++] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     c->argc = 0;
     c->cmd = NULL;
     c->argv_len_sum = 0;
 }
 
+static void freeClientArgvCache(client *c) {
+    while (c->argv_cached) decrRefCount(c->argv_cache[--c->argv_cached]);
+}
+
 /* Close all the slaves connections. This is useful in chained replication
  * when we resync with our own master and want to force all our slaves to
  * resync with us as well. */
@@ -1397,6 +1480,7 @@ void freeClient(client *c) {
     listRelease(c->reply);
     freeClientArgv(c);
     freeClientOriginalArgv(c);
+    freeClientArgvCache(c);
 
     /* Unlink the client: this will close the socket, remove the I/O
      * handlers, and remove references of the client from different
@@ -1524,6 +1608,75 @@ client *lookupClientByID(uint64_t id) {
  * This function is called by threads, but always with handler_installed
  * set to 0. So when handler_installed is set to 0 the function must be
  * thread safe. */
+/* Writes the static buffer and the reply list of the client with a single
+ * writev(), up to IOV_MAX blocks and NET_MAX_WRITES_PER_EVENT bytes, then
+ * releases the blocks that were fully sent. */
+static int _writevToClient(client *c, ssize_t *nwritten) {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+    size_t iov_bytes_len = 0;
+    listIter li;
+    listNode *ln;
+    clientReplyBlock *o;
+
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf + c->sentlen;
+        iov[iovcnt].iov_len = c->bufpos - c->sentlen;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+    }
+    /* 'sentlen' applies to the first block only if the buffer is empty. */
+    size_t offset = c->bufpos > 0 ? 0 : c->sentlen;
+    listRewind(c->reply,&li);
+    while ((ln = listNext(&li)) && iovcnt < IOV_MAX &&
+           iov_bytes_len < NET_MAX_WRITES_PER_EVENT)
+    {
+        o = listNodeValue(ln);
+        if (o->used == 0) {
+            c->reply_bytes -= o->size;
+            listDelNode(c->reply,ln);
+            offset = 0;
+            continue;
+        }
+        iov[iovcnt].iov_base = replyBlockData(o) + offset;
+        iov[iovcnt].iov_len = o->used - offset;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    if (iovcnt == 0) return C_OK;
+
+    *nwritten = connWritev(c->conn,iov,iovcnt);
+    if (*nwritten <= 0) return C_ERR;
+
+    ssize_t remaining = *nwritten;
+    if (c->bufpos > 0) {
+        ssize_t buflen = c->bufpos - c->sentlen;
+        if (remaining < buflen) {
+            c->sentlen += remaining;
+            return C_OK;
+        }
+        c->bufpos = 0;
+        c->sentlen = 0;
+        remaining -= buflen;
+    }
+    while (remaining > 0) {
+        ln = listFirst(c->reply);
+        o = listNodeValue(ln);
+        if (remaining < (ssize_t)(o->used - c->sentlen)) {
+            c->sentlen += remaining;
+            break;
+        }
+        remaining -= (ssize_t)(o->used - c->sentlen);
+        c->reply_bytes -= o->size;
+        listDelNode(c->reply,ln);
+        c->sentlen = 0;
+    }
+    /* If there are no longer objects in the list, we expect
+     * the count of reply bytes to be exactly zero. */
+    if (listLength(c->reply) == 0)
+        serverAssert(c->reply_bytes == 0);
+    return C_OK;
+}
+
 int writeToClient(client *c, int handler_installed) {
     /* Update total number of writes on server */
     atomicIncr(server.stat_total_writes_processed, 1);
@@ -1533,7 +1686,15 @@ int writeToClient(client *c, int handler_installed) {
     clientReplyBlock *o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
+        /* Several blocks at once, when the connection can. Replicas keep
+         * the single writes. */
+        if (listLength(c->reply) > 0 && connHasWritev(c->conn) &&
+            !(c->flags & CLIENT_SLAVE))
+        {
+            nwritten = 0;
+            if (_writevToClient(c,&nwritten) != C_OK) break;
+            totwritten += nwritten;
+        } else if (c->bufpos > 0) {
             nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
 	    //serverLog(LL_WARNING, "STRATOS %s", c->buf+c->sentlen);
             if (nwritten <= 0) break;
@@ -1556,7 +1717,7 @@ int writeToClient(client *c, int handler_installed) {
                 continue;
             }
 
-            nwritten = connWrite(c->conn, o->buf + c->sentlen, objlen - c->sentlen);
+            nwritten = connWrite(c->conn, replyBlockData(o) + c->sentlen, objlen - c->sentlen);
             if (nwritten <= 0) break;
             c->sentlen += nwritten;
             totwritten += nwritten;
@@ -1850,6 +2011,95 @@ static void setProtocolError(const char *errstr, client *c) {
     c->flags |= (CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTOCOL_ERROR);
 }
 
+/* Return the first '\r' of the query buffer between 'p' and 'end', or NULL
+ * if there is none or if a '\0' comes first: the same result strchr() gives
+ * on the null terminated buffer, but without looking past the buffer and
+ * comparing 16 (SSE2) or 32 (AVX2) bytes at a time. */
+static inline char *protoFindCR(char *p, char *end) {
+#if defined(__AVX2__)
+    const __m256i cr32 = _mm256_set1_epi8('\r'), nul32 = _mm256_setzero_si256();
+    while (end-p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v,cr32),_mm256_cmpeq_epi8(v,nul32)));
+        if (mask) {
+            p += __builtin_ctz(mask);
+            return *p == '\r' ? p : NULL;
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i cr16 = _mm_set1_epi8('\r'), nul16 = _mm_setzero_si128();
+    while (end-p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(v,cr16),_mm_cmpeq_epi8(v,nul16)));
+        if (mask) {
+            p += __builtin_ctz(mask);
+            return *p == '\r' ? p : NULL;
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\r') return p;
+        if (*p == '\0') return NULL;
+    }
+    return NULL;
+}
+
+/* Parse the count of a multibulk or bulk header like string2ll() does. The
+ * lengths sent by clients are short runs of digits without sign or leading
+ * zeros, converted here without a branch per digit; everything else, and
+ * the numbers that may overflow, goes through string2ll(). */
+static inline int protoParseLength(const char *p, size_t len, long long *value) {
+    if (len-1 < 18 && (p[0] != '0' || len == 1)) {
+        unsigned long long v = 0;
+        unsigned int bad = 0;
+        for (size_t j = 0; j < len; j++) {
+            unsigned int digit = (unsigned char)p[j] - '0';
+            bad |= digit > 9;
+            v = v*10 + digit;
+        }
+        if (!bad) {
+            *value = v;
+            return 1;
+        }
+    }
+    return string2ll(p,len,value);
+}
+
+/* Create the object of an argument of the client. The arguments that would
+ * be EMBSTR are built in a cached object of the previous commands if one is
+ * large enough, sparing the allocator a malloc() and a free() for most of
+ * the arguments of a pipeline. */
+static robj *createClientArgument(client *c, const char *ptr, size_t len) {
+    if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT) {
+        size_t size = sizeof(robj)+sizeof(struct sdshdr8)+len+1;
+
+        for (int j = c->argv_cached-1; j >= 0; j--) {
+            robj *o = c->argv_cache[j];
+            struct sdshdr8 *sh = (void*)(o+1);
+
+            if (zmalloc_size(o) < size) continue;
+            c->argv_cache[j] = c->argv_cache[--c->argv_cached];
+            o->data_offset = 0;
+            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+                o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+            } else {
+                o->lru = LRU_CLOCK();
+            }
+            sh->len = len;
+            sh->alloc = len;
+            memcpy(sh->buf,ptr,len);
+            sh->buf[len] = '\0';
+            return o;
+        }
+    }
+    return createStringObject(ptr,len);
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -1871,7 +2121,7 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = protoFindCR(c->querybuf+c->qb_pos,c->querybuf+sdslen(c->querybuf));
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1887,7 +2137,7 @@ int processMultibulkBuffer(client *c) {
         /* We know for sure there is a whole line since newline != NULL,
          * so go ahead and find out the multi bulk length. */
         serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
-        ok = string2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
+        ok = protoParseLength(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
         if (!ok || ll > 1024*1024) {
             addReplyError(c,"Protocol error: invalid multibulk length");
             setProtocolError("invalid mbulk count",c);
@@ -1910,7 +2160,7 @@ int processMultibulkBuffer(client *c) {
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = protoFindCR(c->querybuf+c->qb_pos,c->querybuf+sdslen(c->querybuf));
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1933,7 +2183,7 @@ int processMultibulkBuffer(client *c) {
                 return C_ERR;
             }
 
-            ok = string2ll(c->querybuf+c->qb_pos+1,newline-(c->querybuf+c->qb_pos+1),&ll);
+            ok = protoParseLength(c->querybuf+c->qb_pos+1,newline-(c->querybuf+c->qb_pos+1),&ll);
             if (!ok || ll < 0 ||
                     (!(c->flags & CLIENT_MASTER) && ll > server.proto_max_bulk_len)) {
                 addReplyError(c,"Protocol error: invalid bulk length");
@@ -1984,7 +2234,7 @@ int processMultibulkBuffer(client *c) {
                 sdsclear(c->querybuf);
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                    createClientArgument(c,c->querybuf+c->qb_pos,c->bulklen);
                 c->argv_len_sum += c->bulklen;
                 c->qb_pos += c->bulklen+2;
             }
@@ -2143,6 +2393,8 @@ void processInputBuffer(client *c) {
              * execute the command here. All we can do is to flag the client
              * as one that needs to process the command. */
             if (c->flags & CLIENT_PENDING_READ) {
+                /* Unless it is a GET or SET of a slot the thread owns. */
+                if (slotExecCommand(c)) continue;
                 c->flags |= CLIENT_PENDING_COMMAND;
                 break;
             }
@@ -3453,7 +3705,6 @@ void processEventsWhileBlocked(void) {
  * Threaded I/O
  * ========================================================================== */
 
-#define IO_THREADS_MAX_NUM 128
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
 
@@ -3730,13 +3981,15 @@ int handleClientsWithPendingReadsUsingThreads(void) {
     int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
-        int target_id = item_id % server.io_threads_num;
+        int target_id = slotExecThreadOf(c, item_id % server.io_threads_num);
+        c->io_thread = target_id;
         listAddNodeTail(io_threads_list[target_id],c);
         item_id++;
     }
 
     /* Give the start condition to the waiting threads, by setting the
      * start condition atomic var. */
+    slotExecBegin();
     io_threads_op = IO_THREADS_OP_READ;
     for (int j = 1; j < server.io_threads_num; j++) {
         int count = listLength(io_threads_list[j]);
@@ -3758,6 +4011,7 @@ int handleClientsWithPendingReadsUsingThreads(void) {
             pending += getIOPendingCount(j);
         if (pending == 0) break;
     }
+    slotExecEnd();
 
     /* Run the list of clients again to process the new buffers. */
     while(listLength(server.clients_pending_read)) {
@@ -3787,3 +4041,163 @@ int handleClientsWithPendingReadsUsingThreads(void) {
 
     return processed;
 }
+
+#ifdef REDIS_TEST
+
+/* Parse all the commands in the query buffer of 'c', checking them against
+ * the 'expected' arguments. Returns the number of commands parsed, -1 if
+ * an argument is not the expected one. */
+static long respParserTestParse(client *c, sds *expected, int args, long *next, long total, int cache) {
+    long parsed = 0;
+
+    while (c->qb_pos < sdslen(c->querybuf)) {
+        if (processMultibulkBuffer(c) != C_OK) break;
+        if (c->argc != args) return -1;
+        for (int j = 0; j < args; j++) {
+            robj *o = c->argv[j];
+            sds arg = expected[(*next*args+j) % total];
+            int encoding = sdslen(arg) <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT ?
+                           OBJ_ENCODING_EMBSTR : OBJ_ENCODING_RAW;
+
+            if (o->encoding != encoding || sdslen(o->ptr) != sdslen(arg) ||
+                memcmp(o->ptr,arg,sdslen(arg)) != 0) return -1;
+        }
+        freeClientArgv(c);
+        if (!cache) freeClientArgvCache(c);
+        (*next)++;
+        parsed++;
+    }
+    sdsrange(c->querybuf,c->qb_pos,-1);
+    c->qb_pos = 0;
+    return parsed;
+}
+
+int respParserTest(int argc, char **argv, int accurate) {
+    const char charset[] = "0123456789-+ \r\n\0a";
+    char buf[64];
+    int failed = 0;
+    long commands;
+
+    if (argc == 4) {
+        if (accurate) {
+            commands = 1000000;
+        } else {
+            commands = strtol(argv[3],NULL,10);
+        }
+    } else {
+        commands = 100000;
+    }
+
+    server.hz = CONFIG_DEFAULT_HZ;
+    server.maxmemory_policy = MAXMEMORY_NO_EVICTION;
+    server.proto_max_bulk_len = 512ll*1024*1024;
+
+    /* The delimiter scan finds what strchr() finds, NUL bytes included. */
+    for (int iter = 0; iter < 100000 && !failed; iter++) {
+        char scan[128];
+        int len = rand() % (int)(sizeof(scan)-1);
+
+        for (int j = 0; j < len; j++) {
+            int r = rand() % 64;
+            scan[j] = r == 0 ? '\r' : r == 1 ? '\0' : 'a'+r%26;
+        }
+        scan[len] = '\0';
+        int start = len ? rand() % len : 0;
+        if (protoFindCR(scan+start,scan+len) != strchr(scan+start,'\r')) {
+            printf("[failed] protoFindCR() differs from strchr() at iteration %d\n", iter);
+            failed = 1;
+        }
+    }
+
+    /* The lengths are parsed like string2ll() parses them. */
+    const char *edge[] = {"", "0", "00", "01", "-0", "-1", "+1", "1 ", " 1",
+        "999999999999999999", "1000000000000000000", "9223372036854775807",
+        "9223372036854775808", "-9223372036854775808", "18446744073709551616"};
+    for (long iter = 0; iter < 1000000 && !failed; iter++) {
+        const char *p = buf;
+        size_t len;
+        long long a = 0, b = 0;
+
+        if (iter < (long)(sizeof(edge)/sizeof(edge[0]))) {
+            p = edge[iter];
+            len = strlen(p);
+        } else if (iter < 500000) {
+            len = ll2string(buf,sizeof(buf),iter);
+        } else {
+            len = rand() % 21;
+            for (size_t j = 0; j < len; j++)
+                buf[j] = rand() % 4 ? '0'+rand()%10 : charset[rand()%(sizeof(charset)-1)];
+        }
+        int oka = protoParseLength(p,len,&a), okb = string2ll(p,len,&b);
+        if (oka != okb || (oka && a != b)) {
+            printf("[failed] protoParseLength(\"%.*s\") differs from string2ll()\n", (int)len, p);
+            failed = 1;
+        }
+    }
+
+    /* A pipeline of SETs with arguments on both sides of the EMBSTR limit,
+     * parsed whole and in random pieces, with and without the argument
+     * cache. */
+    const int args = 3, distinct = 1000;
+    sds *expected = zmalloc(sizeof(sds)*distinct*args);
+    sds pipeline = sdsempty();
+    for (int j = 0; j < distinct; j++) {
+        int vlen = j % 10 == 0 ? 100+j : j % 60;
+        expected[j*args] = sdsnew("SET");
+        expected[j*args+1] = sdscatprintf(sdsempty(),"key:%d",j);
+        expected[j*args+2] = sdsgrowzero(sdsempty(),vlen);
+        memset(expected[j*args+2],'a'+j%26,vlen);
+        pipeline = sdscatprintf(pipeline,"*%d\r\n",args);
+        for (int k = 0; k < args; k++) {
+            sds arg = expected[j*args+k];
+            pipeline = sdscatprintf(pipeline,"$%zu\r\n",sdslen(arg));
+            pipeline = sdscatlen(pipeline,arg,sdslen(arg));
+            pipeline = sdscatlen(pipeline,"\r\n",2);
+        }
+    }
+
+    client *c = zcalloc(sizeof(client));
+    c->querybuf = sdsempty();
+    c->bulklen = -1;
+
+    long next = 0;
+    for (size_t pos = 0; pos < sdslen(pipeline) && !failed; ) {
+        size_t chunk = 1 + rand() % 64;
+        if (chunk > sdslen(pipeline)-pos) chunk = sdslen(pipeline)-pos;
+        c->querybuf = sdscatlen(c->querybuf,pipeline+pos,chunk);
+        pos += chunk;
+        if (respParserTestParse(c,expected,args,&next,distinct*args,1) < 0) {
+            printf("[failed] Command %ld is parsed wrong from pieces\n", next);
+            failed = 1;
+        }
+    }
+    if (!failed && next != distinct) {
+        printf("[failed] %ld commands parsed from pieces, %d expected\n", next, distinct);
+        failed = 1;
+    }
+
+    for (int cache = 0; cache <= 1 && !failed; cache++) {
+        long long start = ustime();
+        next = 0;
+        while (next < commands && !failed) {
+            c->querybuf = sdscatlen(c->querybuf,pipeline,sdslen(pipeline));
+            if (respParserTestParse(c,expected,args,&next,distinct*args,cache) != distinct) {
+                printf("[failed] Command %ld is parsed wrong\n", next);
+                failed = 1;
+            }
+        }
+        long long elapsed = ustime()-start;
+        printf("Parsed %ld commands %s the argument cache in %lld usec, %.1f ns per command\n",
+               next, cache ? "with" : "without", elapsed, (double)elapsed*1000/next);
+    }
+
+    freeClientArgvCache(c);
+    sdsfree(c->querybuf);
+    zfree(c->argv);
+    zfree(c);
+    for (int j = 0; j < distinct*args; j++) sdsfree(expected[j]);
+    zfree(expected);
+    sdsfree(pipeline);
+    return failed;
+}
+#endif
@@ -29,6 +29,8 @@
  */
 
 #include "server.h"
+#include "cluster.h"
+#include "allocator.h"
 #include <math.h>
 #include <ctype.h>
 
@@ -44,6 +46,7 @@ robj *createObject(int type, void *ptr) {
     o->encoding = OBJ_ENCODING_RAW;
     o->ptr = ptr;
     o->refcount = 1;
+    o->data_offset = 0;
 
     /* Set the LRU to the current lruclock (minutes resolution), or
      * alternatively the LFU counter. */
@@ -89,6 +92,7 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->refcount = 1;
+    o->data_offset = 0;
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
     } else {
@@ -115,7 +119,6 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
  *
  * The current limit of 44 is chosen so that the biggest string object
  * we allocate as EMBSTR will still fit into the 64 byte arena of jemalloc. */
-#define OBJ_ENCODING_EMBSTR_SIZE_LIMIT 44
 robj *createStringObject(const char *ptr, size_t len) {
     if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT)
         return createEmbeddedStringObject(ptr,len);
@@ -1304,6 +1307,9 @@ void memoryCommand(client *c) {
 "    Return internal statistics report from the memory allocator.",
 "PURGE",
 "    Attempt to purge dirty pages for reclamation by the allocator.",
+"SLOT-FRAG [<slot> ...]",
+"    Return the blocks, block bytes, used bytes and fragmentation ratio of the",
+"    slot allocator for the given slots (default: every slot with blocks).",
 "STATS",
 "    Return information about the memory usage of the server.",
 "USAGE <key> [SAMPLES <count>]",
@@ -1447,6 +1453,38 @@ NULL
         sds report = getMemoryDoctorReport();
         addReplyVerbatim(c,report,sdslen(report),"txt");
         sdsfree(report);
+    } else if (!strcasecmp(c->argv[1]->ptr,"slot-frag") && c->argc >= 2) {
+        int slots[CLUSTER_SLOTS], numslots = 0;
+        if (c->argc == 2) {
+            for (int j = 0; j < CLUSTER_SLOTS; j++)
+                if (r_allocator_get_slot_usage(j).blocks) slots[numslots++] = j;
+        } else {
+            for (int j = 2; j < c->argc && numslots < CLUSTER_SLOTS; j++) {
+                long long slot;
+                if (getLongLongFromObjectOrReply(c,c->argv[j],&slot,NULL) != C_OK)
+                    return;
+                if (slot < 0 || slot >= CLUSTER_SLOTS) {
+                    addReplyError(c,"Invalid slot");
+                    return;
+                }
+                slots[numslots++] = slot;
+            }
+        }
+        addReplyArrayLen(c,numslots);
+        for (int j = 0; j < numslots; j++) {
+            slot_usage_t usage = r_allocator_get_slot_usage(slots[j]);
+            addReplyMapLen(c,5);
+            addReplyBulkCString(c,"slot");
+            addReplyLongLong(c,slots[j]);
+            addReplyBulkCString(c,"blocks");
+            addReplyLongLong(c,usage.blocks);
+            addReplyBulkCString(c,"block-bytes");
+            addReplyLongLong(c,usage.bytes_blocks);
+            addReplyBulkCString(c,"used-bytes");
+            addReplyLongLong(c,usage.bytes_used);
+            addReplyBulkCString(c,"frag-ratio");
+            addReplyDouble(c,usage.bytes_used ? (double)usage.bytes_blocks / usage.bytes_used : 0);
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"purge") && c->argc == 2) {
         if (jemalloc_purge() == 0)
             addReply(c, shared.ok);
@@ -32,6 +32,7 @@
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
+#include "allocator.h"
 
 #include <math.h>
 #include <fcntl.h>
@@ -1253,9 +1254,16 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
-            robj key, *o = dictGetVal(de);
+            robj key, *o = dictGetVal(de), segval;
             long long expire;
 
+            /* Values stored in slot blocks: derive the pointer on a copy
+             * so the child doesn't write to (and copy) the block pages. */
+            if (segment_object_is_embedded(o)) {
+                segval = *o;
+                segval.ptr = segment_object_data(o);
+                o = &segval;
+            }
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
@@ -2414,7 +2422,10 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 goto eoferr;
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
-            dictExpand(db->dict,db_size);
+            /* The keyspace sliced by hash slot (cluster mode) can't be
+             * sized: its slices grow on their own, and only the slices of
+             * the slots of the node get keys. */
+            if (!dictIsSliced(db->dict)) dictExpand(db->dict,db_size);
             dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
@@ -322,6 +322,102 @@ static struct rdma_client_info default_client_ops= {
 };
 
 
+/* Transfer engine backend posting the WRs on the QP of the client. */
+struct rdma_client_engine_ctx {
+    struct rdma_client_info *c;
+    struct rdma_mr_cache *mr_cache;     /* NULL: register each block for the transfer. */
+    struct ibv_sge *sges;
+    struct ibv_send_wr *wrs;
+    int size;
+};
+
+static int engine_register_block_client(void *ctx, char *addr, size_t len, void **mr, uint32_t *lkey) {
+    struct rdma_client_engine_ctx *ec = ctx;
+    uint32_t rkey;
+
+    if (ec->mr_cache) {
+        /* The cache owns the registration, the engine must not drop it. */
+        *mr = NULL;
+        return rdma_mr_cache_get(ec->mr_cache, addr, len, lkey, &rkey);
+    }
+
+    /* The blocks are only read locally by the NIC. */
+    struct ibv_mr *m = ibv_reg_mr(ec->c->id->pd, addr, len, 0);
+
+    if (m == NULL) return -1;
+    *mr = m;
+    *lkey = m->lkey;
+    return 0;
+}
+
+static void engine_deregister_block_client(void *ctx, void *mr) {
+    (void) ctx;
+    ibv_dereg_mr((struct ibv_mr *) mr);
+}
+
+static int engine_post_write_chain_client(void *ctx, struct rdma_engine_wr *wrs, int n) {
+    struct rdma_client_engine_ctx *ec = ctx;
+    struct ibv_send_wr *bad_wr;
+
+    if (n > ec->size) {
+        ec->sges = zrealloc(ec->sges, n * sizeof(struct ibv_sge));
+        ec->wrs = zrealloc(ec->wrs, n * sizeof(struct ibv_send_wr));
+        ec->size = n;
+    }
+    for (int i = 0; i < n; i++) {
+        ec->sges[i].addr = (uint64_t)(uintptr_t) wrs[i].local_addr;
+        ec->sges[i].length = wrs[i].length;
+        ec->sges[i].lkey = wrs[i].lkey;
+        memset(&ec->wrs[i], 0, sizeof(struct ibv_send_wr));
+        ec->wrs[i].wr_id = wrs[i].wr_id;
+        ec->wrs[i].sg_list = &ec->sges[i];
+        ec->wrs[i].num_sge = 1;
+        ec->wrs[i].next = (i + 1 < n) ? &ec->wrs[i + 1] : NULL;
+        ec->wrs[i].opcode = IBV_WR_RDMA_WRITE;
+        ec->wrs[i].send_flags = wrs[i].signaled ? IBV_SEND_SIGNALED : 0;
+        ec->wrs[i].wr.rdma.remote_addr = wrs[i].remote_addr;
+        ec->wrs[i].wr.rdma.rkey = wrs[i].rkey;
+    }
+    return ibv_post_send(ec->c->id->qp, ec->wrs, &bad_wr);
+}
+
+static int engine_poll_completions_client(void *ctx, struct rdma_engine_wc *wc, int max) {
+    struct rdma_client_engine_ctx *ec = ctx;
+    struct ibv_wc wcs[RDMA_ENGINE_POLL_BATCH];
+    int ret;
+
+    if (max > RDMA_ENGINE_POLL_BATCH) max = RDMA_ENGINE_POLL_BATCH;
+    ret = ibv_poll_cq(ec->c->id->send_cq, max, wcs);
+    for (int i = 0; i < ret; i++) {
+        wc[i].wr_id = wcs[i].wr_id;
+        wc[i].status = wcs[i].status;
+    }
+    return ret;
+}
+
+static void engine_release_client(void *ctx) {
+    struct rdma_client_engine_ctx *ec = ctx;
+    zfree(ec->sges);
+    zfree(ec->wrs);
+    zfree(ec);
+}
+
+struct rdma_engine_backend rdma_client_engine_backend(struct rdma_client_info *c, struct rdma_mr_cache *mr_cache) {
+    struct rdma_engine_backend b;
+    struct rdma_client_engine_ctx *ec = zcalloc(sizeof(*ec));
+
+    ec->c = c;
+    ec->mr_cache = mr_cache;
+    b.name = "verbs";
+    b.ctx = ec;
+    b.register_block = engine_register_block_client;
+    b.deregister_block = engine_deregister_block_client;
+    b.post_write_chain = engine_post_write_chain_client;
+    b.poll_completions = engine_poll_completions_client;
+    b.release = engine_release_client;
+    return b;
+}
+
 struct rdma_client_info *init_rdma_client(char *ip, char *port) {
     struct rdma_client_info *c = (struct rdma_client_info *) malloc(sizeof(struct rdma_client_info));
     strcpy(c->ip_address, ip);
@@ -7,6 +7,8 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 #include "rdma_buffer.h"
+#include "rdma_engine.h"
+#include "rdma_mr_cache.h"
 
 #include "zmalloc.h"
 /* Capacity of the completion queue (CQ) */
@@ -98,4 +100,6 @@ void wait_for_multiple_send_completions_client(int number_of_completions, struct
 
 struct rdma_client_info *init_rdma_client(char *ip, char *port);
 
+struct rdma_engine_backend rdma_client_engine_backend(struct rdma_client_info *c, struct rdma_mr_cache *mr_cache);
+
 #endif /* __RDMAC_H */
@@ -0,0 +1,391 @@
+/* Pipelined RDMA WRITE engine used by slot migration.
+ *
+ * rdma_engine_write() copies an array of blocks to the recipient keeping up
+ * to 'window' WRs in flight. WRs are posted as chained lists of
+ * 'signal_every' WRs where only the last one is signaled: on a RC QP the
+ * completion of a signaled WR means that all the WRs posted before it are
+ * complete too, so a single CQE retires the whole chain. Completions are
+ * polled in batches of RDMA_ENGINE_POLL_BATCH.
+ *
+ * Blocks not registered by the caller are registered right before they are
+ * posted, and while the window is full the engine registers the blocks that
+ * follow instead of spinning on an empty CQ, so registration overlaps with
+ * the transfer of the previous blocks.
+ *
+ * The loopback backend emulates a link with a given round trip time and
+ * bandwidth in software, copying the blocks in the local address space, so
+ * the engine can be tested and benchmarked on machines without RDMA NICs. */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rdma_engine.h"
+#include "zmalloc.h"
+#include "monotonic.h"
+
+struct rdma_engine *rdma_engine_create(struct rdma_engine_backend *backend, int window, int signal_every) {
+    struct rdma_engine *e = zcalloc(sizeof(*e));
+
+    if (window < 1) window = 1;
+    if (signal_every < 1) signal_every = 1;
+    /* A full window must contain a signaled WR, or nothing would complete. */
+    if (signal_every > window) signal_every = window;
+    e->backend = *backend;
+    e->window = window;
+    e->signal_every = signal_every;
+    hdr_init(1, RDMA_ENGINE_MAX_LATENCY_US, 2, &e->stats.latency);
+    return e;
+}
+
+void rdma_engine_release(struct rdma_engine *e) {
+    if (e->backend.release) e->backend.release(e->backend.ctx);
+    hdr_close(e->stats.latency);
+    zfree(e);
+}
+
+void rdma_engine_reset_stats(struct rdma_engine *e) {
+    struct hdr_histogram *latency = e->stats.latency;
+
+    hdr_reset(latency);
+    memset(&e->stats, 0, sizeof(e->stats));
+    e->stats.latency = latency;
+}
+
+double rdma_engine_gbps(struct rdma_engine *e) {
+    return e->stats.usec ? (double) e->stats.bytes / e->stats.usec / 1000 : 0;
+}
+
+/* Register block 'j' unless the caller already did. */
+static int rdmaEngineRegister(struct rdma_engine *e, struct rdma_write_block *blocks,
+                              void **mrs, uint32_t *lkeys, long j)
+{
+    if (blocks[j].registered) {
+        lkeys[j] = blocks[j].lkey;
+        return 0;
+    }
+    if (e->backend.register_block(e->backend.ctx, blocks[j].local_addr, blocks[j].length,
+                                  &mrs[j], &lkeys[j]) != 0)
+        return -1;
+    e->stats.registered++;
+    return 0;
+}
+
+/* Write the 'n' blocks to their remote address. Returns 0 once all the
+ * writes are complete, -1 if a block could not be registered or posted, or
+ * if a completion reported an error. */
+int rdma_engine_write(struct rdma_engine *e, struct rdma_write_block *blocks, long n) {
+    struct rdma_engine_wc wc[RDMA_ENGINE_POLL_BATCH];
+    struct rdma_engine_wr *chain;
+    monotime *posted_at, start = getMonotonicUs();
+    void **mrs;
+    uint32_t *lkeys;
+    long posted = 0, retired = 0, registered = 0;
+    int err = 0;
+
+    if (n <= 0) return 0;
+    chain = zmalloc(sizeof(*chain) * e->signal_every);
+    posted_at = zmalloc(sizeof(monotime) * n);
+    mrs = zcalloc(sizeof(void *) * n);
+    lkeys = zmalloc(sizeof(uint32_t) * n);
+
+    while (retired < n && !err) {
+        /* Post as many chains as the window allows. */
+        while (posted < n) {
+            int len = e->signal_every;
+            if (len > n - posted) len = n - posted;
+            if (posted - retired + len > e->window) break;
+
+            for (; registered < posted + len; registered++) {
+                if (rdmaEngineRegister(e, blocks, mrs, lkeys, registered) == -1) {
+                    err = 1;
+                    break;
+                }
+            }
+            if (err) break;
+
+            monotime now = getMonotonicUs();
+            for (int i = 0; i < len; i++) {
+                long j = posted + i;
+                chain[i].wr_id = j;
+                chain[i].local_addr = blocks[j].local_addr;
+                chain[i].length = blocks[j].length;
+                chain[i].lkey = lkeys[j];
+                chain[i].remote_addr = blocks[j].remote_addr;
+                chain[i].rkey = blocks[j].rkey;
+                chain[i].signaled = (i == len - 1);
+                posted_at[j] = now;
+            }
+            if (e->backend.post_write_chain(e->backend.ctx, chain, len) != 0) {
+                err = 1;
+                break;
+            }
+            posted += len;
+            e->stats.chains++;
+            e->stats.signaled++;
+            if (posted - retired > e->stats.max_outstanding)
+                e->stats.max_outstanding = posted - retired;
+        }
+        if (err) break;
+
+        int got = e->backend.poll_completions(e->backend.ctx, wc, RDMA_ENGINE_POLL_BATCH);
+        e->stats.polls++;
+        if (got < 0) {
+            err = 1;
+            break;
+        }
+        if (got == 0) {
+            e->stats.empty_polls++;
+            /* Nothing completed: register the blocks that follow meanwhile. */
+            if (registered < n && registered < retired + e->window + e->signal_every) {
+                if (rdmaEngineRegister(e, blocks, mrs, lkeys, registered) == -1) err = 1;
+                else registered++;
+            }
+            continue;
+        }
+
+        monotime now = getMonotonicUs();
+        for (int i = 0; i < got; i++) {
+            if (wc[i].status != 0) {
+                err = 1;
+                break;
+            }
+            /* The WRs of a QP complete in order: everything up to the
+             * signaled one is done. */
+            for (; retired <= (long) wc[i].wr_id; retired++) {
+                hdr_record_value(e->stats.latency, now - posted_at[retired]);
+                if (mrs[retired]) {
+                    e->backend.deregister_block(e->backend.ctx, mrs[retired]);
+                    mrs[retired] = NULL;
+                }
+                e->stats.blocks++;
+                e->stats.bytes += blocks[retired].length;
+            }
+        }
+    }
+
+    /* On errors the QP is in the error state and no block is in flight
+     * anymore: drop the registrations that are left. */
+    for (long j = retired; j < registered; j++) {
+        if (mrs[j]) e->backend.deregister_block(e->backend.ctx, mrs[j]);
+    }
+    e->stats.usec += getMonotonicUs() - start;
+    zfree(chain);
+    zfree(posted_at);
+    zfree(mrs);
+    zfree(lkeys);
+    return err ? -1 : 0;
+}
+
+/* ----------------------------- Loopback backend ----------------------------*/
+
+struct loopback_wr {
+    struct rdma_engine_wr wr;
+    monotime done_at;
+};
+
+struct loopback_ctx {
+    long rtt_us;
+    double bytes_per_us;        /* 0 for an unlimited bandwidth. */
+    monotime link_free_at;      /* The link is busy sending until then. */
+    struct loopback_wr *queue;  /* Posted WRs, in order. */
+    long head, tail, size;
+};
+
+static int loopbackRegister(void *ctx, char *addr, size_t len, void **mr, uint32_t *lkey) {
+    (void) ctx;
+    (void) len;
+    *mr = addr;
+    *lkey = 1;
+    return 0;
+}
+
+static void loopbackDeregister(void *ctx, void *mr) {
+    (void) ctx;
+    (void) mr;
+}
+
+static int loopbackPost(void *ctx, struct rdma_engine_wr *wrs, int n) {
+    struct loopback_ctx *l = ctx;
+    monotime now = getMonotonicUs();
+
+    if (l->tail + n > l->size) {
+        if (l->head) {
+            memmove(l->queue, l->queue + l->head, sizeof(struct loopback_wr) * (l->tail - l->head));
+            l->tail -= l->head;
+            l->head = 0;
+        }
+        if (l->tail + n > l->size) {
+            l->size = (l->tail + n) * 2;
+            l->queue = zrealloc(l->queue, sizeof(struct loopback_wr) * l->size);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        monotime start = l->link_free_at > now ? l->link_free_at : now;
+        if (l->bytes_per_us) start += (monotime) (wrs[i].length / l->bytes_per_us);
+        l->link_free_at = start;
+        l->queue[l->tail].wr = wrs[i];
+        l->queue[l->tail].done_at = start + l->rtt_us;
+        l->tail++;
+    }
+    return 0;
+}
+
+/* Complete the WRs whose time has come, copying their data. */
+static int loopbackPoll(void *ctx, struct rdma_engine_wc *wc, int max) {
+    struct loopback_ctx *l = ctx;
+    monotime now = getMonotonicUs();
+    int got = 0;
+
+    while (l->head < l->tail && got < max && l->queue[l->head].done_at <= now) {
+        struct rdma_engine_wr *wr = &l->queue[l->head].wr;
+        memcpy((void *) (uintptr_t) wr->remote_addr, wr->local_addr, wr->length);
+        if (wr->signaled) {
+            wc[got].wr_id = wr->wr_id;
+            wc[got].status = 0;
+            got++;
+        }
+        l->head++;
+    }
+    if (l->head == l->tail) l->head = l->tail = 0;
+    return got;
+}
+
+static void loopbackRelease(void *ctx) {
+    struct loopback_ctx *l = ctx;
+    zfree(l->queue);
+    zfree(l);
+}
+
+/* A backend that emulates a link with the given round trip time (in usec)
+ * and bandwidth (in GB/s, 0 for unlimited). The remote addresses of the
+ * blocks must be local addresses. */
+struct rdma_engine_backend rdma_engine_loopback_backend(long rtt_us, double gbps) {
+    struct rdma_engine_backend b;
+    struct loopback_ctx *l = zcalloc(sizeof(*l));
+
+    l->rtt_us = rtt_us;
+    l->bytes_per_us = gbps * 1000;
+    b.name = "loopback";
+    b.ctx = l;
+    b.register_block = loopbackRegister;
+    b.deregister_block = loopbackDeregister;
+    b.post_write_chain = loopbackPost;
+    b.poll_completions = loopbackPoll;
+    b.release = loopbackRelease;
+    return b;
+}
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef REDIS_TEST
+
+/* Fails the completion of the first signaled WR at or after 'fail_at'. */
+static long failing_at;
+static int (*failing_poll)(void *ctx, struct rdma_engine_wc *wc, int max);
+
+static int rdmaEngineTestFailingPoll(void *ctx, struct rdma_engine_wc *wc, int max) {
+    int got = failing_poll(ctx, wc, max);
+    for (int i = 0; i < got; i++) {
+        if ((long) wc[i].wr_id >= failing_at) wc[i].status = 5; /* Like IBV_WC_WR_FLUSH_ERR. */
+    }
+    return got;
+}
+
+static int rdmaEngineTestRun(const char *name, long blocks, size_t block_size,
+                             long rtt_us, double gbps, int window, int signal_every,
+                             char *src, char *dst)
+{
+    struct rdma_engine_backend b = rdma_engine_loopback_backend(rtt_us, gbps);
+    struct rdma_engine *e = rdma_engine_create(&b, window, signal_every);
+    struct rdma_write_block *wb = zcalloc(sizeof(*wb) * blocks);
+    int failed = 0;
+
+    for (long j = 0; j < blocks; j++) {
+        wb[j].local_addr = src + j * block_size;
+        wb[j].length = block_size;
+        wb[j].remote_addr = (uint64_t) (uintptr_t) (dst + j * block_size);
+    }
+    memset(dst, 0, blocks * block_size);
+    if (rdma_engine_write(e, wb, blocks) != 0) {
+        printf("[failed] %s: write error\n", name);
+        failed = 1;
+    }
+    if (memcmp(src, dst, blocks * block_size) != 0) {
+        printf("[failed] %s: the blocks were not copied\n", name);
+        failed = 1;
+    }
+    long long chains = (blocks + e->signal_every - 1) / e->signal_every;
+    if (e->stats.blocks != blocks || e->stats.signaled != chains || e->stats.max_outstanding > window) {
+        printf("[failed] %s: %lld blocks, %lld signaled WRs, %lld max outstanding\n",
+               name, e->stats.blocks, e->stats.signaled, e->stats.max_outstanding);
+        failed = 1;
+    }
+    printf("%s: %ld blocks of %zu bytes (rtt %ld us, link %.1f GB/s, window %d, signal every %d): "
+           "%.3f ms, %.2f GB/s, %lld CQEs, latency p50 %lld us p99 %lld us max %lld us\n",
+           name, blocks, block_size, rtt_us, gbps, e->window, e->signal_every,
+           (double) e->stats.usec / 1000, rdma_engine_gbps(e), e->stats.signaled,
+           (long long) hdr_value_at_percentile(e->stats.latency, 50),
+           (long long) hdr_value_at_percentile(e->stats.latency, 99),
+           (long long) hdr_max(e->stats.latency));
+    rdma_engine_release(e);
+    zfree(wb);
+    return failed;
+}
+
+/* ./redis-server test rdmaengine [<blocks> | --accurate] */
+int rdmaEngineTest(int argc, char **argv, int accurate) {
+    long blocks;
+    size_t block_size = 64 * 1024;
+    int failed = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            blocks = 16384;
+        } else {
+            blocks = strtol(argv[3],NULL,10);
+        }
+    } else {
+        blocks = 2048;
+    }
+
+    monotonicInit();
+    char *src = zmalloc(blocks * block_size);
+    char *dst = zmalloc(blocks * block_size);
+    for (size_t j = 0; j < blocks * block_size; j++) src[j] = (char) (j * 31 + (j >> 16));
+
+    /* One WR at a time waiting for its completion, like the old loop. */
+    failed |= rdmaEngineTestRun("serial", blocks, block_size, 10, 12.5, 1, 1, src, dst);
+    failed |= rdmaEngineTestRun("windowed, all signaled", blocks, block_size, 10, 12.5, 256, 1, src, dst);
+    failed |= rdmaEngineTestRun("windowed", blocks, block_size, 10, 12.5,
+                                RDMA_ENGINE_DEFAULT_WINDOW, RDMA_ENGINE_DEFAULT_SIGNAL_EVERY, src, dst);
+    failed |= rdmaEngineTestRun("windowed, unlimited link", blocks, block_size, 0, 0,
+                                RDMA_ENGINE_DEFAULT_WINDOW, RDMA_ENGINE_DEFAULT_SIGNAL_EVERY, src, dst);
+    /* A window smaller than a chain still makes progress. */
+    failed |= rdmaEngineTestRun("small window", 100, 4096, 1, 0, 4, 32, src, dst);
+
+    /* A failed completion stops the transfer. */
+    struct rdma_engine_backend b = rdma_engine_loopback_backend(0, 0);
+    failing_poll = b.poll_completions;
+    failing_at = blocks / 2;
+    b.poll_completions = rdmaEngineTestFailingPoll;
+    struct rdma_engine *e = rdma_engine_create(&b, 64, 8);
+    struct rdma_write_block *wb = zcalloc(sizeof(*wb) * blocks);
+    for (long j = 0; j < blocks; j++) {
+        wb[j].local_addr = src + j * block_size;
+        wb[j].length = block_size;
+        wb[j].remote_addr = (uint64_t) (uintptr_t) (dst + j * block_size);
+    }
+    if (rdma_engine_write(e, wb, blocks) != -1 || e->stats.blocks >= blocks) {
+        printf("[failed] the failed completion was not reported\n");
+        failed = 1;
+    }
+    rdma_engine_release(e);
+    zfree(wb);
+
+    zfree(src);
+    zfree(dst);
+    if (!failed) printf("rdmaengine test: OK\n");
+    return failed;
+}
+#endif
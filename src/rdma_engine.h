@@ -0,0 +1,102 @@
+#ifndef __RDMA_ENGINE_H
+#define __RDMA_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hdr_histogram.h"
+
+/* Completions fetched by a single poll of the backend. */
+#define RDMA_ENGINE_POLL_BATCH (64)
+
+/* Default window of outstanding WRs. It must fit in the send queue of the
+ * QP, see MAX_SEND_WR in rdma_client.h. */
+#define RDMA_ENGINE_DEFAULT_WINDOW (1024)
+/* Default number of WRs per chain, only the last WR of a chain is signaled. */
+#define RDMA_ENGINE_DEFAULT_SIGNAL_EVERY (32)
+
+/* Highest per-block latency tracked by the histogram, in usec. */
+#define RDMA_ENGINE_MAX_LATENCY_US (60LL*1000*1000)
+
+/* A block to copy to the recipient with an RDMA WRITE. */
+struct rdma_write_block {
+    char        *local_addr;
+    uint32_t    length;
+    uint64_t    remote_addr;
+    uint32_t    rkey;
+    /* Set by the caller if the block is already registered, otherwise the
+     * engine registers it before posting and deregisters it once done. */
+    int         registered;
+    uint32_t    lkey;
+};
+
+/* A work request as seen by the backends. */
+struct rdma_engine_wr {
+    uint64_t    wr_id;
+    char        *local_addr;
+    uint32_t    length;
+    uint32_t    lkey;
+    uint64_t    remote_addr;
+    uint32_t    rkey;
+    int         signaled;
+};
+
+struct rdma_engine_wc {
+    uint64_t    wr_id;
+    int         status;     /* 0 on success, like IBV_WC_SUCCESS. */
+};
+
+/* The backend moves the bytes: verbs on a connected QP (see
+ * rdma_client_engine_backend()) or a software loopback. */
+struct rdma_engine_backend {
+    const char *name;
+    void *ctx;
+    /* Register a block for local access. Returns 0 on success. '*mr' is
+     * set to NULL if the registration is owned by someone else (a cache) and
+     * must not be deregistered after the transfer. */
+    int (*register_block)(void *ctx, char *addr, size_t len, void **mr, uint32_t *lkey);
+    void (*deregister_block)(void *ctx, void *mr);
+    /* Post 'n' WRs as a single chained list. Returns 0 on success. */
+    int (*post_write_chain)(void *ctx, struct rdma_engine_wr *wrs, int n);
+    /* Fetch up to 'max' completions without blocking. Returns the number
+     * of completions, or -1 on error. */
+    int (*poll_completions)(void *ctx, struct rdma_engine_wc *wc, int max);
+    void (*release)(void *ctx);
+};
+
+struct rdma_engine_stats {
+    long long blocks;           /* Blocks written. */
+    long long bytes;
+    long long usec;             /* Time spent in rdma_engine_write(). */
+    long long chains;           /* Chained WR lists posted. */
+    long long signaled;         /* Signaled WRs, one CQE each. */
+    long long polls;            /* Polls of the completion queue. */
+    long long empty_polls;      /* Polls that returned no completion. */
+    long long registered;       /* Blocks registered by the engine. */
+    long long max_outstanding;  /* Max WRs in flight at the same time. */
+    /* Time from post to the completion that retired the block, in usec.
+     * With selective signaling a block is retired by the next signaled WR,
+     * so this is an upper bound of the latency of the block itself. */
+    struct hdr_histogram *latency;
+};
+
+struct rdma_engine {
+    struct rdma_engine_backend backend;
+    int window;                 /* Max outstanding WRs. */
+    int signal_every;           /* WRs per chain. */
+    struct rdma_engine_stats stats;
+};
+
+struct rdma_engine *rdma_engine_create(struct rdma_engine_backend *backend, int window, int signal_every);
+void rdma_engine_release(struct rdma_engine *e);
+int rdma_engine_write(struct rdma_engine *e, struct rdma_write_block *blocks, long n);
+void rdma_engine_reset_stats(struct rdma_engine *e);
+double rdma_engine_gbps(struct rdma_engine *e);
+
+struct rdma_engine_backend rdma_engine_loopback_backend(long rtt_us, double gbps);
+
+#ifdef REDIS_TEST
+int rdmaEngineTest(int argc, char *argv[], int accurate);
+#endif
+
+#endif /* __RDMA_ENGINE_H */
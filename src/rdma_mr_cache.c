@@ -0,0 +1,396 @@
+/* Cache of the RDMA registrations of the slot blocks.
+ *
+ * Registering memory pins it and programs the translation tables of the NIC,
+ * which costs tens of microseconds per block: registering every block at the
+ * start of each migration dominated the time before the first byte was sent.
+ * Registrations are kept here, keyed by block address, and reused by the
+ * following migrations. The allocator reports the blocks it gives back to
+ * the system (r_allocator_set_release_hook()) and their registration is
+ * dropped, since the address may be reused by unrelated memory.
+ *
+ * Regions that never go away, like the block arena, can be registered once
+ * in large chunks with rdma_mr_cache_register_region(): the blocks inside
+ * them need no registration of their own. */
+
+#include "fmacros.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <infiniband/verbs.h>
+
+#include "rdma_mr_cache.h"
+#include "zmalloc.h"
+#include "monotonic.h"
+#include "endianconv.h"
+
+struct rdma_mr_cache *rdma_mr_cache_create(struct rdma_mr_cache_ops *ops) {
+    struct rdma_mr_cache *c = zcalloc(sizeof(*c));
+
+    c->ops = *ops;
+    c->blocks = raxNew();
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+void rdma_mr_cache_release(struct rdma_mr_cache *c) {
+    raxIterator ri;
+
+    raxStart(&ri, c->blocks);
+    raxSeek(&ri, "^", NULL, 0);
+    while (raxNext(&ri)) {
+        struct rdma_mr *m = ri.data;
+        c->ops.dereg(c->ops.ctx, m->mr);
+        zfree(m);
+    }
+    raxStop(&ri);
+    raxFree(c->blocks);
+    for (int j = 0; j < c->num_regions; j++) c->ops.dereg(c->ops.ctx, c->regions[j].mr);
+    zfree(c->regions);
+    zfree(c->ops.ctx);
+    pthread_mutex_destroy(&c->lock);
+    zfree(c);
+}
+
+/* Called with the lock held. */
+static int rdmaMRCacheRegister(struct rdma_mr_cache *c, void *addr, size_t len, struct rdma_mr *m) {
+    monotime start = getMonotonicUs();
+    int ret = c->ops.reg(c->ops.ctx, addr, len, &m->mr, &m->lkey, &m->rkey);
+
+    c->stats.reg_usec += getMonotonicUs() - start;
+    if (ret != 0) return -1;
+    m->addr = addr;
+    m->len = len;
+    c->stats.reg_bytes += len;
+    return 0;
+}
+
+/* Called with the lock held: the region that contains [addr, addr+len). */
+static struct rdma_mr *rdmaMRCacheFindRegion(struct rdma_mr_cache *c, char *addr, size_t len) {
+    int lo = 0, hi = c->num_regions - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct rdma_mr *r = &c->regions[mid];
+        if (addr < r->addr) {
+            hi = mid - 1;
+        } else if (addr >= r->addr + r->len) {
+            lo = mid + 1;
+        } else {
+            return (addr + len <= r->addr + r->len) ? r : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Set lkey and rkey to the keys of a registration that covers the 'len'
+ * bytes at 'addr', registering the block if needed. Returns 0 on success,
+ * -1 if the block could not be registered. */
+int rdma_mr_cache_get(struct rdma_mr_cache *c, void *addr, size_t len, uint32_t *lkey, uint32_t *rkey) {
+    /* Keys are big endian so that the blocks are sorted by address. */
+    uint64_t key = htonu64((uint64_t) (uintptr_t) addr);
+    struct rdma_mr *m;
+    int ret = 0;
+
+    pthread_mutex_lock(&c->lock);
+    m = rdmaMRCacheFindRegion(c, addr, len);
+    if (m == NULL) {
+        m = raxFind(c->blocks, (unsigned char *) &key, sizeof(key));
+        if (m == raxNotFound) {
+            m = NULL;
+        } else if (m->len < len) {
+            /* Not the block that was registered at this address. */
+            c->ops.dereg(c->ops.ctx, m->mr);
+            raxRemove(c->blocks, (unsigned char *) &key, sizeof(key), NULL);
+            zfree(m);
+            m = NULL;
+        }
+    }
+    if (m) {
+        c->stats.hits++;
+    } else {
+        m = zmalloc(sizeof(*m));
+        if (rdmaMRCacheRegister(c, addr, len, m) == 0) {
+            raxInsert(c->blocks, (unsigned char *) &key, sizeof(key), m, NULL);
+            c->stats.misses++;
+        } else {
+            zfree(m);
+            m = NULL;
+            ret = -1;
+        }
+    }
+    if (m) {
+        *lkey = m->lkey;
+        *rkey = m->rkey;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* Register the memory from base to base+len in chunks of 'chunk' bytes (one
+ * chunk if 0). The region must stay mapped while the cache exists and must
+ * not overlap the regions already registered. Returns 0 on success, -1 if a
+ * chunk could not be registered: the chunks registered so far are kept. */
+int rdma_mr_cache_register_region(struct rdma_mr_cache *c, void *base, size_t len, size_t chunk) {
+    int ret = 0;
+
+    if (chunk == 0 || chunk > len) chunk = len;
+    pthread_mutex_lock(&c->lock);
+    for (size_t off = 0; off < len; off += chunk) {
+        struct rdma_mr r;
+        size_t n = (len - off < chunk) ? len - off : chunk;
+        if (rdmaMRCacheRegister(c, (char *) base + off, n, &r) == -1) {
+            ret = -1;
+            break;
+        }
+        c->regions = zrealloc(c->regions, sizeof(struct rdma_mr) * (c->num_regions + 1));
+        int j = c->num_regions;
+        while (j > 0 && c->regions[j - 1].addr > r.addr) {
+            c->regions[j] = c->regions[j - 1];
+            j--;
+        }
+        c->regions[j] = r;
+        c->num_regions++;
+        c->stats.region_bytes += n;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* Drop the registration of the block at 'addr', its memory is being freed. */
+void rdma_mr_cache_invalidate(struct rdma_mr_cache *c, void *addr) {
+    uint64_t key = htonu64((uint64_t) (uintptr_t) addr);
+    void *old;
+
+    pthread_mutex_lock(&c->lock);
+    if (raxRemove(c->blocks, (unsigned char *) &key, sizeof(key), &old)) {
+        struct rdma_mr *m = old;
+        c->ops.dereg(c->ops.ctx, m->mr);
+        zfree(m);
+        c->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+struct rdma_mr_cache_stats rdma_mr_cache_get_stats(struct rdma_mr_cache *c) {
+    struct rdma_mr_cache_stats stats;
+
+    pthread_mutex_lock(&c->lock);
+    stats = c->stats;
+    pthread_mutex_unlock(&c->lock);
+    return stats;
+}
+
+/* ------------------------------- Verbs ops ---------------------------------*/
+
+struct rdma_mr_cache_verbs_ctx {
+    struct ibv_pd *pd;
+    int access;
+};
+
+static int rdmaMRCacheVerbsReg(void *ctx, void *addr, size_t len, void **mr, uint32_t *lkey, uint32_t *rkey) {
+    struct rdma_mr_cache_verbs_ctx *v = ctx;
+    struct ibv_mr *m = ibv_reg_mr(v->pd, addr, len, v->access);
+
+    if (m == NULL) return -1;
+    *mr = m;
+    *lkey = m->lkey;
+    *rkey = m->rkey;
+    return 0;
+}
+
+static void rdmaMRCacheVerbsDereg(void *ctx, void *mr) {
+    (void) ctx;
+    ibv_dereg_mr((struct ibv_mr *) mr);
+}
+
+/* Ops registering with ibv_reg_mr() on 'pd'. */
+struct rdma_mr_cache_ops rdma_mr_cache_verbs_ops(struct ibv_pd *pd, int access) {
+    struct rdma_mr_cache_ops ops;
+    struct rdma_mr_cache_verbs_ctx *v = zmalloc(sizeof(*v));
+
+    v->pd = pd;
+    v->access = access;
+    ops.ctx = v;
+    ops.reg = rdmaMRCacheVerbsReg;
+    ops.dereg = rdmaMRCacheVerbsDereg;
+    return ops;
+}
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef REDIS_TEST
+#include "allocator.h"
+
+/* Fake registrations: count them and spend 'reg_cost_us' like a real one. */
+static long test_registered, test_deregistered;
+static long test_reg_cost_us = 20;
+
+static int rdmaMRCacheTestReg(void *ctx, void *addr, size_t len, void **mr, uint32_t *lkey, uint32_t *rkey) {
+    (void) ctx;
+    (void) len;
+    monotime start = getMonotonicUs();
+    while (getMonotonicUs() - start < (monotime) test_reg_cost_us);
+    test_registered++;
+    *mr = addr;
+    *lkey = *rkey = (uint32_t) test_registered;
+    return 0;
+}
+
+static void rdmaMRCacheTestDereg(void *ctx, void *mr) {
+    (void) ctx;
+    (void) mr;
+    test_deregistered++;
+}
+
+static struct rdma_mr_cache *test_cache;
+
+static void rdmaMRCacheTestReleaseHook(void *buffer, size_t len) {
+    (void) len;
+    rdma_mr_cache_invalidate(test_cache, buffer);
+}
+
+static void rdmaMRCacheTestRegisterPool(void *buffer, size_t len, void *privdata) {
+    uint32_t lkey, rkey;
+    rdma_mr_cache_get(privdata, buffer, len, &lkey, &rkey);
+}
+
+/* Register the buffers of all the blocks of 'slot' the way a migration does.
+ * Returns the time it took in usec. */
+static long long rdmaMRCacheTestRegisterSlot(struct rdma_mr_cache *c, int slot, int *failed) {
+    int nblocks;
+    uint32_t lkey, rkey;
+    monotime start = getMonotonicUs();
+    char **bufs = r_allocator_get_block_buffers_for_slot(slot, &nblocks);
+    uint32_t *lens = r_allocator_get_block_buffer_lengths_for_slot(slot, nblocks);
+
+    for (int j = 0; j < nblocks; j++) {
+        if (rdma_mr_cache_get(c, bufs[j], lens[j], &lkey, &rkey) != 0) *failed = 1;
+    }
+    free(bufs);
+    free(lens);
+    return getMonotonicUs() - start;
+}
+
+/* ./redis-server test rdmamrcache [<blocks> | --accurate] */
+int rdmaMRCacheTest(int argc, char **argv, int accurate) {
+    struct rdma_mr_cache_ops ops = {NULL, rdmaMRCacheTestReg, rdmaMRCacheTestDereg};
+    struct rdma_mr_cache_stats st;
+    uint32_t lkey, rkey;
+    long blocks;
+    int failed = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            blocks = 4096;
+        } else {
+            blocks = strtol(argv[3],NULL,10);
+        }
+    } else {
+        blocks = 512;
+    }
+
+    monotonicInit();
+    test_cache = rdma_mr_cache_create(&ops);
+
+    /* Hits, misses, a block that grew and the invalidation. */
+    char *buf = zmalloc(8192);
+    rdma_mr_cache_get(test_cache, buf, 4096, &lkey, &rkey);
+    rdma_mr_cache_get(test_cache, buf, 4096, &lkey, &rkey);
+    rdma_mr_cache_get(test_cache, buf, 8192, &lkey, &rkey);
+    rdma_mr_cache_invalidate(test_cache, buf);
+    rdma_mr_cache_invalidate(test_cache, buf);
+    st = rdma_mr_cache_get_stats(test_cache);
+    if (st.hits != 1 || st.misses != 2 || st.invalidations != 1 ||
+        test_registered != 2 || test_deregistered != 2)
+    {
+        printf("[failed] %lld hits, %lld misses, %lld invalidations, %ld reg, %ld dereg\n",
+               st.hits, st.misses, st.invalidations, test_registered, test_deregistered);
+        failed = 1;
+    }
+    zfree(buf);
+
+    /* Blocks inside a region need no registration, a block across two chunks
+     * gets its own. */
+    char *region = zmalloc(1024 * 1024);
+    long reg_before = test_registered;
+    rdma_mr_cache_register_region(test_cache, region, 1024 * 1024, 256 * 1024);
+    rdma_mr_cache_get(test_cache, region + 1000, 4096, &lkey, &rkey);
+    rdma_mr_cache_get(test_cache, region + 512 * 1024, 4096, &lkey, &rkey);
+    if (test_registered != reg_before + 4) {
+        printf("[failed] %ld registrations for a region of 4 chunks\n", test_registered - reg_before);
+        failed = 1;
+    }
+    rdma_mr_cache_get(test_cache, region + 256 * 1024 - 100, 4096, &lkey, &rkey);
+    if (test_registered != reg_before + 5) {
+        printf("[failed] a block across two chunks was not registered\n");
+        failed = 1;
+    }
+    rdma_mr_cache_invalidate(test_cache, region + 256 * 1024 - 100);
+
+    /* With the allocator: blocks freed to the pool keep their registration,
+     * blocks given back to the system lose it. */
+    r_allocator_init();
+    r_allocator_set_block_size(64 * 1024, 64 * 1024);
+    r_allocator_set_release_hook(rdmaMRCacheTestReleaseHook);
+    for (long j = 0; j < blocks; j++) r_allocator_alloc_new_empty_block(0);
+
+    long long cold_us = rdmaMRCacheTestRegisterSlot(test_cache, 0, &failed);
+    long long warm_us = rdmaMRCacheTestRegisterSlot(test_cache, 0, &failed);
+    printf("%ld blocks: registered in %.3f ms, cached in %.3f ms (%ld us per registration)\n",
+           blocks, (double) cold_us / 1000, (double) warm_us / 1000, test_reg_cost_us);
+
+    st = rdma_mr_cache_get_stats(test_cache);
+    long long inval_before = st.invalidations;
+    r_allocator_set_block_pool(blocks);
+    free_slot(0);
+    if (r_allocator_block_pool_size() != (unsigned int) blocks ||
+        rdma_mr_cache_get_stats(test_cache).invalidations != inval_before)
+    {
+        printf("[failed] the pool did not keep the blocks and their registration\n");
+        failed = 1;
+    }
+
+    /* A new migration reuses the pooled blocks: no registration at all. */
+    reg_before = test_registered;
+    for (long j = 0; j < blocks; j++) r_allocator_alloc_new_empty_block(1);
+    long long pooled_us = rdmaMRCacheTestRegisterSlot(test_cache, 1, &failed);
+    if (test_registered != reg_before) {
+        printf("[failed] %ld registrations for pooled blocks\n", test_registered - reg_before);
+        failed = 1;
+    }
+    printf("%ld blocks from the pool: registrations found in %.3f ms\n", blocks, (double) pooled_us / 1000);
+
+    /* Shrinking the pool gives the blocks back and drops their registration. */
+    free_slot(1);
+    r_allocator_set_block_pool(0);
+    if (rdma_mr_cache_get_stats(test_cache).invalidations != inval_before + blocks) {
+        printf("[failed] the registrations of the freed blocks were not dropped\n");
+        failed = 1;
+    }
+
+    /* A pool filled in advance is registered before the migration starts. */
+    r_allocator_set_block_pool(16);
+    r_allocator_block_pool_fill(16);
+    reg_before = test_registered;
+    r_allocator_block_pool_foreach(rdmaMRCacheTestRegisterPool, test_cache);
+    for (int j = 0; j < 16; j++) r_allocator_alloc_new_empty_block(2);
+    rdmaMRCacheTestRegisterSlot(test_cache, 2, &failed);
+    if (test_registered != reg_before + 16) {
+        printf("[failed] %ld registrations for a pre-registered pool of 16 blocks\n",
+               test_registered - reg_before);
+        failed = 1;
+    }
+    free_slot(2);
+    r_allocator_set_block_pool(0);
+
+    r_allocator_set_release_hook(NULL);
+    rdma_mr_cache_release(test_cache);
+    zfree(region);
+    if (test_registered != test_deregistered) {
+        printf("[failed] %ld registrations, %ld deregistrations\n", test_registered, test_deregistered);
+        failed = 1;
+    }
+    if (!failed) printf("rdmamrcache test: OK\n");
+    return failed;
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef __RDMA_MR_CACHE_H
+#define __RDMA_MR_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "rax.h"
+
+/* Registers memory with the NIC: ibv_reg_mr() on a PD (see
+ * rdma_mr_cache_verbs_ops()) or a fake one in the tests. The cache frees
+ * 'ctx' with zfree() when it is released. */
+struct rdma_mr_cache_ops {
+    void *ctx;
+    int (*reg)(void *ctx, void *addr, size_t len, void **mr, uint32_t *lkey, uint32_t *rkey);
+    void (*dereg)(void *ctx, void *mr);
+};
+
+/* A registration: a single block, or a chunk of a region registered with
+ * rdma_mr_cache_register_region(). */
+struct rdma_mr {
+    char        *addr;
+    size_t      len;
+    void        *mr;
+    uint32_t    lkey;
+    uint32_t    rkey;
+};
+
+struct rdma_mr_cache_stats {
+    long long hits;
+    long long misses;           /* Lookups that registered a block. */
+    long long invalidations;    /* Registrations dropped because the block was freed. */
+    long long reg_usec;         /* Time spent registering, regions included. */
+    long long reg_bytes;
+    long long region_bytes;     /* Bytes registered as regions. */
+};
+
+struct rdma_mr_cache {
+    struct rdma_mr_cache_ops ops;
+    rax *blocks;                /* Big endian block address -> struct rdma_mr. */
+    struct rdma_mr *regions;    /* Sorted by address, they don't overlap. */
+    int num_regions;
+    pthread_mutex_t lock;
+    struct rdma_mr_cache_stats stats;
+};
+
+struct rdma_mr_cache *rdma_mr_cache_create(struct rdma_mr_cache_ops *ops);
+void rdma_mr_cache_release(struct rdma_mr_cache *c);
+int rdma_mr_cache_get(struct rdma_mr_cache *c, void *addr, size_t len, uint32_t *lkey, uint32_t *rkey);
+int rdma_mr_cache_register_region(struct rdma_mr_cache *c, void *base, size_t len, size_t chunk);
+void rdma_mr_cache_invalidate(struct rdma_mr_cache *c, void *addr);
+struct rdma_mr_cache_stats rdma_mr_cache_get_stats(struct rdma_mr_cache *c);
+
+struct ibv_pd;
+struct rdma_mr_cache_ops rdma_mr_cache_verbs_ops(struct ibv_pd *pd, int access);
+
+#ifdef REDIS_TEST
+int rdmaMRCacheTest(int argc, char *argv[], int accurate);
+#endif
+
+#endif /* __RDMA_MR_CACHE_H */
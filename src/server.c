@@ -1027,6 +1027,11 @@ struct redisServer server; /* Server global state */
 			0,NULL,0,0,0,0,0,0
 		},
 
+		{   "migration",migrationCommand,2,
+			"admin ok-stale random",
+			0,NULL,0,0,0,0,0,0
+		},
+
 		{   "restore",restoreCommand,-4,
 			"write use-memory @keyspace @dangerous",
 			0,NULL,1,1,1,0,0,0
@@ -1103,7 +1108,7 @@ struct redisServer server; /* Server global state */
 			0,NULL,0,0,0,0,0,0
 		},
 
-		{   "initRDMAServer",initRDMAServerCommand,4,
+		{   "initRDMAServer",initRDMAServerCommand,-4,
 			"read-only random @keyspace",
 			0,NULL,0,0,0,0,0,0
 		},
@@ -1134,6 +1139,11 @@ struct redisServer server; /* Server global state */
 			0,NULL,0,0,0,0,0,0
 		},
 
+		{   "shadowApply", shadowApplyCommand, 2,
+			"write @keyspace",
+			0,NULL,0,0,0,0,0,0
+		},
+
 		{   "rdmaDoneAck", rdmaDoneAckCommand, 2,
 			"read-only random @keyspace",
 			0,NULL,0,0,0,0,0,0
@@ -1608,6 +1618,11 @@ uint64_t dictSdsHash(const void *key) {
 	return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
+/* Slice of a key of the cluster keyspace, see createKeyspace(). */
+int dictSdsKeySlot(const void *key) {
+	return keyHashSlot((char*)key, sdslen((sds)key));
+}
+
 uint64_t dictSdsCaseHash(const void *key) {
 	return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
@@ -1717,7 +1732,8 @@ dictType dbDictType = {
 	dictSdsKeyCompare,          /* key compare */
 	dictSdsDestructor,          /* key destructor */
 	dictObjectDestructor,       /* val destructor */
-	dictExpandAllowed           /* allow to expand */
+	dictExpandAllowed,          /* allow to expand */
+	dictSdsKeySlot              /* key slice */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -1861,8 +1877,17 @@ int htNeedsResize(dict *dict) {
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
  * we resize the hash table to save memory */
 void tryResizeHashTables(int dbid) {
-	if (htNeedsResize(server.db[dbid].dict))
-		dictResize(server.db[dbid].dict);
+	dict *d = server.db[dbid].dict;
+
+	if (dictIsSliced(d)) {
+		/* Every slot of the keyspace is resized on its own. */
+		for (int j = 0; j < dictNumSlices(d); j++) {
+			dict *slice = dictGetSlice(d,j,0);
+			if (slice && htNeedsResize(slice)) dictResize(slice);
+		}
+	} else if (htNeedsResize(d)) {
+		dictResize(d);
+	}
 	if (htNeedsResize(server.db[dbid].expires))
 		dictResize(server.db[dbid].expires);
 }
@@ -1891,6 +1916,32 @@ int incrementallyRehash(int dbid) {
 	return 0;
 }
 
+/* Sample the chains of the keyspace buckets of every DB, the number of keys a
+ * lookup walks, to check they stay short while the keys of migrated slots
+ * are added and the tables are rehashed next to the threads adding them. */
+#define KEYSPACE_CHAIN_SAMPLES 1024
+void sampleKeyspaceChains(void) {
+	double avg_sum = 0;
+	unsigned long max = 0;
+	int dbs = 0;
+
+	for (int j = 0; j < server.dbnum; j++) {
+		dict *d = server.db[j].dict;
+		unsigned long m;
+		double avg;
+
+		if (dictSize(d) == 0) continue;
+		m = dictSampleChainLength(d,KEYSPACE_CHAIN_SAMPLES,&avg);
+		avg_sum += avg;
+		dbs++;
+		if (m > max) max = m;
+	}
+	server.stat_keyspace_chain_avg = dbs ? avg_sum/dbs : 0;
+	server.stat_keyspace_chain_max = max;
+	if (max > server.stat_keyspace_chain_peak)
+		server.stat_keyspace_chain_peak = max;
+}
+
 /* This function is called once a background process of some kind terminates,
  * as we want to avoid resizing the hash tables when there is a child in order
  * to play well with copy-on-write (otherwise when a resize happens lots of
@@ -2177,6 +2228,9 @@ void databasesCron(void) {
 	/* Defrag keys gradually. */
 	activeDefragCycle();
 
+	/* Compact sparse slot blocks gradually. */
+	slotCompactCycle();
+
 	/* Perform hash tables rehashing if needed, but only if there are no
 	 * other processes saving the DB on disk. Otherwise rehashing is bad
 	 * as will cause a lot of copy-on-write of memory pages. */
@@ -2214,6 +2268,9 @@ void databasesCron(void) {
 			}
 		}
 	}
+
+	/* Sample the chains the rehashing above keeps short. */
+	run_with_period(1000) sampleKeyspaceChains();
 }
 
 /* We take a cached value of the unix time in the global state because with
@@ -3008,10 +3065,7 @@ void initServerConfig(void) {
 		if(0 != (errno = pthread_mutex_init(&server.lock_slots[i], NULL))){
 			serverLog(LL_WARNING, "STRATOS LOCK INIT ERROR");
 		}
-		if(0 != (errno = pthread_mutex_init(&server.ownership_lock_slots[i], NULL))){
-			serverLog(LL_WARNING, "STRATOS LOCK INIT ERROR");
-		}
-		server.migration_ownership_changed[i] = 0;
+		server.slot_ownership[i] = CLUSTER_SLOT_OWNED;
 
 	}
 	if(0 != (errno = pthread_mutex_init(&(server.socket_mutex), NULL))){
@@ -3443,6 +3497,8 @@ void resetServerStats(void) {
 	server.stat_expired_time_cap_reached_count = 0;
 	server.stat_expire_cycle_time_used = 0;
 	server.stat_evictedkeys = 0;
+	server.stat_evicted_bytes = 0;
+	server.stat_evicted_blocks = 0;
 	server.stat_keyspace_misses = 0;
 	server.stat_keyspace_hits = 0;
 	server.stat_active_defrag_hits = 0;
@@ -3450,6 +3506,35 @@ void resetServerStats(void) {
 	server.stat_active_defrag_key_hits = 0;
 	server.stat_active_defrag_key_misses = 0;
 	server.stat_active_defrag_scanned = 0;
+	server.stat_allocator_compact_moved = 0;
+	server.stat_allocator_compact_released = 0;
+	server.stat_migration_indexed_keys = 0;
+	server.stat_migration_index_usec = 0;
+	server.stat_migration_rdma_bytes = 0;
+	server.stat_migration_rdma_usec = 0;
+	server.stat_migration_servable_usec = 0;
+	server.stat_migration_rdma_p99_usec = 0;
+	server.stat_migration_rdma_reg_usec = 0;
+	server.stat_migration_rdma_mr_hits = 0;
+	server.stat_migration_rdma_mr_misses = 0;
+	server.stat_migration_handoff_usec = 0;
+	server.stat_migration_handoff_slots = 0;
+	server.stat_migration_handoff_timeouts = 0;
+	server.stat_migration_parked_writes = 0;
+	server.stat_migration_parked_timeouts = 0;
+	server.stat_migration_parked_max_usec = 0;
+	server.stat_migration_shadow_frames = 0;
+	server.stat_migration_shadow_records = 0;
+	server.stat_migration_shadow_bytes = 0;
+	server.stat_migration_precopy_rounds = 0;
+	server.stat_migration_precopy_blocks = 0;
+	server.stat_migration_precopy_bytes = 0;
+	__atomic_store_n(&server.stat_migration_chunks, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&server.stat_migration_chunk_max_bytes, 0, __ATOMIC_RELAXED);
+	server.stat_cluster_moved_replies = 0;
+	server.stat_cluster_ask_replies = 0;
+	server.stat_cluster_tryagain_replies = 0;
+	server.stat_keyspace_chain_peak = 0;
 	server.stat_fork_time = 0;
 	server.stat_fork_rate = 0;
 	server.stat_total_forks = 0;
@@ -3458,6 +3543,10 @@ void resetServerStats(void) {
 	server.stat_sync_partial_ok = 0;
 	server.stat_sync_partial_err = 0;
 	server.stat_io_reads_processed = 0;
+	server.stat_io_exec_processed = 0;
+	atomicSet(server.stat_reply_values, 0);
+	atomicSet(server.stat_reply_value_bytes_copied, 0);
+	atomicSet(server.stat_reply_value_bytes_referenced, 0);
 	atomicSet(server.stat_total_reads_processed, 0);
 	server.stat_io_writes_processed = 0;
 	atomicSet(server.stat_total_writes_processed, 0);
@@ -3522,6 +3611,7 @@ void initServer(void) {
 	server.get_ack_from_slaves = 0;
 	server.client_pause_type = 0;
 	server.paused_clients = listCreate();
+	server.parked_clients = listCreate();
 	server.events_processed_while_blocked = 0;
 	server.system_memory_size = zmalloc_get_memory_size();
 	server.blocked_last_cron = 0;
@@ -3579,7 +3669,8 @@ void initServer(void) {
 
 	/* Create the Redis databases, and initialize other internal state. */
 	for (j = 0; j < server.dbnum; j++) {
-		server.db[j].dict = dictCreateBig(&dbDictType,NULL);
+		server.db[j].dict = server.cluster_enabled ? createKeyspace() :
+			dictCreateBig(&dbDictType,NULL);
 		server.db[j].expires = dictCreateBig(&dbExpiresDictType,NULL);
 		server.db[j].expires_cursor = 0;
 		server.db[j].blocking_keys = dictCreateBig(&keylistDictType,NULL);
@@ -4108,6 +4199,8 @@ void call(client *c, int flags) {
 		char *latency_event = (real_cmd->flags & CMD_FAST) ?
 			"fast-command" : "command";
 		latencyAddSampleIfNeeded(latency_event,duration/1000);
+		if (server.cluster_enabled && migrationInProgress())
+			migrationRecordCommand(duration);
 	}
 
 	/* Log the command into the Slow log if needed.
@@ -4628,73 +4721,22 @@ int processCommand(client *c) {
 		queueMultiCommand(c);
 		addReply(c,shared.queued);
 	} else {
-		if(is_write_command){
-
-			int intSlot = keyHashSlot((char *) c->argv[1]->ptr, sdslen(c->argv[1]->ptr));
-			if(pthread_mutex_trylock(&server.ownership_lock_slots[intSlot]) == 0){
-				if(server.migration_ownership_changed[intSlot] == 1){
-					clusterNode *recipientNode = server.cluster->migrating_slots_to[intSlot];
-					if(!recipientNode){
-						serverLog(LL_WARNING, "Recipient Node is null");
-					}
-					int port = recipientNode->port;
-					server.cluster->slots[intSlot] = recipientNode;
-					server.cluster->migrating_slots_to[intSlot] = NULL;
-					server.cluster->importing_slots_from[intSlot] = NULL;
-					sds command = sdscatprintf(sdsempty(), "-%s %d %s:%d", "MOVED", intSlot, recipientNode->ip, port); 
-					addReplyErrorSds(c,command);
-					server.migration_ownership_changed[intSlot] = 0;
-
-				}else{
-					// serverLog(LL_WARNING, "STRATOS IM HERE 2");
-					call(c,CMD_CALL_FULL);
-					c->woff = server.master_repl_offset;
-					if (listLength(server.ready_keys))
-						handleClientsBlockedOnKeys();
-				}
-				pthread_mutex_unlock(&server.ownership_lock_slots[intSlot]);
-			}else{
-				addReplyError(c,"-TRYAGAIN  Key is migrating");
-				//serverLog(LL_WARNING, "STRATOS COULD NOT ACQUIRE LOCK FOR SLOT %d", intSlot);
+		int slot_write = 0;
+
+		/* Writes to a slot that is being handed over are parked until the
+		 * hand-off completes, they are then redirected to the new owner. */
+		if (is_may_replicate_command && server.cluster_enabled) {
+			if (!clusterBeginCommandWrite(c)) {
+				clusterParkClient(c);
+				return C_OK;
 			}
-
-		}else if(is_read_command){
-			int intSlot = keyHashSlot((char *) c->argv[1]->ptr, sdslen(c->argv[1]->ptr));
-			if(pthread_mutex_trylock(&server.ownership_lock_slots[intSlot]) == 0){
-				if(server.migration_ownership_changed[intSlot] == 1){
-					clusterNode *recipientNode = server.cluster->migrating_slots_to[intSlot];
-					if(!recipientNode){
-						serverLog(LL_WARNING, "Recipient Node is null");
-					}
-					int port = recipientNode->port;
-					server.cluster->slots[intSlot] = recipientNode;
-					server.cluster->migrating_slots_to[intSlot] = NULL;
-					server.cluster->importing_slots_from[intSlot] = NULL;
-					sds command = sdscatprintf(sdsempty(), "-%s %d %s:%d", "MOVED", intSlot, recipientNode->ip, port); 
-					addReplyErrorSds(c,command);
-					server.migration_ownership_changed[intSlot] = 0;
-
-				}else{
-					call(c,CMD_CALL_FULL);
-					c->woff = server.master_repl_offset;
-					if (listLength(server.ready_keys))
-						handleClientsBlockedOnKeys();
-				}
-				pthread_mutex_unlock(&server.ownership_lock_slots[intSlot]);
-			}else{
-				call(c,CMD_CALL_FULL);
-				c->woff = server.master_repl_offset;
-				if (listLength(server.ready_keys))
-					handleClientsBlockedOnKeys();
-				//serverLog(LL_WARNING, "STRATOS COULD NOT ACQUIRE LOCK FOR SLOT %d", intSlot);
-			}
-
-		}else{
-			call(c,CMD_CALL_FULL);
-			c->woff = server.master_repl_offset;
-			if (listLength(server.ready_keys))
-				handleClientsBlockedOnKeys();
+			slot_write = 1;
 		}
+		call(c,CMD_CALL_FULL);
+		if (slot_write) clusterEndCommandWrite(c);
+		c->woff = server.master_repl_offset;
+		if (listLength(server.ready_keys))
+			handleClientsBlockedOnKeys();
 	}
 
 	return C_OK;
@@ -5318,6 +5360,115 @@ sds genRedisInfoString(const char *section) {
 		freeMemoryOverheadData(mh);
 	}
 
+	/* Slot allocator */
+	if (allsections || defsections || !strcasecmp(section,"allocator")) {
+		allocator_info_t ai = r_allocator_get_info();
+		char sparse_hmem[64];
+		long long pending_slots, pending_keys, promoted_keys;
+		bytesToHuman(sparse_hmem,ai.sparse_overhead);
+		slotIndexGetPendingStats(&pending_slots,&pending_keys,&promoted_keys);
+
+		if (sections++) info = sdscat(info,"\r\n");
+		info = sdscatprintf(info,
+				"# Allocator\r\n"
+				"allocator_block_size:%zu\r\n"
+				"allocator_block_min_size:%zu\r\n"
+				"allocator_slots:%u\r\n"
+				"allocator_blocks:%lu\r\n"
+				"allocator_overflow_blocks:%lu\r\n"
+				"allocator_block_bytes:%zu\r\n"
+				"allocator_used_bytes:%zu\r\n"
+				"allocator_sparse_slots:%u\r\n"
+				"allocator_sparse_overhead:%zu\r\n"
+				"allocator_sparse_overhead_human:%s\r\n"
+				"allocator_frag_ratio:%.2f\r\n"
+				"allocator_max_value_size:%zu\r\n"
+				"allocator_compact_moved:%lld\r\n"
+				"allocator_compact_released_blocks:%lld\r\n"
+				"migration_indexed_keys:%lld\r\n"
+				"migration_index_keys_per_sec:%.0f\r\n"
+				"migration_last_servable_ms:%.3f\r\n"
+				"migration_pending_slots:%lld\r\n"
+				"migration_pending_keys:%lld\r\n"
+				"migration_promoted_keys:%lld\r\n"
+				"migration_rdma_bytes:%lld\r\n"
+				"migration_rdma_gbps:%.2f\r\n"
+				"migration_rdma_block_p99_us:%lld\r\n"
+				"migration_rdma_reg_usec:%lld\r\n"
+				"migration_rdma_mr_hits:%lld\r\n"
+				"migration_rdma_mr_misses:%lld\r\n"
+				"migration_handoff_last_ms:%.3f\r\n"
+				"migration_handoff_slots:%lld\r\n"
+				"migration_handoff_timeouts:%lld\r\n"
+				"migration_parked_writes:%lld\r\n"
+				"migration_parked_timeouts:%lld\r\n"
+				"migration_parked_ms_max:%.3f\r\n"
+				"migration_shadow_records:%lld\r\n"
+				"migration_shadow_frames:%lld\r\n"
+				"migration_shadow_bytes:%lld\r\n"
+				"migration_precopy_rounds:%lld\r\n"
+				"migration_precopy_blocks:%lld\r\n"
+				"migration_precopy_bytes:%lld\r\n"
+				"migration_chunks:%lld\r\n"
+				"migration_chunk_max_bytes:%lld\r\n"
+				"allocator_block_pool_blocks:%u\r\n"
+				"keyspace_chain_len_avg:%.2f\r\n"
+				"keyspace_chain_len_max:%lu\r\n"
+				"keyspace_chain_len_peak:%lu\r\n",
+			ai.block_size_max,
+			ai.block_size_min,
+			ai.slots,
+			ai.blocks,
+			ai.overflow_blocks,
+			ai.bytes_blocks,
+			ai.bytes_used,
+			ai.sparse_slots,
+			ai.sparse_overhead,
+			sparse_hmem,
+			ai.bytes_used ? (double)ai.bytes_blocks / ai.bytes_used : 0,
+			/* genericSetKey() stores key and value with 8 bytes of sds header and the null term. */
+			ai.max_kv_size - 2*(8+1),
+			server.stat_allocator_compact_moved,
+			server.stat_allocator_compact_released,
+			server.stat_migration_indexed_keys,
+			server.stat_migration_index_usec ?
+				(double)server.stat_migration_indexed_keys*1000000/server.stat_migration_index_usec : 0,
+			(double)server.stat_migration_servable_usec/1000,
+			pending_slots, pending_keys, promoted_keys,
+			server.stat_migration_rdma_bytes,
+			server.stat_migration_rdma_usec ?
+				(double)server.stat_migration_rdma_bytes/server.stat_migration_rdma_usec/1000 : 0,
+			server.stat_migration_rdma_p99_usec,
+			server.stat_migration_rdma_reg_usec,
+			server.stat_migration_rdma_mr_hits,
+			server.stat_migration_rdma_mr_misses,
+			(double)server.stat_migration_handoff_usec/1000,
+			server.stat_migration_handoff_slots,
+			server.stat_migration_handoff_timeouts,
+			server.stat_migration_parked_writes,
+			server.stat_migration_parked_timeouts,
+			(double)server.stat_migration_parked_max_usec/1000,
+			server.stat_migration_shadow_records,
+			server.stat_migration_shadow_frames,
+			server.stat_migration_shadow_bytes,
+			server.stat_migration_precopy_rounds,
+			server.stat_migration_precopy_blocks,
+			server.stat_migration_precopy_bytes,
+			__atomic_load_n(&server.stat_migration_chunks, __ATOMIC_RELAXED),
+			__atomic_load_n(&server.stat_migration_chunk_max_bytes, __ATOMIC_RELAXED),
+			r_allocator_block_pool_size(),
+			server.stat_keyspace_chain_avg,
+			server.stat_keyspace_chain_max,
+			server.stat_keyspace_chain_peak);
+	}
+
+	/* Slot migration */
+	if (allsections || defsections || !strcasecmp(section,"migration")) {
+		if (sections++) info = sdscat(info,"\r\n");
+		info = sdscat(info,"# Migration\r\n");
+		info = genMigrationInfoString(info);
+	}
+
 	/* Persistence */
 	if (allsections || defsections || !strcasecmp(section,"persistence")) {
 		if (sections++) info = sdscat(info,"\r\n");
@@ -5445,10 +5596,14 @@ sds genRedisInfoString(const char *section) {
 	if (allsections || defsections || !strcasecmp(section,"stats")) {
 		long long stat_total_reads_processed, stat_total_writes_processed;
 		long long stat_net_input_bytes, stat_net_output_bytes;
+		long long stat_reply_values, stat_reply_value_bytes_copied, stat_reply_value_bytes_referenced;
 		atomicGet(server.stat_total_reads_processed, stat_total_reads_processed);
 		atomicGet(server.stat_total_writes_processed, stat_total_writes_processed);
 		atomicGet(server.stat_net_input_bytes, stat_net_input_bytes);
 		atomicGet(server.stat_net_output_bytes, stat_net_output_bytes);
+		atomicGet(server.stat_reply_values, stat_reply_values);
+		atomicGet(server.stat_reply_value_bytes_copied, stat_reply_value_bytes_copied);
+		atomicGet(server.stat_reply_value_bytes_referenced, stat_reply_value_bytes_referenced);
 
 		if (sections++) info = sdscat(info,"\r\n");
 		info = sdscatprintf(info,
@@ -5469,6 +5624,8 @@ sds genRedisInfoString(const char *section) {
 				"expired_time_cap_reached_count:%lld\r\n"
 				"expire_cycle_cpu_milliseconds:%lld\r\n"
 				"evicted_keys:%lld\r\n"
+				"evicted_bytes:%lld\r\n"
+				"evicted_blocks:%lld\r\n"
 				"keyspace_hits:%lld\r\n"
 				"keyspace_misses:%lld\r\n"
 				"pubsub_channels:%ld\r\n"
@@ -5490,7 +5647,11 @@ sds genRedisInfoString(const char *section) {
 				"total_reads_processed:%lld\r\n"
 				"total_writes_processed:%lld\r\n"
 				"io_threaded_reads_processed:%lld\r\n"
-				"io_threaded_writes_processed:%lld\r\n",
+				"io_threaded_writes_processed:%lld\r\n"
+				"io_threaded_commands_processed:%lld\r\n"
+				"reply_values:%lld\r\n"
+				"reply_value_bytes_copied:%lld\r\n"
+				"reply_value_bytes_referenced:%lld\r\n",
 			server.stat_numconnections,
 			server.stat_numcommands,
 			getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -5507,6 +5668,8 @@ sds genRedisInfoString(const char *section) {
 			server.stat_expired_time_cap_reached_count,
 			server.stat_expire_cycle_time_used/1000,
 			server.stat_evictedkeys,
+			server.stat_evicted_bytes,
+			server.stat_evicted_blocks,
 			server.stat_keyspace_hits,
 			server.stat_keyspace_misses,
 			dictSize(server.pubsub_channels),
@@ -5528,7 +5691,11 @@ sds genRedisInfoString(const char *section) {
 			stat_total_reads_processed,
 			stat_total_writes_processed,
 			server.stat_io_reads_processed,
-			server.stat_io_writes_processed);
+			server.stat_io_writes_processed,
+			server.stat_io_exec_processed,
+			stat_reply_values,
+			stat_reply_value_bytes_copied,
+			stat_reply_value_bytes_referenced);
 	}
 
 	/* Replication */
@@ -6587,7 +6754,16 @@ struct redisTest {
 	{"crc64", crc64Test},
 	{"zmalloc", zmalloc_test},
 	{"sds", sdsTest},
-	{"dict", dictTest}
+	{"dict", dictTest},
+	{"allocator", allocatorTest},
+	{"slotindex", slotIndexTest},
+	{"shadowlog", shadowLogTest},
+	{"slotexec", slotExecTest},
+	{"respparser", respParserTest},
+	{"ae", aeTest},
+	{"rdmaengine", rdmaEngineTest},
+	{"rdmamrcache", rdmaMRCacheTest},
+	{"migrationtransport", migrationTransportTest}
 };
 redisTestProc *getTestProcByName(const char *name) {
 	int numtests = sizeof(redisTests)/sizeof(struct redisTest);
@@ -6847,6 +7023,26 @@ int main(int argc, char **argv) {
 	serverLog(LL_WARNING, "STRATOS ALLOCATOR INITIATED");
 
 	r_allocator_init();
+	r_allocator_set_block_size(server.allocator_block_min_size, server.allocator_block_size);
+	r_allocator_set_block_pool(server.allocator_block_pool);
+	r_allocator_set_release_hook(rdmaBlockReleased);
+	if (server.allocator_arena_size) {
+		static const char *hugepages_names[] = {"no", "thp", "2mb", "1gb"};
+		if (r_allocator_arena_init(server.allocator_arena_size, server.allocator_arena_hugepages,
+				server.allocator_arena_numa_node, server.allocator_arena_prefault_blocks) == -1) {
+			serverLog(LL_WARNING, "WARNING: Unable to reserve %zu bytes for the allocator arena, slot blocks will be malloc'd.",
+				server.allocator_arena_size);
+		} else {
+			arena_stats_t as = r_allocator_arena_stats();
+			serverLog(LL_NOTICE, "Allocator arena: %u blocks (%zu bytes), huge pages: %s, NUMA node: %d, %u blocks prefaulted.",
+				as.blocks_total, as.region_size, hugepages_names[as.hugepages], as.numa_node, as.blocks_prefaulted);
+			if (as.hugepages != server.allocator_arena_hugepages)
+				serverLog(LL_WARNING, "WARNING: allocator-arena-hugepages %s is not available, using %s.",
+					hugepages_names[server.allocator_arena_hugepages], hugepages_names[as.hugepages]);
+			if (as.numa_node != server.allocator_arena_numa_node)
+				serverLog(LL_WARNING, "WARNING: Unable to bind the allocator arena to NUMA node %d.", server.allocator_arena_numa_node);
+		}
+	}
 
 	redisSetCpuAffinity(server.server_cpulist);
 	setOOMScoreAdj(-1);
@@ -40,6 +40,8 @@
 #include "rdma_buffer.h"
 #include "rdma_client.h"
 #include "rdma_server.h"
+#include "rdma_mr_cache.h"
+#include "migration_transport.h"
 #include "robj.h"
 
 #include <stdio.h>
@@ -157,6 +159,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define IO_THREADS_MAX_NUM      128       /* Max io-threads, main thread included */
+#define PROTO_ARGV_CACHE_SIZE   8         /* Argument objects kept for reuse by a client */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -299,7 +303,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
 #define BLOCKED_PAUSE 6   /* Blocked by CLIENT PAUSE */
-#define BLOCKED_NUM 7     /* Number of blocked states. */
+#define BLOCKED_SLOT 7    /* Write parked while its slot changes hands. */
+#define BLOCKED_NUM 8     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -676,6 +681,8 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
 
+#define OBJ_ENCODING_EMBSTR_SIZE_LIMIT 44 /* Longest string encoded as EMBSTR */
+
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
 #define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
@@ -698,6 +705,7 @@ char *getObjectTypeName(robj*);
     _var.refcount = OBJ_STATIC_REFCOUNT; \
     _var.type = OBJ_STRING; \
     _var.encoding = OBJ_ENCODING_RAW; \
+    _var.data_offset = 0; \
     _var.ptr = _ptr; \
 } while(0)
 
@@ -707,9 +715,14 @@ struct evictionPoolEntry; /* Defined in evict.c */
  * which is actually a linked list of blocks like that, that is: client->reply. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    char *ref;      /* If not NULL the block has no buf: its 'used' bytes are
+                       those of a value in a slot block, see addReplyBulkSlotValue(). */
+    int slot;       /* The slot pinned by 'ref'. */
     char buf[];
 } clientReplyBlock;
 
+#define replyBlockData(o) ((o)->ref ? (o)->ref : (o)->buf)
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
@@ -878,6 +891,9 @@ typedef struct client {
     int original_argc;      /* Num of arguments of original command if arguments were rewritten. */
     robj **original_argv;   /* Arguments of original command if arguments were rewritten. */
     size_t argv_len_sum;    /* Sum of lengths of objects in argv list. */
+    robj *argv_cache[PROTO_ARGV_CACHE_SIZE]; /* EMBSTR arguments of the previous
+                                                commands, reused by the parser. */
+    int argv_cached;        /* Num of objects in argv_cache. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
     user *user;             /* User associated with this connection. If the
                                user is set to NULL the connection can do
@@ -923,7 +939,12 @@ typedef struct client {
     sds peerid;             /* Cached peer ID. */
     sds sockname;           /* Cached connection target address. */
     listNode *client_list_node; /* list node in client list */
-    listNode *paused_list_node; /* list node within the pause list */
+    listNode *paused_list_node; /* list node within the pause or parked list */
+    long long parked_start; /* Time the write was parked, see BLOCKED_SLOT. */
+    int parked_slot;        /* Frozen slot the write waits for. */
+    int io_thread;          /* I/O thread reading the client in the current read phase. */
+    int exec_slot;          /* Slot of the last GET or SET parsed by an I/O thread,
+                               -1 if none, see slotExecThreadOf(). */
     RedisModuleUserChangedFunc auth_callback; /* Module callback to execute
                                                * when the authenticated user
                                                * changes. */
@@ -1265,6 +1286,7 @@ struct redisServer {
     rax *clients_index;         /* Active clients dictionary by client ID. */
     pause_type client_pause_type;      /* True if clients are currently paused */
     list *paused_clients;       /* List of pause clients */
+    list *parked_clients;       /* Writes parked on a frozen slot. */
     mstime_t client_pause_end_time;    /* Time when we undo clients_paused */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
@@ -1275,12 +1297,14 @@ struct redisServer {
     pthread_mutex_t generic_migration_mutex;
     pthread_mutex_t socket_mutex;
     pthread_mutex_t lock_slots[16385];
-    pthread_mutex_t ownership_lock_slots[16385];
+    uint64_t slot_ownership[16385]; /* (epoch << 2) | CLUSTER_SLOT_* state,
+                                     * see clusterSlotState(). */
+    int slot_writers[16385];        /* Writes of the slot being executed,
+                                     * see clusterFreezeSlot(). */
     int pending_migration_writes[16385];
     rax *migrated_keys;
     //pthread_rwlock_t ownership_mutex;
 
-    int migration_ownership_changed[16385];
     int migrateActive;
 
     redisAtomic uint64_t next_client_id; /* Next client unique ID. Incremental. */
@@ -1289,6 +1313,7 @@ struct redisServer {
                                    queries. Will still serve RESP2 queries. */
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_exec_slots;  /* Execute the GET / SET of their slots in the IO threads? */
     int io_threads_active;      /* Is IO threads currently active? */
     long long events_processed_while_blocked; /* processEventsWhileBlocked() */
 
@@ -1314,6 +1339,8 @@ struct redisServer {
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_evicted_bytes;   /* Memory given back by the evictions, slot blocks included */
+    long long stat_evicted_blocks;  /* Slot blocks released by the evictions */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
@@ -1321,6 +1348,37 @@ struct redisServer {
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
     long long stat_active_defrag_key_misses;/* number of keys scanned and not moved */
     long long stat_active_defrag_scanned;   /* number of dictEntries scanned */
+    long long stat_allocator_compact_moved;     /* K-Vs moved by the slot block compactor */
+    long long stat_allocator_compact_released;  /* slot blocks released by the compactor */
+    long long stat_migration_indexed_keys;      /* keys of migrated slots added to the keyspace */
+    long long stat_migration_index_usec;        /* time spent indexing migrated slots */
+    long long stat_migration_servable_usec;     /* time for the slowest slot of the last batch to be servable */
+    long long stat_migration_rdma_bytes;        /* bytes of slot blocks written with RDMA */
+    long long stat_migration_rdma_usec;         /* time spent writing slot blocks with RDMA */
+    long long stat_migration_rdma_p99_usec;     /* p99 block latency of the last RDMA transfer */
+    long long stat_migration_rdma_reg_usec;     /* time spent registering slot blocks with the NIC */
+    long long stat_migration_rdma_mr_hits;      /* slot blocks whose registration was cached */
+    long long stat_migration_rdma_mr_misses;    /* slot blocks registered */
+    long long stat_migration_handoff_usec;      /* time it took for the cluster to know the new owner of the last batch */
+    long long stat_migration_handoff_slots;     /* slots handed over to other nodes */
+    long long stat_migration_handoff_timeouts;  /* nodes that didn't ack a hand-off in time */
+    long long stat_migration_parked_writes;     /* writes parked while their slot was frozen */
+    long long stat_migration_parked_timeouts;   /* parked writes answered with -TRYAGAIN */
+    long long stat_migration_parked_max_usec;   /* longest a write stayed parked */
+    long long stat_migration_shadow_frames;     /* frames of shadow writes sent to recipients */
+    long long stat_migration_shadow_records;    /* writes served during migration and forwarded */
+    long long stat_migration_shadow_bytes;
+    long long stat_migration_precopy_rounds;    /* pre-copy rounds that resent dirty blocks */
+    long long stat_migration_precopy_blocks;    /* slot blocks resent because they were written */
+    long long stat_migration_precopy_bytes;
+    long long stat_migration_chunks;            /* slot chunks migrated and handed off */
+    long long stat_migration_chunk_max_bytes;   /* block bytes of the largest chunk */
+    long long stat_cluster_moved_replies;       /* -MOVED redirections */
+    long long stat_cluster_ask_replies;         /* -ASK redirections */
+    long long stat_cluster_tryagain_replies;    /* -TRYAGAIN, slot unstable or parked too long */
+    double stat_keyspace_chain_avg;             /* sampled avg keys per non empty keyspace bucket */
+    unsigned long stat_keyspace_chain_max;      /* longest keyspace chain of the last sample */
+    unsigned long stat_keyspace_chain_peak;     /* longest keyspace chain sampled */
     size_t stat_peak_memory;        /* Max used memory record */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
@@ -1350,6 +1408,10 @@ struct redisServer {
     long long stat_dump_payload_sanitizations; /* Number deep dump payloads integrity validations. */
     long long stat_io_reads_processed; /* Number of read events processed by IO / Main threads */
     long long stat_io_writes_processed; /* Number of write events processed by IO / Main threads */
+    long long stat_io_exec_processed; /* Number of commands executed by IO / Main threads while reading */
+    redisAtomic long long stat_reply_values; /* Values of keys sent as bulk replies by GET */
+    redisAtomic long long stat_reply_value_bytes_copied; /* Bytes of those values copied to the output buffers */
+    redisAtomic long long stat_reply_value_bytes_referenced; /* Bytes of those values sent from their slot block */
     redisAtomic long long stat_total_reads_processed; /* Total number of read events processed */
     redisAtomic long long stat_total_writes_processed; /* Total number of write events processed */
     /* The following two are used to track instantaneous metrics, like
@@ -1377,6 +1439,8 @@ struct redisServer {
     int active_defrag_cycle_max;       /* maximal effort for defrag in CPU percentage */
     unsigned long active_defrag_max_scan_fields; /* maximum number of fields of set/hash/zset/list to process from within the main dict scan */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
+    size_t reply_zero_copy_threshold; /* Values at least this long are sent from their
+                                         slot block, 0 = always copied. */
     int dbnum;                      /* Total number of configured DBs */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
     int supervised_mode;            /* See SUPERVISED_* */
@@ -1676,6 +1740,10 @@ struct redisServer {
     int failover_state; /* Failover state */
     //
     struct rdma_client_info *rdma_client;
+    struct rdma_engine *rdma_engine;    /* Writes the slot blocks to the recipient. */
+    struct rdma_mr_cache *rdma_mr_cache;    /* Registrations of the slot blocks. */
+    struct ibv_pd *rdma_mr_cache_pd;        /* PD of the registrations in the cache. */
+    struct migration_receiver *migration_receiver; /* Applies the writes of a TCP/SHM donor. */
     struct rdma_buffer_info *rdma_buffer;
     void *rdma_base_pointer;
     size_t rdma_buffer_size;
@@ -1685,6 +1753,28 @@ struct redisServer {
     int migration_active;
     connection *recipient_conn;
     int rdmaDoneAck;
+    /* Slot allocator */
+    size_t allocator_block_size;        /* Max size of a slot block. */
+    size_t allocator_block_min_size;    /* Size of the first block of a slot. */
+    size_t allocator_arena_size;        /* Bytes reserved for slot blocks at startup, 0 = malloc each block. */
+    int allocator_arena_hugepages;      /* ALLOCATOR_HUGEPAGES_* page size of the arena. */
+    int allocator_arena_numa_node;      /* NUMA node the arena is bound to, -1 = no binding. */
+    int allocator_arena_prefault_blocks;/* Arena blocks faulted in at startup. */
+    int allocator_compact;              /* Compact sparse slot blocks in the background. */
+    int allocator_evict_blocks;         /* Evict the cold K-Vs of the block of the victim together. */
+    int allocator_compact_threshold;    /* Evacuate blocks used less than this percent. */
+    int allocator_compact_cycle_max;    /* Max CPU percent used by the compactor. */
+    int migration_index_threads;        /* Threads indexing the K-Vs of received slots. */
+    int migration_lazy_index;           /* Serve received slots before their keys are indexed. */
+    int migration_rdma_window;          /* Max outstanding RDMA WRITEs. */
+    int migration_rdma_signal_every;    /* RDMA WRITEs per signaled chain. */
+    size_t migration_rdma_region_chunk; /* Register the arena in chunks of this size, 0 = block by block. */
+    int migration_precopy_rounds;       /* Rounds resending the written blocks before they are locked, 0 = lock at once. */
+    size_t migration_precopy_threshold; /* Lock the blocks once the written ones add up to this many bytes. */
+    int migration_chunk_slots;          /* Max slots migrated and handed off together. */
+    size_t migration_chunk_bytes;       /* Max block bytes of a chunk, 0 = no limit. */
+    int migration_transport;            /* MIGRATION_TRANSPORT_*: how the blocks are written. */
+    unsigned int allocator_block_pool; /* Freed slot blocks kept registered for the next migration. */
     
 };
 
@@ -1795,6 +1885,7 @@ typedef struct {
 extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
 extern dictType objectKeyPointerValueDictType;
+extern dictType keylistDictType;
 extern dictType objectKeyHeapPointerValueDictType;
 extern dictType setDictType;
 extern dictType zsetDictType;
@@ -1854,7 +1945,6 @@ long moduleDefragGlobals(void);
 long long ustime(void);
 long long mstime(void);
 void getRandomHexChars(char *p, size_t len);
-void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
@@ -1891,6 +1981,7 @@ void addReplyVerbatim(client *c, const char *s, size_t len, const char *ext);
 void addReplyProto(client *c, const char *s, size_t len);
 void AddReplyFromClient(client *c, client *src);
 void addReplyBulk(client *c, robj *obj);
+void addReplyBulkSlotValue(client *c, int slot, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
@@ -1958,6 +2049,9 @@ void protectClient(client *c);
 void unprotectClient(client *c);
 void initThreadedIO(void);
 client *lookupClientByID(uint64_t id);
+#ifdef REDIS_TEST
+int respParserTest(int argc, char *argv[], int accurate);
+#endif
 
 #ifdef __GNUC__
 void addReplyErrorFormat(client *c, const char *fmt, ...)
@@ -2299,7 +2393,12 @@ void incrementErrorCount(const char *fullerr, size_t namelen);
 void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(int update_daylight_info);
 void resetServerStats(void);
+void initServerConfig(void);
+void createSharedObjects(void);
 void activeDefragCycle(void);
+void slotCompactCycle(void);
+int slotCompactSlot(int slot);
+int slotCompactIsMigrating(int slot);
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -2427,22 +2526,19 @@ void discardDbBackup(dbBackup *buckup, int flags, void(callback)(void*));
 int selectDb(client *c, int id);
 void signalModifiedKey(client *c, redisDb *db, robj *key);
 void signalFlushedDb(int dbid, int async);
+dict *createKeyspace(void);
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count);
 unsigned int countKeysInSlot(unsigned int hashslot);
 unsigned int delKeysInSlot(unsigned int hashslot);
+unsigned int delKeysInSlotAllocator(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(sds key);
-void slotToKeyDel(sds key);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlush(int async);
 size_t lazyfreeGetPendingObjectsCount(void);
 size_t lazyfreeGetFreedObjectsCount(void);
 void freeObjAsync(robj *key, robj *obj);
-void freeSlotsToKeysMapAsync(rax *rt);
-void freeSlotsToKeysMap(rax *rt, int async);
 
 
 /* API to get key arguments from commands */
@@ -2469,6 +2565,62 @@ void migrateCloseTimedoutSockets(void);
 void clusterBeforeSleep(void);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
 
+/* Index rebuild of migrated slots */
+typedef struct slotIndexStats {
+    long long keys_added;       /* Keys added to the dict. */
+    long long keys_existing;    /* Keys skipped because they already exist. */
+    long long scan_us;          /* Time spent scanning the blocks and hashing the keys. */
+    long long insert_us;        /* Time spent inserting the keys in the dict. */
+    long long total_us;
+} slotIndexStats;
+
+void slotIndexRebuild(dict *d, int *slots, int nslots, int threads,
+                      long long *servable_us, slotIndexStats *stats);
+void slotIndexRebuildLazy(dict *d, int *slots, int nslots, int threads,
+                          long long *servable_us, slotIndexStats *stats);
+int slotIndexPromoteKey(dict *d, sds key);
+int slotIndexIsPending(int slot);
+void slotIndexDiscardPending(void);
+void slotIndexGetPendingStats(long long *slots, long long *keys, long long *promoted);
+#ifdef REDIS_TEST
+int slotIndexTest(int argc, char *argv[], int accurate);
+#endif
+
+/* Execution of the commands of owned slots in the I/O threads */
+int slotExecOwner(int slot, int threads);
+int slotExecThreadOf(client *c, int fallback);
+void slotExecBegin(void);
+void slotExecEnd(void);
+int slotExecCommand(client *c);
+#ifdef REDIS_TEST
+int slotExecTest(int argc, char *argv[], int accurate);
+#endif
+
+/* Delta channel of the migrated slots */
+#define SHADOWLOG_SET 1
+#define SHADOWLOG_DEL 2
+#define SHADOWLOG_FRAME_BYTES (64*1024)
+
+typedef struct shadowRecord {
+    int op;                     /* SHADOWLOG_SET or SHADOWLOG_DEL. */
+    const char *key;
+    size_t keylen;
+    const char *val;            /* NULL for SHADOWLOG_DEL. */
+    size_t vallen;
+} shadowRecord;
+
+void shadowLogAppend(int slot, int op, const char *key, size_t keylen,
+                     const char *val, size_t vallen);
+void shadowLogKey(redisDb *db, robj *key, int slot);
+sds *shadowLogTakeFrames(int slot, int *count);
+void shadowLogRestoreFrames(int slot, sds *frames, int count);
+void shadowLogDiscard(int slot);
+int shadowFrameSlot(const char *frame, size_t len, uint32_t *count);
+int shadowFrameNext(const char *frame, size_t len, size_t *pos, shadowRecord *r);
+#ifdef REDIS_TEST
+int shadowLogTest(int argc, char *argv[], int accurate);
+#endif
+
 /* Sentinel */
 void initSentinelConfig(void);
 void initSentinel(void);
@@ -2724,7 +2876,10 @@ void registerRDMABlockSlotsCommand(client *c);
 void rdmaDoneSlotsCommand(client *c);
 void rdmaDoneBatchCommand(client *c);
 void rdmaDoneAckCommand(client  *c);
+void rdmaBlockReleased(void *buffer, size_t len);
 void shadowWriteCommand(client *c);
+void shadowApplyCommand(client *c);
+void migrationCommand(client *c);
 
 void objectCommand(client *c);
 void memoryCommand(client *c);
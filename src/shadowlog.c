@@ -0,0 +1,455 @@
+/* Delta channel of the writes to the slots being migrated.
+ *
+ * While a slot is migrated by RDMA the donor keeps serving its writes. Every
+ * write to a migrating slot appends the post-image of the keys it touched to
+ * the log of the slot: a SET record with the current value of the key, or a
+ * DEL record if it no longer exists. Since a record carries the whole value,
+ * applying the records of a key in order, whatever the commands that
+ * produced them, leaves the recipient with the value the donor has.
+ *
+ * The records of a slot are packed in frames of at most SHADOWLOG_FRAME_BYTES:
+ *
+ *   frame:  magic (2 bytes) | slot (2 bytes) | count (4 bytes) | records
+ *   record: SHADOWLOG_SET | key len (4 bytes) | value len (4 bytes) | key | value
+ *           SHADOWLOG_DEL | key len (4 bytes) | key
+ *
+ * All the integers are little endian. The migration thread takes the frames
+ * of a slot with shadowLogTakeFrames() once the slot is frozen, and sends
+ * them back to back as SHADOWAPPLY commands. The frames of a slot are kept
+ * in the order they were filled, so the records of every key are applied in
+ * the order of the writes. */
+
+#include "server.h"
+#include "cluster.h"
+#include "endianconv.h"
+
+#include <math.h>
+
+#define SHADOWLOG_MAGIC 0x5357
+#define SHADOWLOG_FRAME_HDR 8
+
+static struct {
+    pthread_mutex_t lock;
+    list *frames[CLUSTER_SLOTS];    /* Frames of the slot, the last one is filled. */
+} shadowlog = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static sds shadowFrameNew(int slot) {
+    unsigned char hdr[SHADOWLOG_FRAME_HDR];
+    uint16_t magic = SHADOWLOG_MAGIC, s = slot;
+    uint32_t count = 0;
+
+    memrev16ifbe(&magic);
+    memrev16ifbe(&s);
+    memcpy(hdr, &magic, 2);
+    memcpy(hdr+2, &s, 2);
+    memcpy(hdr+4, &count, 4);
+    return sdsnewlen(hdr, SHADOWLOG_FRAME_HDR);
+}
+
+static uint32_t shadowFrameCount(const char *frame) {
+    uint32_t count;
+
+    memcpy(&count, frame+4, 4);
+    memrev32ifbe(&count);
+    return count;
+}
+
+/* Append a record to the log of 'slot'. */
+void shadowLogAppend(int slot, int op, const char *key, size_t keylen,
+                     const char *val, size_t vallen)
+{
+    unsigned char hdr[9];
+    uint32_t kl = keylen, vl = vallen, count;
+    size_t hdrlen = op == SHADOWLOG_SET ? 9 : 5;
+    size_t reclen = hdrlen + keylen + (op == SHADOWLOG_SET ? vallen : 0);
+
+    hdr[0] = op;
+    memrev32ifbe(&kl);
+    memrev32ifbe(&vl);
+    memcpy(hdr+1, &kl, 4);
+    memcpy(hdr+5, &vl, 4);
+
+    pthread_mutex_lock(&shadowlog.lock);
+    list *l = shadowlog.frames[slot];
+    if (l == NULL) l = shadowlog.frames[slot] = listCreate();
+    listNode *ln = listLast(l);
+    if (ln == NULL || (sdslen(ln->value) > SHADOWLOG_FRAME_HDR &&
+                       sdslen(ln->value) + reclen > SHADOWLOG_FRAME_BYTES))
+    {
+        listAddNodeTail(l, shadowFrameNew(slot));
+        ln = listLast(l);
+    }
+    sds frame = ln->value;
+    frame = sdsMakeRoomFor(frame, reclen);
+    frame = sdscatlen(frame, hdr, hdrlen);
+    frame = sdscatlen(frame, key, keylen);
+    if (op == SHADOWLOG_SET) frame = sdscatlen(frame, val, vallen);
+    count = shadowFrameCount(frame) + 1;
+    memrev32ifbe(&count);
+    memcpy(frame+4, &count, 4);
+    ln->value = frame;
+    pthread_mutex_unlock(&shadowlog.lock);
+}
+
+/* Log the post-image of 'key', that belongs to the migrating 'slot', after a
+ * write touched it. Only strings live in the slot blocks, the other types are
+ * not logged. */
+void shadowLogKey(redisDb *db, robj *key, int slot) {
+    robj *val = lookupKeyReadWithFlags(db, key, LOOKUP_NOTOUCH|LOOKUP_NONOTIFY);
+
+    if (val == NULL) {
+        shadowLogAppend(slot, SHADOWLOG_DEL, key->ptr, sdslen(key->ptr), NULL, 0);
+    } else if (val->type == OBJ_STRING) {
+        char buf[LONG_STR_SIZE];
+
+        if (sdsEncodedObject(val)) {
+            shadowLogAppend(slot, SHADOWLOG_SET, key->ptr, sdslen(key->ptr),
+                            val->ptr, sdslen(val->ptr));
+        } else {
+            int len = ll2string(buf, sizeof(buf), (long) val->ptr);
+            shadowLogAppend(slot, SHADOWLOG_SET, key->ptr, sdslen(key->ptr), buf, len);
+        }
+    }
+}
+
+/* Detach the frames of 'slot', in order. The caller frees them with
+ * sdsfree() and the array with zfree(). Returns NULL if nothing was logged. */
+sds *shadowLogTakeFrames(int slot, int *count) {
+    sds *frames = NULL;
+    list *l;
+
+    pthread_mutex_lock(&shadowlog.lock);
+    l = shadowlog.frames[slot];
+    shadowlog.frames[slot] = NULL;
+    pthread_mutex_unlock(&shadowlog.lock);
+
+    *count = 0;
+    if (l == NULL) return NULL;
+    frames = zmalloc(sizeof(sds) * listLength(l));
+    while (listLength(l)) {
+        listNode *ln = listFirst(l);
+        frames[(*count)++] = ln->value;
+        listDelNode(l, ln);
+    }
+    listRelease(l);
+    return frames;
+}
+
+/* Put back the frames taken by shadowLogTakeFrames() that the recipient did
+ * not apply, ahead of the records logged since. Takes ownership of the frames
+ * and of the array. */
+void shadowLogRestoreFrames(int slot, sds *frames, int count) {
+    if (frames == NULL) return;
+    pthread_mutex_lock(&shadowlog.lock);
+    list *l = shadowlog.frames[slot];
+    if (l == NULL) l = shadowlog.frames[slot] = listCreate();
+    for (int j = count-1; j >= 0; j--) listAddNodeHead(l, frames[j]);
+    pthread_mutex_unlock(&shadowlog.lock);
+    zfree(frames);
+}
+
+/* Drop the log of 'slot', for example when its migration is aborted. */
+void shadowLogDiscard(int slot) {
+    int count;
+    sds *frames = shadowLogTakeFrames(slot, &count);
+
+    for (int j = 0; j < count; j++) sdsfree(frames[j]);
+    zfree(frames);
+}
+
+/* Returns the slot of the frame, or -1 if it's not a frame. */
+int shadowFrameSlot(const char *frame, size_t len, uint32_t *count) {
+    uint16_t magic, slot;
+
+    if (len < SHADOWLOG_FRAME_HDR) return -1;
+    memcpy(&magic, frame, 2);
+    memcpy(&slot, frame+2, 2);
+    memrev16ifbe(&magic);
+    memrev16ifbe(&slot);
+    if (magic != SHADOWLOG_MAGIC || slot >= CLUSTER_SLOTS) return -1;
+    if (count) *count = shadowFrameCount(frame);
+    return slot;
+}
+
+/* Decode the record of the frame at '*pos', 0 for the first one, and move
+ * '*pos' to the next one. Returns 1 if a record was decoded, 0 at the end of
+ * the frame and -1 if the frame is truncated or corrupted. */
+int shadowFrameNext(const char *frame, size_t len, size_t *pos, shadowRecord *r) {
+    size_t p = *pos ? *pos : SHADOWLOG_FRAME_HDR;
+    uint32_t kl, vl = 0;
+
+    if (p == len) return 0;
+    if (p + 5 > len) return -1;
+    r->op = (unsigned char) frame[p];
+    if (r->op != SHADOWLOG_SET && r->op != SHADOWLOG_DEL) return -1;
+    memcpy(&kl, frame+p+1, 4);
+    memrev32ifbe(&kl);
+    p += 5;
+    if (r->op == SHADOWLOG_SET) {
+        if (p + 4 > len) return -1;
+        memcpy(&vl, frame+p, 4);
+        memrev32ifbe(&vl);
+        p += 4;
+    }
+    if (kl > len - p || vl > len - p - kl) return -1;
+    r->key = frame+p;
+    r->keylen = kl;
+    r->val = r->op == SHADOWLOG_SET ? frame+p+kl : NULL;
+    r->vallen = vl;
+    *pos = p + kl + vl;
+    return 1;
+}
+
+#ifdef REDIS_TEST
+
+static uint64_t shadowLogTestHash(const void *key) {
+    return dictGenHashFunction(key, sdslen((sds) key));
+}
+
+static int shadowLogTestCompare(void *privdata, const void *key1, const void *key2) {
+    UNUSED(privdata);
+    return sdslen((sds) key1) == sdslen((sds) key2) && memcmp(key1, key2, sdslen((sds) key1)) == 0;
+}
+
+static void shadowLogTestDestructor(void *privdata, void *val) {
+    UNUSED(privdata);
+    sdsfree(val);
+}
+
+static dictType shadowLogTestDictType = {
+    shadowLogTestHash, NULL, NULL, shadowLogTestCompare,
+    shadowLogTestDestructor, shadowLogTestDestructor, NULL
+};
+
+static void shadowLogTestSet(dict *d, const char *key, size_t keylen, const char *val, size_t vallen) {
+    sds k = sdsnewlen(key, keylen);
+    dictEntry *de = dictFind(d, k);
+
+    if (de) {
+        sdsfree(dictGetVal(de));
+        dictSetVal(d, de, sdsnewlen(val, vallen));
+        sdsfree(k);
+    } else {
+        dictAdd(d, k, sdsnewlen(val, vallen));
+    }
+}
+
+static void shadowLogTestDel(dict *d, const char *key, size_t keylen) {
+    sds k = sdsnewlen(key, keylen);
+    dictDelete(d, k);
+    sdsfree(k);
+}
+
+/* Apply the frames logged for every slot to 'd'. Returns the number of
+ * records, or -1 if a frame can't be decoded. */
+static long long shadowLogTestApply(dict *d, long long *numframes, long long *bytes) {
+    long long records = 0;
+
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        int count;
+        sds *frames = shadowLogTakeFrames(slot, &count);
+
+        for (int j = 0; j < count; j++) {
+            shadowRecord r;
+            size_t pos = 0;
+            uint32_t expected;
+            int res;
+
+            if (shadowFrameSlot(frames[j], sdslen(frames[j]), &expected) != slot) return -1;
+            while ((res = shadowFrameNext(frames[j], sdslen(frames[j]), &pos, &r)) == 1) {
+                if (r.op == SHADOWLOG_SET) shadowLogTestSet(d, r.key, r.keylen, r.val, r.vallen);
+                else shadowLogTestDel(d, r.key, r.keylen);
+                records++;
+                expected--;
+            }
+            if (res == -1 || expected != 0) return -1;
+            *bytes += sdslen(frames[j]);
+            sdsfree(frames[j]);
+        }
+        *numframes += count;
+        zfree(frames);
+    }
+    return records;
+}
+
+/* Zipfian key ids, like the request distribution of the YCSB workloads. */
+static long *shadowLogTestZipf(long keys, long ops) {
+    double *cdf = zmalloc(sizeof(double) * keys), sum = 0;
+    long *ids = zmalloc(sizeof(long) * ops);
+
+    for (long j = 0; j < keys; j++) sum += 1 / pow(j + 1, 0.99);
+    for (long j = 0; j < keys; j++) {
+        cdf[j] = (j ? cdf[j-1] : 0) + 1 / pow(j + 1, 0.99) / sum;
+    }
+    for (long j = 0; j < ops; j++) {
+        double u = (double) rand() / RAND_MAX;
+        long lo = 0, hi = keys - 1;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+        }
+        ids[j] = lo;
+    }
+    zfree(cdf);
+    return ids;
+}
+
+static int shadowLogTestSame(dict *a, dict *b) {
+    dictIterator *di;
+    dictEntry *de;
+    int same = dictSize(a) == dictSize(b);
+
+    di = dictGetIterator(a);
+    while (same && (de = dictNext(di)) != NULL) {
+        dictEntry *other = dictFind(b, dictGetKey(de));
+        same = other && sdscmp(dictGetVal(de), dictGetVal(other)) == 0;
+    }
+    dictReleaseIterator(di);
+    return same;
+}
+
+int shadowLogTest(int argc, char **argv, int accurate) {
+    long keys = 100000, ops;
+    int failed = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            ops = 10000000;
+        } else {
+            ops = strtol(argv[3],NULL,10);
+        }
+    } else {
+        ops = 1000000;
+    }
+
+    /* Records of a key are applied in order, frames are bounded. */
+    {
+        char big[1024];
+        int count, numrecords = 0;
+
+        memset(big, 'x', sizeof(big));
+        shadowLogAppend(42, SHADOWLOG_SET, "k", 1, "v1", 2);
+        shadowLogAppend(42, SHADOWLOG_DEL, "k", 1, NULL, 0);
+        shadowLogAppend(42, SHADOWLOG_SET, "k", 1, "v2", 2);
+        for (int j = 0; j < 200; j++)
+            shadowLogAppend(42, SHADOWLOG_SET, "big", 3, big, sizeof(big));
+
+        sds *frames = shadowLogTakeFrames(42, &count);
+        if (count < 2) {
+            printf("[failed] 200 KB of records in %d frame\n", count);
+            failed = 1;
+        }
+        for (int j = 0; j < count; j++) {
+            shadowRecord r;
+            size_t pos = 0;
+
+            if (sdslen(frames[j]) > SHADOWLOG_FRAME_BYTES) {
+                printf("[failed] frame of %zu bytes\n", sdslen(frames[j]));
+                failed = 1;
+            }
+            while (shadowFrameNext(frames[j], sdslen(frames[j]), &pos, &r) == 1) {
+                int ok = 1;
+                if (numrecords == 0) ok = r.op == SHADOWLOG_SET && r.vallen == 2 && !memcmp(r.val, "v1", 2);
+                if (numrecords == 1) ok = r.op == SHADOWLOG_DEL && r.keylen == 1 && r.val == NULL;
+                if (numrecords == 2) ok = r.op == SHADOWLOG_SET && r.vallen == 2 && !memcmp(r.val, "v2", 2);
+                if (!ok) {
+                    printf("[failed] record %d out of order\n", numrecords);
+                    failed = 1;
+                }
+                numrecords++;
+            }
+        }
+        if (numrecords != 203) {
+            printf("[failed] %d records decoded, expected 203\n", numrecords);
+            failed = 1;
+        }
+
+        /* A truncated frame is detected. */
+        shadowRecord r;
+        size_t pos = 0;
+        int res = 1;
+        while (res == 1) res = shadowFrameNext(frames[0], sdslen(frames[0]) - 1, &pos, &r);
+        if (res != -1) {
+            printf("[failed] truncated frame not detected\n");
+            failed = 1;
+        }
+        if (shadowFrameSlot("garbage!", 8, NULL) != -1) {
+            printf("[failed] frame with a bad magic accepted\n");
+            failed = 1;
+        }
+        for (int j = 0; j < count; j++) sdsfree(frames[j]);
+        zfree(frames);
+    }
+
+    /* 50/50 workload over zipfian keys, like workloads/workloadfulva5050:
+     * keys of 30 bytes, values of 100 bytes. The writes are logged as the
+     * donor does while the slots are migrated, 1 in 10 is a delete. The
+     * recipient applies the frames and must end up with the same keyspace. */
+    {
+        dict *donor = dictCreate(&shadowLogTestDictType, NULL);
+        dict *recipient = dictCreate(&shadowLogTestDictType, NULL);
+        long *ids = shadowLogTestZipf(keys, ops);
+        long long reads = 0, writes = 0, dels = 0, found = 0, numframes = 0, bytes = 0, rpc_bytes = 0;
+        char key[31], val[101];
+
+        srand(1234);
+        memset(val, 'v', 100);
+        val[100] = '\0';
+        long long start = ustime();
+        for (long j = 0; j < ops; j++) {
+            snprintf(key, sizeof(key), "user%026ld", ids[j]);
+            if (rand() & 1) {
+                sds k = sdsnewlen(key, 30);
+                found += dictFind(donor, k) != NULL;
+                sdsfree(k);
+                reads++;
+                continue;
+            }
+            int slot = keyHashSlot(key, 30);
+            if (rand() % 10 == 0) {
+                shadowLogTestDel(donor, key, 30);
+                shadowLogAppend(slot, SHADOWLOG_DEL, key, 30, NULL, 0);
+                dels++;
+            } else {
+                memcpy(val, &j, sizeof(j));
+                shadowLogTestSet(donor, key, 30, val, 100);
+                shadowLogAppend(slot, SHADOWLOG_SET, key, 30, val, 100);
+                /* *3 $11 shadowWrite $30 key $100 value, and +OK. */
+                rpc_bytes += 4 + 5 + 13 + 5 + 32 + 6 + 102 + 5;
+            }
+            writes++;
+        }
+        long long workload_us = ustime() - start;
+
+        start = ustime();
+        long long records = shadowLogTestApply(recipient, &numframes, &bytes);
+        long long apply_us = ustime() - start;
+
+        if (records != writes) {
+            printf("[failed] %lld records applied, %lld writes\n", records, writes);
+            failed = 1;
+        }
+        if (!shadowLogTestSame(donor, recipient)) {
+            printf("[failed] the recipient differs from the donor\n");
+            failed = 1;
+        }
+        printf("50/50 workload: %lld reads (%lld hits), %lld writes logged in %.3f ms, %.0f ops/sec\n",
+               reads, found, writes, (double) workload_us / 1000, (double) ops * 1000000 / workload_us);
+        printf("Applied %lld records in %lld frames (%lld bytes) in %.3f ms, %.0f records/sec\n",
+               records, numframes, bytes, (double) apply_us / 1000,
+               (double) records * 1000000 / (apply_us ? apply_us : 1));
+        printf("One shadowWrite per SET instead: %lld round trips, %lld bytes\n",
+               writes - dels, rpc_bytes);
+
+        zfree(ids);
+        dictRelease(donor);
+        dictRelease(recipient);
+    }
+
+    if (!failed) printf("All shadow log tests passed\n");
+    return failed;
+}
+
+#endif
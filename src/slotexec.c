@@ -0,0 +1,415 @@
+/* Execution of single key commands in the I/O threads.
+ *
+ * With io-threads-exec-slots the I/O threads that read and parse the queries
+ * also execute the plain GET and SET of the keys they own: of N threads
+ * (io-threads, the main thread being thread 0) thread i owns the hash slots
+ * [i*CLUSTER_SLOTS/N, (i+1)*CLUSTER_SLOTS/N). A client is handed to the owner
+ * of the slot of its last GET or SET, so clients that keep using the same
+ * slots are served by the same thread, and every slice of the keyspace and
+ * every slot of the allocator is only written by its owner.
+ *
+ * The main thread stays the coordinator: it runs whatever the I/O threads
+ * leave pending in the clients once they are done, that is the commands of
+ * slots owned by another thread, multi key and cross slot commands, and all
+ * the commands with effects outside of their slot. For the same reason the
+ * I/O threads execute nothing at all while any of those effects is possible
+ * (see slotExecBegin()): with replicas, AOF, keyspace notifications, client
+ * side caching, MONITOR, keys with a TTL, WATCH or maxmemory the commands go
+ * to the main thread as before.
+ *
+ * The keyspace is made concurrent (dictEnableConcurrency()) for the duration
+ * of the read phase, which lets several threads add keys to the sliced dict
+ * of the db and resize their own slices. The counters of the commands they
+ * execute (commandstats, keyspace hits and misses, dirty) are kept per thread
+ * and added to the global ones by the main thread after the phase. These
+ * commands are not logged in the slowlog and latency monitor. */
+
+#include "server.h"
+#include "cluster.h"
+#include "monotonic.h"
+#include "allocator.h"
+
+#define SLOTEXEC_GET 0
+#define SLOTEXEC_SET 1
+#define SLOTEXEC_CMDS 2
+
+/* What the I/O threads may execute in the current read phase. */
+#define SLOTEXEC_READS (1<<0)
+#define SLOTEXEC_WRITES (1<<1)
+
+typedef struct slotExecCmdStats {
+    struct redisCommand *cmd;
+    long long calls;
+    long long usec;
+} slotExecCmdStats;
+
+typedef struct slotExecThread {
+    slotExecCmdStats cmds[SLOTEXEC_CMDS];
+    long long hits;
+    long long misses;
+    long long dirty;
+} __attribute__((aligned(64))) slotExecThread;
+
+static slotExecThread slotexec_threads[IO_THREADS_MAX_NUM];
+static int slotexec_flags;     /* Only written by the main thread between phases. */
+
+/* The I/O thread owning the hash slot 'slot' when 'threads' threads are used. */
+int slotExecOwner(int slot, int threads) {
+    return (int) ((long) slot * threads / CLUSTER_SLOTS);
+}
+
+/* The I/O thread a client waiting to be read is handed to: the owner of the
+ * slot of its last GET or SET, or 'fallback' if it didn't send any. */
+int slotExecThreadOf(client *c, int fallback) {
+    if (!server.io_threads_exec_slots || c->exec_slot < 0) return fallback;
+    return slotExecOwner(c->exec_slot, server.io_threads_num);
+}
+
+/* Computes what the I/O threads can execute in the read phase about to
+ * start. Everything the commands do outside of the dict and the allocator
+ * slot of their key must be known to be a no-op for the whole phase. */
+static int slotExecPhaseFlags(void) {
+    int flags;
+
+    if (!server.io_threads_exec_slots) return 0;
+    if (server.loading || server.masterhost) return 0;
+    if (server.client_pause_type != CLIENT_PAUSE_OFF) return 0;
+    if (listLength(server.monitors) || server.notify_keyspace_events) return 0;
+    if (server.tracking_clients || trackingGetTotalKeys()) return 0;
+    if (server.cluster_enabled && server.cluster->state != CLUSTER_OK) return 0;
+    /* The threads look the commands up: no rehash step must move them. */
+    if (dictIsRehashing(server.commands)) return 0;
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        if (dictSize(db->expires) || dictSize(db->blocking_keys) ||
+            dictSize(db->watched_keys)) return 0;
+    }
+
+    flags = SLOTEXEC_READS;
+    if (listLength(server.slaves) == 0 && server.repl_backlog == NULL &&
+        server.aof_state == AOF_OFF && server.maxmemory == 0 &&
+        server.repl_min_slaves_to_write == 0 &&
+        writeCommandsDeniedByDiskError() == DISK_ERROR_TYPE_NONE)
+    {
+        flags |= SLOTEXEC_WRITES;
+    }
+    return flags;
+}
+
+/* Called by the main thread before the I/O threads start a read phase. */
+void slotExecBegin(void) {
+    slotexec_flags = slotExecPhaseFlags();
+    if (!slotexec_flags) return;
+    for (int j = 0; j < server.dbnum; j++) dictEnableConcurrency(server.db[j].dict);
+}
+
+/* Called by the main thread once all the I/O threads are done reading. */
+void slotExecEnd(void) {
+    if (!slotexec_flags) return;
+    for (int j = 0; j < server.dbnum; j++) dictDisableConcurrency(server.db[j].dict);
+    slotexec_flags = 0;
+
+    for (int t = 0; t < server.io_threads_num; t++) {
+        slotExecThread *st = slotexec_threads+t;
+        for (int j = 0; j < SLOTEXEC_CMDS; j++) {
+            slotExecCmdStats *cs = st->cmds+j;
+            if (cs->calls == 0) continue;
+            cs->cmd->calls += cs->calls;
+            cs->cmd->microseconds += cs->usec;
+            server.stat_numcommands += cs->calls;
+            server.stat_io_exec_processed += cs->calls;
+            cs->calls = cs->usec = 0;
+        }
+        server.stat_keyspace_hits += st->hits;
+        server.stat_keyspace_misses += st->misses;
+        server.dirty += st->dirty;
+        st->hits = st->misses = st->dirty = 0;
+    }
+}
+
+/* Same checks as processCommand() for a user that can run every command on
+ * every key. */
+static int slotExecAuthorized(client *c) {
+    int auth_required = (!(DefaultUser->flags & USER_FLAG_NOPASS) ||
+                         (DefaultUser->flags & USER_FLAG_DISABLED)) &&
+                        !c->authenticated;
+    if (auth_required) return 0;
+    return c->user == NULL ||
+           (c->user->flags & (USER_FLAG_ALLCOMMANDS|USER_FLAG_ALLKEYS)) ==
+           (USER_FLAG_ALLCOMMANDS|USER_FLAG_ALLKEYS);
+}
+
+static int slotExecGet(client *c, int slot, slotExecThread *st) {
+    robj *o;
+
+    pthread_mutex_lock(&server.lock_slots[slot]);
+    o = lookupKey(c->db, c->argv[1], LOOKUP_NONE);
+    pthread_mutex_unlock(&server.lock_slots[slot]);
+    /* The error reply updates the global error stats. */
+    if (o && o->type != OBJ_STRING) return 0;
+
+    if (o) {
+        st->hits++;
+        addReplyBulkSlotValue(c, slot, o);
+    } else {
+        st->misses++;
+        addReplyNull(c);
+    }
+    return 1;
+}
+
+static int slotExecSet(client *c, slotExecThread *st) {
+    c->argv[2] = tryObjectEncoding(c->argv[2]);
+    genericSetKey(c, c->db, c->argv[1], c->argv[2], 0, 1);
+    st->dirty++;
+    addReply(c, shared.ok);
+    return 1;
+}
+
+/* Called by the I/O thread that parsed the command of 'c'. Executes it and
+ * resets the client if it is a GET or SET of a slot owned by the thread,
+ * returns 0 leaving the command to the main thread otherwise. */
+int slotExecCommand(client *c) {
+    struct redisCommand *cmd;
+    slotExecThread *st = slotexec_threads+c->io_thread;
+    int which, slot, done;
+    monotime timer;
+
+    if (!slotexec_flags) return 0;
+    if (c->argc != 2 && c->argc != 3) return 0;
+    if (c->flags & (CLIENT_MULTI|CLIENT_PUBSUB|CLIENT_TRACKING|CLIENT_BLOCKED)) return 0;
+
+    cmd = lookupCommand(c->argv[0]->ptr);
+    if (cmd == NULL) return 0;
+    if (cmd->proc == getCommand && c->argc == 2) {
+        which = SLOTEXEC_GET;
+    } else if (cmd->proc == setCommand && c->argc == 3 && (slotexec_flags & SLOTEXEC_WRITES)) {
+        which = SLOTEXEC_SET;
+    } else {
+        return 0;
+    }
+
+    slot = keyHashSlot(c->argv[1]->ptr, sdslen(c->argv[1]->ptr));
+    c->exec_slot = slot;
+    if (slotExecOwner(slot, server.io_threads_num) != c->io_thread) return 0;
+    if (!slotExecAuthorized(c)) return 0;
+    /* Redirections, writes parked during a hand-off, and writes that must
+     * be shadow logged are up to the main thread. A write counts itself in
+     * the writers of the slot before it checks the state, so that a freeze
+     * waits for it, see clusterFreezeSlot(). */
+    if (server.cluster_enabled) {
+        if (server.cluster->slots[slot] != server.cluster->myself ||
+            slotCompactIsMigrating(slot)) return 0;
+        if (which == SLOTEXEC_SET) {
+            if (server.cluster->migrating_slots_to[slot]) return 0;
+            if (!clusterBeginSlotWrite(slot)) return 0;
+        }
+        if (clusterSlotState(slot) != CLUSTER_SLOT_OWNED) {
+            if (which == SLOTEXEC_SET) clusterEndSlotWrite(slot);
+            return 0;
+        }
+    }
+
+    c->cmd = c->lastcmd = cmd;
+    elapsedStart(&timer);
+    done = which == SLOTEXEC_GET ? slotExecGet(c, slot, st) : slotExecSet(c, st);
+    if (server.cluster_enabled && which == SLOTEXEC_SET) clusterEndSlotWrite(slot);
+    if (!done) return 0;
+    c->duration = elapsedUs(timer);
+    st->cmds[which].cmd = cmd;
+    st->cmds[which].calls++;
+    st->cmds[which].usec += c->duration;
+    resetClient(c);
+    return 1;
+}
+
+#ifdef REDIS_TEST
+
+#define SLOTEXEC_TEST_MAX_THREADS 8
+
+typedef struct slotExecTestWorker {
+    pthread_t tid;
+    client *c;
+    sds *keys;          /* The keys of the slots owned by the worker. */
+    long count;
+    long declined;      /* Commands left to the main thread. */
+} slotExecTestWorker;
+
+/* Executes 'argv' like an I/O thread that just parsed it for 'c'. */
+static int slotExecTestCall(client *c, int argc, const char *cmd, sds key, const char *val) {
+    int done;
+
+    c->argc = argc;
+    c->argv[0] = createStringObject(cmd, strlen(cmd));
+    c->argv[1] = createStringObject(key, sdslen(key));
+    if (argc == 3) c->argv[2] = createStringObject(val, strlen(val));
+    done = slotExecCommand(c);
+    if (!done) resetClient(c);
+    return done;
+}
+
+/* What an I/O thread does with the SETs and GETs of its slots. */
+static void *slotExecTestRun(void *arg) {
+    slotExecTestWorker *w = arg;
+    char val[32];
+
+    for (long j = 0; j < w->count; j++) {
+        snprintf(val, sizeof(val), "val:%s", w->keys[j]);
+        if (!slotExecTestCall(w->c, 3, "set", w->keys[j], val)) w->declined++;
+    }
+    for (long j = 0; j < w->count; j++)
+        if (!slotExecTestCall(w->c, 2, "get", w->keys[j], NULL)) w->declined++;
+    return NULL;
+}
+
+/* The part of the server the commands of the I/O threads use. The keyspace
+ * is sliced like in cluster mode, without the cluster. */
+static void slotExecTestInitServer(void) {
+    monotonicInit();
+    initServerConfig();
+    ACLInit();
+    createSharedObjects();
+    dictEnableResize();
+    server.dbnum = 1;
+    server.db = zcalloc(sizeof(redisDb));
+    server.db[0].expires = dictCreate(&dbExpiresDictType, NULL);
+    server.db[0].blocking_keys = dictCreate(&keylistDictType, NULL);
+    server.db[0].ready_keys = dictCreate(&objectKeyPointerValueDictType, NULL);
+    server.db[0].watched_keys = dictCreate(&keylistDictType, NULL);
+    server.monitors = listCreate();
+    server.slaves = listCreate();
+    server.io_threads_exec_slots = 1;
+}
+
+int slotExecTest(int argc, char **argv, int accurate) {
+    slotExecTestWorker workers[SLOTEXEC_TEST_MAX_THREADS];
+    char buf[32];
+    long keys, count[SLOTEXEC_TEST_MAX_THREADS];
+    sds *all;
+    int failed = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            keys = 4000000;
+        } else {
+            keys = strtol(argv[3],NULL,10);
+        }
+    } else {
+        keys = 1000000;
+    }
+
+    /* Every thread owns a single range of slots, and all the slots are owned. */
+    for (int threads = 1; threads <= IO_THREADS_MAX_NUM; threads++) {
+        int prev = 0;
+        for (int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+            int owner = slotExecOwner(slot, threads);
+            if (owner != prev && owner != prev+1) break;
+            prev = owner;
+        }
+        if (prev != threads-1 || slotExecOwner(0, threads) != 0) {
+            printf("[failed] %d threads: the slots are not split in %d ranges\n", threads, threads);
+            failed = 1;
+        }
+    }
+
+    slotExecTestInitServer();
+    all = zmalloc(sizeof(sds)*keys);
+    for (long j = 0; j < keys; j++) {
+        snprintf(buf, sizeof(buf), "key:%ld", j);
+        all[j] = sdsnew(buf);
+    }
+
+    /* SETs then GETs of every key through slotExecCommand(), each thread
+     * sending the commands of its own slots like the I/O threads. */
+    long long base_us = 0;
+    for (int threads = 1; threads <= SLOTEXEC_TEST_MAX_THREADS; threads *= 2) {
+        struct redisCommand *get = lookupCommandByCString("get");
+        struct redisCommand *set = lookupCommandByCString("set");
+        long long hits = server.stat_keyspace_hits, misses = server.stat_keyspace_misses;
+        long long dirty = server.dirty, gets = get->calls, sets = set->calls;
+        long declined = 0, wrong = 0;
+        long long start;
+
+        r_allocator_init();
+        server.db[0].dict = dictCreateSliced(&dbDictType, NULL, CLUSTER_SLOTS);
+        server.io_threads_num = threads;
+        for (int t = 0; t < threads; t++) count[t] = 0;
+        for (long j = 0; j < keys; j++)
+            count[slotExecOwner(keyHashSlot(all[j], sdslen(all[j])), threads)]++;
+        for (int t = 0; t < threads; t++) {
+            workers[t].c = createClient(NULL);
+            workers[t].c->io_thread = t;
+            workers[t].c->argv = zmalloc(sizeof(robj*)*3);
+            workers[t].keys = zmalloc(sizeof(sds)*(count[t]+1));
+            workers[t].count = 0;
+            workers[t].declined = 0;
+        }
+        for (long j = 0; j < keys; j++) {
+            int slot = keyHashSlot(all[j], sdslen(all[j]));
+            slotExecTestWorker *w = workers+slotExecOwner(slot, threads);
+            w->keys[w->count++] = all[j];
+        }
+
+        slotExecBegin();
+        start = ustime();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&workers[t].tid, NULL, slotExecTestRun, workers+t);
+        for (int t = 0; t < threads; t++) {
+            pthread_join(workers[t].tid, NULL);
+            declined += workers[t].declined;
+        }
+        long long us = ustime() - start;
+        /* The commands of the slots of another thread are left to it. */
+        if (threads > 1) {
+            client *c = workers[0].c;
+            sds key = workers[threads-1].keys[0];
+            if (slotExecTestCall(c, 2, "get", key, NULL) ||
+                c->exec_slot != (int) keyHashSlot(key, sdslen(key)))
+            {
+                printf("[failed] %d threads: thread 0 executed a GET of thread %d\n",
+                       threads, threads-1);
+                failed = 1;
+            }
+        }
+
+        slotExecEnd();
+        if (threads == 1) base_us = us;
+
+        for (long j = 0; j < keys; j++) {
+            robj key, *o;
+            initStaticStringObject(key, all[j]);
+            o = lookupKey(server.db, &key, LOOKUP_NOTOUCH);
+            snprintf(buf, sizeof(buf), "val:%s", all[j]);
+            if (o == NULL || !sdsEncodedObject(o) || strcmp(o->ptr, buf)) wrong++;
+        }
+        if (declined != 0 || wrong != 0 || (long) dictSize(server.db[0].dict) != keys) {
+            printf("[failed] %d threads: %lu keys in the db, %ld commands declined, "
+                   "%ld wrong values, expected %ld keys\n",
+                   threads, dictSize(server.db[0].dict), declined, wrong, keys);
+            failed = 1;
+        }
+        if (server.stat_keyspace_hits - hits != keys || server.stat_keyspace_misses != misses ||
+            server.dirty - dirty != keys || get->calls - gets != keys || set->calls - sets != keys)
+        {
+            printf("[failed] %d threads: the stats of the threads were not added up\n", threads);
+            failed = 1;
+        }
+
+        printf("%d threads: %ld SET + GET in %.3f ms, %.0f ops/sec, speedup %.2f\n",
+               threads, keys, (double) us / 1000, (double) keys * 2 * 1000000 / us,
+               (double) base_us / us);
+
+        for (int t = 0; t < threads; t++) {
+            zfree(workers[t].keys);
+            freeClient(workers[t].c);
+        }
+        dictRelease(server.db[0].dict);
+        r_allocator_free_world();
+    }
+
+    for (long j = 0; j < keys; j++) sdsfree(all[j]);
+    zfree(all);
+    return failed;
+}
+
+#endif
@@ -0,0 +1,847 @@
+/* Index rebuild of the slots received by RDMA migration.
+ *
+ * The RDMA writes copy the slot blocks of the donor in blocks of the local
+ * allocator, but the keyspace knows nothing about the K-Vs they hold.
+ * slotIndexRebuild() adds them to the dict of the db with a pool of worker
+ * threads, in two phases:
+ *
+ * 1. Scan: the blocks of every slot are split in chunks of at most
+ *    SLOTINDEX_CHUNK_BLOCKS blocks. Workers claim chunks, walk them with a
+ *    SEGMENT_ITER_REBUILD iterator and stage every key with its hash. The
+ *    segments are position independent (see segment_object_data()), so the
+ *    K-Vs are not patched and the scan doesn't write to the blocks.
+ *
+ * 2. Insert: the dict is made concurrent and expanded once for all the
+ *    staged keys (every slice of a sliced keyspace for the keys of its
+ *    slot), then workers claim chunks again and add the staged keys with
+ *    dictAddPrehashed(), prefetching the buckets of the keys that follow.
+ *    A slot is servable once the last of its chunks has been inserted.
+ *
+ * Workers only take the stripe locks of the dict (see dictEnableConcurrency()),
+ * so foreground commands are served while the index is rebuilt.
+ *
+ * slotIndexRebuildLazy() replaces the insert phase with a pending index per
+ * slot: a compact open addressing table of the staged keys, published as
+ * soon as it is built, so the slot is servable right after the scan. A
+ * lookup that misses in the dict checks the pending index of the slot of
+ * the key (slotIndexPromoteKey()) and moves the key to the dict, while a
+ * background thread moves all the others. Every pending entry is moved
+ * exactly once, either by the lookup or by the background thread, and the
+ * table of a slot is dropped once all its entries are in the dict. */
+
+#include "server.h"
+#include "atomicvar.h"
+#include "allocator.h"
+#include "cluster.h"
+
+#include <sched.h>
+
+#define SLOTINDEX_CHUNK_BLOCKS 8    /* Blocks of a slot scanned by a single worker. */
+#define SLOTINDEX_PREFETCH 8        /* Keys whose bucket is prefetched ahead of the insert. */
+#define SLOTINDEX_MOVE_BATCH 1024   /* Pending keys moved by the background thread per lock hold. */
+
+typedef struct slotIndexEntry {
+    robj *key_meta;         /* The value meta follows the key meta in the segment. */
+    uint64_t hash;
+} slotIndexEntry;
+
+typedef struct slotIndexChunk {
+    int slot_idx;           /* Index of the slot in the slots array of the job. */
+    int first_block;
+    int num_blocks;
+    slotIndexEntry *entries;
+    size_t count;
+    size_t size;
+} slotIndexChunk;
+
+/* Pending index entry states. */
+#define SLOTINDEX_PENDING 0     /* Only in the pending index. */
+#define SLOTINDEX_CLAIMED 1     /* Being added to the dict. */
+#define SLOTINDEX_DONE 2        /* Added to the dict. */
+
+typedef struct slotIndexPendingEntry {
+    robj *key_meta;         /* NULL for an empty bucket. */
+    uint64_t hash;
+    int state;              /* SLOTINDEX_PENDING/CLAIMED/DONE, accessed atomically. */
+} slotIndexPendingEntry;
+
+typedef struct slotIndexPending {
+    dict *d;
+    int slot;
+    int discarded;          /* Unpublished by slotIndexDiscardPending(). */
+    unsigned long mask;     /* Size of the table - 1, the size is a power of two. */
+    unsigned long count;    /* Keys in the table. */
+    slotIndexPendingEntry *table;
+    struct slotIndexPending *next;  /* Background thread queue. */
+} slotIndexPending;
+
+/* The pending index of every slot, NULL when all the keys of the slot are in
+ * the dict. The lock protects the pointers and the lifetime of the tables:
+ * lookups hold it for reading, publishing and dropping a table need it for
+ * writing. The background thread holds it for reading while moving keys, so
+ * once slotIndexDiscardPending() gets it no key is being added to the dict. */
+static slotIndexPending *pending_slots[CLUSTER_SLOTS];
+static pthread_rwlock_t pending_lock = PTHREAD_RWLOCK_INITIALIZER;
+static redisAtomic int pending_count;           /* Published pending indexes. */
+static redisAtomic long long pending_keys;      /* Keys not moved to the dict yet. */
+static redisAtomic long long pending_promoted;  /* Keys moved by lookups. */
+static dict *pending_concurrent_dict;           /* Dict we made concurrent. */
+
+/* Queue of the background thread, protected by indexer_mutex. */
+static pthread_mutex_t indexer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t indexer_cond = PTHREAD_COND_INITIALIZER;
+static slotIndexPending *indexer_head, *indexer_tail;
+static int indexer_started;
+
+typedef struct slotIndexJob {
+    dict *d;
+    int *slots;
+    int nslots;
+    slotIndexChunk *chunks;
+    long nchunks;
+    redisAtomic long next_chunk;    /* Next chunk (or slot) to claim, shared by the workers. */
+    int phase;              /* SLOTINDEX_PHASE_* */
+    redisAtomic int *chunks_left;   /* Chunks of each slot not inserted yet. */
+    long *first_chunk;      /* First chunk of each slot, the chunks of a slot are contiguous. */
+    long long start;        /* ustime() at the start of the job. */
+    long long *servable_us; /* Out: time it took for each slot to be servable. */
+    redisAtomic long long keys_added;
+    redisAtomic long long keys_existing;
+} slotIndexJob;
+
+#define SLOTINDEX_PHASE_SCAN 0
+#define SLOTINDEX_PHASE_INSERT 1
+#define SLOTINDEX_PHASE_PENDING 2   /* Workers claim slots and build their pending index. */
+
+static void slotIndexPublish(slotIndexPending *p);
+
+static void slotIndexScanChunk(slotIndexJob *job, slotIndexChunk *chunk) {
+    int slot = job->slots[chunk->slot_idx];
+    segment_iterator_t iter;
+    robj *key_meta, *val_meta;
+
+    segment_iterator_init_range(&iter, slot, chunk->first_block, chunk->num_blocks, SEGMENT_ITER_REBUILD);
+    while (segment_iterator_next(&iter, &key_meta, &val_meta) != NULL) {
+        if (chunk->count == chunk->size) {
+            chunk->size = chunk->size ? chunk->size * 2 : 1024;
+            chunk->entries = zrealloc(chunk->entries, chunk->size * sizeof(slotIndexEntry));
+        }
+        chunk->entries[chunk->count].key_meta = key_meta;
+        chunk->entries[chunk->count].hash = dictHashKey(job->d, segment_object_data(key_meta));
+        chunk->count++;
+    }
+}
+
+static void slotIndexInsertChunk(slotIndexJob *job, slotIndexChunk *chunk) {
+    dict *d = job->d;
+    dict *sd = dictGetSlice(d, job->slots[chunk->slot_idx], 1);
+    dictht *ht = dictIsRehashing(sd) ? &sd->ht[1] : &sd->ht[0];
+    long long added = 0;
+
+    for (size_t j = 0; j < chunk->count; j++) {
+        if (j + SLOTINDEX_PREFETCH < chunk->count)
+            __builtin_prefetch(&ht->table[chunk->entries[j + SLOTINDEX_PREFETCH].hash & ht->sizemask]);
+
+        robj *key_meta = chunk->entries[j].key_meta;
+        if (dictAddPrehashed(d, segment_object_data(key_meta), segment_value_meta(key_meta),
+                             chunk->entries[j].hash) == DICT_OK)
+            added++;
+    }
+    atomicIncr(job->keys_added, added);
+    atomicIncr(job->keys_existing, (long long) chunk->count - added);
+
+    zfree(chunk->entries);
+    chunk->entries = NULL;
+
+    int left;
+    atomicGetIncr(job->chunks_left[chunk->slot_idx], left, -1);
+    if (left == 1 && job->servable_us)
+        job->servable_us[chunk->slot_idx] = ustime() - job->start;
+}
+
+/* Build the pending index of the slot job->slots[slot_idx] from the keys
+ * staged by its chunks and publish it. */
+static void slotIndexBuildPending(slotIndexJob *job, int slot_idx) {
+    long first = job->first_chunk[slot_idx];
+    long last = first + job->chunks_left[slot_idx];
+    unsigned long count = 0, size = 1;
+    slotIndexPending *p;
+
+    if (slotIndexIsPending(job->slots[slot_idx])) {
+        /* Received again before the previous pending index of the slot was
+         * drained: add the keys to the dict right away. */
+        for (long c = first; c < last; c++) slotIndexInsertChunk(job, &job->chunks[c]);
+        if (job->servable_us) job->servable_us[slot_idx] = ustime() - job->start;
+        return;
+    }
+
+    for (long c = first; c < last; c++) count += job->chunks[c].count;
+    if (count) {
+        /* Keep the load factor at most 2/3 so that probes stay short. */
+        while (size < count + count / 2) size <<= 1;
+        p = zmalloc(sizeof(*p));
+        p->d = job->d;
+        p->slot = job->slots[slot_idx];
+        p->discarded = 0;
+        p->mask = size - 1;
+        p->count = count;
+        p->table = zcalloc(sizeof(slotIndexPendingEntry) * size);
+        p->next = NULL;
+        for (long c = first; c < last; c++) {
+            slotIndexChunk *chunk = &job->chunks[c];
+            for (size_t j = 0; j < chunk->count; j++) {
+                unsigned long idx = chunk->entries[j].hash & p->mask;
+                while (p->table[idx].key_meta) idx = (idx + 1) & p->mask;
+                p->table[idx].key_meta = chunk->entries[j].key_meta;
+                p->table[idx].hash = chunk->entries[j].hash;
+            }
+            zfree(chunk->entries);
+            chunk->entries = NULL;
+        }
+        slotIndexPublish(p);
+    }
+    if (job->servable_us) job->servable_us[slot_idx] = ustime() - job->start;
+}
+
+static void *slotIndexWorker(void *arg) {
+    slotIndexJob *job = arg;
+    long idx;
+
+    while (1) {
+        atomicGetIncr(job->next_chunk, idx, 1);
+        if (job->phase == SLOTINDEX_PHASE_PENDING) {
+            if (idx >= job->nslots) break;
+            slotIndexBuildPending(job, idx);
+            continue;
+        }
+        if (idx >= job->nchunks) break;
+        if (job->phase == SLOTINDEX_PHASE_SCAN)
+            slotIndexScanChunk(job, &job->chunks[idx]);
+        else
+            slotIndexInsertChunk(job, &job->chunks[idx]);
+    }
+    return NULL;
+}
+
+/* Run the current phase of the job on 'threads' threads (the caller is one
+ * of them). */
+static void slotIndexRunPhase(slotIndexJob *job, int threads) {
+    pthread_t *tids = zmalloc(sizeof(pthread_t) * threads);
+    int started = 0;
+
+    atomicSet(job->next_chunk, 0);
+    for (int j = 1; j < threads; j++) {
+        if (pthread_create(&tids[started], NULL, slotIndexWorker, job) != 0) break;
+        started++;
+    }
+    slotIndexWorker(job);
+    for (int j = 0; j < started; j++) pthread_join(tids[j], NULL);
+    zfree(tids);
+}
+
+/* Add the K-Vs stored in the allocator blocks of 'slots' to the dict 'd',
+ * using 'threads' threads. Keys that already exist in the dict are skipped.
+ *
+ * If 'servable_us' is not NULL, servable_us[j] is set to the microseconds it
+ * took for slots[j] to be completely indexed. 'stats' (if not NULL) is
+ * populated with the keys added and the time spent in every phase.
+ *
+ * The caller must guarantee that the blocks of the slots are not modified
+ * while the function runs. */
+/* Split the blocks of every slot in chunks and run the scan phase. Returns
+ * the number of staged keys. */
+static size_t slotIndexScan(slotIndexJob *job, dict *d, int *slots, int nslots,
+                            int threads, long long *servable_us)
+{
+    size_t staged = 0;
+
+    job->d = d;
+    job->slots = slots;
+    job->nslots = nslots;
+    job->servable_us = servable_us;
+    job->start = ustime();
+    job->chunks_left = zcalloc(sizeof(redisAtomic int) * (nslots ? nslots : 1));
+    job->first_chunk = zcalloc(sizeof(long) * (nslots ? nslots : 1));
+
+    for (int j = 0; j < nslots; j++) {
+        slot_usage_t usage = r_allocator_get_slot_usage(slots[j]);
+        job->nchunks += (usage.blocks + SLOTINDEX_CHUNK_BLOCKS - 1) / SLOTINDEX_CHUNK_BLOCKS;
+    }
+    job->chunks = zcalloc(sizeof(slotIndexChunk) * (job->nchunks ? job->nchunks : 1));
+    for (long j = 0, c = 0; j < nslots; j++) {
+        slot_usage_t usage = r_allocator_get_slot_usage(slots[j]);
+        job->first_chunk[j] = c;
+        for (unsigned int b = 0; b < usage.blocks; b += SLOTINDEX_CHUNK_BLOCKS) {
+            job->chunks[c].slot_idx = j;
+            job->chunks[c].first_block = b;
+            job->chunks[c].num_blocks = SLOTINDEX_CHUNK_BLOCKS;
+            job->chunks_left[j]++;
+            c++;
+        }
+        if (usage.blocks == 0 && servable_us) servable_us[j] = 0;
+    }
+
+    job->phase = SLOTINDEX_PHASE_SCAN;
+    slotIndexRunPhase(job, threads);
+    for (long j = 0; j < job->nchunks; j++) staged += job->chunks[j].count;
+    return staged;
+}
+
+/* Size the dict once for the 'staged' keys of the job. The slices of a
+ * sliced keyspace are sized one by one, for the keys of their slot. */
+static void slotIndexExpand(slotIndexJob *job, size_t staged) {
+    dict *d = job->d;
+
+    if (!staged) return;
+    if (!dictIsSliced(d)) {
+        dictExpand(d, dictSize(d) + staged);
+        return;
+    }
+    for (int j = 0; j < job->nslots; j++) {
+        long first = job->first_chunk[j];
+        long last = first + job->chunks_left[j];
+        unsigned long count = 0;
+
+        for (long c = first; c < last; c++) count += job->chunks[c].count;
+        if (count) {
+            dict *sd = dictGetSlice(d, job->slots[j], 1);
+            dictExpand(sd, dictSize(sd) + count);
+        }
+    }
+}
+
+static void slotIndexFreeJob(slotIndexJob *job) {
+    for (long j = 0; j < job->nchunks; j++) zfree(job->chunks[j].entries);
+    zfree(job->chunks);
+    zfree(job->chunks_left);
+    zfree(job->first_chunk);
+}
+
+void slotIndexRebuild(dict *d, int *slots, int nslots, int threads,
+                      long long *servable_us, slotIndexStats *stats)
+{
+    slotIndexJob job = {0};
+    long long keys;
+    long long scan_start, insert_start;
+    size_t staged;
+
+    if (threads < 1) threads = 1;
+
+    /* Phase 1: scan the blocks and hash the keys. */
+    scan_start = ustime();
+    staged = slotIndexScan(&job, d, slots, nslots, threads, servable_us);
+
+    /* Phase 2: size the dict once for all the keys and insert them. */
+    insert_start = ustime();
+    dictEnableConcurrency(d);
+    slotIndexExpand(&job, staged);
+    job.phase = SLOTINDEX_PHASE_INSERT;
+    slotIndexRunPhase(&job, threads);
+    dictDisableConcurrency(d);
+
+    if (stats) {
+        atomicGet(job.keys_added, keys);
+        stats->keys_added = keys;
+        atomicGet(job.keys_existing, keys);
+        stats->keys_existing = keys;
+        stats->scan_us = insert_start - scan_start;
+        stats->insert_us = ustime() - insert_start;
+        stats->total_us = ustime() - job.start;
+    }
+    slotIndexFreeJob(&job);
+}
+
+/* ----------------------------- Lazy indexing -------------------------------*/
+
+/* Move a pending key to the dict, unless the other side (a lookup or the
+ * background thread) already claimed it, in which case wait for it to be in
+ * the dict. Returns 1 if the key was moved by this call. */
+static int slotIndexMoveEntry(slotIndexPending *p, slotIndexPendingEntry *e) {
+    int expected = SLOTINDEX_PENDING;
+
+    if (__atomic_compare_exchange_n(&e->state, &expected, SLOTINDEX_CLAIMED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        dictAddPrehashed(p->d, segment_object_data(e->key_meta),
+                         segment_value_meta(e->key_meta), e->hash);
+        __atomic_store_n(&e->state, SLOTINDEX_DONE, __ATOMIC_RELEASE);
+        atomicDecr(pending_keys, 1);
+        return 1;
+    }
+    while (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) != SLOTINDEX_DONE) sched_yield();
+    return 0;
+}
+
+/* Called with pending_lock held for writing. The first published table makes
+ * the dict concurrent, since the background thread adds keys next to the main
+ * thread, and the last one dropped ends it. */
+static void slotIndexUnpublish(slotIndexPending *p) {
+    int count;
+
+    if (pending_slots[p->slot] != p) return;
+    pending_slots[p->slot] = NULL;
+    atomicGetIncr(pending_count, count, -1);
+    if (count == 1 && pending_concurrent_dict) {
+        dictDisableConcurrency(pending_concurrent_dict);
+        pending_concurrent_dict = NULL;
+    }
+}
+
+static void *slotIndexIndexerMain(void *arg) {
+    UNUSED(arg);
+    redis_set_thread_title("slot_indexer");
+
+    while (1) {
+        slotIndexPending *p;
+
+        pthread_mutex_lock(&indexer_mutex);
+        while (indexer_head == NULL) pthread_cond_wait(&indexer_cond, &indexer_mutex);
+        p = indexer_head;
+        indexer_head = p->next;
+        if (indexer_head == NULL) indexer_tail = NULL;
+        pthread_mutex_unlock(&indexer_mutex);
+
+        unsigned long idx = 0;
+        while (idx <= p->mask) {
+            pthread_rwlock_rdlock(&pending_lock);
+            if (p->discarded) {
+                pthread_rwlock_unlock(&pending_lock);
+                break;
+            }
+            for (unsigned long end = idx + SLOTINDEX_MOVE_BATCH; idx <= p->mask && idx < end; idx++) {
+                if (p->table[idx].key_meta) slotIndexMoveEntry(p, &p->table[idx]);
+            }
+            pthread_rwlock_unlock(&pending_lock);
+        }
+
+        pthread_rwlock_wrlock(&pending_lock);
+        slotIndexUnpublish(p);
+        pthread_rwlock_unlock(&pending_lock);
+        zfree(p->table);
+        zfree(p);
+    }
+    return NULL;
+}
+
+/* Make the pending index of a slot visible to lookups and queue it for the
+ * background thread. */
+static void slotIndexPublish(slotIndexPending *p) {
+    int count;
+
+    atomicIncr(pending_keys, (long long) p->count);
+    pthread_rwlock_wrlock(&pending_lock);
+    serverAssert(pending_slots[p->slot] == NULL);
+    pending_slots[p->slot] = p;
+    atomicGetIncr(pending_count, count, 1);
+    if (count == 0) {
+        dictEnableConcurrency(p->d);
+        pending_concurrent_dict = p->d;
+    }
+    pthread_rwlock_unlock(&pending_lock);
+
+    pthread_mutex_lock(&indexer_mutex);
+    if (!indexer_started) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, slotIndexIndexerMain, NULL) != 0) {
+            serverPanic("Unable to create the slot indexer thread");
+        }
+        indexer_started = 1;
+    }
+    if (indexer_tail) indexer_tail->next = p;
+    else indexer_head = p;
+    indexer_tail = p;
+    pthread_cond_signal(&indexer_cond);
+    pthread_mutex_unlock(&indexer_mutex);
+}
+
+/* Like slotIndexRebuild(), but the keys are not added to the dict before
+ * returning: every slot gets a pending index instead and is servable as soon
+ * as it is published. Lookups move the keys they need to the dict with
+ * slotIndexPromoteKey() and a background thread moves the rest.
+ *
+ * 'servable_us' reports the time it took to publish the pending index of
+ * every slot. In 'stats', keys_added is the number of keys that were
+ * published, insert_us the time spent building the pending indexes. */
+void slotIndexRebuildLazy(dict *d, int *slots, int nslots, int threads,
+                          long long *servable_us, slotIndexStats *stats)
+{
+    slotIndexJob job = {0};
+    long long scan_start, pending_start;
+    size_t staged;
+
+    if (threads < 1) threads = 1;
+
+    scan_start = ustime();
+    staged = slotIndexScan(&job, d, slots, nslots, threads, servable_us);
+
+    /* Size the dict for all the keys now: the moves never expand it. */
+    pending_start = ustime();
+    slotIndexExpand(&job, staged);
+    job.phase = SLOTINDEX_PHASE_PENDING;
+    slotIndexRunPhase(&job, threads);
+
+    if (stats) {
+        stats->keys_added = staged;
+        stats->keys_existing = 0;
+        stats->scan_us = pending_start - scan_start;
+        stats->insert_us = ustime() - pending_start;
+        stats->total_us = ustime() - job.start;
+    }
+    slotIndexFreeJob(&job);
+}
+
+/* Called when 'key' is not found in 'd': if the key is in the pending index
+ * of its slot, move it to the dict. Returns 1 if the key was pending, so the
+ * caller has to look it up again, 0 otherwise. */
+int slotIndexPromoteKey(dict *d, sds key) {
+    int count, found = 0;
+    slotIndexPending *p;
+
+    atomicGet(pending_count, count);
+    if (count == 0) return 0;
+
+    pthread_rwlock_rdlock(&pending_lock);
+    p = pending_slots[keyHashSlot(key, sdslen(key))];
+    if (p && p->d == d && !p->discarded) {
+        uint64_t hash = dictHashKey(d, key);
+        for (unsigned long idx = hash & p->mask; p->table[idx].key_meta; idx = (idx + 1) & p->mask) {
+            slotIndexPendingEntry *e = &p->table[idx];
+            if (e->hash == hash && dictCompareKeys(d, key, segment_object_data(e->key_meta))) {
+                if (slotIndexMoveEntry(p, e)) atomicIncr(pending_promoted, 1);
+                found = 1;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&pending_lock);
+    return found;
+}
+
+/* Returns 1 if some keys of 'slot' are not in the dict yet. */
+int slotIndexIsPending(int slot) {
+    int pending;
+
+    pthread_rwlock_rdlock(&pending_lock);
+    pending = pending_slots[slot] != NULL;
+    pthread_rwlock_unlock(&pending_lock);
+    return pending;
+}
+
+/* Drop all the pending indexes without moving their keys, before the dict
+ * is emptied. On return no key is being moved to the dict. */
+void slotIndexDiscardPending(void) {
+    int count;
+
+    atomicGet(pending_count, count);
+    if (count == 0) return;
+
+    pthread_rwlock_wrlock(&pending_lock);
+    for (int j = 0; j < CLUSTER_SLOTS; j++) {
+        slotIndexPending *p = pending_slots[j];
+        if (p == NULL) continue;
+        p->discarded = 1;
+        slotIndexUnpublish(p);
+    }
+    atomicSet(pending_keys, 0);
+    pthread_rwlock_unlock(&pending_lock);
+}
+
+void slotIndexGetPendingStats(long long *slots, long long *keys, long long *promoted) {
+    int count;
+
+    atomicGet(pending_count, count);
+    *slots = count;
+    atomicGet(pending_keys, *keys);
+    atomicGet(pending_promoted, *promoted);
+}
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef REDIS_TEST
+
+static uint64_t slotIndexTestHash(const void *key) {
+    return dictGenHashFunction(key, sdslen((sds) key));
+}
+
+static int slotIndexTestCompare(void *privdata, const void *key1, const void *key2) {
+    UNUSED(privdata);
+    return sdslen((sds) key1) == sdslen((sds) key2) && memcmp(key1, key2, sdslen((sds) key1)) == 0;
+}
+
+static int slotIndexTestSlice(const void *key) {
+    return keyHashSlot((char *) key, sdslen((sds) key));
+}
+
+static dictType slotIndexTestDictType = {
+    slotIndexTestHash, NULL, NULL, slotIndexTestCompare, NULL, NULL, NULL
+};
+
+static dictType slotIndexTestSlicedDictType = {
+    slotIndexTestHash, NULL, NULL, slotIndexTestCompare, NULL, NULL, NULL, slotIndexTestSlice
+};
+
+static dict *slotIndexTestCreateDict(int sliced) {
+    if (sliced) return dictCreateSliced(&slotIndexTestSlicedDictType, NULL, CLUSTER_SLOTS);
+    return dictCreate(&slotIndexTestDictType, NULL);
+}
+
+static int slotIndexTestCompareTimes(const void *a, const void *b) {
+    long long ta = *(const long long *) a, tb = *(const long long *) b;
+    return (ta > tb) - (ta < tb);
+}
+
+/* Hash tags of the test slots: the keys of slot j are "{tag}:key:N", so that
+ * slotIndexPromoteKey() finds them in their pending index. */
+static long slot_tags[64];
+
+static void slotIndexTestFindTags(int nslots) {
+    char tag[32];
+    int found = 0;
+
+    for (int j = 0; j < nslots; j++) slot_tags[j] = -1;
+    for (long n = 0; found < nslots; n++) {
+        int slot = keyHashSlot(tag, snprintf(tag, sizeof(tag), "%ld", n));
+        if (slot < nslots && slot_tags[slot] == -1) {
+            slot_tags[slot] = n;
+            found++;
+        }
+    }
+}
+
+/* Write key number 'j' as an sds with its 8 bytes header in 'buf'. */
+static sds slotIndexTestKey(char *buf, size_t size, long j, int nslots) {
+    int len = snprintf(buf + 8, size - 8, "{%ld}:key:%ld", slot_tags[j % nslots], j);
+    memset(buf, 0, 8);
+    buf[5] = buf[6] = len;
+    buf[7] = SDS_TYPE_8;
+    return (sds) (buf + 8);
+}
+
+/* Store 'keys' K-Vs in the allocator blocks of 'nslots' slots the way
+ * genericSetKey() does: key and value are sds strings copied with the 8
+ * bytes before the string. */
+static void slotIndexTestFill(int nslots, long keys) {
+    char key[8+48], val[8+100];
+    robj key_meta, val_meta, *ptr_key_meta, *ptr_val_meta;
+    int allocated_new_block;
+
+    memset(val, 'v', sizeof(val));
+    memset(val, 0, 8);
+    val[5] = val[6] = sizeof(val) - 8 - 1;
+    val[7] = SDS_TYPE_8;
+    val[sizeof(val) - 1] = '\0';
+    for (long j = 0; j < keys; j++) {
+        sds k = slotIndexTestKey(key, sizeof(key), j, nslots);
+        r_allocator_insert_kv(j % nslots, key, sdslen(k) + 8 + 1, val, sizeof(val),
+                              &key_meta, sizeof(robj), &val_meta, sizeof(robj),
+                              &allocated_new_block, &ptr_key_meta, &ptr_val_meta);
+    }
+}
+
+/* Check that every key is in the dict and points at its segment. Keys
+ * multiple of 'deleted_every' (if not zero) must not be in the dict. */
+static int slotIndexTestVerify(dict *d, int nslots, long keys, long deleted_every) {
+    char buf[8+48];
+    long expected = keys;
+
+    if (deleted_every) expected -= (keys + deleted_every - 1) / deleted_every;
+    if ((long) dictSize(d) != expected) {
+        printf("[failed] %lu keys in the dict, expected %ld\n", dictSize(d), expected);
+        return 1;
+    }
+    for (long j = 0; j < keys; j++) {
+        sds key = slotIndexTestKey(buf, sizeof(buf), j, nslots);
+        dictEntry *de = dictFind(d, key);
+        if (deleted_every && j % deleted_every == 0) {
+            if (de != NULL) {
+                printf("[failed] deleted key %s is back in the dict\n", key);
+                return 1;
+            }
+            continue;
+        }
+        if (de == NULL) {
+            printf("[failed] %s is not in the dict\n", key);
+            return 1;
+        }
+        /* The value is the value meta, right after the key meta in the segment. */
+        robj *val_meta = dictGetVal(de);
+        robj *key_meta = (robj *) ((char *) val_meta - sizeof(robj));
+        if (segment_object_data(key_meta) != dictGetKey(de) ||
+            ((char *) segment_object_ptr(val_meta))[0] != 'v') {
+            printf("[failed] %s does not point at its segment\n", key);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void slotIndexTestResetSlots(int nslots) {
+    /* Forget the free segments found by the previous scan, like the
+     * recipient does before indexing. */
+    for (int j = 0; j < nslots; j++) r_allocator_lock_slot_blocks(j);
+}
+
+/* Overwrite the cached pointers of all the metas, as if the blocks had been
+ * written by RDMA from another address space. With 'check' set, returns the
+ * number of metas whose pointer is not the poisoned one anymore. */
+static long slotIndexTestPoison(int nslots, int check) {
+    void *poison = (void *) 0x1;
+    long patched = 0;
+
+    for (int j = 0; j < nslots; j++) {
+        segment_iterator_t iter;
+        robj *key_meta, *val_meta;
+        segment_iterator_init(&iter, j, SEGMENT_ITER_READONLY);
+        while (segment_iterator_next(&iter, &key_meta, &val_meta) != NULL) {
+            if (check) {
+                patched += (key_meta->ptr != poison) + (val_meta->ptr != poison);
+            } else {
+                key_meta->ptr = val_meta->ptr = poison;
+            }
+        }
+    }
+    return patched;
+}
+
+/* ./redis-server test slotindex [<count> | --accurate] */
+int slotIndexTest(int argc, char **argv, int accurate) {
+    long keys;
+    int nslots = 64, failed = 0;
+    int slots[64];
+    long long servable[64], start;
+    slotIndexStats st;
+
+    if (argc == 4) {
+        if (accurate) {
+            keys = 10000000;
+        } else {
+            keys = strtol(argv[3],NULL,10);
+        }
+    } else {
+        keys = 1000000;
+    }
+
+    r_allocator_init();
+    r_allocator_set_block_size(64 * 1024, BLOCK_SIZE_BYTES);
+    for (int j = 0; j < nslots; j++) slots[j] = j;
+    slotIndexTestFindTags(nslots);
+    slotIndexTestFill(nslots, keys);
+
+    /* One key at a time with dictFind() + dictAdd(), as before. */
+    dict *d = dictCreate(&slotIndexTestDictType, NULL);
+    slotIndexTestResetSlots(nslots);
+    start = ustime();
+    for (int j = 0; j < nslots; j++) {
+        segment_iterator_t iter;
+        robj *key_meta, *val_meta;
+        segment_iterator_init(&iter, j, SEGMENT_ITER_REBUILD);
+        while (segment_iterator_next(&iter, &key_meta, &val_meta) != NULL) {
+            /* This is what the recipient had to do before the segments
+             * were position independent. */
+            key_meta->ptr = segment_object_data(key_meta);
+            val_meta->ptr = segment_object_data(val_meta);
+            if (dictFind(d, key_meta->ptr) == NULL) dictAdd(d, key_meta->ptr, val_meta);
+        }
+    }
+    long long serial_us = ustime() - start;
+    failed |= slotIndexTestVerify(d, nslots, keys, 0);
+    printf("dictAdd, 1 thread: %ld keys in %.3f ms, %.0f keys/sec\n",
+           keys, (double) serial_us / 1000, (double) keys * 1000000 / serial_us);
+    dictRelease(d);
+
+    /* The last run indexes in a dict per slot, like the cluster keyspace. */
+    int threads[] = {1, 4, 4};
+    int sliced[] = {0, 0, 1};
+    for (int t = 0; t < 3; t++) {
+        d = slotIndexTestCreateDict(sliced[t]);
+        slotIndexTestResetSlots(nslots);
+        slotIndexTestPoison(nslots, 0);
+        slotIndexRebuild(d, slots, nslots, threads[t], servable, &st);
+        if (slotIndexTestPoison(nslots, 1) != 0) {
+            printf("[failed] the index rebuild patched the segments\n");
+            failed = 1;
+        }
+        failed |= slotIndexTestVerify(d, nslots, keys, 0);
+        if (st.keys_added != keys) {
+            printf("[failed] %lld keys added, expected %ld\n", st.keys_added, keys);
+            failed = 1;
+        }
+        qsort(servable, nslots, sizeof(long long), slotIndexTestCompareTimes);
+        printf("slotIndexRebuild%s, %d threads: %ld keys in %.3f ms (scan %.3f ms, insert %.3f ms), "
+               "%.0f keys/sec, slots servable after p50 %.3f ms max %.3f ms\n",
+               sliced[t] ? " (dict per slot)" : "", threads[t], keys, (double) st.total_us / 1000, (double) st.scan_us / 1000,
+               (double) st.insert_us / 1000, (double) st.keys_added * 1000000 / st.total_us,
+               (double) servable[nslots / 2] / 1000, (double) servable[nslots - 1] / 1000);
+
+        /* Indexing the same slots again must not add anything. */
+        slotIndexTestResetSlots(nslots);
+        slotIndexRebuild(d, slots, nslots, threads[t], NULL, &st);
+        if (st.keys_added != 0 || st.keys_existing != keys || (long) dictSize(d) != keys) {
+            printf("[failed] second rebuild: %lld keys added, %lld existing\n",
+                   st.keys_added, st.keys_existing);
+            failed = 1;
+        }
+        dictRelease(d);
+    }
+
+    /* Lazy: lookups and deletes while the background thread indexes. */
+    char buf[8+48];
+    long long pslots, pkeys, promoted;
+    long misses = 0;
+    d = slotIndexTestCreateDict(1);
+    slotIndexTestResetSlots(nslots);
+    slotIndexRebuildLazy(d, slots, nslots, 4, servable, &st);
+    start = ustime();
+    for (long j = 0; j < keys; j += 5) {
+        sds key = slotIndexTestKey(buf, sizeof(buf), j, nslots);
+        if (dictFind(d, key) == NULL) {
+            misses++;
+            slotIndexPromoteKey(d, key);
+            if (dictFind(d, key) == NULL) {
+                printf("[failed] %s not found after the promotion\n", key);
+                failed = 1;
+                break;
+            }
+        }
+        if (j % 10 == 0) dictDelete(d, key);
+    }
+    long long lookup_us = ustime() - start;
+    do {
+        usleep(1000);
+        slotIndexGetPendingStats(&pslots, &pkeys, &promoted);
+    } while (pslots != 0);
+    long long drained_us = ustime() - start;
+    failed |= slotIndexTestVerify(d, nslots, keys, 10);
+    if (pkeys != 0 || promoted > misses) {
+        printf("[failed] %lld keys still pending, %lld promoted for %ld misses\n",
+               pkeys, promoted, misses);
+        failed = 1;
+    }
+    qsort(servable, nslots, sizeof(long long), slotIndexTestCompareTimes);
+    printf("slotIndexRebuildLazy, 4 threads: slots servable after p50 %.3f ms max %.3f ms "
+           "(scan %.3f ms, pending index %.3f ms), %lld of %ld lookups promoted in %.3f ms, "
+           "all keys indexed after %.3f ms\n",
+           (double) servable[nslots / 2] / 1000, (double) servable[nslots - 1] / 1000,
+           (double) st.scan_us / 1000, (double) st.insert_us / 1000, promoted,
+           (keys + 4) / 5, (double) lookup_us / 1000, (double) drained_us / 1000);
+    dictRelease(d);
+
+    /* Flushing the db drops the pending indexes. */
+    d = dictCreate(&slotIndexTestDictType, NULL);
+    slotIndexTestResetSlots(nslots);
+    slotIndexRebuildLazy(d, slots, nslots, 4, NULL, &st);
+    slotIndexDiscardPending();
+    slotIndexGetPendingStats(&pslots, &pkeys, &promoted);
+    if (pslots != 0 || pkeys != 0 || slotIndexIsPending(0) ||
+        slotIndexPromoteKey(d, slotIndexTestKey(buf, sizeof(buf), 0, nslots)))
+    {
+        printf("[failed] pending indexes left after the discard\n");
+        failed = 1;
+    }
+    dictRelease(d);
+
+    for (int j = 0; j < nslots; j++) free_slot(j);
+    if (!failed) printf("slotindex test: OK\n");
+    return failed;
+}
+#endif
@@ -300,7 +300,7 @@ int getGenericCommand(client *c) {
         return C_ERR;
     }
 
-    addReplyBulk(c,o);
+    addReplyBulkSlotValue(c,keyHashSlot(c->argv[1]->ptr,sdslen(c->argv[1]->ptr)),o);
     return C_OK;
 }
 
@@ -64,6 +64,7 @@ int ld2string(char *buf, size_t len, long double value, ld2string_mode mode);
 sds getAbsolutePath(char *filename);
 long getTimeZone(void);
 int pathIsBaseName(char *path);
+void getRandomBytes(unsigned char *p, size_t len);
 
 #ifdef REDIS_TEST
 int utilTest(int argc, char **argv, int accurate);